@@ -0,0 +1,270 @@
+#ifdef WIN32
+// Must go before windows.h, AF_UNIX sockets are supported since Windows 10 1803
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include "ControlChannel.h"
+#include "Platform.h"
+
+void Log(WSTRING str);
+
+using namespace ControlProtocol;
+
+#ifdef WIN32
+#define CloseSocket(socket) closesocket(static_cast<SOCKET>(socket))
+#define ShutdownSocket(socket) shutdown(static_cast<SOCKET>(socket), SD_BOTH)
+#define PollSockets WSAPoll
+typedef WSAPOLLFD PollDescriptor;
+#else
+#define CloseSocket(socket) close(static_cast<int>(socket))
+#define ShutdownSocket(socket) shutdown(static_cast<int>(socket), SHUT_RDWR)
+#define PollSockets poll
+typedef pollfd PollDescriptor;
+#endif
+
+// Blocking calls are entered only when poll reports data, so the server thread notices stopping within this interval
+static const int pollIntervalMilliseconds = 100;
+// Failed accepts are retried after a delay doubling up to the maximum
+static const int minAcceptBackoffMilliseconds = 10;
+static const int maxAcceptBackoffMilliseconds = 1000;
+
+ControlChannel::ControlChannel(const string& path)
+	: path(path), listener(invalidSocket), handler(nullptr), stopping(false), activeClient(invalidSocket)
+{
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		Log(WSTR("Control socket path is too long"));
+		return;
+	}
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, path.c_str(), path.size());
+
+#ifdef WIN32
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+	{
+		Log(WSTR("Failed to initialize Winsock"));
+		return;
+	}
+	DeleteFileA(path.c_str());
+#else
+	unlink(path.c_str());
+#endif
+
+	auto socket = static_cast<Socket>(::socket(AF_UNIX, SOCK_STREAM, 0));
+	if (socket == invalidSocket || static_cast<intptr_t>(socket) < 0)
+	{
+		Log(WSTR("Failed to create control socket"));
+		return;
+	}
+	if (bind(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+	{
+		Log(WSTR("Failed to bind control socket"));
+		CloseSocket(socket);
+		return;
+	}
+#ifndef WIN32
+	// Anyone who can connect can turn profiling of the process on and make it write files
+	chmod(path.c_str(), S_IRUSR | S_IWUSR);
+#endif
+	if (listen(socket, 4) != 0)
+	{
+		Log(WSTR("Failed to listen on control socket"));
+		CloseSocket(socket);
+		return;
+	}
+	listener = socket;
+	server = thread(&ControlChannel::ServerThread, this);
+}
+
+ControlChannel::~ControlChannel()
+{
+	if (listener == invalidSocket)
+		return;
+	stopping = true;
+	// Neither shutdown nor close of the listener wakes up accept on every platform, the server thread polls instead.
+	// A client in the middle of a request is cut off, so that the thread does not wait for it
+	{
+		lock_guard<mutex> lock(clientLock);
+		if (activeClient != invalidSocket)
+			ShutdownSocket(activeClient);
+	}
+	if (server.joinable())
+		server.join();
+	CloseSocket(listener);
+#ifdef WIN32
+	DeleteFileA(path.c_str());
+	WSACleanup();
+#else
+	unlink(path.c_str());
+#endif
+}
+
+void ControlChannel::SetHandler(Handler handler)
+{
+	this->handler = handler;
+}
+
+void ControlChannel::ServerThread()
+{
+	auto backoff = minAcceptBackoffMilliseconds;
+	while (WaitReadable(listener))
+	{
+		auto client = static_cast<Socket>(accept(listener, nullptr, nullptr));
+		if (client == invalidSocket || static_cast<intptr_t>(client) < 0)
+		{
+			// Out of descriptors or a similar persistent failure, the listener stays readable and would spin the thread
+			for (auto waited = 0; waited < backoff && !stopping; waited += pollIntervalMilliseconds)
+				this_thread::sleep_for(chrono::milliseconds(min(pollIntervalMilliseconds, backoff)));
+			backoff = min(backoff * 2, maxAcceptBackoffMilliseconds);
+			continue;
+		}
+		backoff = minAcceptBackoffMilliseconds;
+#ifndef WIN32
+		ucred credentials;
+		socklen_t credentialsSize = sizeof(credentials);
+		if (getsockopt(static_cast<int>(client), SOL_SOCKET, SO_PEERCRED, &credentials, &credentialsSize) != 0
+			|| (credentials.uid != geteuid() && credentials.uid != 0))
+		{
+			CloseSocket(client);
+			continue;
+		}
+#endif
+		SetActiveClient(client);
+		Serve(client);
+		SetActiveClient(invalidSocket);
+		CloseSocket(client);
+	}
+}
+
+void ControlChannel::SetActiveClient(Socket client)
+{
+	lock_guard<mutex> lock(clientLock);
+	activeClient = client;
+	if (client != invalidSocket && stopping)
+		ShutdownSocket(client);
+}
+
+// False when the channel is stopping or poll fails
+bool ControlChannel::WaitReadable(Socket socket) const
+{
+	while (!stopping)
+	{
+		PollDescriptor descriptor;
+		descriptor.fd = static_cast<decltype(descriptor.fd)>(socket);
+		descriptor.events = POLLIN;
+		descriptor.revents = 0;
+		auto result = PollSockets(&descriptor, 1, pollIntervalMilliseconds);
+		if (result > 0)
+			return true;
+#ifndef WIN32
+		if (result < 0 && errno == EINTR)
+			continue;
+#endif
+		if (result < 0)
+			return false;
+	}
+	return false;
+}
+
+void ControlChannel::Serve(Socket client)
+{
+	vector<uint8_t> argument;
+	vector<uint8_t> message(maxMessageSize);
+	RequestHeader request;
+	while (!stopping && Receive(client, &request, sizeof(request)))
+	{
+		if (request.magic != requestMagic || request.version != version || request.argumentSize > maxArgumentSize)
+		{
+			// The stream cannot be trusted after a malformed header
+			Reply(client, BadRequest, "Malformed request");
+			return;
+		}
+		argument.resize(request.argumentSize);
+		if (request.argumentSize > 0 && !Receive(client, argument.data(), request.argumentSize))
+			return;
+
+		Handler currentHandler = handler;
+		if (currentHandler == nullptr)
+		{
+			if (!Reply(client, NotReady, "GroboTrace.Core is not loaded yet"))
+				return;
+			continue;
+		}
+		// The profiler may be released while a detach is handled, the destructor then waits for the reply
+		// instead of cutting the client off
+		auto detach = request.command == Detach;
+		if (detach)
+			SetActiveClient(invalidSocket);
+		int messageSize = static_cast<int>(message.size());
+		auto status = static_cast<Status>(currentHandler(request.command, request.value, argument.data(), static_cast<int>(argument.size()), message.data(), &messageSize));
+		if (messageSize < 0 || messageSize > static_cast<int>(message.size()))
+			messageSize = 0;
+		if (!Reply(client, status, string(reinterpret_cast<char*>(message.data()), messageSize)))
+			return;
+		// The profiler is about to be unloaded, and the client must not hold this thread in recv
+		if (detach && status == Ok)
+			return;
+		if (detach)
+			SetActiveClient(client);
+	}
+}
+
+bool ControlChannel::Receive(Socket socket, void* buffer, size_t size) const
+{
+	auto data = static_cast<char*>(buffer);
+	while (size > 0)
+	{
+		// An idle client must not keep the server thread in recv when the channel is being destroyed
+		if (!WaitReadable(socket))
+			return false;
+		auto received = recv(socket, data, static_cast<int>(size), 0);
+		if (received <= 0)
+			return false;
+		data += received;
+		size -= received;
+	}
+	return true;
+}
+
+bool ControlChannel::Send(Socket socket, const void* buffer, size_t size)
+{
+	auto data = static_cast<const char*>(buffer);
+	while (size > 0)
+	{
+#ifdef WIN32
+		auto sent = send(socket, data, static_cast<int>(size), 0);
+#else
+		auto sent = send(static_cast<int>(socket), data, size, MSG_NOSIGNAL);
+#endif
+		if (sent <= 0)
+			return false;
+		data += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+bool ControlChannel::Reply(Socket socket, Status status, const string& message)
+{
+	ResponseHeader response;
+	response.magic = responseMagic;
+	response.status = status;
+	response.messageSize = static_cast<uint32_t>(message.size());
+	response.reserved = 0;
+	return Send(socket, &response, sizeof(response)) && Send(socket, message.data(), message.size());
+}
\ No newline at end of file
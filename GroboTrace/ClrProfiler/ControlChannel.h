@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "ControlProtocol.h"
+
+using namespace std;
+
+// Unix domain socket served by a background thread, accepts ControlProtocol requests and passes them to GroboTrace.Core.
+// Connections are served one at a time, the socket is accessible to the owner of the process only
+class ControlChannel
+{
+public:
+	typedef int(*Handler)(int command, int64_t value, const uint8_t* argument, int argumentSize, uint8_t* message, int* messageSize);
+
+	explicit ControlChannel(const string& path);
+	~ControlChannel();
+
+	bool IsValid() const { return listener != invalidSocket; }
+	const string& GetPath() const { return path; }
+
+	// Set when GroboTrace.Core is loaded, requests are answered with NotReady before that
+	void SetHandler(Handler handler);
+
+private:
+	typedef intptr_t Socket;
+	static const Socket invalidSocket = -1;
+
+	void ServerThread();
+	void Serve(Socket client);
+	void SetActiveClient(Socket client);
+	bool WaitReadable(Socket socket) const;
+	bool Receive(Socket socket, void* buffer, size_t size) const;
+	static bool Send(Socket socket, const void* buffer, size_t size);
+	static bool Reply(Socket socket, ControlProtocol::Status status, const string& message);
+
+	string path;
+	Socket listener;
+	atomic<Handler> handler;
+	atomic<bool> stopping;
+	// Guards the active client against being closed while the destructor shuts it down
+	mutex clientLock;
+	Socket activeClient;
+	thread server;
+};
\ No newline at end of file
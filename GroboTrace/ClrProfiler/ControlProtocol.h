@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+// Binary protocol of the control socket (GROBOTRACE_CONTROL=1). A client sends any number of requests over one connection,
+// every request gets exactly one response. Integers are little-endian, strings are UTF-8 without terminating zero
+namespace ControlProtocol
+{
+	const uint32_t requestMagic = 0x51435447; // 'GTCQ'
+	const uint32_t responseMagic = 0x52435447; // 'GTCR'
+	const uint16_t version = 1;
+	const uint32_t maxArgumentSize = 4096;
+	const uint32_t maxMessageSize = 64 * 1024;
+
+	enum Command : uint16_t
+	{
+		// Argument is a Namespace.Type.Method pattern list ('*' matches any substring), empty argument means all methods
+		EnableProbes = 1,
+		DisableProbes = 2,
+		// Stats of all threads and per method totals
+		ClearStats = 3,
+		// Argument is a path of the file to write, it is written by the profiled process
+		DumpSnapshot = 4,
+		// Value is 1 of N Profiler.Profile sections to trace for all keys, 0 restores per key rates
+		SetSamplingRate = 5,
+		// Value is the maximal number of call tree nodes of all threads, 0 means unlimited
+		SetCallTreeNodesLimit = 6,
+		GetStatus = 7,
+		// Reverts the methods instrumented through ReJIT and unloads the profiler, only a profiler attached to a running process can detach
+		Detach = 8,
+	};
+
+	enum Status : int32_t
+	{
+		Ok = 0,
+		UnknownCommand = 1,
+		BadRequest = 2,
+		// GroboTrace.Core is loaded by a bootstrap thread, commands are rejected until then and after a detach
+		NotReady = 3,
+		Failed = 4,
+	};
+
+	struct RequestHeader
+	{
+		uint32_t magic;
+		uint16_t version;
+		uint16_t command;
+		int64_t value;
+		uint32_t argumentSize;
+		uint32_t reserved;
+	};
+
+	// Followed by a human readable message
+	struct ResponseHeader
+	{
+		uint32_t magic;
+		int32_t status;
+		uint32_t messageSize;
+		uint32_t reserved;
+	};
+}
\ No newline at end of file
@@ -5,69 +5,263 @@
 #include "corhlpr.h"
 #include "CComPtr.h"
 #include "profiler_pal.h"
-#include <fstream>
-#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <thread>
 #include <unordered_set>
 #include <unordered_map>
 
 //global static singleton
 CorProfiler* corProfiler;
 
-CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr), callback(nullptr), init(nullptr), failed(false)
+CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr), corProfilerInfo10(nullptr), corProfilerInfo12(nullptr), stackSampler(nullptr), perfMap(nullptr), jitCost(nullptr), inliningRecorder(nullptr), symbolTable(nullptr), sharedStats(nullptr), controlChannel(nullptr), methodFilter(nullptr), diagnosticLog(nullptr), reJitQueue(nullptr), waitTracker(nullptr), callback(nullptr), moduleUnloaded(nullptr), standby(false), managedControl(nullptr), detaching(false), runtimeStarted(false)
 {
 }
 
 CorProfiler::~CorProfiler()
 {
+    // First, a detach requested over the socket may still be finishing on its thread, which is joined here
+    // before anything it uses is destroyed and the library is unloaded
+    if (this->controlChannel != nullptr)
+    {
+        delete this->controlChannel;
+        this->controlChannel = nullptr;
+    }
+    if (this->reJitQueue != nullptr)
+    {
+        delete this->reJitQueue;
+        this->reJitQueue = nullptr;
+    }
+    if (this->waitTracker != nullptr)
+    {
+        delete this->waitTracker;
+        this->waitTracker = nullptr;
+    }
+    if (this->methodFilter != nullptr)
+    {
+        delete this->methodFilter;
+        this->methodFilter = nullptr;
+    }
+    if (this->stackSampler != nullptr)
+    {
+        delete this->stackSampler;
+        this->stackSampler = nullptr;
+    }
+    if (this->perfMap != nullptr)
+    {
+        delete this->perfMap;
+        this->perfMap = nullptr;
+    }
+    if (this->jitCost != nullptr)
+    {
+        delete this->jitCost;
+        this->jitCost = nullptr;
+    }
+    if (this->inliningRecorder != nullptr)
+    {
+        delete this->inliningRecorder;
+        this->inliningRecorder = nullptr;
+    }
+    if (this->symbolTable != nullptr)
+    {
+        delete this->symbolTable;
+        this->symbolTable = nullptr;
+    }
+    if (this->sharedStats != nullptr)
+    {
+        delete this->sharedStats;
+        this->sharedStats = nullptr;
+    }
+    if (this->corProfilerInfo10 != nullptr)
+    {
+        this->corProfilerInfo10->Release();
+        this->corProfilerInfo10 = nullptr;
+    }
+    if (this->corProfilerInfo12 != nullptr)
+    {
+        this->corProfilerInfo12->Release();
+        this->corProfilerInfo12 = nullptr;
+    }
     if (this->corProfilerInfo != nullptr)
     {
         this->corProfilerInfo->Release();
         this->corProfilerInfo = nullptr;
     }
+    // Last, the components above log while they are destroyed
+    if (this->diagnosticLog != nullptr)
+    {
+        delete this->diagnosticLog;
+        this->diagnosticLog = nullptr;
+    }
 }
 
-void DebugOutput(char* str)
+static DiagnosticLog* GetDiagnosticLog()
 {
-#ifdef _DEBUG
-	OutputDebugStringA(str);
-#else
-#endif
+	return corProfiler == nullptr ? nullptr : corProfiler->diagnosticLog;
 }
 
-void DebugOutput(WCHAR* str)
+void DebugOutput(const char* str)
 {
-#ifdef _DEBUG
-	OutputDebugStringW(str);
-#else
-#endif
+	auto log = GetDiagnosticLog();
+	if (log != nullptr && log->IsEnabled(DiagnosticLog::Debug))
+		log->WriteUtf8(DiagnosticLog::Debug, str, strlen(str));
+}
+
+void DebugOutput(const WCHAR* str)
+{
+	auto log = GetDiagnosticLog();
+	if (log != nullptr && log->IsEnabled(DiagnosticLog::Debug))
+		log->Write(DiagnosticLog::Debug, str, char_traits<WCHAR>::length(str));
 }
 
 #define USE_SETTINGS
 
-void Log(wstring str)
+// Messages written before the log is created go to the debug output directly
+void Log(WSTRING str)
+{
+	auto log = GetDiagnosticLog();
+	if (log != nullptr)
+		log->Write(DiagnosticLog::Info, str);
+	else
+		Platform::WriteDebugOutput(WSTR("grobotrace: ") + str);
+}
+
+// Messages with numbers on paths that run after startup, the log's writer thread formats them (see DiagnosticLog::Format)
+void LogFormat(const WCHAR* format, INT64 argument0, INT64 argument1)
+{
+	auto log = GetDiagnosticLog();
+	if (log != nullptr)
+		log->WriteFormat(DiagnosticLog::Info, format, argument0, argument1);
+	else
+		Platform::WriteDebugOutput(WSTR("grobotrace: ") + DiagnosticLog::Format(format, argument0, argument1));
+}
+
+void DebugOutputFormat(const WCHAR* format, INT64 argument0, INT64 argument1)
+{
+	auto log = GetDiagnosticLog();
+	if (log != nullptr && log->IsEnabled(DiagnosticLog::Debug))
+		log->WriteFormat(DiagnosticLog::Debug, format, argument0, argument1);
+}
+
+WSTRING GetSetting(const WCHAR* name)
 {
-	OutputDebugString((L"grobotrace: " + str).c_str());
+	return Platform::GetEnvironmentValue(name);
 }
 
-DWORD STDMETHODCALLTYPE Suicide(void *p)
+bool IsSettingEnabled(const WCHAR* name)
+{
+	auto value = GetSetting(name);
+	return value == WSTR("1") || Platform::EqualsIgnoreCase(value.c_str(), WSTR("true"));
+}
+
+ThreadID GetCurrentProfilerThreadId(ICorProfilerInfo4* corProfilerInfo)
+{
+	ThreadID threadId = 0;
+	corProfilerInfo->GetCurrentThreadID(&threadId);
+	return threadId;
+}
+
+// Called by GroboTrace.Core
+int CopySampledTree(BOOL currentThreadOnly, SampledNode* buffer, int capacity)
+{
+	if (corProfiler->stackSampler == nullptr)
+		return 0;
+	return corProfiler->stackSampler->CopyTree(currentThreadOnly ? GetCurrentProfilerThreadId(corProfiler->corProfilerInfo) : 0, buffer, capacity);
+}
+
+// Called by GroboTrace.Core
+void ClearSampledTree(BOOL currentThreadOnly)
+{
+	if (corProfiler->stackSampler != nullptr)
+		corProfiler->stackSampler->ClearTree(currentThreadOnly ? GetCurrentProfilerThreadId(corProfiler->corProfilerInfo) : 0);
+}
+
+// Stats area of the shared segment, GroboTrace.Core publishes its stats there
+BYTE* GetSharedStatsArea(INT64* capacity)
+{
+	if (corProfiler->sharedStats == nullptr)
+	{
+		*capacity = 0;
+		return nullptr;
+	}
+	*capacity = corProfiler->sharedStats->GetStatsCapacity();
+	return corProfiler->sharedStats->GetStatsArea();
+}
+
+// Called by GroboTrace.Core at boundaries of profiled sections and of the methods whose CPU time is measured
+UINT64 GetThreadCpuTime()
+{
+	return Platform::GetThreadCpuTime();
+}
+
+// Called by GroboTrace.Core, it checks the level itself before building a message
+void WriteManagedLog(int level, const WCHAR* message)
+{
+	auto log = GetDiagnosticLog();
+	if (log != nullptr && level >= DiagnosticLog::Error && level <= DiagnosticLog::Verbose)
+		log->Write(static_cast<DiagnosticLog::Level>(level), message, char_traits<WCHAR>::length(message));
+}
+
+BOOL GetMethodSymbol(int methodId, const char** assemblyName, const char** typeName, const char** methodName)
+{
+	return corProfiler->symbolTable != nullptr && corProfiler->symbolTable->Get(methodId, assemblyName, typeName, methodName);
+}
+
+// HRESULTs and metadata tokens are logged in hex
+WSTRING FormatHex(UINT32 value)
+{
+	char buffer[16];
+	snprintf(buffer, sizeof(buffer), "0x%08X", static_cast<unsigned>(value));
+	return Platform::FromUtf8(buffer);
+}
+
+int ControlReply(ControlProtocol::Status status, const string& text, uint8_t* message, int* messageSize)
+{
+	auto size = text.size() < static_cast<size_t>(*messageSize) ? static_cast<int>(text.size()) : *messageSize;
+	memcpy(message, text.data(), size);
+	*messageSize = size;
+	return status;
+}
+
+// Handler of the control socket
+int HandleControlRequest(int command, int64_t value, const uint8_t* argument, int argumentSize, uint8_t* message, int* messageSize)
+{
+	return corProfiler->HandleControl(command, value, argument, argumentSize, message, messageSize);
+}
+
+string GetControlSocketPath()
+{
+	auto setting = GetSetting(WSTR("GROBOTRACE_CONTROL_SOCKET"));
+	if (!setting.empty())
+		return Platform::ToUtf8(setting);
+	char path[1024];
+#ifdef WIN32
+	auto len = GetTempPathA(sizeof(path) - 32, path);
+	sprintf(path + len, "grobotrace-%u.sock", static_cast<unsigned>(Platform::GetProcessId()));
+#else
+	sprintf(path, "/tmp/grobotrace-%u.sock", static_cast<unsigned>(Platform::GetProcessId()));
+#endif
+	return string(path);
+}
+
+void Suicide()
 {
 	for (int i = 0; i < 10; ++i)
 	{
-		Sleep(1000);
-		Log(L"Requesting profiler detach");
+		this_thread::sleep_for(chrono::seconds(1));
+		Log(WSTR("Requesting profiler detach"));
 		if (corProfiler->corProfilerInfo->RequestProfilerDetach(0) == S_OK)
 			break;
 	}
-	return 0;
 }
 
 #ifdef USE_SETTINGS
 
-vector<wstring> ParseLine(const wstring& str)
+vector<WSTRING> ParseLine(const WSTRING& str)
 {
 	int n = str.length();
 	int state = 0;
-	vector<wstring> result;
+	vector<WSTRING> result;
 	vector<WCHAR> cur;
 	for (int i = 0; i <= n; ++i)
 	{
@@ -88,7 +282,7 @@ vector<wstring> ParseLine(const wstring& str)
 		case 1:
 			if (c == ' ' || c == '\t')
 			{
-				result.push_back(wstring(cur.begin(), cur.end()));
+				result.push_back(WSTRING(cur.begin(), cur.end()));
 				cur.clear();
 				state = 0;
 			}
@@ -97,7 +291,7 @@ vector<wstring> ParseLine(const wstring& str)
 		case 2:
 			if (c == '"')
 			{
-				result.push_back(wstring(cur.begin(), cur.end()));
+				result.push_back(WSTRING(cur.begin(), cur.end()));
 				cur.clear();
 				state = 0;
 			}
@@ -123,31 +317,22 @@ vector<wstring> ParseLine(const wstring& str)
 	return result;
 }
 
-bool NeedProfile(const wstring& settingsFileName)
+bool NeedProfile(const WSTRING& settingsFileName)
 {
-	WCHAR fullFileName[1024];
-	WCHAR str[1024];
-	auto len = GetModuleFileNameW(nullptr, fullFileName, 1024);
-	Log(L"Asked to profile:");
+	auto fullFileName = Platform::GetExecutablePath();
+	Log(WSTR("Asked to profile:"));
 	Log(fullFileName);
 
-	auto settingsStream = wifstream(settingsFileName);
-	if (!settingsStream.is_open())
+	vector<WSTRING> lines;
+	if (!Platform::ReadLines(settingsFileName, lines))
 		return false;
 
-	wstring fileName;
-	for (int i = len - 1; i >= 0; --i)
-		if (fullFileName[i] == '\\')
-		{
-			fileName = wstring(&fullFileName[i + 1]);
-			break;
-		}
+	// On Linux this is "dotnet" for framework-dependent apps, the command line tells them apart
+	auto fileName = Platform::GetFileName(fullFileName);
 
 	bool needProfile = false;
-	while (!settingsStream.eof())
+	for (const auto& cur : lines)
 	{
-		wstring cur;
-		getline(settingsStream, cur);
 		auto parsedLine = ParseLine(cur);
 
 		if (parsedLine.size() == 0)
@@ -160,11 +345,10 @@ bool NeedProfile(const wstring& settingsFileName)
 			needProfile = true;
 			break;
 		}
-		auto commandLine = wstring(GetCommandLine());
+		auto commandLine = Platform::GetProcessCommandLine();
 		for (int i = 1; i < parsedLine.size(); ++i)
-			needProfile |= commandLine.find(parsedLine[i]) != string::npos;
+			needProfile |= commandLine.find(parsedLine[i]) != WSTRING::npos;
 	}
-	settingsStream.close();
 	return needProfile;
 }
 
@@ -172,10 +356,20 @@ bool NeedProfile(const wstring& settingsFileName)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk)
 {
-	Log(L"Profiler started");
+	return InitializeProfiler(pICorProfilerInfoUnk, false);
+}
+
+// Attached profiler reads the same settings from the environment of the process, the client data of the attach request is not used
+HRESULT CorProfiler::InitializeProfiler(IUnknown* pICorProfilerInfoUnk, bool attach)
+{
+	auto logFileSize = Platform::ParseInt(GetSetting(WSTR("GROBOTRACE_LOG_FILE_MB")));
+	diagnosticLog = new DiagnosticLog(DiagnosticLog::ParseLevel(GetSetting(WSTR("GROBOTRACE_LOG_LEVEL")), DiagnosticLog::Info),
+		GetSetting(WSTR("GROBOTRACE_LOG_FILE")), static_cast<UINT64>(logFileSize > 0 ? logFileSize : 16) << 20, 4096);
 
 	corProfiler = this;
 
+	Log(attach ? WSTR("Profiler attached") : WSTR("Profiler started"));
+
     HRESULT queryInterfaceResult = pICorProfilerInfoUnk->QueryInterface(__uuidof(ICorProfilerInfo4), reinterpret_cast<void **>(&this->corProfilerInfo));
 
     if (FAILED(queryInterfaceResult))
@@ -185,61 +379,201 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
 
 	FindProfilerFolder();
 
+	// Stack sampling engine replaces IL rewriting, it needs runtime suspension API of .NET Core 3.0+
+	bool useStackSampler = Platform::EqualsIgnoreCase(GetSetting(WSTR("GROBOTRACE_ENGINE")).c_str(), WSTR("StackSampling"));
+	if (useStackSampler && FAILED(pICorProfilerInfoUnk->QueryInterface(__uuidof(ICorProfilerInfo10), reinterpret_cast<void **>(&this->corProfilerInfo10))))
+	{
+		Log(WSTR("ICorProfilerInfo10 is not supported by the runtime, stack sampling is disabled"));
+		useStackSampler = false;
+	}
+
 #ifdef USE_SETTINGS
 
-	bool needProfile = NeedProfile(profilerFolder + L"\\GroboTrace.ini");
+	// Attaching to a process is a request to profile it
+	bool needProfile = attach || NeedProfile(Platform::CombinePath(profilerFolder, WSTR("GroboTrace.ini")));
 
-	Log(needProfile ? L"will profile" : L"skipped");
+	// Probes of an unlisted process stay off until they are enabled through the control socket
+	standby = !needProfile && IsSettingEnabled(WSTR("GROBOTRACE_CONTROL"));
+	needProfile |= standby;
+
+	Log(needProfile ? (standby ? WSTR("will profile on request") : WSTR("will profile")) : WSTR("skipped"));
 	DWORD eventMask = needProfile ? COR_PRF_MONITOR_JIT_COMPILATION
+		| COR_PRF_MONITOR_MODULE_LOADS
 		| COR_PRF_DISABLE_TRANSPARENCY_CHECKS_UNDER_FULL_TRUST /* helps the case where this profiler is used on Full CLR */
 															   /*| COR_PRF_DISABLE_INLINING*/
 		: COR_PRF_MONITOR_NONE;
 
 #else
 	DWORD eventMask = COR_PRF_MONITOR_JIT_COMPILATION
+		| COR_PRF_MONITOR_MODULE_LOADS
 		| COR_PRF_DISABLE_TRANSPARENCY_CHECKS_UNDER_FULL_TRUST /* helps the case where this profiler is used on Full CLR */
 															   /*| COR_PRF_DISABLE_INLINING*/
 		;
 #endif
 
+	// Transparency checks cannot be changed after startup. The runtime refuses to detach a profiler that has called SetILFunctionBody,
+	// so an attached profiler instruments methods only through ReJIT, which .NET Core 3.0+ allows to enable on attach
+	if (attach)
+		eventMask = COR_PRF_MONITOR_JIT_COMPILATION | COR_PRF_MONITOR_MODULE_LOADS | COR_PRF_ENABLE_REJIT;
+
+	// Trees of sampled threads are dropped when the threads are destroyed
+	if (useStackSampler && needProfile)
+		eventMask |= COR_PRF_ENABLE_STACK_SNAPSHOT | COR_PRF_MONITOR_THREADS;
+
     auto hr = this->corProfilerInfo->SetEventMask(eventMask);
+	if (attach && FAILED(hr))
+	{
+		Log(WSTR("Failed to set event mask on attach, .NET Core 3.0 or later is needed: ") + FormatHex(hr));
+		return E_FAIL;
+	}
+
+	if (attach && !useStackSampler)
+		reJitQueue = new ReJitQueue(corProfilerInfo, 100);
+
+	// Waits are attributed to call tree nodes of the IL rewriting engine, the EventPipe session of a profiler needs .NET 5+
+	if (needProfile && !useStackSampler && IsSettingEnabled(WSTR("GROBOTRACE_WAITS")))
+	{
+		if (FAILED(pICorProfilerInfoUnk->QueryInterface(__uuidof(ICorProfilerInfo12), reinterpret_cast<void **>(&this->corProfilerInfo12))))
+			Log(WSTR("ICorProfilerInfo12 is not supported by the runtime, waits are not tracked"));
+		else if (FAILED(corProfilerInfo12->SetEventMask2(eventMask, COR_PRF_HIGH_MONITOR_EVENT_PIPE)))
+			Log(WSTR("Failed to enable EventPipe events, waits are not tracked"));
+		else
+		{
+			waitTracker = new WaitTracker(corProfilerInfo12, IsSettingEnabled(WSTR("GROBOTRACE_THREAD_POOL_WAITS")));
+			if (waitTracker->Start())
+				Log(WSTR("Wait tracking is enabled"));
+			else
+			{
+				delete waitTracker;
+				waitTracker = nullptr;
+			}
+		}
+	}
 
-	InitializeCriticalSection(&criticalSection);
+	if (needProfile)
+	{
+		auto filterFileName = GetSetting(WSTR("GROBOTRACE_FILTER"));
+		methodFilter = new MethodFilter(filterFileName.empty() ? Platform::CombinePath(profilerFolder, WSTR("GroboTrace.filter")) : filterFileName);
+	}
 
-	Log(L"Profiler successfully initialized");
+	if (useStackSampler && needProfile)
+	{
+		auto interval = Platform::ParseInt(GetSetting(WSTR("GROBOTRACE_STACK_SAMPLING_INTERVAL_MS")));
+		stackSampler = new StackSampler(corProfilerInfo10, interval > 0 ? interval : 10);
+		stackSampler->Start();
+		Log(WSTR("Stack sampler started"));
+	}
 
-	if (!needProfile)
+	bool writePerfMap = IsSettingEnabled(WSTR("GROBOTRACE_PERF_MAP"));
+	bool writeJitDump = IsSettingEnabled(WSTR("GROBOTRACE_JITDUMP"));
+	if ((writePerfMap || writeJitDump) && needProfile)
+	{
+		perfMap = new PerfMap(corProfilerInfo, writePerfMap, writeJitDump, IsSettingEnabled(WSTR("GROBOTRACE_JITDUMP_IL_MAPS")));
+		Log(WSTR("Perf map is enabled"));
+	}
+
+	if (needProfile && !useStackSampler && IsSettingEnabled(WSTR("GROBOTRACE_SHARED_STATS")))
+	{
+		auto capacity = Platform::ParseInt(GetSetting(WSTR("GROBOTRACE_SHARED_STATS_MB")));
+		sharedStats = new SharedStats((capacity > 0 ? capacity : 8) << 20, 32 << 20);
+		if (sharedStats->IsValid())
+		{
+			// Symbols go to the segment as well, so that readers can name methods
+			symbolTable = new SymbolTable(sharedStats->GetSymbolsArea(), sharedStats->GetSymbolsSize());
+			Log(WSTR("Shared stats segment is created"));
+		}
+		else
+		{
+			delete sharedStats;
+			sharedStats = nullptr;
+		}
+	}
+
+	if (needProfile && !useStackSampler && symbolTable == nullptr)
+	{
+		symbolTable = new SymbolTable(1 << 20, 64 << 20);
+		if (!symbolTable->IsValid())
+		{
+			delete symbolTable;
+			symbolTable = nullptr;
+		}
+	}
+
+	if (IsSettingEnabled(WSTR("GROBOTRACE_JIT_COST")) && needProfile)
+	{
+		auto topCount = Platform::ParseInt(GetSetting(WSTR("GROBOTRACE_JIT_COST_TOP")));
+		jitCost = new JitCost(Platform::CombinePath(profilerFolder, WSTR("GroboTrace.JitCost.txt")), topCount > 0 ? topCount : 50);
+		Log(WSTR("JIT cost profiling is enabled"));
+	}
+
+	if (IsSettingEnabled(WSTR("GROBOTRACE_INLINING")) && needProfile)
 	{
-		DWORD tmp;
-		CreateThread(0, 0, Suicide, 0, 0, &tmp);
+		auto capacity = Platform::ParseInt(GetSetting(WSTR("GROBOTRACE_INLINING_CAPACITY")));
+		inliningRecorder = new InliningRecorder(corProfilerInfo, Platform::CombinePath(profilerFolder, WSTR("GroboTrace.Inlining.txt")), capacity > 0 ? capacity : 65536, 100);
+		Log(WSTR("Inlining recorder is enabled"));
 	}
 
+	// The socket is the only way to detach an attached profiler
+	if ((IsSettingEnabled(WSTR("GROBOTRACE_CONTROL")) || attach) && needProfile)
+	{
+		controlChannel = new ControlChannel(GetControlSocketPath());
+		if (controlChannel->IsValid())
+			Log(WSTR("Control socket is created"));
+		else
+		{
+			delete controlChannel;
+			controlChannel = nullptr;
+		}
+	}
+
+	Log(WSTR("Profiler successfully initialized"));
+
+	// Attached profiler loads GroboTrace.Core in ProfilerAttachComplete
+	if (!needProfile)
+		thread(Suicide).detach();
+	else if (!attach)
+		thread(&CorProfiler::LoadCore, this).detach();
+
     return S_OK;
 }
 
 void CorProfiler::FindProfilerFolder()
 {
-	WCHAR fileName[1024];
-
-	int len = GetModuleFileName(GetModuleHandle(L"ClrProfiler.dll"), fileName, 1024);
-	for (int i = len - 1; i >= 0; --i)
-		if (fileName[i] == '\\')
-		{
-			fileName[i] = 0;
-			break;
-		}
-	profilerFolder = wstring(fileName);
+	profilerFolder = Platform::GetProfilerFolder();
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::Shutdown()
 {
-	Log(L"Profiler is about to shutdown");
+	Log(WSTR("Profiler is about to shutdown"));
+	if (this->controlChannel != nullptr)
+	{
+		// Requests must not reach GroboTrace.Core while the runtime is shutting down
+		delete this->controlChannel;
+		this->controlChannel = nullptr;
+	}
+	if (this->stackSampler != nullptr)
+		this->stackSampler->Stop();
+	if (this->reJitQueue != nullptr)
+		this->reJitQueue->Stop();
+	if (this->waitTracker != nullptr)
+		this->waitTracker->Stop();
+	if (this->perfMap != nullptr)
+	{
+		// Flushes pending entries
+		delete this->perfMap;
+		this->perfMap = nullptr;
+	}
+	if (this->jitCost != nullptr)
+		this->jitCost->WriteReport();
+	if (this->inliningRecorder != nullptr)
+		this->inliningRecorder->WriteReport();
+	if (this->diagnosticLog != nullptr)
+		this->diagnosticLog->Stop();
     if (this->corProfilerInfo != nullptr)
     {
         this->corProfilerInfo->Release();
         this->corProfilerInfo = nullptr;
     }
-	DeleteCriticalSection(&criticalSection);
     return S_OK;
 }
 
@@ -295,6 +629,13 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadFinished(ModuleID moduleId, HRE
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadStarted(ModuleID moduleId)
 {
+	// Releases ids and stats of the methods rewritten in the module, ModuleID values are reused by the runtime
+	if (methodFilter != nullptr)
+		methodFilter->ModuleUnloaded(moduleId);
+	if (reJitQueue != nullptr)
+		reJitQueue->ModuleUnloaded(moduleId);
+	if (moduleUnloaded != nullptr)
+		moduleUnloaded(moduleId);
     return S_OK;
 }
 
@@ -328,6 +669,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ClassUnloadFinished(ClassID classId, HRES
     return S_OK;
 }
 
+// Not raised by the runtime, functions are released together with their modules in ModuleUnloadStarted
 HRESULT STDMETHODCALLTYPE CorProfiler::FunctionUnloadStarted(FunctionID functionId)
 {
     return S_OK;
@@ -350,7 +692,7 @@ mdToken GetTokenFromSig(ModuleID moduleId, char* sig, int len)
 	CComPtr<IMetaDataEmit> metadataEmit;
 	if (FAILED(corProfiler->corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataEmit, reinterpret_cast<IUnknown **>(&metadataEmit))))
 	{
-		OutputDebugString(L"Failed to get metadata emit {C++}");
+		Log(WSTR("Failed to get metadata emit {C++}"));
 		return 0;
 	}
 	
@@ -360,181 +702,302 @@ mdToken GetTokenFromSig(ModuleID moduleId, char* sig, int len)
 	return token;
 }
 
+// The runtime copies the body of a ReJIT-ed method, so it is built in a buffer of the JIT thread
+static thread_local vector<BYTE> reJitBody;
 
-HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock)
+void* allocateForReJitBody(ModuleID moduleId, ULONG size)
+{
+	reJitBody.resize(size);
+	return reJitBody.data();
+}
+
+// Assemblies compiled while the runtime starts, GroboTrace.Core used to be loaded on the JIT of the first method outside of them
+static const WCHAR* startupAssemblies[] = { WSTR("mscorlib"), WSTR("System.Core"), WSTR("GroboTrace"), WSTR("GroboTrace.Core"), WSTR("GrEmit") };
+
+void CorProfiler::DetectRuntimeStart(FunctionID functionId)
 {
-	HRESULT hr;
-	mdToken methodDefToken;
-	mdTypeDef typeDefToken;
-	mdModule moduleToken;
 	ClassID classId;
 	ModuleID moduleId;
-	AssemblyID assemblyId;
-	WCHAR methodNameBuffer[1024];
-	ULONG actualMethodNameSize;
-	WCHAR typeNameBuffer[1024];
-	ULONG actualTypeNameSize;
-	WCHAR moduleNameBuffer[1024];
-	ULONG actualModuleNameSize;
-	WCHAR assemblyNameBuffer[1024];
-	ULONG actualAssemblyNameSize;
-	char str[1024];
-
-	//sprintf(str, "JIT Compilation of the method %I64d", functionId);
+	mdToken methodDefToken;
+	MethodInfo method;
+	if (FAILED(corProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &methodDefToken)) || !GetMethodInfo(moduleId, methodDefToken, method))
+		return;
+	for (auto assemblyName : startupAssemblies)
+	{
+		if (Platform::Equals(method.assemblyName, assemblyName))
+			return;
+	}
+	SetRuntimeStarted();
+}
 
-	//OutputDebugStringA(str);
+void CorProfiler::SetRuntimeStarted()
+{
+	{
+		lock_guard<mutex> lock(runtimeStartLock);
+		runtimeStarted = true;
+	}
+	runtimeStartChanged.notify_all();
+}
 
-	/*if (FAILED(this->corProfilerInfo->GetFunctionInfo2(functionId, 0, 0, 0, 0, 0, &methodGenericParameters, 0)))
+// Runs on its own thread: the hosting API waits for the runtime to finish starting, and nothing on the JIT path waits for this
+void CorProfiler::LoadCore()
+{
+	// The DllExport stubs are entered from this native thread, which the runtime accepts only once it has finished starting.
+	// hostfxr waits for that by itself
+	if (!ManagedBootstrap::HasHostingApi())
 	{
-		OutputDebugStringW(L"GetFunctionInfo2 failed");
-		return S_OK;
-	}*/
+		unique_lock<mutex> lock(runtimeStartLock);
+		runtimeStartChanged.wait(lock, [this] { return runtimeStarted.load(); });
+	}
 
-	//sprintf(str, "MethodGenericParameters %d\r\n", methodGenericParameters);
+	CoreEntryPoints entryPoints = {};
+	if (!ManagedBootstrap::LoadCore(profilerFolder, entryPoints))
+	{
+		Log(WSTR("GroboTrace.Core is not loaded, methods are left uninstrumented"));
+		return;
+	}
 
-	//OutputDebugStringA(str);
+	auto folder = profilerFolder;
+	reinterpret_cast<void(*)(WCHAR*)>(entryPoints.setProfilerPath)(&folder[0]);
+	DebugOutput(WSTR("Successfully called 'SetProfilerPath' method"));
 
-	//OutputDebugStringW(L"We are dead");
+	auto init = reinterpret_cast<void(*)(void*, void*, void*, void*, void*, void*, void*, int, void*, void*)>(entryPoints.init);
+	init(reinterpret_cast<void*>(&GetTokenFromSig), reinterpret_cast<void*>(&Platform::AllocateTaskMemory), stackSampler != nullptr ? reinterpret_cast<void*>(&CopySampledTree) : nullptr, stackSampler != nullptr ? reinterpret_cast<void*>(&ClearSampledTree) : nullptr, reinterpret_cast<void*>(&GetMethodSymbol), reinterpret_cast<void*>(&GetSharedStatsArea), reinterpret_cast<void*>(&WriteManagedLog), diagnosticLog->GetLevel(),
+		waitTracker != nullptr ? reinterpret_cast<void*>(&WaitTracker::SetCurrentThreadSlot) : nullptr, reinterpret_cast<void*>(&GetThreadCpuTime));
+	DebugOutput(WSTR("Successfully called 'Init' method"));
 
-	if (this->failed)
-		return S_OK;
+	if (entryPoints.moduleUnloaded == nullptr)
+		DebugOutput(WSTR("Failed to obtain 'ModuleUnloaded' method addr, methods of unloaded modules will not be released"));
+	else
+		moduleUnloaded = reinterpret_cast<void(*)(ModuleID)>(entryPoints.moduleUnloaded);
 
-	if (FAILED(this->corProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &methodDefToken)))
+	if (entryPoints.control == nullptr)
+		DebugOutput(WSTR("Failed to obtain 'Control' method addr, control socket is disabled"));
+	else
 	{
-		DebugOutput(L"GetFunctionInfo failed");
-		return S_OK;
+		auto control = reinterpret_cast<ControlChannel::Handler>(entryPoints.control);
+		// Before the first instrumented method gets a chance to run
+		if (standby)
+		{
+			uint8_t message[256];
+			int messageSize = sizeof(message);
+			control(ControlProtocol::DisableProbes, 0, nullptr, 0, message, &messageSize);
+		}
+		managedControl = control;
+		if (controlChannel != nullptr)
+			controlChannel->SetHandler(&HandleControlRequest);
 	}
 
+	atomic_thread_fence(memory_order_release);
+	callback = reinterpret_cast<SharpResponse(*)(WCHAR*, WCHAR*, FunctionID, mdToken, char*, void*, int, BOOL)>(entryPoints.installTracing);
+	Log(WSTR("GroboTrace.Core is loaded"));
 
-	if (FAILED(this->corProfilerInfo->GetModuleInfo(moduleId, 0, 1024, &actualModuleNameSize, moduleNameBuffer, &assemblyId)))
+	// Methods compiled from now on are queued by JITCompilationStarted, the ones compiled before are found here
+	if (reJitQueue != nullptr)
 	{
-		DebugOutput(L"GetModuleInfo failed");
-		return S_OK;
+		QueueJitedMethods();
+		reJitQueue->Start();
 	}
+}
 
-	if (FAILED(this->corProfilerInfo->GetAssemblyInfo(assemblyId, 1024, &actualAssemblyNameSize, assemblyNameBuffer, 0, 0)))
+bool CorProfiler::GetMethodInfo(ModuleID moduleId, mdMethodDef methodDefToken, MethodInfo& method)
+{
+	ULONG actualSize;
+	AssemblyID assemblyId;
+	if (FAILED(this->corProfilerInfo->GetModuleInfo(moduleId, 0, 1024, &actualSize, method.moduleName, &assemblyId)))
 	{
-		DebugOutput(L"GetAssemblyInfo failed");
-		return S_OK;
+		DebugOutput(WSTR("GetModuleInfo failed"));
+		return false;
 	}
 
-	CComPtr<IMetaDataImport> metadataImport;
-	if (FAILED(corProfiler->corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport))))
+	if (FAILED(this->corProfilerInfo->GetAssemblyInfo(assemblyId, 1024, &actualSize, method.assemblyName, 0, 0)))
 	{
-		DebugOutput(L"Failed to get IMetadataImport {C++}");
-		return S_OK;
+		DebugOutput(WSTR("GetAssemblyInfo failed"));
+		return false;
 	}
 
-	if (FAILED(metadataImport->GetMethodProps(methodDefToken, &typeDefToken, methodNameBuffer, 1024, &actualMethodNameSize, 0, 0, 0, 0, 0)))
+	if (FAILED(corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&method.metadataImport))))
 	{
-		DebugOutput(L"GetMethodProps failed");
-		return S_OK;
+		DebugOutput(WSTR("Failed to get IMetadataImport {C++}"));
+		return false;
 	}
 
-	if (FAILED(metadataImport->GetTypeDefProps(typeDefToken, typeNameBuffer, 1024, &actualTypeNameSize, 0, 0)))
+	if (FAILED(method.metadataImport->GetMethodProps(methodDefToken, &method.typeDefToken, method.methodName, 1024, &actualSize, 0, 0, 0, 0, 0)))
 	{
-		DebugOutput(L"GetTypeDefProps failed");
-		return S_OK;
+		DebugOutput(WSTR("GetMethodProps failed"));
+		return false;
 	}
 
+	if (FAILED(method.metadataImport->GetTypeDefProps(method.typeDefToken, method.typeName, 1024, &actualSize, 0, 0)))
+	{
+		DebugOutput(WSTR("GetTypeDefProps failed"));
+		return false;
+	}
+	return true;
+}
 
-	if (!lstrcmpW(assemblyNameBuffer, L"GroboTrace"))
-		return S_OK;
+bool CorProfiler::ShouldInstrument(ModuleID moduleId, mdMethodDef methodDefToken, MethodInfo& method, MethodFilter::Thresholds& thresholds)
+{
+	return methodFilter == nullptr || methodFilter->ShouldInstrument(moduleId, method.metadataImport, method.assemblyName, method.typeDefToken, methodDefToken, method.methodName, thresholds);
+}
 
-	if (!lstrcmpW(assemblyNameBuffer, L"GroboTrace.Core"))
-		return S_OK;
+// Reads a compressed unsigned integer of a signature blob (ECMA-335 II.23.2)
+static ULONG UncompressSignatureData(PCCOR_SIGNATURE& signature)
+{
+	ULONG result;
+	if ((signature[0] & 0x80) == 0)
+	{
+		result = signature[0];
+		signature += 1;
+	}
+	else if ((signature[0] & 0xC0) == 0x80)
+	{
+		result = ((signature[0] & 0x3F) << 8) | signature[1];
+		signature += 2;
+	}
+	else
+	{
+		result = ((signature[0] & 0x1F) << 24) | (signature[1] << 16) | (signature[2] << 8) | signature[3];
+		signature += 4;
+	}
+	return result;
+}
 
-	if (!lstrcmpW(assemblyNameBuffer, L"GrEmit"))
-		return S_OK;
+// Reports show these names: Namespace.Outer+Inner for the type and Method`2(3) for the method, where the generic arity
+// and the number of parameters tell overloads apart without formatting the whole signature
+void CorProfiler::AddSymbol(int methodId, mdMethodDef methodDefToken, MethodInfo& method)
+{
+	WSTRING methodName = method.methodName;
+	PCCOR_SIGNATURE signature;
+	ULONG signatureSize;
+	if (SUCCEEDED(method.metadataImport->GetMethodProps(methodDefToken, nullptr, nullptr, 0, nullptr, nullptr, &signature, &signatureSize, nullptr, nullptr)) && signatureSize > 1)
+	{
+		auto callingConvention = *signature++;
+		if ((callingConvention & IMAGE_CEE_CS_CALLCONV_GENERIC) != 0)
+			methodName += WSTR("`") + Platform::ToString(UncompressSignatureData(signature));
+		methodName += WSTR("(") + Platform::ToString(UncompressSignatureData(signature)) + WSTR(")");
+	}
+	symbolTable->Add(methodId, method.assemblyName, MethodFilter::GetTypeFullName(method.metadataImport, method.typeDefToken).c_str(), methodName.c_str());
+}
 
-	if (!lstrcmpW(assemblyNameBuffer, L"System.Core"))
-		return S_OK;
+// Compiled methods the filter lets through, several instantiations of a generic method are requested once by ReJitQueue
+void CorProfiler::QueueJitedMethods()
+{
+	CComPtr<ICorProfilerFunctionEnum> functions;
+	if (FAILED(corProfilerInfo->EnumJITedFunctions(&functions)))
+	{
+		Log(WSTR("EnumJITedFunctions failed, only methods compiled after the attach are instrumented"));
+		return;
+	}
 
-	if (!lstrcmpW(assemblyNameBuffer, L"mscorlib"))
-		return S_OK;
+	COR_PRF_FUNCTION batch[256];
+	ULONG fetched = 0;
+	INT64 queued = 0;
+	while (SUCCEEDED(functions->Next(256, batch, &fetched)) && fetched > 0)
+	{
+		for (ULONG i = 0; i < fetched; ++i)
+		{
+			ClassID classId;
+			ModuleID moduleId;
+			mdToken methodDefToken;
+			if (FAILED(corProfilerInfo->GetFunctionInfo(batch[i].functionId, &classId, &moduleId, &methodDefToken)))
+				continue;
+			MethodInfo method;
+			auto thresholds = MethodFilter::defaultThresholds;
+			if (!GetMethodInfo(moduleId, methodDefToken, method) || !ShouldInstrument(moduleId, methodDefToken, method, thresholds))
+				continue;
+			reJitQueue->Add(moduleId, methodDefToken);
+			++queued;
+		}
+	}
+	LogFormat(WSTR("{0} compiled methods are queued for ReJIT"), queued, 0);
+}
+
+int CorProfiler::HandleControl(int command, int64_t value, const uint8_t* argument, int argumentSize, uint8_t* message, int* messageSize)
+{
+	if (detaching)
+		return ControlReply(ControlProtocol::NotReady, "Profiler is detaching", message, messageSize);
+	if (command == ControlProtocol::Detach)
+		return Detach(message, messageSize);
+	return managedControl(command, value, argument, argumentSize, message, messageSize);
+}
+
+// Runs on the thread of the control socket. The runtime does not wait for it, the destructor joins it before the profiler is unloaded
+int CorProfiler::Detach(uint8_t* message, int* messageSize)
+{
+	if (reJitQueue == nullptr)
+		return ControlReply(ControlProtocol::BadRequest, "Methods rewritten at startup cannot be restored, only a profiler attached to a running process can detach", message, messageSize);
 
-//	sprintf(str, "JIT Compilation of the method %I64d %ls.%ls\r\n", functionId, typeNameBuffer, methodNameBuffer);
+	// GroboTrace.Core disables probes and drops the callbacks of the profiler first, nothing calls into it afterwards
+	auto status = managedControl(ControlProtocol::Detach, 0, nullptr, 0, message, messageSize);
+	if (status != ControlProtocol::Ok)
+		return status;
+	detaching = true;
+	callback = nullptr;
+	moduleUnloaded = nullptr;
+	// An active EventPipe session of the profiler keeps the runtime from detaching it
+	if (waitTracker != nullptr)
+		waitTracker->Stop();
 
-//	DebugOutput(str);
-	if (callback == nullptr)
+	auto reverted = reJitQueue->RevertAll();
+	auto hr = corProfilerInfo->RequestProfilerDetach(5000);
+	auto text = Platform::ToUtf8(Platform::ToString(reverted)) + " methods are reverted";
+	if (FAILED(hr))
 	{
-		DebugOutput(L"Trying to enter critical section");
-		EnterCriticalSection(&criticalSection);
-		DebugOutput(L"Entered to critical section");
-		if (!callback)
-		{
-			DebugOutput(L"Trying to load .NET lib");
-			WCHAR fileName[1024];
-
-			int len = GetModuleFileName(GetModuleHandle(L"ClrProfiler.dll"), fileName, 1024);
-			int slashIndex;
-			for (int i = len - 1; i >= 0; --i)
-				if (fileName[i] == '\\')
-				{
-					slashIndex = i;
-					int k = wsprintf(&fileName[i + 1], L"GroboTrace.Core.dll");
-					fileName[i + 1 + k] = 0;
-					break;
-				}
+		Log(WSTR("RequestProfilerDetach failed: ") + FormatHex(hr));
+		return ControlReply(ControlProtocol::Failed, text + ", RequestProfilerDetach failed: " + Platform::ToUtf8(FormatHex(hr)), message, messageSize);
+	}
+	Log(WSTR("Profiler is detaching"));
+	return ControlReply(ControlProtocol::Ok, text + ", the profiler is detaching", message, messageSize);
+}
 
-			DebugOutput(fileName);
-			auto groboTrace = LoadLibrary(fileName);
-			if (!groboTrace)
-				DebugOutput(L"Failed to load GroboTrace.Core");
-			else
-				DebugOutput(L"Successfully loaded GroboTrace.Core");
+HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock)
+{
+	mdToken methodDefToken;
+	ClassID classId;
+	ModuleID moduleId;
 
-			auto procAddr = GetProcAddress(groboTrace, "SetProfilerPath");
-			if (!procAddr)
-			{
-				DebugOutput(L"Failed to obtain 'SetProfilerPath' method addr");
-				wsprintf(fileName, L"%ld", GetLastError());
-				DebugOutput(fileName);
-				failed = true;
-				LeaveCriticalSection(&criticalSection);
-				return S_OK;
-			}
-			else
-				DebugOutput(L"Successfully got 'SetProfilerPath' method addr");
-			setProfilerPath = reinterpret_cast<void(*)(WCHAR*)>(procAddr);
+	if (jitCost != nullptr)
+		jitCost->CompilationStarted(functionId);
 
-			procAddr = GetProcAddress(groboTrace, "Init");
-			if (!procAddr)
-			{
-				DebugOutput(L"Failed to obtain 'Init' method addr");
-				wsprintf(fileName, L"%ld", GetLastError());
-				DebugOutput(fileName);
-				failed = true;
-				LeaveCriticalSection(&criticalSection);
-				return S_OK;
-			}
-			else
-				DebugOutput(L"Successfully got 'Init' method addr");
-			init = reinterpret_cast<void(*)(void*, void*)>(procAddr);
+	// Methods compiled before GroboTrace.Core is ready are not worth waiting for
+	auto installTracing = callback;
+	if (installTracing == nullptr)
+	{
+		if (!runtimeStarted)
+			DetectRuntimeStart(functionId);
+		return S_OK;
+	}
 
-			fileName[slashIndex] = 0;
+	if (FAILED(this->corProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &methodDefToken)))
+	{
+		DebugOutput(WSTR("GetFunctionInfo failed"));
+		return S_OK;
+	}
 
-			setProfilerPath(fileName);
-			DebugOutput(L"Successfully called 'SetProfilerPath' method");
+	MethodInfo method;
+	if (!GetMethodInfo(moduleId, methodDefToken, method))
+		return S_OK;
 
-			init(static_cast<void*>(&GetTokenFromSig), static_cast<void*>(&CoTaskMemAlloc));
-			DebugOutput(L"Successfully called 'Init' method");
+	if (jitCost != nullptr)
+	{
+		jitCost->SetMethodName(functionId, method.assemblyName, method.typeName, method.methodName);
+		jitCost->PhaseFinished(functionId, JitCost::Metadata);
+	}
 
-			procAddr = GetProcAddress(groboTrace, "InstallTracing");
-			if (!procAddr)
-			{
-				DebugOutput(L"Failed to obtain 'InstallTracing' method addr");
-				wsprintf(fileName, L"%ld", GetLastError());
-				DebugOutput(fileName);
-				failed = true;
-				LeaveCriticalSection(&criticalSection);
-				return S_OK;
-			}
-			else
-				DebugOutput(L"Successfully got 'InstallTracing' method addr");
-			callback = reinterpret_cast<SharpResponse(*)(WCHAR*, WCHAR*, FunctionID, mdToken, char*, void*)>(procAddr);
-		}
-		LeaveCriticalSection(&criticalSection);
+	auto thresholds = MethodFilter::defaultThresholds;
+	if (!ShouldInstrument(moduleId, methodDefToken, method, thresholds))
+		return S_OK;
+
+	// Nothing is rewritten with stack sampling engine, GroboTrace.Core is loaded only to aggregate samples
+	if (stackSampler != nullptr)
+		return S_OK;
+
+	// Attached profiler instruments the method by ReJIT shortly after this compilation
+	if (reJitQueue != nullptr)
+	{
+		reJitQueue->Add(moduleId, methodDefToken);
+		return S_OK;
 	}
 
 	LPCBYTE methodBody;
@@ -544,23 +1007,26 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID function
 	SharpResponse sharpResponse = SharpResponse();
 	sharpResponse.newMethodBody = nullptr;
 
-	sharpResponse = callback(assemblyNameBuffer, moduleNameBuffer, moduleId, methodDefToken, (char*)methodBody, static_cast<void*>(&allocateForMethodBody));
+	sharpResponse = installTracing(method.assemblyName, method.moduleName, moduleId, methodDefToken, (char*)methodBody, static_cast<void*>(&allocateForMethodBody), thresholds.minInstructions, thresholds.traceSmallMethodsWithLoops);
 
-	if (sharpResponse.newMethodBody != nullptr)
-	{
-		/*OutputDebugStringA("!!! Map entries: ");
-		for (unsigned int i = 0; i < sharpResponse.mapEntriesCount; ++i)
-		{
-			sprintf(str, "Old offset: %u  New offset: %u  fAccurate: %d \r\n", sharpResponse.pMapEntries[i].oldOffset, sharpResponse.pMapEntries[i].newOffset, sharpResponse.pMapEntries[i].fAccurate);
+	if (symbolTable != nullptr && sharpResponse.methodId != 0)
+		AddSymbol(sharpResponse.methodId, methodDefToken, method);
 
-			OutputDebugStringA(str);
-		}*/
+	if (jitCost != nullptr)
+		jitCost->PhaseFinished(functionId, JitCost::Rewrite);
 
+	if (sharpResponse.newMethodBody != nullptr)
+	{
 		IfFailRet(corProfilerInfo->SetILInstrumentedCodeMap(functionId, true, sharpResponse.mapEntriesCount, sharpResponse.pMapEntries));
 
 
 		IfFailRet(corProfilerInfo->SetILFunctionBody(moduleId, methodDefToken, sharpResponse.newMethodBody));
-		DebugOutput(L"Successfully rewrote method");
+		DebugOutput(WSTR("Successfully rewrote method"));
+
+		if (jitCost != nullptr)
+			jitCost->PhaseFinished(functionId, JitCost::SetILFunctionBody);
+		if (inliningRecorder != nullptr)
+			inliningRecorder->MethodRewritten(functionId);
 	}
 	
 	return S_OK;
@@ -573,6 +1039,10 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID function
 
 HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationFinished(FunctionID functionId, HRESULT hrStatus, BOOL fIsSafeToBlock)
 {
+	if (perfMap != nullptr && SUCCEEDED(hrStatus))
+		perfMap->MethodCompiled(functionId, 0);
+	if (jitCost != nullptr)
+		jitCost->CompilationFinished(functionId);
     return S_OK;
 }
 
@@ -593,67 +1063,8 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITFunctionPitched(FunctionID functionId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::JITInlining(FunctionID callerId, FunctionID calleeId, BOOL *pfShouldInline)
 {
-	return S_OK;
-
-	HRESULT hr;
-	mdToken methodDefToken;
-	mdTypeDef typeDefToken;
-	mdModule moduleToken;
-	ClassID classId;
-	ModuleID moduleId;
-	AssemblyID assemblyId;
-	WCHAR methodNameBuffer[1024];
-	ULONG actualMethodNameSize;
-	WCHAR typeNameBuffer[1024];
-	ULONG actualTypeNameSize;
-	WCHAR moduleNameBuffer[1024];
-	ULONG actualModuleNameSize;
-	WCHAR assemblyNameBuffer[1024];
-	ULONG actualAssemblyNameSize;
-
-	OutputDebugString(L"!!!!! Jit inlining");
-
-	IfFailRet(this->corProfilerInfo->GetFunctionInfo(callerId, &classId, &moduleId, &methodDefToken));
-
-	IfFailRet(this->corProfilerInfo->GetModuleInfo(moduleId, 0, 1024, &actualModuleNameSize, moduleNameBuffer, &assemblyId));
-
-	
-	CComPtr<IMetaDataImport> metadataImport;
-	if (FAILED(corProfiler->corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport))))
-		OutputDebugStringW(L"Failed to get IMetadataImport {C++}");
-
-	char str[1024];
-
-	IfFailRet(metadataImport->GetMethodProps(methodDefToken, &typeDefToken, methodNameBuffer, 1024, &actualMethodNameSize, 0, 0, 0, 0, 0));
-
-	IfFailRet(metadataImport->GetTypeDefProps(typeDefToken, typeNameBuffer, 1024, &actualTypeNameSize, 0, 0));
-
-	sprintf(str, "From (caller): %ls.%ls\r\n", typeNameBuffer, methodNameBuffer);
-
-	OutputDebugStringA(str);
-
-
-
-	IfFailRet(this->corProfilerInfo->GetFunctionInfo(calleeId, &classId, &moduleId, &methodDefToken));
-
-	IfFailRet(this->corProfilerInfo->GetModuleInfo(moduleId, 0, 1024, &actualModuleNameSize, moduleNameBuffer, &assemblyId));
-
-	
-
-	if (FAILED(corProfiler->corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport))))
-		OutputDebugStringW(L"Failed to get IMetadataImport {C++}");
-
-
-	IfFailRet(metadataImport->GetMethodProps(methodDefToken, &typeDefToken, methodNameBuffer, 1024, &actualMethodNameSize, 0, 0, 0, 0, 0));
-
-	IfFailRet(metadataImport->GetTypeDefProps(typeDefToken, typeNameBuffer, 1024, &actualTypeNameSize, 0, 0));
-
-	sprintf(str, "To (callee): %ls.%ls\r\n", typeNameBuffer, methodNameBuffer);
-
-	OutputDebugStringA(str);
-
-
-
+	if (inliningRecorder != nullptr)
+		inliningRecorder->Record(callerId, calleeId, *pfShouldInline);
     return S_OK;
 }
 
@@ -664,6 +1075,8 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ThreadCreated(ThreadID threadId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ThreadDestroyed(ThreadID threadId)
 {
+	if (stackSampler != nullptr)
+		stackSampler->RemoveTree(threadId);
     return S_OK;
 }
 
@@ -914,17 +1327,20 @@ HRESULT STDMETHODCALLTYPE CorProfiler::HandleDestroyed(GCHandleID handleId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::InitializeForAttach(IUnknown *pCorProfilerInfoUnk, void *pvClientData, UINT cbClientData)
 {
-    return S_OK;
+	return InitializeProfiler(pCorProfilerInfoUnk, true);
 }
 
+// Loaded modules and compiled methods can be enumerated from now on
 HRESULT STDMETHODCALLTYPE CorProfiler::ProfilerAttachComplete()
 {
+	SetRuntimeStarted();
+	thread(&CorProfiler::LoadCore, this).detach();
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ProfilerDetachSucceeded()
 {
-	Log(L"Profiler detach succeeded");
+	Log(WSTR("Profiler detach succeeded"));
     return S_OK;
 }
 
@@ -933,18 +1349,49 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ReJITCompilationStarted(FunctionID functi
     return S_OK;
 }
 
+// Methods requested by ReJitQueue are rewritten here the same way JITCompilationStarted rewrites them at startup
 HRESULT STDMETHODCALLTYPE CorProfiler::GetReJITParameters(ModuleID moduleId, mdMethodDef methodId, ICorProfilerFunctionControl *pFunctionControl)
 {
+	// The profiler is detaching, the method keeps its original code
+	auto installTracing = callback;
+	if (installTracing == nullptr)
+		return S_OK;
+
+	MethodInfo method;
+	auto thresholds = MethodFilter::defaultThresholds;
+	if (!GetMethodInfo(moduleId, methodId, method) || !ShouldInstrument(moduleId, methodId, method, thresholds))
+		return S_OK;
+
+	LPCBYTE methodBody;
+	IfFailRet(corProfilerInfo->GetILFunctionBody(moduleId, methodId, &methodBody, NULL));
+
+	auto sharpResponse = installTracing(method.assemblyName, method.moduleName, moduleId, methodId, (char*)methodBody, static_cast<void*>(&allocateForReJitBody), thresholds.minInstructions, thresholds.traceSmallMethodsWithLoops);
+
+	if (symbolTable != nullptr && sharpResponse.methodId != 0)
+		AddSymbol(sharpResponse.methodId, methodId, method);
+
+	if (sharpResponse.newMethodBody == nullptr)
+		return S_OK;
+
+	// Unlike ICorProfilerInfo, the function control copies the map
+	auto hr = pFunctionControl->SetILInstrumentedCodeMap(sharpResponse.mapEntriesCount, sharpResponse.pMapEntries);
+	Platform::FreeTaskMemory(sharpResponse.pMapEntries);
+	IfFailRet(hr);
+	IfFailRet(pFunctionControl->SetILFunctionBody(static_cast<ULONG>(reJitBody.size()), reJitBody.data()));
+	DebugOutput(WSTR("Successfully rewrote method through ReJIT"));
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ReJITCompilationFinished(FunctionID functionId, ReJITID rejitId, HRESULT hrStatus, BOOL fIsSafeToBlock)
 {
+	if (perfMap != nullptr && SUCCEEDED(hrStatus))
+		perfMap->MethodCompiled(functionId, rejitId);
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ReJITError(ModuleID moduleId, mdMethodDef methodId, FunctionID functionId, HRESULT hrStatus)
 {
+	LogFormat(WSTR("ReJIT of method {0:x} failed: {1:x}"), methodId, static_cast<UINT32>(hrStatus));
     return S_OK;
 }
 
@@ -963,3 +1410,53 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ConditionalWeakTableElementReferences(ULO
     return S_OK;
 }
 
+HRESULT STDMETHODCALLTYPE CorProfiler::GetAssemblyReferences(const WCHAR* wszAssemblyPath, ICorProfilerAssemblyReferenceProvider* pAsmRefProvider)
+{
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE CorProfiler::ModuleInMemorySymbolsUpdated(ModuleID moduleId)
+{
+    return S_OK;
+}
+
+// Dynamic methods are only observed here, they are instrumented by the managed hook of DynamicMethod.CreateDelegate
+// (MethodBaseTracingInstaller.HookCreateDelegate): pILHeader is read-only, and a dynamic method has neither a ModuleID nor
+// a methodDef token, so neither SetILFunctionBody nor ReJIT can replace its IL
+HRESULT STDMETHODCALLTYPE CorProfiler::DynamicMethodJITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock, LPCBYTE pILHeader, ULONG cbILHeader)
+{
+	if (jitCost != nullptr)
+	{
+		jitCost->CompilationStarted(functionId);
+		jitCost->SetMethodName(functionId, WSTR("(dynamic methods)"), WSTR("DynamicMethod"), WSTR("Invoke"));
+	}
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE CorProfiler::DynamicMethodJITCompilationFinished(FunctionID functionId, HRESULT hrStatus, BOOL fIsSafeToBlock)
+{
+	if (perfMap != nullptr && SUCCEEDED(hrStatus))
+		perfMap->DynamicMethodCompiled(functionId);
+	if (jitCost != nullptr)
+		jitCost->CompilationFinished(functionId);
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE CorProfiler::DynamicMethodUnloaded(FunctionID functionId)
+{
+    return S_OK;
+}
+
+// Delivered synchronously on the thread that raised the event
+HRESULT STDMETHODCALLTYPE CorProfiler::EventPipeEventDelivered(EVENTPIPE_PROVIDER provider, DWORD eventId, DWORD eventVersion, ULONG cbMetadataBlob, LPCBYTE metadataBlob, ULONG cbEventData, LPCBYTE eventData, LPCGUID pActivityId, LPCGUID pRelatedActivityId, ThreadID eventThread, ULONG numStackFrames, UINT_PTR stackFrames[])
+{
+	if (waitTracker != nullptr && !detaching)
+		waitTracker->EventDelivered(eventId, cbEventData, eventData);
+    return S_OK;
+}
+
+HRESULT STDMETHODCALLTYPE CorProfiler::EventPipeProviderCreated(EVENTPIPE_PROVIDER provider)
+{
+    return S_OK;
+}
+
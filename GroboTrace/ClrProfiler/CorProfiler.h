@@ -4,10 +4,25 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include "cor.h"
 #include "corprof.h"
 #include "CComPtr.h"
+#include "Platform.h"
+#include "StackSampler.h"
+#include "PerfMap.h"
+#include "JitCost.h"
+#include "InliningRecorder.h"
+#include "SymbolTable.h"
+#include "SharedStats.h"
+#include "ControlChannel.h"
+#include "MethodFilter.h"
+#include "ManagedBootstrap.h"
+#include "DiagnosticLog.h"
+#include "ReJitQueue.h"
+#include "WaitTracker.h"
 
 using namespace std;
 
@@ -16,30 +31,77 @@ struct SharpResponse
 	LPCBYTE newMethodBody;
 	COR_IL_MAP* pMapEntries;
 	ULONG mapEntriesCount;
+	int methodId;
 };
 
-class CorProfiler : public ICorProfilerCallback5
+class CorProfiler : public ICorProfilerCallback10
 {
 private:
     std::atomic<int> refCount;
 
-	SharpResponse(* volatile callback)(WCHAR*, WCHAR*, ModuleID, mdToken, char*, void*);
-	void(* volatile init)(void*, void*);
-	void(* volatile setProfilerPath)(WCHAR*);
-
-	bool failed;
-
-	RTL_CRITICAL_SECTION criticalSection;
-	wstring profilerFolder;
-
+	// Published by the bootstrap thread once GroboTrace.Core is ready, JIT events are let through uninstrumented until then
+	SharpResponse(* volatile callback)(WCHAR*, WCHAR*, ModuleID, mdToken, char*, void*, int, BOOL);
+	void(* volatile moduleUnloaded)(ModuleID);
+
+	// Process is not listed in GroboTrace.ini, it is instrumented only to be turned on through the control socket
+	bool standby;
+
+	// Control handler of GroboTrace.Core, Detach is handled by the profiler itself
+	ControlChannel::Handler managedControl;
+	atomic<bool> detaching;
+
+	// .NET Framework has no hosting API that waits for the runtime, the bootstrap thread waits for the first method
+	// of an application assembly to be compiled instead
+	atomic<bool> runtimeStarted;
+	mutex runtimeStartLock;
+	condition_variable runtimeStartChanged;
+
+	WSTRING profilerFolder;
+
+	// Names of a method, the filter and GroboTrace.Core need them on both JIT and ReJIT paths
+	struct MethodInfo
+	{
+		WCHAR assemblyName[1024];
+		WCHAR moduleName[1024];
+		WCHAR typeName[1024];
+		WCHAR methodName[1024];
+		mdTypeDef typeDefToken;
+		CComPtr<IMetaDataImport> metadataImport;
+	};
+
+	HRESULT InitializeProfiler(IUnknown* pICorProfilerInfoUnk, bool attach);
 	void FindProfilerFolder();
+	void LoadCore();
+	void DetectRuntimeStart(FunctionID functionId);
+	void SetRuntimeStarted();
+	bool GetMethodInfo(ModuleID moduleId, mdMethodDef methodDefToken, MethodInfo& method);
+	bool ShouldInstrument(ModuleID moduleId, mdMethodDef methodDefToken, MethodInfo& method, MethodFilter::Thresholds& thresholds);
+	void AddSymbol(int methodId, mdMethodDef methodDefToken, MethodInfo& method);
+	void QueueJitedMethods();
 
 public:
 	ICorProfilerInfo4* corProfilerInfo;
+	ICorProfilerInfo10* corProfilerInfo10;
+	ICorProfilerInfo12* corProfilerInfo12;
+	StackSampler* stackSampler;
+	PerfMap* perfMap;
+	JitCost* jitCost;
+	InliningRecorder* inliningRecorder;
+	SymbolTable* symbolTable;
+	SharedStats* sharedStats;
+	ControlChannel* controlChannel;
+	MethodFilter* methodFilter;
+	DiagnosticLog* diagnosticLog;
+	// Created when the profiler is attached to a running process, all methods are instrumented through it then
+	ReJitQueue* reJitQueue;
+	WaitTracker* waitTracker;
 
 	CorProfiler();
     virtual ~CorProfiler();
 
+	int HandleControl(int command, int64_t value, const uint8_t* argument, int argumentSize, uint8_t* message, int* messageSize);
+	int Detach(uint8_t* message, int* messageSize);
+
     HRESULT STDMETHODCALLTYPE Initialize(IUnknown* pICorProfilerInfoUnk) override;
     HRESULT STDMETHODCALLTYPE Shutdown() override;
     HRESULT STDMETHODCALLTYPE AppDomainCreationStarted(AppDomainID appDomainId) override;
@@ -127,10 +189,22 @@ public:
     HRESULT STDMETHODCALLTYPE MovedReferences2(ULONG cMovedObjectIDRanges, ObjectID oldObjectIDRangeStart[], ObjectID newObjectIDRangeStart[], SIZE_T cObjectIDRangeLength[]) override;
     HRESULT STDMETHODCALLTYPE SurvivingReferences2(ULONG cSurvivingObjectIDRanges, ObjectID objectIDRangeStart[], SIZE_T cObjectIDRangeLength[]) override;
     HRESULT STDMETHODCALLTYPE ConditionalWeakTableElementReferences(ULONG cRootRefs, ObjectID keyRefIds[], ObjectID valueRefIds[], GCHandleID rootIds[]) override;
+    HRESULT STDMETHODCALLTYPE GetAssemblyReferences(const WCHAR* wszAssemblyPath, ICorProfilerAssemblyReferenceProvider* pAsmRefProvider) override;
+    HRESULT STDMETHODCALLTYPE ModuleInMemorySymbolsUpdated(ModuleID moduleId) override;
+    HRESULT STDMETHODCALLTYPE DynamicMethodJITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock, LPCBYTE pILHeader, ULONG cbILHeader) override;
+    HRESULT STDMETHODCALLTYPE DynamicMethodJITCompilationFinished(FunctionID functionId, HRESULT hrStatus, BOOL fIsSafeToBlock) override;
+    HRESULT STDMETHODCALLTYPE DynamicMethodUnloaded(FunctionID functionId) override;
+    HRESULT STDMETHODCALLTYPE EventPipeEventDelivered(EVENTPIPE_PROVIDER provider, DWORD eventId, DWORD eventVersion, ULONG cbMetadataBlob, LPCBYTE metadataBlob, ULONG cbEventData, LPCBYTE eventData, LPCGUID pActivityId, LPCGUID pRelatedActivityId, ThreadID eventThread, ULONG numStackFrames, UINT_PTR stackFrames[]) override;
+    HRESULT STDMETHODCALLTYPE EventPipeProviderCreated(EVENTPIPE_PROVIDER provider) override;
 
     HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override
     {
-        if (riid == __uuidof(ICorProfilerCallback5) ||
+        if (riid == __uuidof(ICorProfilerCallback10) ||
+            riid == __uuidof(ICorProfilerCallback9) ||
+            riid == __uuidof(ICorProfilerCallback8) ||
+            riid == __uuidof(ICorProfilerCallback7) ||
+            riid == __uuidof(ICorProfilerCallback6) ||
+            riid == __uuidof(ICorProfilerCallback5) ||
             riid == __uuidof(ICorProfilerCallback4) ||
             riid == __uuidof(ICorProfilerCallback3) ||
             riid == __uuidof(ICorProfilerCallback2) ||
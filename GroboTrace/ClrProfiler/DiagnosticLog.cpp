@@ -0,0 +1,289 @@
+#include "DiagnosticLog.h"
+#include <chrono>
+
+static const char* levelNames[] = { "error", "info", "debug", "verbose" };
+
+DiagnosticLog::DiagnosticLog(Level level, const WSTRING& fileName, UINT64 maxFileSize, int capacity)
+	: level(level), enqueuePosition(0), dequeuePosition(0), dropped(0), started(Platform::GetTimestamp()),
+	fileName(fileName), maxFileSize(maxFileSize), fileSize(0), file(nullptr), stopping(false)
+{
+	UINT64 size = 1;
+	while (size < static_cast<UINT64>(capacity))
+		size <<= 1;
+	mask = size - 1;
+	maxFragments = size >= 4 ? size / 4 : 1;
+	records = new Record[size];
+	for (UINT64 i = 0; i < size; ++i)
+		records[i].sequence.store(i, memory_order_relaxed);
+
+	if (!fileName.empty())
+	{
+		file = Platform::OpenFile(fileName, "wb");
+		if (file == nullptr)
+			Platform::WriteDebugOutput(WSTR("grobotrace: Failed to open log file ") + fileName);
+	}
+	writer = thread(&DiagnosticLog::WriterThread, this);
+}
+
+DiagnosticLog::~DiagnosticLog()
+{
+	Stop();
+	if (file != nullptr)
+		fclose(file);
+	delete[] records;
+}
+
+void DiagnosticLog::Write(Level messageLevel, const WCHAR* message, size_t length)
+{
+	if (!IsEnabled(messageLevel))
+		return;
+	if (stopping.load(memory_order_acquire))
+	{
+		Platform::WriteDebugOutput(WSTR("grobotrace: ") + WSTRING(message, length));
+		return;
+	}
+	WriteChunks(messageLevel, Utf16, reinterpret_cast<const char*>(message), length * sizeof(WCHAR), sizeof(WCHAR));
+}
+
+void DiagnosticLog::Write(Level messageLevel, const WSTRING& message)
+{
+	Write(messageLevel, message.c_str(), message.size());
+}
+
+void DiagnosticLog::WriteUtf8(Level messageLevel, const char* message, size_t length)
+{
+	if (!IsEnabled(messageLevel))
+		return;
+	if (stopping.load(memory_order_acquire))
+	{
+		Platform::WriteDebugOutput(WSTR("grobotrace: ") + Platform::FromUtf8(string(message, length)));
+		return;
+	}
+	WriteChunks(messageLevel, Utf8, message, length, 1);
+}
+
+void DiagnosticLog::WriteFormat(Level messageLevel, const WCHAR* format, INT64 argument0, INT64 argument1)
+{
+	if (!IsEnabled(messageLevel))
+		return;
+	if (stopping.load(memory_order_acquire))
+	{
+		Platform::WriteDebugOutput(WSTR("grobotrace: ") + Format(format, argument0, argument1));
+		return;
+	}
+
+	UINT64 position;
+	if (!Reserve(1, position))
+		return;
+	auto& record = records[position & mask];
+	record.timestamp = Platform::GetTimestamp();
+	record.threadId = Platform::GetThreadId();
+	record.level = messageLevel;
+	record.kind = Formatted;
+	record.fragments = 1;
+	record.length = 0;
+	record.format = format;
+	record.arguments[0] = argument0;
+	record.arguments[1] = argument1;
+	record.sequence.store(position + 1, memory_order_release);
+}
+
+// The writer frees records in order, so when the last record of the range is free, all of them are
+bool DiagnosticLog::Reserve(UINT64 count, UINT64& position)
+{
+	position = enqueuePosition.load(memory_order_relaxed);
+	for (;;)
+	{
+		auto last = position + count - 1;
+		auto sequence = records[last & mask].sequence.load(memory_order_acquire);
+		auto difference = static_cast<INT64>(sequence - last);
+		if (difference == 0)
+		{
+			if (enqueuePosition.compare_exchange_weak(position, position + count, memory_order_relaxed))
+				return true;
+		}
+		else if (difference < 0)
+		{
+			// The writer is behind by the whole ring
+			dropped.fetch_add(1, memory_order_relaxed);
+			return false;
+		}
+		else
+			position = enqueuePosition.load(memory_order_relaxed);
+	}
+}
+
+// Fragments are filled in order, the writer takes the message once its last record is filled. Messages longer than
+// maxFragments records are cut
+void DiagnosticLog::WriteChunks(Level messageLevel, Kind kind, const char* message, size_t size, size_t charSize)
+{
+	const size_t capacity = sizeof(Record::message);
+	UINT64 count = size == 0 ? 1 : (size + capacity - 1) / capacity;
+	if (count > maxFragments)
+	{
+		count = maxFragments;
+		size = static_cast<size_t>(count) * capacity;
+	}
+
+	UINT64 position;
+	if (!Reserve(count, position))
+		return;
+	auto timestamp = Platform::GetTimestamp();
+	auto threadId = Platform::GetThreadId();
+	for (UINT64 i = 0; i < count; ++i)
+	{
+		auto& record = records[(position + i) & mask];
+		auto chunk = size < capacity ? size : capacity;
+		record.timestamp = timestamp;
+		record.threadId = threadId;
+		record.level = messageLevel;
+		record.kind = kind;
+		record.fragments = i == 0 ? static_cast<UINT16>(count) : 0;
+		record.length = static_cast<UINT16>(chunk / charSize);
+		record.format = nullptr;
+		memcpy(record.utf8Message, message, chunk);
+		record.sequence.store(position + i + 1, memory_order_release);
+		message += chunk;
+		size -= chunk;
+	}
+}
+
+void DiagnosticLog::Stop()
+{
+	if (stopping.exchange(true))
+		return;
+	if (writer.joinable())
+		writer.join();
+}
+
+WSTRING DiagnosticLog::Format(const WCHAR* format, INT64 argument0, INT64 argument1)
+{
+	WSTRING result;
+	for (auto c = format; *c != 0; ++c)
+	{
+		if (c[0] == '{' && (c[1] == '0' || c[1] == '1'))
+		{
+			auto argument = c[1] == '0' ? argument0 : argument1;
+			if (c[2] == '}')
+			{
+				result += Platform::ToString(argument);
+				c += 2;
+				continue;
+			}
+			if (c[2] == ':' && c[3] == 'x' && c[4] == '}')
+			{
+				char buffer[24];
+				snprintf(buffer, sizeof(buffer), "0x%08llX", static_cast<unsigned long long>(argument));
+				result += Platform::FromUtf8(buffer);
+				c += 4;
+				continue;
+			}
+		}
+		result += *c;
+	}
+	return result;
+}
+
+DiagnosticLog::Level DiagnosticLog::ParseLevel(const WSTRING& value, Level defaultLevel)
+{
+	for (int i = Error; i <= Verbose; ++i)
+	{
+		auto name = Platform::FromUtf8(levelNames[i]);
+		if (Platform::EqualsIgnoreCase(value.c_str(), name.c_str()))
+			return static_cast<Level>(i);
+	}
+	return defaultLevel;
+}
+
+void DiagnosticLog::WriterThread()
+{
+	while (!stopping.load(memory_order_acquire))
+	{
+		if (!Drain())
+			this_thread::sleep_for(chrono::milliseconds(20));
+	}
+	// Producers that got their position before stopping was set finish filling their records in a moment
+	this_thread::sleep_for(chrono::milliseconds(1));
+	Drain();
+}
+
+bool DiagnosticLog::Drain()
+{
+	bool drained = false;
+	for (;;)
+	{
+		auto& record = records[dequeuePosition & mask];
+		if (record.sequence.load(memory_order_acquire) != dequeuePosition + 1)
+			break;
+		// The producer is still filling the rest of the message
+		UINT64 fragments = record.fragments == 0 ? 1 : record.fragments;
+		auto lastPosition = dequeuePosition + fragments - 1;
+		if (fragments > 1 && records[lastPosition & mask].sequence.load(memory_order_acquire) != lastPosition + 1)
+			break;
+		OutputLine(record.level, record.threadId, record.timestamp, Assemble(dequeuePosition, fragments));
+		for (UINT64 i = 0; i < fragments; ++i, ++dequeuePosition)
+			records[dequeuePosition & mask].sequence.store(dequeuePosition + mask + 1, memory_order_release);
+		drained = true;
+	}
+
+	auto lost = dropped.exchange(0, memory_order_relaxed);
+	if (lost > 0)
+		OutputLine(Error, Platform::GetThreadId(), Platform::GetTimestamp(), Platform::ToString(lost) + WSTR(" messages are dropped, the log ring is full"));
+	if (drained && file != nullptr)
+		fflush(file);
+	return drained;
+}
+
+WSTRING DiagnosticLog::Assemble(UINT64 position, UINT64 fragments) const
+{
+	auto& first = records[position & mask];
+	if (first.kind == Formatted)
+		return Format(first.format, first.arguments[0], first.arguments[1]);
+	if (first.kind == Utf8)
+	{
+		string message;
+		for (UINT64 i = 0; i < fragments; ++i)
+		{
+			auto& record = records[(position + i) & mask];
+			message.append(record.utf8Message, record.length);
+		}
+		return Platform::FromUtf8(message);
+	}
+	WSTRING message;
+	for (UINT64 i = 0; i < fragments; ++i)
+	{
+		auto& record = records[(position + i) & mask];
+		message.append(record.message, record.length);
+	}
+	return message;
+}
+
+void DiagnosticLog::OutputLine(Level messageLevel, DWORD threadId, UINT64 timestamp, const WSTRING& message)
+{
+	if (fileName.empty())
+	{
+		Platform::WriteDebugOutput(WSTR("grobotrace: ") + message);
+		return;
+	}
+	if (file == nullptr)
+		return;
+
+	char prefix[64];
+	auto milliseconds = (timestamp - started) * 1000.0 / Platform::GetTimestampFrequency();
+	auto prefixLength = snprintf(prefix, sizeof(prefix), "%12.3f %6u %-7s ", milliseconds, static_cast<unsigned>(threadId), levelNames[messageLevel]);
+	auto line = string(prefix, prefixLength) + Platform::ToUtf8(message) + "\n";
+
+	if (fileSize + line.size() > maxFileSize && fileSize > 0)
+		Rotate();
+	if (file != nullptr && fwrite(line.data(), 1, line.size(), file) == line.size())
+		fileSize += line.size();
+}
+
+// Only the previous file is kept
+void DiagnosticLog::Rotate()
+{
+	fclose(file);
+	Platform::RenameFile(fileName, fileName + WSTR(".1"));
+	file = Platform::OpenFile(fileName, "wb");
+	fileSize = 0;
+}
\ No newline at end of file
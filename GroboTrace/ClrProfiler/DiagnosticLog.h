@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include "Platform.h"
+
+using namespace std;
+
+// Diagnostic messages of the profiler and of GroboTrace.Core. A producer copies its message into fixed-size records
+// of a lock-free ring and returns, the writer thread formats records and writes them to a rotating file or to the debug output.
+// Nothing blocks a JIT thread: when the ring is full the message is dropped and counted
+class DiagnosticLog
+{
+public:
+	enum Level
+	{
+		Error,
+		Info,
+		Debug,
+		// Method bodies before and after rewriting
+		Verbose
+	};
+
+	// Empty fileName sends messages to the debug output, which is stderr on Linux when GROBOTRACE_LOG is enabled.
+	// A file is moved to fileName.1 once it grows over maxFileSize
+	DiagnosticLog(Level level, const WSTRING& fileName, UINT64 maxFileSize, int capacity);
+	~DiagnosticLog();
+
+	Level GetLevel() const
+	{
+		return level;
+	}
+
+	bool IsEnabled(Level messageLevel) const
+	{
+		return messageLevel <= level;
+	}
+
+	// Long messages take several adjacent records, which the writer puts back together
+	void Write(Level messageLevel, const WCHAR* message, size_t length);
+	void Write(Level messageLevel, const WSTRING& message);
+	// Converted to UTF-16 by the writer
+	void WriteUtf8(Level messageLevel, const char* message, size_t length);
+	// The format must be a literal, only its address is stored; the writer thread substitutes the arguments (see Format)
+	void WriteFormat(Level messageLevel, const WCHAR* format, INT64 argument0, INT64 argument1);
+	// Writes out what is left in the ring, later messages go to the debug output synchronously
+	void Stop();
+
+	// {0} and {1} are replaced by the arguments in decimal, {0:x} and {1:x} in hex
+	static WSTRING Format(const WCHAR* format, INT64 argument0, INT64 argument1);
+
+	// error, info, debug or verbose
+	static Level ParseLevel(const WSTRING& value, Level defaultLevel);
+
+private:
+	// Keeps a record under 512 bytes
+	static const int maxMessageLength = 224;
+
+	enum Kind : BYTE
+	{
+		Utf16,
+		Utf8,
+		Formatted
+	};
+
+	struct Record
+	{
+		// Position the record is ready to be written at, or the position plus one once it is filled (bounded MPMC queue of D. Vyukov)
+		atomic<UINT64> sequence;
+		UINT64 timestamp;
+		DWORD threadId;
+		Level level;
+		Kind kind;
+		// Number of records of the message, set in its first record only
+		UINT16 fragments;
+		// In WCHARs or in bytes, depending on the kind
+		UINT16 length;
+		const WCHAR* format;
+		INT64 arguments[2];
+		union
+		{
+			WCHAR message[maxMessageLength];
+			char utf8Message[maxMessageLength * sizeof(WCHAR)];
+		};
+	};
+
+	Level level;
+	Record* records;
+	UINT64 mask;
+	// A message may take at most this many records
+	UINT64 maxFragments;
+	atomic<UINT64> enqueuePosition;
+	UINT64 dequeuePosition;
+	atomic<UINT64> dropped;
+	UINT64 started;
+
+	WSTRING fileName;
+	UINT64 maxFileSize;
+	UINT64 fileSize;
+	FILE* file;
+
+	atomic<bool> stopping;
+	thread writer;
+
+	// Reserves adjacent records for a message, returns false when the ring has no room
+	bool Reserve(UINT64 count, UINT64& position);
+	void WriteChunks(Level messageLevel, Kind kind, const char* message, size_t size, size_t charSize);
+	void WriterThread();
+	// Returns false when the ring is empty
+	bool Drain();
+	WSTRING Assemble(UINT64 position, UINT64 fragments) const;
+	void OutputLine(Level messageLevel, DWORD threadId, UINT64 timestamp, const WSTRING& message);
+	void Rotate();
+};
\ No newline at end of file
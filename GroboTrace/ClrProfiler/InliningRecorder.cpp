@@ -0,0 +1,178 @@
+#include "InliningRecorder.h"
+#include "CComPtr.h"
+#include <algorithm>
+#include <sstream>
+
+void Log(WSTRING str);
+
+InliningRecorder::InliningRecorder(ICorProfilerInfo4* corProfilerInfo, const WSTRING& reportFileName, int capacity, int topCount)
+	: corProfilerInfo(corProfilerInfo), reportFileName(reportFileName), topCount(topCount), dropped(0)
+{
+	size_t size = 1024;
+	while (size < static_cast<size_t>(capacity))
+		size *= 2;
+	mask = size - 1;
+	pairs = vector<Pair>(size);
+	callees = vector<Callee>(size);
+}
+
+size_t InliningRecorder::Hash(UINT_PTR x)
+{
+	// FunctionIDs are pointers, the lower bits are mostly zero
+	UINT64 h = static_cast<UINT64>(x) * 0x9E3779B97F4A7C15ull;
+	return static_cast<size_t>(h ^ (h >> 32));
+}
+
+InliningRecorder::Callee* InliningRecorder::GetCallee(FunctionID functionId)
+{
+	for (size_t i = 0, index = Hash(functionId) & mask; i <= mask; ++i, index = (index + 1) & mask)
+	{
+		auto& callee = callees[index];
+		auto current = callee.functionId.load();
+		if (current == functionId)
+			return &callee;
+		if (current == 0)
+		{
+			FunctionID expected = 0;
+			if (callee.functionId.compare_exchange_strong(expected, functionId) || expected == functionId)
+				return &callee;
+		}
+	}
+	++dropped;
+	return nullptr;
+}
+
+// Returns false if the pair has already been seen, the caller could have been compiled more than once
+bool InliningRecorder::AddPair(FunctionID callerId, FunctionID calleeId, bool inlined, bool calleeRewritten)
+{
+	for (size_t i = 0, index = Hash(callerId * 31 + calleeId) & mask; i <= mask; ++i, index = (index + 1) & mask)
+	{
+		auto& pair = pairs[index];
+		LONG state = pair.state.load();
+		if (state == Empty)
+		{
+			LONG expected = Empty;
+			if (pair.state.compare_exchange_strong(expected, Writing))
+			{
+				pair.callerId = callerId;
+				pair.calleeId = calleeId;
+				pair.inlined = inlined;
+				pair.calleeRewritten = calleeRewritten;
+				pair.state.store(Ready);
+				return true;
+			}
+			state = expected;
+		}
+		while (state == Writing)
+			state = pair.state.load();
+		if (pair.callerId == callerId && pair.calleeId == calleeId)
+			return false;
+	}
+	++dropped;
+	return false;
+}
+
+void InliningRecorder::Record(FunctionID callerId, FunctionID calleeId, BOOL shouldInline)
+{
+	auto callee = GetCallee(calleeId);
+	if (callee == nullptr)
+		return;
+	bool rewritten = callee->rewritten.load();
+	if (!AddPair(callerId, calleeId, shouldInline != FALSE, rewritten))
+		return;
+	if (!shouldInline)
+		++callee->rejected;
+	else if (rewritten)
+		++callee->inlinedRewritten;
+	else
+		++callee->inlinedOriginal;
+}
+
+void InliningRecorder::MethodRewritten(FunctionID functionId)
+{
+	auto callee = GetCallee(functionId);
+	if (callee != nullptr)
+		callee->rewritten.store(true);
+}
+
+const WSTRING& InliningRecorder::GetName(FunctionID functionId)
+{
+	auto it = names.find(functionId);
+	if (it != names.end())
+		return it->second;
+
+	WSTRING name = WSTR("?");
+	ClassID classId;
+	ModuleID moduleId;
+	mdToken methodDefToken;
+	AssemblyID assemblyId;
+	WCHAR moduleNameBuffer[1024];
+	ULONG actualModuleNameSize;
+	WCHAR assemblyNameBuffer[1024];
+	ULONG actualAssemblyNameSize;
+	WCHAR methodNameBuffer[1024];
+	ULONG actualMethodNameSize;
+	WCHAR typeNameBuffer[1024];
+	ULONG actualTypeNameSize;
+	mdTypeDef typeDefToken;
+	CComPtr<IMetaDataImport> metadataImport;
+	if (SUCCEEDED(corProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &methodDefToken))
+		&& SUCCEEDED(corProfilerInfo->GetModuleInfo(moduleId, 0, 1024, &actualModuleNameSize, moduleNameBuffer, &assemblyId))
+		&& SUCCEEDED(corProfilerInfo->GetAssemblyInfo(assemblyId, 1024, &actualAssemblyNameSize, assemblyNameBuffer, 0, 0))
+		&& SUCCEEDED(corProfilerInfo->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)))
+		&& SUCCEEDED(metadataImport->GetMethodProps(methodDefToken, &typeDefToken, methodNameBuffer, 1024, &actualMethodNameSize, 0, 0, 0, 0, 0))
+		&& SUCCEEDED(metadataImport->GetTypeDefProps(typeDefToken, typeNameBuffer, 1024, &actualTypeNameSize, 0, 0)))
+		name = WSTRING(assemblyNameBuffer) + WSTR("!") + typeNameBuffer + WSTR(".") + methodNameBuffer;
+	return names.emplace(functionId, name).first->second;
+}
+
+void InliningRecorder::WriteReport()
+{
+	int pairsCount = 0, inlinedOriginal = 0, inlinedRewritten = 0, rejected = 0;
+	vector<const Callee*> bypassing, lost;
+	for (const auto& pair : pairs)
+		if (pair.state.load() == Ready)
+			++pairsCount;
+	for (const auto& callee : callees)
+	{
+		if (callee.functionId.load() == 0)
+			continue;
+		inlinedOriginal += callee.inlinedOriginal;
+		inlinedRewritten += callee.inlinedRewritten;
+		rejected += callee.rejected;
+		if (callee.rewritten && callee.inlinedOriginal > 0)
+		{
+			bypassing.push_back(&callee);
+			// Once rewritten, a callee no one inlines any more is most likely too big for the JIT now
+			if (callee.inlinedRewritten == 0)
+				lost.push_back(&callee);
+		}
+	}
+
+	ostringstream report;
+	report << "Caller-callee pairs: " << pairsCount << ", inlined with original IL: " << inlinedOriginal
+		<< ", inlined with instrumented IL: " << inlinedRewritten << ", rejected: " << rejected << endl;
+	if (dropped > 0)
+		report << "Table is full, " << dropped.load() << " decisions are dropped, increase GROBOTRACE_INLINING_CAPACITY" << endl;
+
+	auto byOriginal = [](const Callee* x, const Callee* y) { return x->inlinedOriginal > y->inlinedOriginal; };
+	auto writeCallees = [&](vector<const Callee*>& list)
+	{
+		sort(list.begin(), list.end(), byOriginal);
+		report << "  original  instrumented  name" << endl;
+		for (size_t i = 0; i < list.size() && i < static_cast<size_t>(topCount); ++i)
+			report << "  " << list[i]->inlinedOriginal << "  " << list[i]->inlinedRewritten << "  " << Platform::ToUtf8(GetName(list[i]->functionId)) << endl;
+	};
+
+	report << endl << "Instrumented methods inlined with original IL, these call sites are not traced:" << endl;
+	writeCallees(bypassing);
+	report << endl << "Methods inlined before instrumentation and not inlined after it:" << endl;
+	writeCallees(lost);
+
+	if (!Platform::WriteTextFile(reportFileName, report.str()))
+	{
+		Log(WSTR("Failed to write inlining report to ") + reportFileName);
+		return;
+	}
+	Log(WSTR("Inlining report is written to ") + reportFileName);
+}
\ No newline at end of file
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Platform.h"
+
+using namespace std;
+
+// Records JIT inlining decisions to show how instrumentation changes them: callees inlined with their original IL
+// bypass tracing, callees inlined before being rewritten may stop being inlined afterwards.
+// JITInlining is called on JIT threads, so the tables are fixed size and lock-free, names are resolved only for the report
+class InliningRecorder
+{
+public:
+	InliningRecorder(ICorProfilerInfo4* corProfilerInfo, const WSTRING& reportFileName, int capacity, int topCount);
+
+	void Record(FunctionID callerId, FunctionID calleeId, BOOL shouldInline);
+	void MethodRewritten(FunctionID functionId);
+
+	void WriteReport();
+
+private:
+	enum SlotState
+	{
+		Empty,
+		Writing,
+		Ready
+	};
+
+	struct Pair
+	{
+		atomic<LONG> state;
+		FunctionID callerId;
+		FunctionID calleeId;
+		bool inlined;
+		bool calleeRewritten;
+	};
+
+	struct Callee
+	{
+		atomic<FunctionID> functionId;
+		atomic<bool> rewritten;
+		atomic<LONG> inlinedOriginal;
+		atomic<LONG> inlinedRewritten;
+		atomic<LONG> rejected;
+	};
+
+	static size_t Hash(UINT_PTR x);
+	Callee* GetCallee(FunctionID functionId);
+	bool AddPair(FunctionID callerId, FunctionID calleeId, bool inlined, bool calleeRewritten);
+	const WSTRING& GetName(FunctionID functionId);
+
+	ICorProfilerInfo4* corProfilerInfo;
+	WSTRING reportFileName;
+	size_t mask;
+	int topCount;
+	vector<Pair> pairs;
+	vector<Callee> callees;
+	atomic<LONG> dropped;
+	unordered_map<FunctionID, WSTRING> names;
+};
\ No newline at end of file
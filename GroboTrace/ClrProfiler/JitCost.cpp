@@ -0,0 +1,148 @@
+#include "JitCost.h"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+void Log(WSTRING str);
+
+static const char* phaseNames[JitCost::PhasesCount] = { "metadata", "managed rewrite", "SetILFunctionBody" };
+
+JitCost::JitCost(const WSTRING& reportFileName, int topCount)
+	: reportFileName(reportFileName), topCount(topCount), frequency(Platform::GetTimestampFrequency()), totalCost()
+{
+}
+
+LONGLONG JitCost::Now()
+{
+	return Platform::GetTimestamp();
+}
+
+LONGLONG JitCost::Cost::Profiler() const
+{
+	LONGLONG result = 0;
+	for (int i = 0; i < PhasesCount; ++i)
+		result += phases[i];
+	return result;
+}
+
+void JitCost::Cost::Add(LONGLONG ticks, const LONGLONG* phaseTicks)
+{
+	++count;
+	total += ticks;
+	if (ticks > max)
+		max = ticks;
+	for (int i = 0; i < PhasesCount; ++i)
+		phases[i] += phaseTicks[i];
+}
+
+// Must be called under statsMutex
+JitCost::Pending* JitCost::FindPending(FunctionID functionId)
+{
+	auto it = pending.find(PendingKey(Platform::GetThreadId(), functionId));
+	return it == pending.end() ? nullptr : &it->second;
+}
+
+void JitCost::CompilationStarted(FunctionID functionId)
+{
+	auto now = Now();
+	lock_guard<mutex> lock(statsMutex);
+	// The same method can be compiled on several threads at once, hence the thread in the key
+	auto& entry = pending[PendingKey(Platform::GetThreadId(), functionId)];
+	entry = Pending();
+	entry.started = now;
+	entry.lastMark = now;
+}
+
+void JitCost::PhaseFinished(FunctionID functionId, Phase phase)
+{
+	auto now = Now();
+	lock_guard<mutex> lock(statsMutex);
+	auto entry = FindPending(functionId);
+	if (entry != nullptr)
+	{
+		entry->phases[phase] += now - entry->lastMark;
+		entry->lastMark = now;
+	}
+}
+
+void JitCost::SetMethodName(FunctionID functionId, const WCHAR* assemblyName, const WCHAR* typeName, const WCHAR* methodName)
+{
+	lock_guard<mutex> lock(statsMutex);
+	auto entry = FindPending(functionId);
+	if (entry != nullptr)
+	{
+		entry->assemblyName = assemblyName;
+		entry->methodName = WSTRING(typeName) + WSTR(".") + methodName;
+	}
+}
+
+void JitCost::CompilationFinished(FunctionID functionId)
+{
+	auto now = Now();
+	lock_guard<mutex> lock(statsMutex);
+	auto it = pending.find(PendingKey(Platform::GetThreadId(), functionId));
+	if (it != pending.end())
+	{
+		const auto& entry = it->second;
+		auto ticks = now - entry.started;
+		totalCost.Add(ticks, entry.phases);
+		// Methods filtered out before their names are read go to a single bucket
+		auto assemblyName = entry.assemblyName.empty() ? WSTRING(WSTR("?")) : entry.assemblyName;
+		assemblies[assemblyName].Add(ticks, entry.phases);
+		methods[assemblyName + WSTR("!") + (entry.methodName.empty() ? WSTRING(WSTR("?")) : entry.methodName)].Add(ticks, entry.phases);
+		pending.erase(it);
+	}
+}
+
+double JitCost::ToMilliseconds(LONGLONG ticks) const
+{
+	return ticks * 1000.0 / frequency;
+}
+
+void JitCost::WriteReport()
+{
+	lock_guard<mutex> lock(statsMutex);
+
+	// Wide streams are not usable with char16_t, the report is formatted in UTF-8
+	ostringstream report;
+	report << fixed << setprecision(3);
+	auto profiler = totalCost.Profiler();
+	report << "JIT compilations: " << totalCost.count << ", total " << ToMilliseconds(totalCost.total) << " ms, profiler "
+		<< ToMilliseconds(profiler) << " ms (" << (totalCost.total > 0 ? profiler * 100.0 / totalCost.total : 0.0) << "%)" << endl;
+	for (int i = 0; i < PhasesCount; ++i)
+		report << "  " << phaseNames[i] << ": " << ToMilliseconds(totalCost.phases[i]) << " ms" << endl;
+
+	typedef pair<const WSTRING*, const Cost*> Row;
+	auto byTotal = [](const Row& x, const Row& y) { return x.second->total > y.second->total; };
+	auto writeRows = [&](vector<Row>& rows, size_t count)
+	{
+		sort(rows.begin(), rows.end(), byTotal);
+		report << "  total ms    profiler ms   max ms      count  name" << endl;
+		for (size_t i = 0; i < rows.size() && i < count; ++i)
+		{
+			const auto& cost = *rows[i].second;
+			report << "  " << setw(10) << ToMilliseconds(cost.total) << "  " << setw(10) << ToMilliseconds(cost.Profiler())
+				<< "  " << setw(10) << ToMilliseconds(cost.max) << "  " << setw(5) << cost.count << "  " << Platform::ToUtf8(*rows[i].first) << endl;
+		}
+	};
+
+	vector<Row> rows;
+	for (const auto& entry : assemblies)
+		rows.push_back(Row(&entry.first, &entry.second));
+	report << endl << "Assemblies:" << endl;
+	writeRows(rows, rows.size());
+
+	rows.clear();
+	for (const auto& entry : methods)
+		rows.push_back(Row(&entry.first, &entry.second));
+	report << endl << "Top " << topCount << " slowest methods:" << endl;
+	writeRows(rows, topCount);
+
+	if (!Platform::WriteTextFile(reportFileName, report.str()))
+	{
+		Log(WSTR("Failed to write JIT cost report to ") + reportFileName);
+		return;
+	}
+	Log(WSTR("JIT cost report is written to ") + reportFileName);
+}
\ No newline at end of file
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "Platform.h"
+
+using namespace std;
+
+// Measures how long JIT compilation takes per method and per assembly and how much of it is spent in the profiler itself.
+// The report is written on shutdown
+class JitCost
+{
+public:
+	enum Phase
+	{
+		Metadata,
+		Rewrite,
+		SetILFunctionBody,
+		PhasesCount
+	};
+
+	JitCost(const WSTRING& reportFileName, int topCount);
+
+	void CompilationStarted(FunctionID functionId);
+	// Time since the previous phase (or the start of compilation) is attributed to the given phase
+	void PhaseFinished(FunctionID functionId, Phase phase);
+	void SetMethodName(FunctionID functionId, const WCHAR* assemblyName, const WCHAR* typeName, const WCHAR* methodName);
+	void CompilationFinished(FunctionID functionId);
+
+	void WriteReport();
+
+private:
+	struct Pending
+	{
+		LONGLONG started;
+		LONGLONG lastMark;
+		LONGLONG phases[PhasesCount];
+		WSTRING assemblyName;
+		WSTRING methodName;
+	};
+
+	struct Cost
+	{
+		int count;
+		LONGLONG total;
+		LONGLONG max;
+		LONGLONG phases[PhasesCount];
+
+		LONGLONG Profiler() const;
+		void Add(LONGLONG ticks, const LONGLONG* phaseTicks);
+	};
+
+	typedef pair<DWORD, FunctionID> PendingKey;
+
+	static LONGLONG Now();
+	Pending* FindPending(FunctionID functionId);
+	double ToMilliseconds(LONGLONG ticks) const;
+
+	WSTRING reportFileName;
+	int topCount;
+	LONGLONG frequency;
+
+	mutex statsMutex;
+	map<PendingKey, Pending> pending;
+	Cost totalCost;
+	unordered_map<WSTRING, Cost> assemblies;
+	unordered_map<WSTRING, Cost> methods;
+};
\ No newline at end of file
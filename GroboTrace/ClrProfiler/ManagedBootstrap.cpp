@@ -0,0 +1,142 @@
+#include "ManagedBootstrap.h"
+#include <cstdint>
+
+void Log(WSTRING str);
+void DebugOutput(const WCHAR* str);
+
+// The few declarations of hostfxr.h and coreclr_delegates.h the bootstrap needs
+#ifdef WIN32
+#define HOSTFXR_CALLTYPE __cdecl
+#define CORECLR_DELEGATE_CALLTYPE __stdcall
+#define HOSTSTR(str) L##str
+typedef wchar_t HostChar;
+#else
+#define HOSTFXR_CALLTYPE
+#define CORECLR_DELEGATE_CALLTYPE
+#define HOSTSTR(str) str
+typedef char HostChar;
+#endif
+
+typedef void* HostContextHandle;
+typedef int32_t(HOSTFXR_CALLTYPE* InitializeForRuntimeConfig)(const HostChar* runtimeConfigPath, const void* parameters, HostContextHandle* hostContextHandle);
+typedef int32_t(HOSTFXR_CALLTYPE* GetRuntimeDelegate)(const HostContextHandle hostContextHandle, int32_t type, void** delegate);
+typedef int32_t(HOSTFXR_CALLTYPE* CloseHostContext)(const HostContextHandle hostContextHandle);
+typedef int(CORECLR_DELEGATE_CALLTYPE* LoadAssemblyAndGetFunctionPointer)(const HostChar* assemblyPath, const HostChar* typeName, const HostChar* methodName, const HostChar* delegateTypeName, void* reserved, void** delegate);
+typedef int(CORECLR_DELEGATE_CALLTYPE* ComponentEntryPoint)(void* arg, int32_t argSize);
+
+// hdt_load_assembly_and_get_function_pointer of hostfxr_delegate_type
+static const int32_t loadAssemblyAndGetFunctionPointerDelegate = 5;
+
+#ifdef WIN32
+static const WCHAR* hostfxrFileName = WSTR("hostfxr.dll");
+
+static WSTRING ToHostString(const WSTRING& str)
+{
+	return str;
+}
+#else
+static const WCHAR* hostfxrFileName = WSTR("libhostfxr.so");
+
+static string ToHostString(const WSTRING& str)
+{
+	return Platform::ToUtf8(str);
+}
+#endif
+
+// Status codes of the host are HRESULT-like
+static WSTRING FormatStatus(int32_t status)
+{
+	char buffer[16];
+	snprintf(buffer, sizeof(buffer), "0x%08X", static_cast<uint32_t>(status));
+	return Platform::FromUtf8(buffer);
+}
+
+static bool LoadThroughExports(const WSTRING& profilerFolder, CoreEntryPoints& entryPoints)
+{
+	auto fileName = Platform::CombinePath(profilerFolder, WSTR("GroboTrace.Core.dll"));
+	DebugOutput(fileName.c_str());
+	auto groboTrace = Platform::LoadNativeLibrary(fileName);
+	if (groboTrace == nullptr)
+	{
+		Log(WSTR("Failed to load GroboTrace.Core: ") + Platform::GetLastLibraryError());
+		return false;
+	}
+
+	entryPoints.setProfilerPath = Platform::GetExport(groboTrace, "SetProfilerPath");
+	entryPoints.init = Platform::GetExport(groboTrace, "Init");
+	entryPoints.installTracing = Platform::GetExport(groboTrace, "InstallTracing");
+	entryPoints.moduleUnloaded = Platform::GetExport(groboTrace, "ModuleUnloaded");
+	entryPoints.control = Platform::GetExport(groboTrace, "Control");
+	if (entryPoints.setProfilerPath == nullptr || entryPoints.init == nullptr || entryPoints.installTracing == nullptr)
+	{
+		Log(WSTR("GroboTrace.Core has no unmanaged exports, it must be built with DllExport for .NET Framework"));
+		return false;
+	}
+	return true;
+}
+
+static bool LoadThroughHostfxr(void* hostfxr, const WSTRING& profilerFolder, CoreEntryPoints& entryPoints)
+{
+	auto initializeForRuntimeConfig = reinterpret_cast<InitializeForRuntimeConfig>(Platform::GetExport(hostfxr, "hostfxr_initialize_for_runtime_config"));
+	auto getRuntimeDelegate = reinterpret_cast<GetRuntimeDelegate>(Platform::GetExport(hostfxr, "hostfxr_get_runtime_delegate"));
+	auto closeHostContext = reinterpret_cast<CloseHostContext>(Platform::GetExport(hostfxr, "hostfxr_close"));
+	if (initializeForRuntimeConfig == nullptr || getRuntimeDelegate == nullptr || closeHostContext == nullptr)
+	{
+		Log(WSTR("hostfxr cannot load components, .NET Core 3.0 or later is needed"));
+		return false;
+	}
+
+	// The app is already running, so this is a secondary context of the same runtime.
+	// hostfxr holds it back until the runtime has finished starting, which is why the bootstrap has its own thread
+	auto runtimeConfig = ToHostString(Platform::CombinePath(profilerFolder, WSTR("GroboTrace.Core.runtimeconfig.json")));
+	HostContextHandle context = nullptr;
+	auto status = initializeForRuntimeConfig(runtimeConfig.c_str(), nullptr, &context);
+	if (status < 0 || context == nullptr)
+	{
+		Log(WSTR("Failed to initialize host context for GroboTrace.Core: ") + FormatStatus(status));
+		if (context != nullptr)
+			closeHostContext(context);
+		return false;
+	}
+
+	LoadAssemblyAndGetFunctionPointer loadAssembly = nullptr;
+	status = getRuntimeDelegate(context, loadAssemblyAndGetFunctionPointerDelegate, reinterpret_cast<void**>(&loadAssembly));
+	closeHostContext(context);
+	if (status < 0 || loadAssembly == nullptr)
+	{
+		Log(WSTR("Failed to get load_assembly_and_get_function_pointer: ") + FormatStatus(status));
+		return false;
+	}
+
+	// GroboTrace.Core targets .NET Framework 4.5 and cannot use UnmanagedCallersOnly,
+	// so its entry is a method of the default ComponentEntryPoint delegate type which hands out the rest.
+	// The assembly is loaded into an isolated load context here, Loader.GetEntryPoints moves it to the default one
+	auto assemblyPath = ToHostString(Platform::CombinePath(profilerFolder, WSTR("GroboTrace.Core.dll")));
+	ComponentEntryPoint getEntryPoints = nullptr;
+	status = loadAssembly(assemblyPath.c_str(), HOSTSTR("GroboTrace.Core.Loader, GroboTrace.Core"), HOSTSTR("GetEntryPoints"), nullptr, nullptr, reinterpret_cast<void**>(&getEntryPoints));
+	if (status < 0 || getEntryPoints == nullptr)
+	{
+		Log(WSTR("Failed to load GroboTrace.Core: ") + FormatStatus(status));
+		return false;
+	}
+	if (getEntryPoints(&entryPoints, sizeof(entryPoints)) != 0 || entryPoints.setProfilerPath == nullptr || entryPoints.init == nullptr || entryPoints.installTracing == nullptr)
+	{
+		Log(WSTR("GroboTrace.Core returned no entry points"));
+		return false;
+	}
+	return true;
+}
+
+bool ManagedBootstrap::HasHostingApi()
+{
+	return Platform::GetLoadedLibrary(hostfxrFileName) != nullptr;
+}
+
+bool ManagedBootstrap::LoadCore(const WSTRING& profilerFolder, CoreEntryPoints& entryPoints)
+{
+	auto hostfxr = Platform::GetLoadedLibrary(hostfxrFileName);
+	if (hostfxr == nullptr)
+		return LoadThroughExports(profilerFolder, entryPoints);
+	DebugOutput(WSTR("Loading GroboTrace.Core through hostfxr"));
+	return LoadThroughHostfxr(hostfxr, profilerFolder, entryPoints);
+}
\ No newline at end of file
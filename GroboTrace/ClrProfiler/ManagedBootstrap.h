@@ -0,0 +1,25 @@
+#pragma once
+
+#include "Platform.h"
+
+// Unmanaged entry points of GroboTrace.Core, the layout is shared with Loader.GetEntryPoints
+struct CoreEntryPoints
+{
+	void* setProfilerPath;
+	void* init;
+	void* installTracing;
+	void* moduleUnloaded;
+	void* control;
+};
+
+// Loads GroboTrace.Core into the running runtime: through the hosting API of hostfxr on .NET Core
+// and through the DllExport stubs on .NET Framework
+namespace ManagedBootstrap
+{
+	// Blocks until the runtime is able to run managed code, so it must not be called on a thread the runtime waits for.
+	// Without the hosting API the caller has to wait for the runtime to start itself
+	bool LoadCore(const WSTRING& profilerFolder, CoreEntryPoints& entryPoints);
+
+	// Processes started by dotnet or an apphost have hostfxr loaded, .NET Framework has none
+	bool HasHostingApi();
+}
\ No newline at end of file
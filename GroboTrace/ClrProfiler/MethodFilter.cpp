@@ -0,0 +1,347 @@
+#include "MethodFilter.h"
+#include "CComPtr.h"
+#include <cstring>
+
+#ifndef WIN32
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+void Log(WSTRING str);
+
+// GroboTrace itself and the code its probes call can never be instrumented
+static const WCHAR* reservedAssemblies[] = { WSTR("GroboTrace"), WSTR("GroboTrace.Core"), WSTR("GrEmit"), WSTR("mscorlib"), WSTR("System.Private.CoreLib") };
+
+const MethodFilter::Thresholds MethodFilter::defaultThresholds = { 50, true };
+
+MethodFilter::Glob::Glob(const WSTRING& pattern)
+	: anchoredStart(pattern.empty() || pattern[0] != WSTR('*')), anchoredEnd(pattern.empty() || pattern[pattern.size() - 1] != WSTR('*'))
+{
+	size_t start = 0;
+	while (true)
+	{
+		auto star = pattern.find(WSTR('*'), start);
+		auto segment = pattern.substr(start, star == WSTRING::npos ? WSTRING::npos : star - start);
+		if (!segment.empty())
+			segments.push_back(segment);
+		if (star == WSTRING::npos)
+			break;
+		start = star + 1;
+	}
+}
+
+bool MethodFilter::Glob::MatchAt(const WSTRING& str, size_t position, const WSTRING& segment)
+{
+	if (position + segment.size() > str.size())
+		return false;
+	for (size_t i = 0; i < segment.size(); ++i)
+	{
+		if (segment[i] != WSTR('?') && segment[i] != str[position + i])
+			return false;
+	}
+	return true;
+}
+
+// Segments between stars are matched greedily from the left, the last one is pinned to the end if there is no trailing star
+bool MethodFilter::Glob::Match(const WSTRING& str) const
+{
+	if (segments.empty())
+		return !anchoredStart || str.empty();
+	size_t position = 0;
+	size_t first = 0;
+	size_t last = segments.size();
+	if (anchoredStart)
+	{
+		if (!MatchAt(str, 0, segments[0]))
+			return false;
+		position = segments[0].size();
+		first = 1;
+		if (segments.size() == 1 && anchoredEnd)
+			return position == str.size();
+	}
+	if (anchoredEnd && last > first)
+		--last;
+	for (auto i = first; i < last; ++i)
+	{
+		while (position + segments[i].size() <= str.size() && !MatchAt(str, position, segments[i]))
+			++position;
+		if (position + segments[i].size() > str.size())
+			return false;
+		position += segments[i].size();
+	}
+	if (!anchoredEnd || last == segments.size())
+		return true;
+	auto& tail = segments.back();
+	return str.size() >= position + tail.size() && MatchAt(str, str.size() - tail.size(), tail);
+}
+
+MethodFilter::MethodFilter(const WSTRING& fileName)
+	: fileName(fileName), config(Load(fileName)), stopping(false)
+{
+#ifndef WIN32
+	inotifyFd = inotify_init();
+	if (inotifyFd < 0)
+	{
+		Log(WSTR("Failed to initialize inotify, filter will not be reloaded"));
+		return;
+	}
+#else
+	stopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+#endif
+	watcher = thread(&MethodFilter::WatcherThread, this);
+}
+
+MethodFilter::~MethodFilter()
+{
+	stopping = true;
+#ifdef WIN32
+	SetEvent(stopEvent);
+#endif
+	if (watcher.joinable())
+		watcher.join();
+#ifndef WIN32
+	if (inotifyFd >= 0)
+		close(inotifyFd);
+#else
+	CloseHandle(stopEvent);
+#endif
+}
+
+// Whitespace separated, wide string streams are not usable with char16_t
+vector<WSTRING> MethodFilter::SplitTokens(const WSTRING& line)
+{
+	vector<WSTRING> result;
+	size_t start = 0;
+	while (true)
+	{
+		start = line.find_first_not_of(WSTR(" \t\r"), start);
+		if (start == WSTRING::npos)
+			break;
+		auto end = line.find_first_of(WSTR(" \t\r"), start);
+		result.push_back(line.substr(start, end == WSTRING::npos ? WSTRING::npos : end - start));
+		start = end;
+	}
+	return result;
+}
+
+shared_ptr<MethodFilter::Config> MethodFilter::Load(const WSTRING& fileName)
+{
+	auto result = make_shared<Config>();
+	result->thresholds = defaultThresholds;
+	// Used to be hard-coded, a rule from the file can include it back
+	result->rules.push_back(Rule { Assembly, false, Glob(WSTR("System.Core")) });
+
+	vector<WSTRING> lines;
+	if (!Platform::ReadLines(fileName, lines))
+	{
+		result->hasMethodRules = false;
+		return result;
+	}
+	int lineNumber = 0;
+	for (auto& line : lines)
+	{
+		++lineNumber;
+		auto comment = line.find(WSTR('#'));
+		if (comment != WSTRING::npos)
+			line.resize(comment);
+		auto tokens = SplitTokens(line);
+		if (tokens.empty())
+			continue;
+		tokens.resize(3);
+		const auto& command = tokens[0];
+		const auto& argument = tokens[1];
+		const auto& pattern = tokens[2];
+
+		if (command == WSTR("include") || command == WSTR("exclude"))
+		{
+			Kind kind;
+			if (argument == WSTR("assembly"))
+				kind = Assembly;
+			else if (argument == WSTR("namespace"))
+				kind = Namespace;
+			else if (argument == WSTR("type"))
+				kind = Type;
+			else if (argument == WSTR("method"))
+				kind = Method;
+			else
+			{
+				Log(WSTR("Unknown rule kind in filter at line ") + Platform::ToString(lineNumber));
+				continue;
+			}
+			if (pattern.empty())
+			{
+				Log(WSTR("Missing pattern in filter at line ") + Platform::ToString(lineNumber));
+				continue;
+			}
+			result->rules.push_back(Rule { kind, command == WSTR("include"), Glob(pattern) });
+		}
+		else if (command == WSTR("min_instructions"))
+			result->thresholds.minInstructions = Platform::ParseInt(argument);
+		else if (command == WSTR("trace_small_loops"))
+			result->thresholds.traceSmallMethodsWithLoops = argument == WSTR("yes") || argument == WSTR("true") || argument == WSTR("1");
+		else
+			Log(WSTR("Unknown filter setting at line ") + Platform::ToString(lineNumber));
+	}
+
+	result->hasMethodRules = false;
+	for (auto& rule : result->rules)
+		result->hasMethodRules |= rule.kind == Method;
+	Log(WSTR("Filter is loaded, ") + Platform::ToString(result->rules.size()) + WSTR(" rules"));
+	return result;
+}
+
+bool MethodFilter::IsReserved(const WCHAR* assemblyName)
+{
+	for (auto reserved : reservedAssemblies)
+	{
+		if (Platform::Equals(assemblyName, reserved))
+			return true;
+	}
+	return false;
+}
+
+bool MethodFilter::HasDontTraceAttribute(IMetaDataImport* metadataImport, mdToken token)
+{
+	const void* data;
+	ULONG size;
+	return metadataImport->GetCustomAttributeByName(token, WSTR("GroboTrace.DontTraceAttribute"), &data, &size) == S_OK;
+}
+
+// Namespace.Outer+Inner, the same as Type.FullName
+WSTRING MethodFilter::GetTypeFullName(IMetaDataImport* metadataImport, mdTypeDef typeDefToken)
+{
+	WCHAR typeNameBuffer[1024];
+	ULONG actualTypeNameSize;
+	if (FAILED(metadataImport->GetTypeDefProps(typeDefToken, typeNameBuffer, 1024, &actualTypeNameSize, nullptr, nullptr)))
+		return WSTRING();
+	mdTypeDef enclosingTypeDefToken;
+	if (SUCCEEDED(metadataImport->GetNestedClassProps(typeDefToken, &enclosingTypeDefToken)))
+		return GetTypeFullName(metadataImport, enclosingTypeDefToken) + WSTR("+") + typeNameBuffer;
+	return WSTRING(typeNameBuffer);
+}
+
+// Rules are scanned from the end down to the one that has decided so far, the first matching rule of the kind wins
+MethodFilter::Verdict MethodFilter::Evaluate(const Config& config, Verdict verdict, Kind kind, const WSTRING& name)
+{
+	for (int i = static_cast<int>(config.rules.size()) - 1; i > verdict.ruleIndex; --i)
+	{
+		auto& rule = config.rules[i];
+		if (rule.kind == kind && rule.glob.Match(name))
+			return Verdict { i, rule.include };
+	}
+	return verdict;
+}
+
+bool MethodFilter::ShouldInstrument(ModuleID moduleId, IMetaDataImport* metadataImport, const WCHAR* assemblyName, mdTypeDef typeDefToken, mdMethodDef methodToken, const WCHAR* methodName, Thresholds& thresholds)
+{
+	if (IsReserved(assemblyName))
+		return false;
+
+	auto current = atomic_load(&config);
+	thresholds = current->thresholds;
+
+	Verdict moduleVerdict;
+	bool typeCached = false;
+	Verdict typeVerdict;
+	{
+		lock_guard<mutex> lock(current->cacheLock);
+		auto module = current->modules.find(moduleId);
+		if (module == current->modules.end())
+			module = current->modules.emplace(moduleId, Evaluate(*current, Verdict { -1, true }, Assembly, assemblyName)).first;
+		moduleVerdict = module->second;
+		auto& types = current->types[moduleId];
+		auto type = types.find(typeDefToken);
+		if (type != types.end())
+		{
+			typeVerdict = type->second;
+			typeCached = true;
+		}
+	}
+
+	// Only types of the modules with included methods are looked at, metadata is read outside of the lock
+	WSTRING typeName;
+	if (!typeCached || current->hasMethodRules)
+		typeName = GetTypeFullName(metadataImport, typeDefToken);
+	if (!typeCached)
+	{
+		if (HasDontTraceAttribute(metadataImport, typeDefToken))
+			typeVerdict = Verdict { static_cast<int>(current->rules.size()), false };
+		else
+		{
+			auto outerTypeName = typeName.substr(0, typeName.find(WSTR('+')));
+			auto lastDot = outerTypeName.rfind(WSTR('.'));
+			auto namespaceName = lastDot == WSTRING::npos ? WSTRING() : outerTypeName.substr(0, lastDot);
+			typeVerdict = Evaluate(*current, Evaluate(*current, moduleVerdict, Namespace, namespaceName), Type, typeName);
+		}
+		lock_guard<mutex> lock(current->cacheLock);
+		current->types[moduleId][typeDefToken] = typeVerdict;
+	}
+
+	// [DontTrace] types are marked with a verdict no rule can override
+	if (typeVerdict.ruleIndex == static_cast<int>(current->rules.size()))
+		return false;
+	if (HasDontTraceAttribute(metadataImport, methodToken))
+		return false;
+	if (current->hasMethodRules)
+		typeVerdict = Evaluate(*current, typeVerdict, Method, typeName + WSTR(".") + methodName);
+	return typeVerdict.include;
+}
+
+void MethodFilter::ModuleUnloaded(ModuleID moduleId)
+{
+	auto current = atomic_load(&config);
+	lock_guard<mutex> lock(current->cacheLock);
+	current->modules.erase(moduleId);
+	current->types.erase(moduleId);
+}
+
+// Watches the directory, so that the file can be created later and replaced by editors with a rename
+void MethodFilter::WatcherThread()
+{
+	auto separator = fileName.find_last_of(WSTR("\\/"));
+	auto directory = separator == WSTRING::npos ? WSTRING(WSTR(".")) : fileName.substr(0, separator);
+	auto baseName = separator == WSTRING::npos ? fileName : fileName.substr(separator + 1);
+
+#ifndef WIN32
+	if (inotify_add_watch(inotifyFd, Platform::ToUtf8(directory).c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0)
+	{
+		Log(WSTR("Failed to watch filter directory ") + directory);
+		return;
+	}
+	auto narrowBaseName = Platform::ToUtf8(baseName);
+	alignas(inotify_event) char buffer[4096];
+	while (!stopping)
+	{
+		pollfd descriptor = { inotifyFd, POLLIN, 0 };
+		if (poll(&descriptor, 1, 500) <= 0)
+			continue;
+		auto size = read(inotifyFd, buffer, sizeof(buffer));
+		bool changed = false;
+		for (ssize_t offset = 0; offset < size; )
+		{
+			auto event = reinterpret_cast<inotify_event*>(buffer + offset);
+			changed |= event->len > 0 && narrowBaseName == event->name;
+			offset += sizeof(inotify_event) + event->len;
+		}
+		if (changed)
+			atomic_store(&config, Load(fileName));
+	}
+#else
+	auto change = FindFirstChangeNotificationW(directory.c_str(), FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+	if (change == INVALID_HANDLE_VALUE)
+	{
+		Log(WSTR("Failed to watch filter directory ") + directory);
+		return;
+	}
+	HANDLE handles[] = { change, stopEvent };
+	// Notifications do not tell which file has changed, reloading a small file is cheap anyway
+	while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0)
+	{
+		atomic_store(&config, Load(fileName));
+		if (!FindNextChangeNotification(change))
+			break;
+	}
+	FindCloseChangeNotification(change);
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Platform.h"
+
+using namespace std;
+
+// Decides which methods get instrumented. Rules are read from GroboTrace.filter next to the profiler (or GROBOTRACE_FILTER),
+// one per line, the last matching rule wins:
+//
+//   exclude assembly System.*
+//   include namespace MyCompany.Orders
+//   exclude type *Dto
+//   exclude method *.get_*
+//   min_instructions 50
+//   trace_small_loops yes
+//
+// Patterns are globs ('*' matches any substring, '?' any character) compiled once per (re)load.
+// Verdicts of assemblies and types are cached per module, method rules are checked only when there are any.
+// The file is watched and reloaded on change, already compiled methods keep their instrumentation
+class MethodFilter
+{
+public:
+	// Passed to GroboTrace.Core, which counts IL instructions and finds loops anyway
+	struct Thresholds
+	{
+		int minInstructions;
+		bool traceSmallMethodsWithLoops;
+	};
+
+	// Used when the file sets no thresholds or there is no filter at all
+	static const Thresholds defaultThresholds;
+
+	explicit MethodFilter(const WSTRING& fileName);
+	~MethodFilter();
+
+	bool ShouldInstrument(ModuleID moduleId, IMetaDataImport* metadataImport, const WCHAR* assemblyName, mdTypeDef typeDefToken, mdMethodDef methodToken, const WCHAR* methodName, Thresholds& thresholds);
+	void ModuleUnloaded(ModuleID moduleId);
+
+	static WSTRING GetTypeFullName(IMetaDataImport* metadataImport, mdTypeDef typeDefToken);
+
+private:
+	enum Kind { Assembly, Namespace, Type, Method };
+
+	class Glob
+	{
+	public:
+		explicit Glob(const WSTRING& pattern);
+		bool Match(const WSTRING& str) const;
+
+	private:
+		static bool MatchAt(const WSTRING& str, size_t position, const WSTRING& segment);
+
+		vector<WSTRING> segments;
+		bool anchoredStart;
+		bool anchoredEnd;
+	};
+
+	struct Rule
+	{
+		Kind kind;
+		bool include;
+		Glob glob;
+	};
+
+	// Last matching rule of the assembly, namespace and type levels, -1 if there is none
+	struct Verdict
+	{
+		int ruleIndex;
+		bool include;
+	};
+
+	// Immutable after loading except caches, replaced as a whole on reload
+	struct Config
+	{
+		vector<Rule> rules;
+		bool hasMethodRules;
+		Thresholds thresholds;
+
+		mutex cacheLock;
+		unordered_map<ModuleID, Verdict> modules;
+		unordered_map<ModuleID, unordered_map<mdTypeDef, Verdict>> types;
+	};
+
+	static vector<WSTRING> SplitTokens(const WSTRING& line);
+	static shared_ptr<Config> Load(const WSTRING& fileName);
+	static bool IsReserved(const WCHAR* assemblyName);
+	static bool HasDontTraceAttribute(IMetaDataImport* metadataImport, mdToken token);
+	static Verdict Evaluate(const Config& config, Verdict verdict, Kind kind, const WSTRING& name);
+	void WatcherThread();
+
+	WSTRING fileName;
+	shared_ptr<Config> config;
+	atomic<bool> stopping;
+	thread watcher;
+#ifndef WIN32
+	int inotifyFd;
+#else
+	HANDLE stopEvent;
+#endif
+};
\ No newline at end of file
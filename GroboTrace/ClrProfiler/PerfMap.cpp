@@ -0,0 +1,336 @@
+#include "PerfMap.h"
+#include "CComPtr.h"
+#include "profiler_pal.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+void Log(WSTRING str);
+
+// See tools/perf/Documentation/jitdump-specification.txt in the Linux kernel tree
+namespace JitDump
+{
+	const UINT32 magic = 0x4A695444;
+	const UINT32 version = 1;
+	const UINT32 codeLoadRecord = 0;
+	const UINT32 debugInfoRecord = 2;
+
+#if defined(_M_X64) || defined(__x86_64__)
+	const UINT32 elfMachine = 62;
+#elif defined(_M_ARM64) || defined(__aarch64__)
+	const UINT32 elfMachine = 183;
+#else
+	const UINT32 elfMachine = 3;
+#endif
+
+#pragma pack(push, 1)
+	struct FileHeader
+	{
+		UINT32 magic;
+		UINT32 version;
+		UINT32 totalSize;
+		UINT32 elfMachine;
+		UINT32 pad;
+		UINT32 pid;
+		UINT64 timestamp;
+		UINT64 flags;
+	};
+
+	struct RecordHeader
+	{
+		UINT32 id;
+		UINT32 totalSize;
+		UINT64 timestamp;
+	};
+
+	struct CodeLoad
+	{
+		RecordHeader header;
+		UINT32 pid;
+		UINT32 tid;
+		UINT64 vma;
+		UINT64 codeAddress;
+		UINT64 codeSize;
+		UINT64 codeIndex;
+	};
+
+	struct DebugInfo
+	{
+		RecordHeader header;
+		UINT64 codeAddress;
+		UINT64 entriesCount;
+	};
+
+	struct DebugEntry
+	{
+		UINT64 address;
+		UINT32 line;
+		UINT32 discriminator;
+	};
+#pragma pack(pop)
+}
+
+// Native code of IL offsets is reported as lines of this pseudo file
+static const char ilFileName[] = "IL";
+
+PerfMap::PerfMap(ICorProfilerInfo4* corProfilerInfo, bool writePerfMap, bool writeJitDump, bool writeILMaps)
+	: corProfilerInfo(corProfilerInfo), writeILMaps(writeILMaps), perfMapFile(nullptr), jitDumpFile(nullptr), jitDumpMarker(nullptr), codeIndex(0), stopping(false)
+{
+	char fileName[256];
+	if (writePerfMap)
+	{
+		sprintf(fileName, "/tmp/perf-%u.map", static_cast<unsigned>(Platform::GetProcessId()));
+		perfMapFile = fopen(fileName, "w");
+		if (!perfMapFile)
+			Log(WSTR("Failed to create perf map"));
+	}
+	if (writeJitDump)
+	{
+		sprintf(fileName, "/tmp/jit-%u.dump", static_cast<unsigned>(Platform::GetProcessId()));
+		jitDumpFile = fopen(fileName, "w+b");
+		if (!jitDumpFile)
+			Log(WSTR("Failed to create jitdump"));
+		else
+		{
+#ifndef WIN32
+			// perf record finds jitdump files by executable mappings of them
+			jitDumpMarker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(jitDumpFile), 0);
+			if (jitDumpMarker == MAP_FAILED)
+				jitDumpMarker = nullptr;
+#endif
+			WriteJitDumpHeader();
+		}
+	}
+	writer = thread(&PerfMap::WriterThread, this);
+}
+
+PerfMap::~PerfMap()
+{
+	{
+		lock_guard<mutex> lock(queueMutex);
+		stopping = true;
+	}
+	queueChanged.notify_one();
+	writer.join();
+	if (perfMapFile)
+		fclose(perfMapFile);
+#ifndef WIN32
+	if (jitDumpMarker)
+		munmap(jitDumpMarker, sysconf(_SC_PAGESIZE));
+#endif
+	if (jitDumpFile)
+		fclose(jitDumpFile);
+}
+
+void PerfMap::MethodCompiled(FunctionID functionId, ReJITID rejitId)
+{
+	string name;
+	if (!GetMethodName(functionId, name))
+		return;
+	if (rejitId != 0)
+		name += " [rejit " + to_string(static_cast<unsigned long long>(rejitId)) + "]";
+	AddCode(functionId, rejitId, name);
+}
+
+void PerfMap::DynamicMethodCompiled(FunctionID functionId)
+{
+	// Dynamic methods have neither a module nor a metadata token to take the name from
+	char name[64];
+	sprintf(name, "DynamicMethod_%llx", static_cast<unsigned long long>(functionId));
+	AddCode(functionId, 0, name);
+}
+
+void PerfMap::AddCode(FunctionID functionId, ReJITID rejitId, const string& name)
+{
+	Entry entry;
+	entry.name = name;
+	// perf expects CLOCK_MONOTONIC timestamps in jitdump records, the same as Platform::GetTimestamp on Linux
+	entry.timestamp = Platform::GetTimestamp();
+	entry.threadId = Platform::GetThreadId();
+
+	ULONG32 codeInfosCount;
+	COR_PRF_CODE_INFO codeInfos[4];
+	HRESULT hr = rejitId == 0
+		? corProfilerInfo->GetCodeInfo2(functionId, 4, &codeInfosCount, codeInfos)
+		: corProfilerInfo->GetCodeInfo3(functionId, rejitId, 4, &codeInfosCount, codeInfos);
+	if (FAILED(hr) || codeInfosCount == 0)
+		return;
+
+	if (jitDumpFile && writeILMaps)
+	{
+		ULONG32 mapSize = 0;
+		hr = rejitId == 0
+			? corProfilerInfo->GetILToNativeMapping(functionId, 0, &mapSize, nullptr)
+			: corProfilerInfo->GetILToNativeMapping2(functionId, rejitId, 0, &mapSize, nullptr);
+		if (SUCCEEDED(hr) && mapSize > 0)
+		{
+			entry.ilMap.resize(mapSize);
+			hr = rejitId == 0
+				? corProfilerInfo->GetILToNativeMapping(functionId, mapSize, &mapSize, entry.ilMap.data())
+				: corProfilerInfo->GetILToNativeMapping2(functionId, rejitId, mapSize, &mapSize, entry.ilMap.data());
+			if (FAILED(hr))
+				entry.ilMap.clear();
+		}
+	}
+
+	// Hot and cold parts of a method are reported separately, IL map goes with the first one
+	vector<Entry> entries;
+	for (ULONG32 i = 0; i < codeInfosCount && i < 4; ++i)
+	{
+		Entry part;
+		part.name = entry.name;
+		part.timestamp = entry.timestamp;
+		part.threadId = entry.threadId;
+		part.codeAddress = codeInfos[i].startAddress;
+		part.codeSize = static_cast<ULONG>(codeInfos[i].size);
+		if (jitDumpFile)
+		{
+			auto start = reinterpret_cast<const BYTE*>(part.codeAddress);
+			part.code.assign(start, start + part.codeSize);
+		}
+		if (i == 0)
+			part.ilMap.swap(entry.ilMap);
+		entries.push_back(move(part));
+	}
+
+	{
+		lock_guard<mutex> lock(queueMutex);
+		for (auto& part : entries)
+			queue.push_back(move(part));
+	}
+	queueChanged.notify_one();
+}
+
+bool PerfMap::GetMethodName(FunctionID functionId, string& name)
+{
+	ClassID classId;
+	ModuleID moduleId;
+	mdToken methodDefToken;
+	if (FAILED(corProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &methodDefToken)))
+		return false;
+
+	CComPtr<IMetaDataImport> metadataImport;
+	if (FAILED(corProfilerInfo->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport))))
+		return false;
+
+	WCHAR methodNameBuffer[1024];
+	ULONG actualMethodNameSize;
+	mdTypeDef typeDefToken;
+	if (FAILED(metadataImport->GetMethodProps(methodDefToken, &typeDefToken, methodNameBuffer, 1024, &actualMethodNameSize, 0, 0, 0, 0, 0)))
+		return false;
+
+	name = GetTypeName(moduleId, metadataImport, typeDefToken) + "::" + Platform::ToUtf8(methodNameBuffer);
+	return true;
+}
+
+string PerfMap::GetTypeName(ModuleID moduleId, IMetaDataImport* metadataImport, mdTypeDef typeDefToken)
+{
+	auto key = make_pair(moduleId, typeDefToken);
+	{
+		lock_guard<mutex> lock(typeNamesMutex);
+		auto it = typeNames.find(key);
+		if (it != typeNames.end())
+			return it->second;
+	}
+
+	WCHAR typeNameBuffer[1024];
+	ULONG actualTypeNameSize;
+	string result;
+	if (SUCCEEDED(metadataImport->GetTypeDefProps(typeDefToken, typeNameBuffer, 1024, &actualTypeNameSize, 0, 0)))
+		result = Platform::ToUtf8(typeNameBuffer);
+	mdTypeDef enclosingTypeDefToken;
+	if (SUCCEEDED(metadataImport->GetNestedClassProps(typeDefToken, &enclosingTypeDefToken)))
+		result = GetTypeName(moduleId, metadataImport, enclosingTypeDefToken) + "+" + result;
+
+	lock_guard<mutex> lock(typeNamesMutex);
+	typeNames[key] = result;
+	return result;
+}
+
+void PerfMap::WriterThread()
+{
+	while (true)
+	{
+		deque<Entry> entries;
+		{
+			unique_lock<mutex> lock(queueMutex);
+			queueChanged.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (queue.empty() && stopping)
+				break;
+			entries.swap(queue);
+		}
+		for (const auto& entry : entries)
+		{
+			if (perfMapFile)
+				WritePerfMapEntry(entry);
+			if (jitDumpFile)
+				WriteJitDumpEntry(entry);
+		}
+		if (perfMapFile)
+			fflush(perfMapFile);
+		if (jitDumpFile)
+			fflush(jitDumpFile);
+	}
+}
+
+void PerfMap::WritePerfMapEntry(const Entry& entry)
+{
+	fprintf(perfMapFile, "%llx %x %s\n", static_cast<unsigned long long>(entry.codeAddress), static_cast<unsigned>(entry.codeSize), entry.name.c_str());
+}
+
+void PerfMap::WriteJitDumpHeader()
+{
+	JitDump::FileHeader header = {};
+	header.magic = JitDump::magic;
+	header.version = JitDump::version;
+	header.totalSize = sizeof(header);
+	header.elfMachine = JitDump::elfMachine;
+	header.pid = Platform::GetProcessId();
+	header.timestamp = Platform::GetTimestamp();
+	fwrite(&header, sizeof(header), 1, jitDumpFile);
+}
+
+void PerfMap::WriteJitDumpEntry(const Entry& entry)
+{
+	// Debug info must precede the code load record it describes
+	vector<const COR_DEBUG_IL_TO_NATIVE_MAP*> mappings;
+	for (const auto& mapping : entry.ilMap)
+		if (static_cast<int>(mapping.ilOffset) >= 0 && mapping.nativeStartOffset < entry.codeSize)
+			mappings.push_back(&mapping);
+	if (!mappings.empty())
+	{
+		JitDump::DebugInfo debugInfo = {};
+		debugInfo.header.id = JitDump::debugInfoRecord;
+		debugInfo.header.totalSize = static_cast<UINT32>(sizeof(debugInfo) + mappings.size() * (sizeof(JitDump::DebugEntry) + sizeof(ilFileName)));
+		debugInfo.header.timestamp = entry.timestamp;
+		debugInfo.codeAddress = entry.codeAddress;
+		debugInfo.entriesCount = mappings.size();
+		fwrite(&debugInfo, sizeof(debugInfo), 1, jitDumpFile);
+		for (auto mapping : mappings)
+		{
+			JitDump::DebugEntry debugEntry = {};
+			debugEntry.address = entry.codeAddress + mapping->nativeStartOffset;
+			debugEntry.line = mapping->ilOffset;
+			fwrite(&debugEntry, sizeof(debugEntry), 1, jitDumpFile);
+			fwrite(ilFileName, sizeof(ilFileName), 1, jitDumpFile);
+		}
+	}
+
+	JitDump::CodeLoad codeLoad = {};
+	codeLoad.header.id = JitDump::codeLoadRecord;
+	codeLoad.header.totalSize = static_cast<UINT32>(sizeof(codeLoad) + entry.name.size() + 1 + entry.code.size());
+	codeLoad.header.timestamp = entry.timestamp;
+	codeLoad.pid = Platform::GetProcessId();
+	codeLoad.tid = entry.threadId;
+	codeLoad.vma = entry.codeAddress;
+	codeLoad.codeAddress = entry.codeAddress;
+	codeLoad.codeSize = entry.code.size();
+	codeLoad.codeIndex = codeIndex++;
+	fwrite(&codeLoad, sizeof(codeLoad), 1, jitDumpFile);
+	fwrite(entry.name.c_str(), entry.name.size() + 1, 1, jitDumpFile);
+	if (!entry.code.empty())
+		fwrite(entry.code.data(), entry.code.size(), 1, jitDumpFile);
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Platform.h"
+
+using namespace std;
+
+// Writes /tmp/perf-<pid>.map and /tmp/jit-<pid>.dump for JIT-compiled methods, so that perf can symbolize managed frames.
+// Callbacks only copy code ranges and names, files are written on a background thread
+class PerfMap
+{
+public:
+	PerfMap(ICorProfilerInfo4* corProfilerInfo, bool writePerfMap, bool writeJitDump, bool writeILMaps);
+	~PerfMap();
+
+	// rejitId = 0 for the initial JIT compilation
+	void MethodCompiled(FunctionID functionId, ReJITID rejitId);
+	void DynamicMethodCompiled(FunctionID functionId);
+
+private:
+	struct Entry
+	{
+		string name;
+		UINT64 timestamp;
+		DWORD threadId;
+		UINT_PTR codeAddress;
+		ULONG codeSize;
+		vector<BYTE> code;
+		vector<COR_DEBUG_IL_TO_NATIVE_MAP> ilMap;
+	};
+
+	void AddCode(FunctionID functionId, ReJITID rejitId, const string& name);
+	bool GetMethodName(FunctionID functionId, string& name);
+	string GetTypeName(ModuleID moduleId, IMetaDataImport* metadataImport, mdTypeDef typeDefToken);
+	void WriterThread();
+	void WritePerfMapEntry(const Entry& entry);
+	void WriteJitDumpHeader();
+	void WriteJitDumpEntry(const Entry& entry);
+
+	ICorProfilerInfo4* corProfilerInfo;
+	bool writeILMaps;
+	FILE* perfMapFile;
+	FILE* jitDumpFile;
+	void* jitDumpMarker;
+	UINT64 codeIndex;
+
+	mutex queueMutex;
+	condition_variable queueChanged;
+	deque<Entry> queue;
+	bool stopping;
+	thread writer;
+
+	mutex typeNamesMutex;
+	map<pair<ModuleID, mdTypeDef>, string> typeNames;
+};
\ No newline at end of file
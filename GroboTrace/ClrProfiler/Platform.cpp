@@ -0,0 +1,477 @@
+#include "Platform.h"
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace Platform
+{
+	static bool IsTrailingByte(unsigned char c)
+	{
+		return (c & 0xC0) == 0x80;
+	}
+
+	string ToUtf8(const WCHAR* str)
+	{
+		string result;
+		for (size_t i = 0; str[i] != 0; ++i)
+		{
+			UINT32 c = static_cast<UINT16>(str[i]);
+			if (c >= 0xD800 && c < 0xDC00 && str[i + 1] >= 0xDC00 && str[i + 1] < 0xE000)
+				c = 0x10000 + ((c - 0xD800) << 10) + (static_cast<UINT16>(str[++i]) - 0xDC00);
+			if (c < 0x80)
+				result += static_cast<char>(c);
+			else if (c < 0x800)
+			{
+				result += static_cast<char>(0xC0 | c >> 6);
+				result += static_cast<char>(0x80 | (c & 0x3F));
+			}
+			else if (c < 0x10000)
+			{
+				result += static_cast<char>(0xE0 | c >> 12);
+				result += static_cast<char>(0x80 | (c >> 6 & 0x3F));
+				result += static_cast<char>(0x80 | (c & 0x3F));
+			}
+			else
+			{
+				result += static_cast<char>(0xF0 | c >> 18);
+				result += static_cast<char>(0x80 | (c >> 12 & 0x3F));
+				result += static_cast<char>(0x80 | (c >> 6 & 0x3F));
+				result += static_cast<char>(0x80 | (c & 0x3F));
+			}
+		}
+		return result;
+	}
+
+	string ToUtf8(const WSTRING& str)
+	{
+		return ToUtf8(str.c_str());
+	}
+
+	// Malformed sequences become U+FFFD
+	WSTRING FromUtf8(const string& str)
+	{
+		WSTRING result;
+		size_t n = str.size();
+		for (size_t i = 0; i < n; )
+		{
+			unsigned char lead = str[i++];
+			UINT32 c;
+			int trailing;
+			if (lead < 0x80)
+				c = lead, trailing = 0;
+			else if ((lead & 0xE0) == 0xC0)
+				c = lead & 0x1F, trailing = 1;
+			else if ((lead & 0xF0) == 0xE0)
+				c = lead & 0x0F, trailing = 2;
+			else if ((lead & 0xF8) == 0xF0)
+				c = lead & 0x07, trailing = 3;
+			else
+				c = 0xFFFD, trailing = 0;
+			for (; trailing > 0; --trailing)
+			{
+				if (i == n || !IsTrailingByte(str[i]))
+				{
+					c = 0xFFFD;
+					break;
+				}
+				c = c << 6 | (str[i++] & 0x3F);
+			}
+			if (c >= 0x10000)
+			{
+				result += static_cast<WCHAR>(0xD800 + ((c - 0x10000) >> 10));
+				result += static_cast<WCHAR>(0xDC00 + ((c - 0x10000) & 0x3FF));
+			}
+			else
+				result += static_cast<WCHAR>(c);
+		}
+		return result;
+	}
+
+	WSTRING ToString(INT64 value)
+	{
+		auto digits = to_string(value);
+		return WSTRING(digits.begin(), digits.end());
+	}
+
+	int ParseInt(const WSTRING& str)
+	{
+		size_t i = 0;
+		while (i < str.size() && (str[i] == ' ' || str[i] == '\t'))
+			++i;
+		bool negative = i < str.size() && str[i] == '-';
+		if (i < str.size() && (str[i] == '-' || str[i] == '+'))
+			++i;
+		// Accumulated as a negative number, whose range reaches INT_MIN
+		int result = 0;
+		for (; i < str.size() && str[i] >= '0' && str[i] <= '9'; ++i)
+		{
+			int digit = str[i] - '0';
+			if (result < (INT_MIN + digit) / 10)
+				return 0;
+			result = result * 10 - digit;
+		}
+		if (!negative && result == INT_MIN)
+			return 0;
+		return negative ? result : -result;
+	}
+
+	bool Equals(const WCHAR* x, const WCHAR* y)
+	{
+		while (*x != 0 && *x == *y)
+			++x, ++y;
+		return *x == *y;
+	}
+
+	static WCHAR ToLower(WCHAR c)
+	{
+		return c >= 'A' && c <= 'Z' ? static_cast<WCHAR>(c - 'A' + 'a') : c;
+	}
+
+	bool EqualsIgnoreCase(const WCHAR* x, const WCHAR* y)
+	{
+		while (*x != 0 && ToLower(*x) == ToLower(*y))
+			++x, ++y;
+		return ToLower(*x) == ToLower(*y);
+	}
+
+	WSTRING CombinePath(const WSTRING& folder, const WSTRING& fileName)
+	{
+		return folder + PATH_SEPARATOR + fileName;
+	}
+
+	WSTRING GetFileName(const WSTRING& path)
+	{
+		auto separator = path.find_last_of(WSTR("\\/"));
+		return separator == WSTRING::npos ? path : path.substr(separator + 1);
+	}
+
+	FILE* OpenFile(const WSTRING& fileName, const char* mode)
+	{
+#ifdef WIN32
+		return _wfopen(fileName.c_str(), WSTRING(mode, mode + strlen(mode)).c_str());
+#else
+		return fopen(ToUtf8(fileName).c_str(), mode);
+#endif
+	}
+
+	bool ReadLines(const WSTRING& fileName, vector<WSTRING>& lines)
+	{
+		auto file = OpenFile(fileName, "rb");
+		if (file == nullptr)
+			return false;
+		string text;
+		char buffer[4096];
+		size_t read;
+		while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+			text.append(buffer, read);
+		fclose(file);
+
+		size_t start = text.compare(0, 3, "\xEF\xBB\xBF") == 0 ? 3 : 0;
+		while (start < text.size())
+		{
+			auto end = text.find('\n', start);
+			if (end == string::npos)
+				end = text.size();
+			auto length = end - start;
+			if (length > 0 && text[end - 1] == '\r')
+				--length;
+			lines.push_back(FromUtf8(text.substr(start, length)));
+			start = end + 1;
+		}
+		return true;
+	}
+
+	bool WriteTextFile(const WSTRING& fileName, const string& text)
+	{
+		auto file = OpenFile(fileName, "wb");
+		if (file == nullptr)
+			return false;
+		bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+		return fclose(file) == 0 && written;
+	}
+
+	bool RenameFile(const WSTRING& fileName, const WSTRING& newFileName)
+	{
+#ifdef WIN32
+		return MoveFileExW(fileName.c_str(), newFileName.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		return rename(ToUtf8(fileName).c_str(), ToUtf8(newFileName).c_str()) == 0;
+#endif
+	}
+
+	void* STDMETHODCALLTYPE AllocateTaskMemory(size_t size)
+	{
+#ifdef WIN32
+		return CoTaskMemAlloc(size);
+#else
+		return malloc(size);
+#endif
+	}
+
+	void FreeTaskMemory(void* memory)
+	{
+#ifdef WIN32
+		CoTaskMemFree(memory);
+#else
+		free(memory);
+#endif
+	}
+
+#ifdef WIN32
+
+	WSTRING GetEnvironmentValue(const WCHAR* name)
+	{
+		WCHAR value[1024];
+		auto len = GetEnvironmentVariableW(name, value, 1024);
+		if (len == 0 || len >= 1024)
+			return WSTRING();
+		return WSTRING(value, len);
+	}
+
+	WSTRING GetProfilerFolder()
+	{
+		HMODULE module;
+		WCHAR fileName[1024];
+		if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, reinterpret_cast<LPCWSTR>(&GetProfilerFolder), &module))
+			return WSTRING();
+		auto len = GetModuleFileNameW(module, fileName, 1024);
+		auto path = WSTRING(fileName, len);
+		return path.substr(0, path.size() - GetFileName(path).size() - 1);
+	}
+
+	WSTRING GetExecutablePath()
+	{
+		WCHAR fileName[1024];
+		auto len = GetModuleFileNameW(nullptr, fileName, 1024);
+		return WSTRING(fileName, len);
+	}
+
+	WSTRING GetProcessCommandLine()
+	{
+		return WSTRING(GetCommandLineW());
+	}
+
+	void WriteDebugOutput(const WSTRING& str)
+	{
+		OutputDebugStringW(str.c_str());
+	}
+
+	DWORD GetProcessId()
+	{
+		return GetCurrentProcessId();
+	}
+
+	DWORD GetThreadId()
+	{
+		return GetCurrentThreadId();
+	}
+
+	UINT64 GetTimestamp()
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return counter.QuadPart;
+	}
+
+	UINT64 GetTimestampFrequency()
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		return frequency.QuadPart;
+	}
+
+	UINT64 GetThreadCpuTime()
+	{
+		FILETIME creationTime, exitTime, kernelTime, userTime;
+		if (!GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime))
+			return 0;
+		auto kernel = static_cast<UINT64>(kernelTime.dwHighDateTime) << 32 | kernelTime.dwLowDateTime;
+		auto user = static_cast<UINT64>(userTime.dwHighDateTime) << 32 | userTime.dwLowDateTime;
+		return (kernel + user) * 100;
+	}
+
+	BYTE* ReserveMemory(size_t size)
+	{
+		return static_cast<BYTE*>(VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_READWRITE));
+	}
+
+	bool CommitMemory(BYTE* address, size_t size)
+	{
+		return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+	}
+
+	void ReleaseMemory(BYTE* address, size_t size)
+	{
+		VirtualFree(address, 0, MEM_RELEASE);
+	}
+
+	void* LoadNativeLibrary(const WSTRING& fileName)
+	{
+		return LoadLibraryW(fileName.c_str());
+	}
+
+	void* GetLoadedLibrary(const WSTRING& fileName)
+	{
+		return GetModuleHandleW(fileName.c_str());
+	}
+
+	void* GetExport(void* library, const char* name)
+	{
+		return reinterpret_cast<void*>(::GetProcAddress(static_cast<HMODULE>(library), name));
+	}
+
+	WSTRING GetLastLibraryError()
+	{
+		return WSTR("error ") + ToString(GetLastError());
+	}
+
+#else
+
+	WSTRING GetEnvironmentValue(const WCHAR* name)
+	{
+		auto value = getenv(ToUtf8(name).c_str());
+		return value == nullptr ? WSTRING() : FromUtf8(value);
+	}
+
+	WSTRING GetProfilerFolder()
+	{
+		Dl_info info;
+		if (!dladdr(reinterpret_cast<void*>(&GetProfilerFolder), &info) || info.dli_fname == nullptr)
+			return WSTRING();
+		auto path = FromUtf8(info.dli_fname);
+		return path.substr(0, path.size() - GetFileName(path).size() - 1);
+	}
+
+	WSTRING GetExecutablePath()
+	{
+		char path[1024];
+		auto len = readlink("/proc/self/exe", path, sizeof(path));
+		return len > 0 ? FromUtf8(string(path, len)) : WSTRING();
+	}
+
+	// Arguments are separated by zeros in /proc, they are joined with spaces the way Windows passes the command line
+	WSTRING GetProcessCommandLine()
+	{
+		auto file = fopen("/proc/self/cmdline", "rb");
+		if (file == nullptr)
+			return WSTRING();
+		string commandLine;
+		int c;
+		while ((c = fgetc(file)) != EOF)
+			commandLine += c == 0 ? ' ' : static_cast<char>(c);
+		fclose(file);
+		if (!commandLine.empty() && commandLine.back() == ' ')
+			commandLine.pop_back();
+		return FromUtf8(commandLine);
+	}
+
+	void WriteDebugOutput(const WSTRING& str)
+	{
+		static const bool enabled = GetEnvironmentValue(WSTR("GROBOTRACE_LOG")) == WSTR("1");
+		if (enabled)
+			fprintf(stderr, "%s\n", ToUtf8(str).c_str());
+	}
+
+	DWORD GetProcessId()
+	{
+		return static_cast<DWORD>(getpid());
+	}
+
+	DWORD GetThreadId()
+	{
+		return static_cast<DWORD>(syscall(SYS_gettid));
+	}
+
+	UINT64 GetTimestamp()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<UINT64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+
+	UINT64 GetTimestampFrequency()
+	{
+		return 1000000000;
+	}
+
+	UINT64 GetThreadCpuTime()
+	{
+		timespec ts;
+		if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+			return 0;
+		return static_cast<UINT64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+
+	BYTE* ReserveMemory(size_t size)
+	{
+		auto address = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		return address == MAP_FAILED ? nullptr : static_cast<BYTE*>(address);
+	}
+
+	bool CommitMemory(BYTE* address, size_t size)
+	{
+		return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+	}
+
+	void ReleaseMemory(BYTE* address, size_t size)
+	{
+		munmap(address, size);
+	}
+
+	void* LoadNativeLibrary(const WSTRING& fileName)
+	{
+		return dlopen(ToUtf8(fileName).c_str(), RTLD_NOW);
+	}
+
+	struct LoadedLibrarySearch
+	{
+		string fileName;
+		string path;
+	};
+
+	static int FindLoadedLibrary(dl_phdr_info* info, size_t size, void* data)
+	{
+		auto search = static_cast<LoadedLibrarySearch*>(data);
+		if (info->dlpi_name == nullptr)
+			return 0;
+		string path = info->dlpi_name;
+		auto separator = path.rfind('/');
+		if (path.compare(separator == string::npos ? 0 : separator + 1, string::npos, search->fileName) != 0)
+			return 0;
+		search->path = path;
+		return 1;
+	}
+
+	// dlopen with a bare name searches the library paths, the library is matched by the path it was loaded from instead
+	void* GetLoadedLibrary(const WSTRING& fileName)
+	{
+		LoadedLibrarySearch search = { ToUtf8(fileName), string() };
+		if (dl_iterate_phdr(FindLoadedLibrary, &search) == 0)
+			return nullptr;
+		return dlopen(search.path.c_str(), RTLD_NOW | RTLD_NOLOAD);
+	}
+
+	void* GetExport(void* library, const char* name)
+	{
+		return library == nullptr ? nullptr : dlsym(library, name);
+	}
+
+	WSTRING GetLastLibraryError()
+	{
+		auto error = dlerror();
+		return error == nullptr ? WSTRING() : FromUtf8(error);
+	}
+
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+
+using namespace std;
+
+// Strings of the profiling API: WCHAR is wchar_t on Windows and char16_t with the CoreCLR PAL
+typedef basic_string<WCHAR> WSTRING;
+
+#ifdef WIN32
+#define WSTR(str) L##str
+#define PATH_SEPARATOR WSTR("\\")
+#else
+#define WSTR(str) u##str
+#define PATH_SEPARATOR WSTR("/")
+#endif
+
+// The few OS services the profiler needs. The PAL headers declare most of Win32 API, but profilers are not linked
+// against the PAL, so on Linux only the types and COM definitions from there may be used, everything else goes through here
+namespace Platform
+{
+	WSTRING GetEnvironmentValue(const WCHAR* name);
+	// Folder of ClrProfiler.dll or libClrProfiler.so, without the trailing separator
+	WSTRING GetProfilerFolder();
+	WSTRING GetExecutablePath();
+	WSTRING GetProcessCommandLine();
+	WSTRING CombinePath(const WSTRING& folder, const WSTRING& fileName);
+	// Both separators are accepted, settings may come from another platform
+	WSTRING GetFileName(const WSTRING& path);
+
+	string ToUtf8(const WCHAR* str);
+	string ToUtf8(const WSTRING& str);
+	WSTRING FromUtf8(const string& str);
+	WSTRING ToString(INT64 value);
+	// Leading digits only, like _wtoi. 0 when there are none or they are out of the range of int
+	int ParseInt(const WSTRING& str);
+	bool Equals(const WCHAR* x, const WCHAR* y);
+	// Folds ASCII letters only, enough for setting values
+	bool EqualsIgnoreCase(const WCHAR* x, const WCHAR* y);
+
+	// Text files are UTF-8, a BOM is skipped and line endings of both platforms are accepted
+	bool ReadLines(const WSTRING& fileName, vector<WSTRING>& lines);
+	bool WriteTextFile(const WSTRING& fileName, const string& text);
+	FILE* OpenFile(const WSTRING& fileName, const char* mode);
+	// Replaces an existing target
+	bool RenameFile(const WSTRING& fileName, const WSTRING& newFileName);
+
+	// Debugger output on Windows, stderr on Linux when GROBOTRACE_LOG is enabled
+	void WriteDebugOutput(const WSTRING& str);
+
+	DWORD GetProcessId();
+	DWORD GetThreadId();
+	// Monotonic, QueryPerformanceCounter ticks on Windows and CLOCK_MONOTONIC nanoseconds on Linux
+	UINT64 GetTimestamp();
+	UINT64 GetTimestampFrequency();
+	// User and kernel time of the calling thread in nanoseconds, GetThreadTimes on Windows only advances with scheduler ticks
+	UINT64 GetThreadCpuTime();
+
+	// Memory the runtime may take ownership of, like the IL map of ICorProfilerInfo::SetILInstrumentedCodeMap:
+	// CoTaskMemAlloc on Windows and malloc on Linux, where the runtime's CoTaskMemFree is free. Has the calling convention
+	// of callbacks, GroboTrace.Core calls it through a function pointer
+	void* STDMETHODCALLTYPE AllocateTaskMemory(size_t size);
+	void FreeTaskMemory(void* memory);
+
+	// Address space is reserved without backing memory, pages are committed on demand
+	BYTE* ReserveMemory(size_t size);
+	bool CommitMemory(BYTE* address, size_t size);
+	void ReleaseMemory(BYTE* address, size_t size);
+
+	void* LoadNativeLibrary(const WSTRING& fileName);
+	// Library already mapped into the process, found by its file name; nothing is loaded when it is not there
+	void* GetLoadedLibrary(const WSTRING& fileName);
+	void* GetExport(void* library, const char* name);
+	WSTRING GetLastLibraryError();
+}
\ No newline at end of file
@@ -0,0 +1,152 @@
+#include "ReJitQueue.h"
+#include <algorithm>
+#include <chrono>
+
+void Log(WSTRING str);
+void LogFormat(const WCHAR* format, INT64 argument0, INT64 argument1);
+void DebugOutputFormat(const WCHAR* format, INT64 argument0, INT64 argument1);
+
+ReJitQueue::ReJitQueue(ICorProfilerInfo4* corProfilerInfo, int intervalMilliseconds)
+	: corProfilerInfo(corProfilerInfo), intervalMilliseconds(intervalMilliseconds), stopping(false)
+{
+}
+
+ReJitQueue::~ReJitQueue()
+{
+	Stop();
+}
+
+void ReJitQueue::Add(ModuleID moduleId, mdMethodDef methodDef)
+{
+	if (stopping)
+		return;
+	lock_guard<mutex> guard(pendingLock);
+	pending.emplace_back(moduleId, methodDef);
+}
+
+void ReJitQueue::Start()
+{
+	flusher = thread(&ReJitQueue::FlushThread, this);
+}
+
+void ReJitQueue::Stop()
+{
+	stopping = true;
+	if (flusher.joinable())
+		flusher.join();
+}
+
+int ReJitQueue::Flush()
+{
+	vector<pair<ModuleID, mdMethodDef>> batch;
+	{
+		lock_guard<mutex> guard(pendingLock);
+		batch.swap(pending);
+	}
+	if (batch.empty())
+		return 0;
+	// A method may be queued again before its first ReJIT is requested
+	sort(batch.begin(), batch.end());
+	batch.erase(unique(batch.begin(), batch.end()), batch.end());
+
+	lock_guard<mutex> guard(requestLock);
+	vector<ModuleID> moduleIds;
+	vector<mdMethodDef> methodDefs;
+	for (const auto& method : batch)
+	{
+		auto it = requested.find(method.first);
+		if (it != requested.end() && it->second.count(method.second) != 0)
+			continue;
+		moduleIds.push_back(method.first);
+		methodDefs.push_back(method.second);
+	}
+	if (moduleIds.empty())
+		return 0;
+
+	// Methods are remembered as requested only once RequestReJIT succeeds, so that RevertAll counts only them.
+	// A failed batch is retried method by method, one bad method must not keep the rest of the batch uninstrumented
+	int count = 0;
+	if (SUCCEEDED(corProfilerInfo->RequestReJIT(static_cast<ULONG>(moduleIds.size()), moduleIds.data(), methodDefs.data())))
+	{
+		for (size_t i = 0; i < moduleIds.size(); ++i)
+			requested[moduleIds[i]].insert(methodDefs[i]);
+		count = static_cast<int>(moduleIds.size());
+	}
+	else
+	{
+		for (size_t i = 0; i < moduleIds.size(); ++i)
+		{
+			if (FAILED(corProfilerInfo->RequestReJIT(1, &moduleIds[i], &methodDefs[i])))
+				continue;
+			requested[moduleIds[i]].insert(methodDefs[i]);
+			++count;
+		}
+		LogFormat(WSTR("RequestReJIT failed for {0} of {1} methods"), moduleIds.size() - count, moduleIds.size());
+	}
+	DebugOutputFormat(WSTR("ReJIT is requested for {0} methods"), count, 0);
+	return count;
+}
+
+void ReJitQueue::ModuleUnloaded(ModuleID moduleId)
+{
+	{
+		lock_guard<mutex> guard(pendingLock);
+		for (size_t i = 0; i < pending.size();)
+		{
+			if (pending[i].first != moduleId)
+				++i;
+			else
+			{
+				pending[i] = pending.back();
+				pending.pop_back();
+			}
+		}
+	}
+	lock_guard<mutex> guard(requestLock);
+	requested.erase(moduleId);
+}
+
+int ReJitQueue::RevertAll()
+{
+	Stop();
+
+	lock_guard<mutex> guard(requestLock);
+	vector<ModuleID> moduleIds;
+	vector<mdMethodDef> methodDefs;
+	for (const auto& module : requested)
+	{
+		for (auto methodDef : module.second)
+		{
+			moduleIds.push_back(module.first);
+			methodDefs.push_back(methodDef);
+		}
+	}
+	requested.clear();
+	if (moduleIds.empty())
+		return 0;
+
+	// Failures of single methods come back in statuses, they keep running the instrumented code with probes disabled
+	vector<HRESULT> statuses(moduleIds.size());
+	if (FAILED(corProfilerInfo->RequestRevert(static_cast<ULONG>(moduleIds.size()), moduleIds.data(), methodDefs.data(), statuses.data())))
+	{
+		Log(WSTR("RequestRevert failed"));
+		return 0;
+	}
+	int reverted = 0;
+	for (auto status : statuses)
+	{
+		if (SUCCEEDED(status))
+			++reverted;
+	}
+	LogFormat(WSTR("{0} of {1} methods are reverted"), reverted, moduleIds.size());
+	return reverted;
+}
+
+void ReJitQueue::FlushThread()
+{
+	while (!stopping)
+	{
+		Flush();
+		this_thread::sleep_for(chrono::milliseconds(intervalMilliseconds));
+	}
+}
\ No newline at end of file
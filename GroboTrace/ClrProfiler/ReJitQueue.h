@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "Platform.h"
+
+using namespace std;
+
+// Methods instrumented through ReJIT when the profiler is attached to a running process. Code compiled before the attach
+// can be changed only this way, and unlike SetILFunctionBody a ReJIT-ed method gets its original code back on detach.
+// RequestReJIT must not be called from JIT callbacks, so methods are queued there and requested in batches by a background thread
+class ReJitQueue
+{
+public:
+	ReJitQueue(ICorProfilerInfo4* corProfilerInfo, int intervalMilliseconds);
+	~ReJitQueue();
+
+	void Add(ModuleID moduleId, mdMethodDef methodDef);
+	// Starts the thread, the first batch is requested right away
+	void Start();
+	// Later methods are ignored
+	void Stop();
+	// Methods already requested are skipped, returns the number of requested ones
+	int Flush();
+	// ModuleID values are reused by the runtime
+	void ModuleUnloaded(ModuleID moduleId);
+	// Stops the thread and restores the original code of all requested methods, returns the number of reverted ones
+	int RevertAll();
+
+private:
+	void FlushThread();
+
+	ICorProfilerInfo4* corProfilerInfo;
+	int intervalMilliseconds;
+
+	mutex pendingLock;
+	vector<pair<ModuleID, mdMethodDef>> pending;
+
+	// Also serializes RequestReJIT and RequestRevert
+	mutex requestLock;
+	unordered_map<ModuleID, unordered_set<mdMethodDef>> requested;
+
+	atomic<bool> stopping;
+	thread flusher;
+};
\ No newline at end of file
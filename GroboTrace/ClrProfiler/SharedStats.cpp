@@ -0,0 +1,116 @@
+#include "SharedStats.h"
+#include <atomic>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+void Log(WSTRING str);
+
+static const size_t pageSize = 4096;
+
+static size_t RoundUp(size_t value)
+{
+	return (value + pageSize - 1) & ~(pageSize - 1);
+}
+
+SharedStats::SharedStats(size_t statsCapacity, size_t symbolsSize)
+	: segment(nullptr)
+{
+	auto statsOffset = RoundUp(sizeof(SharedStatsFormat::SegmentHeader));
+	auto symbolsOffset = statsOffset + RoundUp(statsCapacity);
+	segmentSize = symbolsOffset + RoundUp(symbolsSize);
+	auto pid = Platform::GetProcessId();
+
+#ifdef WIN32
+	WCHAR mappingName[64];
+	wsprintf(mappingName, WSTR("Local\\GroboTrace-%u"), pid);
+	mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<UINT64>(segmentSize) >> 32), static_cast<DWORD>(segmentSize), mappingName);
+	if (mapping == nullptr)
+	{
+		Log(WSTR("Failed to create shared stats mapping"));
+		return;
+	}
+	segment = static_cast<BYTE*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, segmentSize));
+#else
+	// Pages of a shm object are allocated on the first touch, unused capacity costs nothing.
+	// Only the owner can read the segment. A segment left by a crashed process that had the same pid is removed,
+	// and an existing object is never reused, as someone else could have created it in advance
+	name = "/grobotrace-" + to_string(pid);
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0 && errno == EEXIST)
+	{
+		shm_unlink(name.c_str());
+		fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	}
+	if (fd < 0)
+	{
+		Log(WSTR("Failed to create shared stats segment"));
+		return;
+	}
+	if (ftruncate(fd, segmentSize) == 0)
+	{
+		auto address = mmap(nullptr, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (address != MAP_FAILED)
+			segment = static_cast<BYTE*>(address);
+	}
+	close(fd);
+	if (segment == nullptr)
+		shm_unlink(name.c_str());
+#endif
+	if (segment == nullptr)
+	{
+		Log(WSTR("Failed to map shared stats segment"));
+		return;
+	}
+
+	auto header = reinterpret_cast<SharedStatsFormat::SegmentHeader*>(segment);
+	header->pid = pid;
+	header->statsOffset = statsOffset;
+	header->statsCapacity = RoundUp(statsCapacity);
+	header->symbolsOffset = symbolsOffset;
+	header->symbolsSize = RoundUp(symbolsSize);
+	header->version = SharedStatsFormat::segmentVersion;
+	atomic_thread_fence(memory_order_seq_cst);
+	// Magic goes last, readers do not look at a half initialized header
+	header->magic = SharedStatsFormat::segmentMagic;
+}
+
+SharedStats::~SharedStats()
+{
+#ifdef WIN32
+	if (segment != nullptr)
+		UnmapViewOfFile(segment);
+	if (mapping != nullptr)
+		CloseHandle(mapping);
+#else
+	if (segment != nullptr)
+	{
+		munmap(segment, segmentSize);
+		shm_unlink(name.c_str());
+	}
+#endif
+}
+
+BYTE* SharedStats::GetStatsArea() const
+{
+	return segment + reinterpret_cast<SharedStatsFormat::SegmentHeader*>(segment)->statsOffset;
+}
+
+size_t SharedStats::GetStatsCapacity() const
+{
+	return static_cast<size_t>(reinterpret_cast<SharedStatsFormat::SegmentHeader*>(segment)->statsCapacity);
+}
+
+BYTE* SharedStats::GetSymbolsArea() const
+{
+	return segment + reinterpret_cast<SharedStatsFormat::SegmentHeader*>(segment)->symbolsOffset;
+}
+
+size_t SharedStats::GetSymbolsSize() const
+{
+	return static_cast<size_t>(reinterpret_cast<SharedStatsFormat::SegmentHeader*>(segment)->symbolsSize);
+}
\ No newline at end of file
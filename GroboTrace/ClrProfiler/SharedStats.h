@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include "Platform.h"
+#include "SharedStatsFormat.h"
+
+using namespace std;
+
+// Shared memory segment with live stats for out-of-process readers, see SharedStatsFormat.h for the layout.
+// The stats area is filled by GroboTrace.Core, the symbols area belongs to SymbolTable
+class SharedStats
+{
+public:
+	SharedStats(size_t statsCapacity, size_t symbolsSize);
+	~SharedStats();
+
+	bool IsValid() const { return segment != nullptr; }
+
+	BYTE* GetStatsArea() const;
+	size_t GetStatsCapacity() const;
+	BYTE* GetSymbolsArea() const;
+	size_t GetSymbolsSize() const;
+
+private:
+	BYTE* segment;
+	size_t segmentSize;
+#ifdef WIN32
+	HANDLE mapping;
+#else
+	string name;
+#endif
+};
\ No newline at end of file
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+
+// Layout of the shared memory segment published by the profiler (/dev/shm/grobotrace-<pid> on Linux,
+// Local\GroboTrace-<pid> mapping on Windows). Only fixed size types and offsets are used, so that readers
+// do not need the runtime headers. Readers must check magic and version first
+namespace SharedStatsFormat
+{
+	const uint32_t segmentMagic = 0x53535447; // 'GTSS'
+	const uint32_t segmentVersion = 1;
+	const uint32_t symbolsMagic = 0x4D595347; // 'GSYM'
+	const uint32_t symbolsVersion = 1;
+	const int slotBits = 24;
+
+	struct SegmentHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t pid;
+		uint32_t reserved;
+		uint64_t statsOffset;
+		uint64_t statsCapacity;
+		uint64_t symbolsOffset;
+		uint64_t symbolsSize;
+	};
+
+	// Stats area is rewritten as a whole under a seqlock: sequence is odd while the writer is inside.
+	// Readers copy the area and retry if the sequence was odd or changed
+	struct StatsHeader
+	{
+		volatile int64_t sequence;
+		int64_t timestampMilliseconds; // Unix time of the last update
+		double ticksPerMillisecond;
+		int32_t methodsCount;
+		int32_t threadsCount;
+		int32_t nodesCount;
+		int32_t truncated;
+	};
+
+	// Per method totals over all threads, followed by threads and their call tree nodes
+	struct MethodRecord
+	{
+		int32_t methodId;
+		int32_t reserved;
+		int64_t calls;
+		int64_t ticks;
+		int64_t p50;
+		int64_t p99;
+		int64_t p999;
+		int64_t max;
+	};
+
+	struct ThreadRecord
+	{
+		int32_t managedThreadId;
+		int32_t firstNode;
+		int32_t nodesCount;
+		int32_t reserved;
+	};
+
+	// Nodes of a thread go in preorder, node 0 is the root, parent indexes are relative to the thread's first node
+	struct NodeRecord
+	{
+		int32_t methodId;
+		int32_t parentIndex;
+		int64_t calls;
+		int64_t ticks;
+	};
+
+	// Symbol table region: header, index by method slot, then UTF-8 strings
+	struct SymbolsHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t maxEntries;
+		volatile uint32_t entriesCount;
+		uint32_t stringsOffset;
+		volatile uint32_t stringsSize;
+	};
+
+	// Offsets are relative to the start of the strings area, zero means no string
+	struct SymbolEntry
+	{
+		volatile int32_t methodId;
+		uint32_t assemblyName;
+		uint32_t typeName;
+		uint32_t methodName;
+	};
+
+	inline const SymbolEntry* FindSymbol(const void* symbols, int32_t methodId)
+	{
+		auto header = static_cast<const SymbolsHeader*>(symbols);
+		uint32_t slot = (methodId & ((1 << slotBits) - 1)) - 1;
+		if (methodId <= 0 || slot >= header->entriesCount)
+			return nullptr;
+		auto entry = reinterpret_cast<const SymbolEntry*>(header + 1) + slot;
+		return entry->methodId == methodId ? entry : nullptr;
+	}
+
+	inline const char* GetSymbolString(const void* symbols, uint32_t offset)
+	{
+		auto header = static_cast<const SymbolsHeader*>(symbols);
+		return static_cast<const char*>(symbols) + header->stringsOffset + offset;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,39 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+
+namespace SmokeTest
+{
+    // Loaded with libClrProfiler.so by RunSmokeTest.cmake, exercises enough JIT compilations to go through the profiler callbacks
+    public static class Program
+    {
+        public static int Main()
+        {
+            var total = 0L;
+            for(var i = 0; i < 20; ++i)
+                total += Fibonacci(i);
+            var words = new List<string> {"alpha", "beta", "gamma"};
+            var lengths = words.Select(word => word.Length).Sum();
+            try
+            {
+                Throw();
+            }
+            catch(InvalidOperationException)
+            {
+                total += lengths;
+            }
+            Console.WriteLine($"SmokeTest finished: {total}");
+            return 0;
+        }
+
+        private static long Fibonacci(int n)
+        {
+            return n < 2 ? n : Fibonacci(n - 1) + Fibonacci(n - 2);
+        }
+
+        private static void Throw()
+        {
+            throw new InvalidOperationException();
+        }
+    }
+}
\ No newline at end of file
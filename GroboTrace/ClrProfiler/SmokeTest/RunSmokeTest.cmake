@@ -0,0 +1,52 @@
+# Builds SmokeTest and runs it under libClrProfiler.so, invoked by ctest:
+#   cmake -DDOTNET=<dotnet> -DPROFILER=<libClrProfiler.so> -DSOURCE=<SmokeTest folder> -DOUTPUT=<folder> -P RunSmokeTest.cmake
+# Passes when the runtime loads the profiler, the profiler instruments the process and writes its JIT cost report on shutdown
+
+foreach(variable DOTNET PROFILER SOURCE OUTPUT)
+    if(NOT DEFINED ${variable})
+        message(FATAL_ERROR "${variable} is not set")
+    endif()
+endforeach()
+
+# Built out of the source tree, obj/ stays next to the copied project
+file(COPY "${SOURCE}/SmokeTest.csproj" "${SOURCE}/Program.cs" DESTINATION "${OUTPUT}/src")
+execute_process(
+    COMMAND "${DOTNET}" build "${OUTPUT}/src/SmokeTest.csproj" -c Release -o "${OUTPUT}/bin" --nologo
+    RESULT_VARIABLE result
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE output)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Failed to build SmokeTest:\n${output}")
+endif()
+
+# GroboTrace.ini and reports live next to the profiler
+get_filename_component(profilerFolder "${PROFILER}" DIRECTORY)
+file(WRITE "${profilerFolder}/GroboTrace.ini" "dotnet SmokeTest.dll\n")
+file(REMOVE "${profilerFolder}/GroboTrace.JitCost.txt")
+
+set(ENV{CORECLR_ENABLE_PROFILING} 1)
+set(ENV{CORECLR_PROFILER} "{1bde2824-ad74-46f0-95a4-d7e7dab3b6b6}")
+set(ENV{CORECLR_PROFILER_PATH} "${PROFILER}")
+set(ENV{GROBOTRACE_LOG} 1)
+set(ENV{GROBOTRACE_JIT_COST} 1)
+
+execute_process(
+    COMMAND "${DOTNET}" "${OUTPUT}/bin/SmokeTest.dll"
+    WORKING_DIRECTORY "${OUTPUT}/bin"
+    RESULT_VARIABLE result
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE log)
+message("${output}${log}")
+
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "SmokeTest exited with ${result}")
+endif()
+foreach(expected "SmokeTest finished" "grobotrace: Profiler successfully initialized" "grobotrace: will profile" "grobotrace: JIT cost report is written")
+    string(FIND "${output}${log}" "${expected}" position)
+    if(position EQUAL -1)
+        message(FATAL_ERROR "'${expected}' is not found in the output")
+    endif()
+endforeach()
+if(NOT EXISTS "${profilerFolder}/GroboTrace.JitCost.txt")
+    message(FATAL_ERROR "JIT cost report is not written")
+endif()
\ No newline at end of file
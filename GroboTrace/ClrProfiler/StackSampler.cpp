@@ -0,0 +1,237 @@
+#include "StackSampler.h"
+#include <chrono>
+#include <system_error>
+
+void Log(WSTRING str);
+
+StackSampler::StackSampler(ICorProfilerInfo10* corProfilerInfo, DWORD intervalMilliseconds)
+	: corProfilerInfo(corProfilerInfo), intervalMilliseconds(intervalMilliseconds), stopping(false), stacks(maxThreads)
+{
+}
+
+StackSampler::~StackSampler()
+{
+	Stop();
+}
+
+void StackSampler::Start()
+{
+	try
+	{
+		samplerThread = thread(&StackSampler::Run, this);
+	}
+	catch (const system_error&)
+	{
+		Log(WSTR("Failed to start stack sampler thread"));
+	}
+}
+
+void StackSampler::Stop()
+{
+	if (!samplerThread.joinable())
+		return;
+	stopping = true;
+	samplerThread.join();
+}
+
+void StackSampler::Run()
+{
+	while (!stopping)
+	{
+		this_thread::sleep_for(chrono::milliseconds(intervalMilliseconds));
+		if (!stopping)
+			TakeSamples();
+	}
+}
+
+HRESULT STDMETHODCALLTYPE StackSampler::StackSnapshotCallback(FunctionID functionId, UINT_PTR ip, COR_PRF_FRAME_INFO frameInfo, ULONG32 contextSize, BYTE context[], void* clientData)
+{
+	auto stack = static_cast<ThreadStack*>(clientData);
+	// Zero is passed for unmanaged frames
+	if (functionId == 0)
+		return S_OK;
+	if (stack->depth == maxDepth)
+		return S_FALSE;
+	stack->frames[stack->depth++] = functionId;
+	return S_OK;
+}
+
+void StackSampler::TakeSamples()
+{
+	if (FAILED(corProfilerInfo->SuspendRuntime()))
+		return;
+
+	int threadsCount = 0;
+	ICorProfilerThreadEnum* threadEnum = nullptr;
+	if (SUCCEEDED(corProfilerInfo->EnumThreads(&threadEnum)))
+	{
+		ThreadID threadId;
+		ULONG fetched;
+		while (threadsCount < maxThreads && threadEnum->Next(1, &threadId, &fetched) == S_OK)
+		{
+			auto& stack = stacks[threadsCount];
+			stack.threadId = threadId;
+			stack.depth = 0;
+			corProfilerInfo->DoStackSnapshot(threadId, StackSnapshotCallback, COR_PRF_SNAPSHOT_DEFAULT, &stack, nullptr, 0);
+			++threadsCount;
+		}
+		threadEnum->Release();
+	}
+
+	corProfilerInfo->ResumeRuntime();
+
+	// Trees are updated only after the runtime is resumed
+	lock_guard<mutex> lock(treesMutex);
+	for (int i = 0; i < threadsCount; ++i)
+	{
+		const auto& stack = stacks[i];
+		// Frames go from the leaf, a truncated stack is attached to the root by its outermost kept frame
+		if (stack.depth == 0)
+			continue;
+		auto& tree = trees[stack.threadId];
+		if (tree.nodes.empty())
+			InitTree(tree.nodes);
+		int node = 0;
+		++tree.nodes[0].samples;
+		for (int j = stack.depth - 1; j >= 0; --j)
+		{
+			node = FindOrAddChild(tree.nodes, node, stack.frames[j]);
+			++tree.nodes[node].samples;
+		}
+	}
+}
+
+void StackSampler::InitTree(vector<TreeNode>& nodes)
+{
+	nodes.clear();
+	nodes.push_back(TreeNode { 0, 0, -1, -1 });
+}
+
+int StackSampler::FindOrAddChild(vector<TreeNode>& nodes, int parent, FunctionID functionId)
+{
+	for (int child = nodes[parent].firstChild; child >= 0; child = nodes[child].nextSibling)
+		if (nodes[child].functionId == functionId)
+			return child;
+	int child = static_cast<int>(nodes.size());
+	nodes.push_back(TreeNode { functionId, 0, -1, nodes[parent].firstChild });
+	nodes[parent].firstChild = child;
+	return child;
+}
+
+void StackSampler::MergeTree(vector<TreeNode>& target, int targetNode, const vector<TreeNode>& source, int sourceNode)
+{
+	target[targetNode].samples += source[sourceNode].samples;
+	for (int child = source[sourceNode].firstChild; child >= 0; child = source[child].nextSibling)
+		MergeTree(target, FindOrAddChild(target, targetNode, source[child].functionId), source, child);
+}
+
+const StackSampler::FunctionInfo& StackSampler::ResolveFunction(FunctionID functionId)
+{
+	auto it = functions.find(functionId);
+	if (it != functions.end())
+		return it->second;
+
+	FunctionInfo info = { 0, 0, nullptr };
+	ClassID classId;
+	if (SUCCEEDED(corProfilerInfo->GetFunctionInfo(functionId, &classId, &info.moduleId, &info.methodToken)))
+	{
+		auto moduleIt = modules.find(info.moduleId);
+		if (moduleIt == modules.end())
+		{
+			WCHAR moduleNameBuffer[1024];
+			ULONG actualModuleNameSize;
+			WCHAR assemblyNameBuffer[1024];
+			ULONG actualAssemblyNameSize;
+			AssemblyID assemblyId;
+			ModuleNames names;
+			if (SUCCEEDED(corProfilerInfo->GetModuleInfo(info.moduleId, 0, 1024, &actualModuleNameSize, moduleNameBuffer, &assemblyId))
+				&& SUCCEEDED(corProfilerInfo->GetAssemblyInfo(assemblyId, 1024, &actualAssemblyNameSize, assemblyNameBuffer, 0, 0)))
+			{
+				names.assemblyName = assemblyNameBuffer;
+				names.modulePath = moduleNameBuffer;
+			}
+			moduleIt = modules.emplace(info.moduleId, names).first;
+		}
+		info.moduleNames = &moduleIt->second;
+	}
+	return functions.emplace(functionId, info).first->second;
+}
+
+int StackSampler::CopyTree(ThreadID threadId, SampledNode* buffer, int capacity)
+{
+	lock_guard<mutex> lock(treesMutex);
+
+	vector<TreeNode> merged;
+	const vector<TreeNode>* tree = &merged;
+	if (threadId == 0)
+	{
+		InitTree(merged);
+		for (const auto& entry : trees)
+			if (!entry.second.nodes.empty())
+				MergeTree(merged, 0, entry.second.nodes, 0);
+	}
+	else
+	{
+		auto it = trees.find(threadId);
+		if (it == trees.end() || it->second.nodes.empty())
+			InitTree(merged);
+		else
+			tree = &it->second.nodes;
+	}
+
+	int count = 0;
+	vector<pair<int, int>> stack;
+	stack.push_back(make_pair(0, -1));
+	while (!stack.empty())
+	{
+		auto node = stack.back().first;
+		auto parentIndex = stack.back().second;
+		stack.pop_back();
+		const auto& treeNode = (*tree)[node];
+		if (count < capacity)
+		{
+			auto& result = buffer[count];
+			result.parentIndex = parentIndex;
+			result.samples = treeNode.samples;
+			result.moduleId = 0;
+			result.methodToken = 0;
+			result.assemblyName = nullptr;
+			result.modulePath = nullptr;
+			if (treeNode.functionId != 0)
+			{
+				const auto& info = ResolveFunction(treeNode.functionId);
+				if (info.moduleNames != nullptr)
+				{
+					result.moduleId = info.moduleId;
+					result.methodToken = info.methodToken;
+					result.assemblyName = info.moduleNames->assemblyName.c_str();
+					result.modulePath = info.moduleNames->modulePath.c_str();
+				}
+			}
+		}
+		for (int child = treeNode.firstChild; child >= 0; child = (*tree)[child].nextSibling)
+			stack.push_back(make_pair(child, count));
+		++count;
+	}
+
+	return count;
+}
+
+void StackSampler::ClearTree(ThreadID threadId)
+{
+	lock_guard<mutex> lock(treesMutex);
+	if (threadId == 0)
+		trees.clear();
+	else
+	{
+		auto it = trees.find(threadId);
+		if (it != trees.end())
+			InitTree(it->second.nodes);
+	}
+}
+
+void StackSampler::RemoveTree(ThreadID threadId)
+{
+	lock_guard<mutex> lock(treesMutex);
+	trees.erase(threadId);
+}
\ No newline at end of file
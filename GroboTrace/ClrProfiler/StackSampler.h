@@ -0,0 +1,100 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include "Platform.h"
+
+using namespace std;
+
+// Node of a sampled call tree as it is passed to GroboTrace.Core, nodes go in preorder and node 0 is the root
+struct SampledNode
+{
+	int parentIndex;
+	int samples;
+	ModuleID moduleId;
+	mdToken methodToken;
+	const WCHAR* assemblyName;
+	const WCHAR* modulePath;
+};
+
+// Zero-rewrite engine: periodically suspends the runtime, walks stacks of all managed threads
+// and aggregates them into per-thread call trees
+class StackSampler
+{
+public:
+	StackSampler(ICorProfilerInfo10* corProfilerInfo, DWORD intervalMilliseconds);
+	~StackSampler();
+
+	void Start();
+	void Stop();
+
+	// threadId = 0 means trees of all threads merged together.
+	// Returns total number of nodes, only the first capacity nodes are copied
+	int CopyTree(ThreadID threadId, SampledNode* buffer, int capacity);
+	void ClearTree(ThreadID threadId);
+	// Trees stay while their threads live, including the rounds a thread is not sampled in
+	void RemoveTree(ThreadID threadId);
+
+private:
+	static const int maxThreads = 1024;
+	static const int maxDepth = 512;
+
+	struct TreeNode
+	{
+		FunctionID functionId;
+		int samples;
+		int firstChild;
+		int nextSibling;
+	};
+
+	struct ThreadTree
+	{
+		vector<TreeNode> nodes;
+	};
+
+	// Innermost maxDepth frames of a deeper stack are kept
+	struct ThreadStack
+	{
+		ThreadID threadId;
+		int depth;
+		FunctionID frames[maxDepth];
+	};
+
+	struct ModuleNames
+	{
+		WSTRING assemblyName;
+		WSTRING modulePath;
+	};
+
+	struct FunctionInfo
+	{
+		ModuleID moduleId;
+		mdToken methodToken;
+		const ModuleNames* moduleNames;
+	};
+
+	static HRESULT STDMETHODCALLTYPE StackSnapshotCallback(FunctionID functionId, UINT_PTR ip, COR_PRF_FRAME_INFO frameInfo, ULONG32 contextSize, BYTE context[], void* clientData);
+
+	void Run();
+	void TakeSamples();
+	static void InitTree(vector<TreeNode>& nodes);
+	static int FindOrAddChild(vector<TreeNode>& nodes, int parent, FunctionID functionId);
+	static void MergeTree(vector<TreeNode>& target, int targetNode, const vector<TreeNode>& source, int sourceNode);
+	const FunctionInfo& ResolveFunction(FunctionID functionId);
+
+	ICorProfilerInfo10* corProfilerInfo;
+	DWORD intervalMilliseconds;
+	thread samplerThread;
+	volatile bool stopping;
+
+	// Preallocated, nothing is allocated while the runtime is suspended
+	vector<ThreadStack> stacks;
+
+	mutex treesMutex;
+	unordered_map<ThreadID, ThreadTree> trees;
+	unordered_map<FunctionID, FunctionInfo> functions;
+	unordered_map<ModuleID, ModuleNames> modules;
+};
\ No newline at end of file
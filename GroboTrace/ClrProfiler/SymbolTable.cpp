@@ -0,0 +1,149 @@
+#include "SymbolTable.h"
+#include <atomic>
+#include <cstring>
+
+void Log(WSTRING str);
+
+static const size_t pageSize = 4096;
+
+static size_t RoundUp(size_t value)
+{
+	return (value + pageSize - 1) & ~(pageSize - 1);
+}
+
+size_t SymbolTable::GetRegionSize(UINT32 maxEntries, UINT32 maxStringsSize)
+{
+	return RoundUp(sizeof(Header) + static_cast<size_t>(maxEntries) * sizeof(Entry)) + RoundUp(maxStringsSize);
+}
+
+SymbolTable::SymbolTable(UINT32 maxEntries, UINT32 maxStringsSize)
+	: region(nullptr), regionSize(GetRegionSize(maxEntries, maxStringsSize)), ownsRegion(true), committedIndex(0), committedStrings(0), header(nullptr), entries(nullptr), strings(nullptr)
+{
+	// Address space is reserved at once so that pointers into the table stay valid, pages are committed as the table grows
+	region = Platform::ReserveMemory(regionSize);
+	if (region == nullptr || !Platform::CommitMemory(region, pageSize))
+	{
+		Log(WSTR("Failed to reserve memory for symbol table"));
+		region = nullptr;
+		return;
+	}
+	committedIndex = pageSize;
+	InitRegion(maxEntries);
+}
+
+SymbolTable::SymbolTable(BYTE* externalRegion, size_t externalRegionSize)
+	: region(externalRegion), regionSize(externalRegionSize), ownsRegion(false), committedIndex(0), committedStrings(0), header(nullptr), entries(nullptr), strings(nullptr)
+{
+	if (region == nullptr)
+		return;
+	// A quarter of the region goes to the index
+	auto maxEntries = static_cast<UINT32>((regionSize / 4 - sizeof(Header)) / sizeof(Entry));
+	committedIndex = RoundUp(sizeof(Header) + static_cast<size_t>(maxEntries) * sizeof(Entry));
+	committedStrings = regionSize - committedIndex;
+	InitRegion(maxEntries);
+}
+
+SymbolTable::~SymbolTable()
+{
+	if (region != nullptr && ownsRegion)
+		Platform::ReleaseMemory(region, regionSize);
+}
+
+void SymbolTable::InitRegion(UINT32 maxEntries)
+{
+	auto stringsOffset = RoundUp(sizeof(Header) + static_cast<size_t>(maxEntries) * sizeof(Entry));
+	header = reinterpret_cast<Header*>(region);
+	entries = reinterpret_cast<Entry*>(region + sizeof(Header));
+	strings = reinterpret_cast<char*>(region + stringsOffset);
+	header->magic = SharedStatsFormat::symbolsMagic;
+	header->version = SharedStatsFormat::symbolsVersion;
+	header->maxEntries = maxEntries;
+	header->entriesCount = 0;
+	header->stringsOffset = static_cast<UINT32>(stringsOffset);
+	// Offset 0 is the empty string
+	if (!Commit(stringsOffset + 1))
+	{
+		region = nullptr;
+		return;
+	}
+	strings[0] = 0;
+	header->stringsSize = 1;
+}
+
+// Commits pages up to the given offset in the region, the index and the strings grow separately
+bool SymbolTable::Commit(size_t end)
+{
+	size_t stringsOffset = header->stringsOffset;
+	size_t& committed = end > stringsOffset ? committedStrings : committedIndex;
+	size_t start = end > stringsOffset ? stringsOffset : 0;
+	if (end <= start + committed)
+		return true;
+	if (!ownsRegion)
+		return false;
+	auto newCommitted = RoundUp(end - start);
+	if (!Platform::CommitMemory(region + start + committed, newCommitted - committed))
+		return false;
+	committed = newCommitted;
+	return true;
+}
+
+UINT32 SymbolTable::Intern(const WCHAR* str)
+{
+	auto utf8 = Platform::ToUtf8(str);
+	if (utf8.empty())
+		return 0;
+	// With the terminating zero
+	auto len = utf8.size() + 1;
+
+	auto it = interned.find(utf8);
+	if (it != interned.end())
+		return it->second;
+
+	UINT32 offset = header->stringsSize;
+	if (offset + len > regionSize - header->stringsOffset || !Commit(header->stringsOffset + offset + len))
+		return 0;
+	memcpy(strings + offset, utf8.c_str(), len);
+	header->stringsSize = static_cast<UINT32>(offset + len);
+	interned.emplace(utf8, offset);
+	return offset;
+}
+
+void SymbolTable::Add(int methodId, const WCHAR* assemblyName, const WCHAR* typeName, const WCHAR* methodName)
+{
+	if (region == nullptr)
+		return;
+	UINT32 slot = (methodId & ((1 << SharedStatsFormat::slotBits) - 1)) - 1;
+	if (slot >= header->maxEntries)
+		return;
+
+	lock_guard<mutex> lock(tableMutex);
+	if (Commit(sizeof(Header) + (static_cast<size_t>(slot) + 1) * sizeof(Entry)))
+	{
+		auto& entry = entries[slot];
+		// Readers check the id before and after reading the offsets
+		entry.methodId = 0;
+		atomic_thread_fence(memory_order_seq_cst);
+		entry.assemblyName = Intern(assemblyName);
+		entry.typeName = Intern(typeName);
+		entry.methodName = Intern(methodName);
+		atomic_thread_fence(memory_order_seq_cst);
+		entry.methodId = methodId;
+		if (slot >= header->entriesCount)
+			header->entriesCount = slot + 1;
+	}
+}
+
+bool SymbolTable::Get(int methodId, const char** assemblyName, const char** typeName, const char** methodName) const
+{
+	if (region == nullptr)
+		return false;
+	auto entry = SharedStatsFormat::FindSymbol(region, methodId);
+	if (entry == nullptr)
+		return false;
+	atomic_thread_fence(memory_order_seq_cst);
+	*assemblyName = strings + entry->assemblyName;
+	*typeName = strings + entry->typeName;
+	*methodName = strings + entry->methodName;
+	atomic_thread_fence(memory_order_seq_cst);
+	return entry->methodId == methodId;
+}
\ No newline at end of file
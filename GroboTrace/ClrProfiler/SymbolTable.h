@@ -0,0 +1,50 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "Platform.h"
+#include "SharedStatsFormat.h"
+
+using namespace std;
+
+// Names of instrumented methods captured once from the metadata read in JITCompilationStarted.
+// Everything lives in one region addressed by offsets (header, then index by method slot, then UTF-8 strings),
+// so the region can be handed as is to readers in other processes. Strings are interned and never removed
+class SymbolTable
+{
+public:
+	// Reserves its own region, pages are committed as the table grows
+	SymbolTable(UINT32 maxEntries, UINT32 maxStringsSize);
+	// Uses committed memory of the given size, e.g. a part of the shared stats segment
+	SymbolTable(BYTE* externalRegion, size_t externalRegionSize);
+	~SymbolTable();
+
+	bool IsValid() const { return region != nullptr; }
+
+	void Add(int methodId, const WCHAR* assemblyName, const WCHAR* typeName, const WCHAR* methodName);
+	// Lock-free, returns false for unknown methods and stale ids of reused slots
+	bool Get(int methodId, const char** assemblyName, const char** typeName, const char** methodName) const;
+
+	static size_t GetRegionSize(UINT32 maxEntries, UINT32 maxStringsSize);
+
+private:
+	typedef SharedStatsFormat::SymbolsHeader Header;
+	typedef SharedStatsFormat::SymbolEntry Entry;
+
+	void InitRegion(UINT32 maxEntries);
+	UINT32 Intern(const WCHAR* str);
+	bool Commit(size_t end);
+
+	BYTE* region;
+	size_t regionSize;
+	bool ownsRegion;
+	size_t committedIndex;
+	size_t committedStrings;
+	Header* header;
+	Entry* entries;
+	char* strings;
+
+	mutex tableMutex;
+	unordered_map<string, UINT32> interned;
+};
\ No newline at end of file
@@ -0,0 +1,143 @@
+#include "WaitTracker.h"
+#include <cstring>
+
+void Log(WSTRING str);
+
+namespace
+{
+	const UINT64 contentionKeyword = 0x4000;
+	const UINT64 threadingKeyword = 0x10000;
+	const UINT64 threadTransferKeyword = 0x80000000;
+	const UINT64 waitHandleKeyword = 0x40000000000;
+	// Wait handle and thread pool events are verbose
+	const UINT32 verboseLevel = 5;
+
+	struct ThreadState
+	{
+		WaitTracker::Slot* slot;
+		UINT64 lockWaitStarted;
+		UINT64 handleWaitStarted;
+	};
+
+	thread_local ThreadState threadState;
+}
+
+WaitTracker::WaitTracker(ICorProfilerInfo12* corProfilerInfo, bool trackThreadPoolQueue)
+	: corProfilerInfo(corProfilerInfo), trackThreadPoolQueue(trackThreadPoolQueue), session(0), started(false),
+	nanosecondsPerTimestamp(1000000000.0 / Platform::GetTimestampFrequency()), timestampFrequency(Platform::GetTimestampFrequency())
+{
+	if (trackThreadPoolQueue)
+		queuedWorkItems = vector<QueuedWorkItem>(queuedWorkItemsSize);
+}
+
+WaitTracker::~WaitTracker()
+{
+	Stop();
+}
+
+bool WaitTracker::Start()
+{
+	COR_PRF_EVENTPIPE_PROVIDER_CONFIG provider;
+	provider.providerName = WSTR("Microsoft-Windows-DotNETRuntime");
+	provider.keywords = contentionKeyword | waitHandleKeyword | (trackThreadPoolQueue ? threadingKeyword | threadTransferKeyword : 0);
+	provider.loggingLevel = verboseLevel;
+	provider.filterData = nullptr;
+	auto hr = corProfilerInfo->EventPipeStartSession(1, &provider, FALSE, &session);
+	if (FAILED(hr))
+	{
+		Log(WSTR("Failed to start EventPipe session, waits are not tracked"));
+		return false;
+	}
+	started = true;
+	return true;
+}
+
+void WaitTracker::Stop()
+{
+	if (!started)
+		return;
+	started = false;
+	corProfilerInfo->EventPipeStopSession(session);
+}
+
+void WaitTracker::SetCurrentThreadSlot(Slot* slot)
+{
+	threadState.slot = slot;
+	threadState.lockWaitStarted = 0;
+	threadState.handleWaitStarted = 0;
+}
+
+size_t WaitTracker::Hash(UINT_PTR workId)
+{
+	// WorkIDs are addresses, the lower bits are mostly zero
+	UINT64 h = static_cast<UINT64>(workId) * 0x9E3779B97F4A7C15ull;
+	return static_cast<size_t>(h ^ (h >> 32));
+}
+
+UINT64 WaitTracker::ToNanoseconds(UINT64 timestamps) const
+{
+	return static_cast<UINT64>(timestamps * nanosecondsPerTimestamp);
+}
+
+void WaitTracker::EventDelivered(DWORD eventId, ULONG dataSize, LPCBYTE data)
+{
+	auto& state = threadState;
+	switch (eventId)
+	{
+	case ContentionStart:
+		if (state.slot != nullptr)
+			state.lockWaitStarted = Platform::GetTimestamp();
+		break;
+	case WaitHandleWaitStart:
+		if (state.slot != nullptr)
+			state.handleWaitStarted = Platform::GetTimestamp();
+		break;
+	case ContentionStop:
+		// Waits which began before the session are skipped
+		if (state.slot == nullptr || state.lockWaitStarted == 0)
+			break;
+		state.slot->lockWaitNanoseconds += ToNanoseconds(Platform::GetTimestamp() - state.lockWaitStarted);
+		++state.slot->lockWaits;
+		state.slot->pending = 1;
+		state.lockWaitStarted = 0;
+		break;
+	case WaitHandleWaitStop:
+		if (state.slot == nullptr || state.handleWaitStarted == 0)
+			break;
+		state.slot->handleWaitNanoseconds += ToNanoseconds(Platform::GetTimestamp() - state.handleWaitStarted);
+		++state.slot->handleWaits;
+		state.slot->pending = 1;
+		state.handleWaitStarted = 0;
+		break;
+	case ThreadPoolEnqueue:
+	case ThreadPoolDequeue:
+	{
+		// WorkID is the first field of both events
+		if (!trackThreadPoolQueue || dataSize < sizeof(UINT_PTR))
+			break;
+		UINT_PTR workId;
+		memcpy(&workId, data, sizeof(workId));
+		auto timestamp = Platform::GetTimestamp();
+		auto& item = queuedWorkItems[Hash(workId) & (queuedWorkItemsSize - 1)];
+		if (eventId == ThreadPoolEnqueue)
+		{
+			// The slot is emptied first, so that a dequeue racing with this one does not match the new timestamp to the old item
+			item.workId.store(0);
+			item.enqueued.store(timestamp);
+			item.workId.store(workId);
+			break;
+		}
+		auto enqueued = item.enqueued.load();
+		UINT_PTR expected = workId;
+		if (!item.workId.compare_exchange_strong(expected, 0) || timestamp - enqueued > maxQueueWaitSeconds * timestampFrequency)
+			break;
+		// Attributed to the worker thread that picks the item up
+		if (state.slot == nullptr)
+			break;
+		state.slot->queueWaitNanoseconds += ToNanoseconds(timestamp - enqueued);
+		++state.slot->queueWaits;
+		state.slot->pending = 1;
+		break;
+	}
+	}
+}
\ No newline at end of file
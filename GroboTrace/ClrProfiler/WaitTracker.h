@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include "Platform.h"
+
+using namespace std;
+
+// Time threads spend blocked on monitors and wait handles, and time work items spend in the thread pool queue,
+// taken from the runtime events of an EventPipe session of the profiler (.NET 5+). Events of such a session are delivered
+// synchronously on the thread that raises them, so a thread adds its waits to its own slot without any locking,
+// and GroboTrace.Core moves them into the current call tree node on the next probe of the same thread
+class WaitTracker
+{
+public:
+	// Layout is shared with WaitEvents.Slot of GroboTrace.Core, which owns the memory
+	struct Slot
+	{
+		// Set when there are waits GroboTrace.Core has not taken yet
+		INT64 pending;
+		INT64 lockWaits;
+		INT64 lockWaitNanoseconds;
+		INT64 handleWaits;
+		INT64 handleWaitNanoseconds;
+		INT64 queueWaits;
+		INT64 queueWaitNanoseconds;
+	};
+
+	WaitTracker(ICorProfilerInfo12* corProfilerInfo, bool trackThreadPoolQueue);
+	~WaitTracker();
+
+	bool Start();
+	void Stop();
+
+	// Waits of threads without a slot are not tracked
+	static void SetCurrentThreadSlot(Slot* slot);
+
+	void EventDelivered(DWORD eventId, ULONG dataSize, LPCBYTE data);
+
+private:
+	// Microsoft-Windows-DotNETRuntime
+	enum EventId
+	{
+		ThreadPoolEnqueue = 61,
+		ThreadPoolDequeue = 62,
+		ContentionStart = 81,
+		ContentionStop = 91,
+		// .NET 9+, Monitor.Wait and WaitHandle waits, which also cover SemaphoreSlim and blocking on tasks
+		WaitHandleWaitStart = 301,
+		WaitHandleWaitStop = 302,
+	};
+
+	// Queued work items go to a fixed table by the hash of their WorkID without any locking, an item whose slot is taken
+	// by a later one is not tracked. Items lost by the session or moved by the GC, whose WorkID is their address, are never
+	// dequeued; their slots are simply reused, and an entry older than maxQueueWaitSeconds is not taken for a dequeued item
+	struct QueuedWorkItem
+	{
+		atomic<UINT_PTR> workId;
+		atomic<UINT64> enqueued;
+	};
+
+	static const size_t queuedWorkItemsSize = 65536;
+	static const int maxQueueWaitSeconds = 60;
+
+	static size_t Hash(UINT_PTR workId);
+
+	UINT64 ToNanoseconds(UINT64 timestamps) const;
+
+	ICorProfilerInfo12* corProfilerInfo;
+	bool trackThreadPoolQueue;
+	EVENTPIPE_SESSION session;
+	bool started;
+	double nanosecondsPerTimestamp;
+	UINT64 timestampFrequency;
+
+	vector<QueuedWorkItem> queuedWorkItems;
+};
\ No newline at end of file
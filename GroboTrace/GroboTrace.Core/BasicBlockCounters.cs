@@ -0,0 +1,117 @@
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Reflection;
+using System.Threading;
+
+using GrEmit.MethodBodyParsing;
+
+using MethodBody = GrEmit.MethodBodyParsing.MethodBody;
+using OpCodes = GrEmit.MethodBodyParsing.OpCodes;
+
+namespace GroboTrace.Core
+{
+    // Entry counters of basic blocks of the methods selected by GROBOTRACE_BLOCKS.
+    // Block ids are global and grow monotonically, counters are stored in fixed size chunks so that they are never moved
+    internal static class BasicBlockCounters
+    {
+        public static bool NeedCount(MethodBase method)
+        {
+            var filter = TracingSettings.BasicBlocksFilter;
+            return filter != null && filter.IsMatch(method.DeclaringType?.FullName + "." + method.Name);
+        }
+
+        // Must be called before any other modification of the method body, while instructions have their original offsets
+        public static void InjectCounters(MethodBase method, MethodBody methodBody, MetadataToken blockEnteredToken, IntPtr blockEnteredAddress)
+        {
+            var blocks = BasicBlockFinder.FindBasicBlocks(methodBody.Instructions.ToArray(), methodBody.ExceptionHandlers);
+            if(blocks.Count == 0)
+                return;
+            var firstBlockId = Register(method, blocks);
+            for(var i = 0; i < blocks.Count; ++i)
+            {
+                // Leader becomes the counter increment followed by a copy of the original instruction,
+                // so that branches, exception handlers and IL map entries pointing to the leader now point to the counter
+                var leader = blocks[i].Leader;
+                var copy = Instruction.Create(OpCodes.Nop);
+                copy.OpCode = leader.OpCode;
+                copy.Operand = leader.Operand;
+                leader.OpCode = OpCodes.Ldc_I4;
+                leader.Operand = firstBlockId + i; // [ blockId ]
+                var index = methodBody.Instructions.IndexOf(leader);
+                methodBody.Instructions.Insert(++index, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)blockEnteredAddress : (long)blockEnteredAddress)); // [ blockId, funcAddr ]
+                methodBody.Instructions.Insert(++index, Instruction.Create(OpCodes.Calli, blockEnteredToken)); // []
+                methodBody.Instructions.Insert(++index, copy);
+            }
+        }
+
+        public static void Increment(int blockId)
+        {
+            Interlocked.Increment(ref chunks[blockId >> chunkBits][blockId & chunkMask]);
+        }
+
+        public static List<BasicBlockStats> GetStats()
+        {
+            MethodBlocks[] snapshot;
+            lock(registrationLock)
+                snapshot = methodBlocks.ToArray();
+            var result = new List<BasicBlockStats>();
+            foreach(var entry in snapshot)
+            {
+                for(var i = 0; i < entry.ILOffsets.Length; ++i)
+                {
+                    var blockId = entry.FirstBlockId + i;
+                    result.Add(new BasicBlockStats
+                        {
+                            Method = entry.Method,
+                            ILOffset = entry.ILOffsets[i],
+                            IsLoopHeader = entry.LoopHeaders[i],
+                            Count = Volatile.Read(ref chunks[blockId >> chunkBits][blockId & chunkMask])
+                        });
+                }
+            }
+            return result;
+        }
+
+        private static int Register(MethodBase method, List<BasicBlock> blocks)
+        {
+            lock(registrationLock)
+            {
+                var firstBlockId = numberOfBlocks;
+                if(((long)firstBlockId + blocks.Count) >> chunkBits >= chunks.Length)
+                    throw new InvalidOperationException("Too many basic blocks");
+                numberOfBlocks += blocks.Count;
+                for(var chunkIndex = firstBlockId >> chunkBits; chunkIndex <= (numberOfBlocks - 1) >> chunkBits; ++chunkIndex)
+                {
+                    if(chunks[chunkIndex] == null)
+                        chunks[chunkIndex] = new long[chunkSize];
+                }
+                methodBlocks.Add(new MethodBlocks
+                    {
+                        Method = method,
+                        FirstBlockId = firstBlockId,
+                        ILOffsets = blocks.Select(block => block.Leader.Offset).ToArray(),
+                        LoopHeaders = blocks.Select(block => block.IsLoopHeader).ToArray()
+                    });
+                return firstBlockId;
+            }
+        }
+
+        private class MethodBlocks
+        {
+            public MethodBase Method;
+            public int FirstBlockId;
+            public int[] ILOffsets;
+            public bool[] LoopHeaders;
+        }
+
+        private const int chunkBits = 12;
+        private const int chunkSize = 1 << chunkBits;
+        private const int chunkMask = chunkSize - 1;
+
+        private static readonly long[][] chunks = new long[1 << 16][];
+        private static readonly List<MethodBlocks> methodBlocks = new List<MethodBlocks>();
+        private static readonly object registrationLock = new object();
+        private static int numberOfBlocks;
+    }
+}
\ No newline at end of file
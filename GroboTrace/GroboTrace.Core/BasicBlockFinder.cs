@@ -0,0 +1,75 @@
+using System.Collections.Generic;
+using System.Linq;
+
+using GrEmit.MethodBodyParsing;
+
+namespace GroboTrace.Core
+{
+    public class BasicBlock
+    {
+        public Instruction Leader { get; set; }
+
+        // Target of a backward branch, i.e. entered on every iteration of a loop
+        public bool IsLoopHeader { get; set; }
+    }
+
+    public static class BasicBlockFinder
+    {
+        // Leaders are the first instruction, branch targets, instructions following branches and starts of protected regions and handlers.
+        // A branch to the next instruction (br.s emitted before the return of debug builds) is a fall-through and does not end its block
+        public static List<BasicBlock> FindBasicBlocks(Instruction[] instructions, IEnumerable<ExceptionHandler> exceptionHandlers)
+        {
+            var blocks = new Dictionary<Instruction, BasicBlock>();
+            if(instructions.Length == 0)
+                return new List<BasicBlock>();
+            AddLeader(blocks, instructions[0], false);
+            foreach(var instruction in instructions)
+            {
+                var operandType = instruction.OpCode.OperandType;
+                if(operandType == OperandType.InlineBrTarget || operandType == OperandType.ShortInlineBrTarget)
+                {
+                    var target = (Instruction)instruction.Operand;
+                    if(target == instruction.Next)
+                        continue;
+                    AddLeader(blocks, target, target.Offset <= instruction.Offset);
+                    AddLeader(blocks, instruction.Next, false);
+                }
+                else if(operandType == OperandType.InlineSwitch)
+                {
+                    foreach(var target in (Instruction[])instruction.Operand)
+                        AddLeader(blocks, target, target.Offset <= instruction.Offset);
+                    AddLeader(blocks, instruction.Next, false);
+                }
+                else if(blockEndInstructions.Contains(instruction.OpCode))
+                    AddLeader(blocks, instruction.Next, false);
+            }
+            foreach(var exceptionHandler in exceptionHandlers)
+            {
+                AddLeader(blocks, exceptionHandler.TryStart, false);
+                AddLeader(blocks, exceptionHandler.HandlerStart, false);
+                AddLeader(blocks, exceptionHandler.FilterStart, false);
+            }
+            return instructions.Where(blocks.ContainsKey).Select(instruction => blocks[instruction]).ToList();
+        }
+
+        private static void AddLeader(Dictionary<Instruction, BasicBlock> blocks, Instruction leader, bool isLoopHeader)
+        {
+            if(leader == null)
+                return;
+            BasicBlock block;
+            if(!blocks.TryGetValue(leader, out block))
+                blocks.Add(leader, block = new BasicBlock {Leader = leader});
+            block.IsLoopHeader |= isLoopHeader;
+        }
+
+        private static readonly OpCode[] blockEndInstructions =
+            {
+                OpCodes.Ret,
+                OpCodes.Throw,
+                OpCodes.Rethrow,
+                OpCodes.Endfinally,
+                OpCodes.Endfilter,
+                OpCodes.Jmp
+            };
+    }
+}
\ No newline at end of file
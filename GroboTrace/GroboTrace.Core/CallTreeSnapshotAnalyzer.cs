@@ -0,0 +1,121 @@
+using System.Collections.Generic;
+using System.Linq;
+
+namespace GroboTrace.Core
+{
+    internal static class CallTreeSnapshotAnalyzer
+    {
+        public static Stats GetStats(CallTreeSnapshot snapshot)
+        {
+            if(snapshot == null || snapshot.Count == 0)
+                return new Stats {Tree = new MethodStatsNode(), List = new List<MethodStats>()};
+            return new Stats
+                {
+                    ElapsedTicks = snapshot.ElapsedTicks,
+                    Tree = GetStatsAsTree(snapshot),
+                    List = GetStatsAsList(snapshot),
+                };
+        }
+
+        private static MethodStatsNode GetStatsAsTree(CallTreeSnapshot snapshot)
+        {
+            var count = snapshot.Count;
+            var nodes = new MethodStatsNode[count];
+            var children = new List<MethodStatsNode>[count];
+            for(var i = 0; i < count; ++i)
+            {
+                nodes[i] = new MethodStatsNode
+                    {
+                        MethodStats = new MethodStats
+                            {
+                                Method = MethodBaseTracingInstaller.GetMethod(snapshot.MethodIds[i]),
+                                MethodName = MethodSymbols.GetName(snapshot.MethodIds[i]),
+                                Calls = snapshot.Calls[i],
+                                RecursiveCalls = snapshot.RecursiveCalls == null ? 0 : snapshot.RecursiveCalls[i],
+                                Ticks = snapshot.Ticks[i],
+                                Percent = snapshot.ElapsedTicks == 0 ? 0.0 : snapshot.Ticks[i] * 100.0 / snapshot.ElapsedTicks
+                            }
+                    };
+                if(snapshot.CpuTicks != null && snapshot.CpuMeasuredTicks[i] > 0)
+                    CpuTime.SetTicks(nodes[i].MethodStats, snapshot.CpuTicks[i], snapshot.CpuMeasuredTicks[i]);
+                var parentIndex = snapshot.ParentIndexes[i];
+                if(parentIndex >= 0)
+                    (children[parentIndex] ?? (children[parentIndex] = new List<MethodStatsNode>())).Add(nodes[i]);
+            }
+            for(var i = 0; i < count; ++i)
+            {
+                nodes[i].Children = children[i] == null
+                                        ? new MethodStatsNode[0]
+                                        : children[i].OrderByDescending(stats => stats.MethodStats.Ticks).ToArray();
+            }
+            nodes[0].MethodStats.Percent = 100.0;
+            if(snapshot.CpuTicks != null && snapshot.ElapsedCpuTicks >= 0)
+                CpuTime.SetTicks(nodes[0].MethodStats, snapshot.ElapsedCpuTicks, snapshot.ElapsedTicks);
+            return nodes[0];
+        }
+
+        private static List<MethodStats> GetStatsAsList(CallTreeSnapshot snapshot)
+        {
+            var count = snapshot.Count;
+            var selfTicks = new long[count];
+            for(var i = 0; i < count; ++i)
+            {
+                selfTicks[i] += snapshot.Ticks[i];
+                var parentIndex = snapshot.ParentIndexes[i];
+                if(parentIndex >= 0)
+                    selfTicks[parentIndex] -= snapshot.Ticks[i];
+            }
+            var statsDict = new Dictionary<int, MethodStats>();
+            for(var i = 1; i < count; ++i)
+            {
+                var methodId = snapshot.MethodIds[i];
+                if(methodId == 0)
+                    continue;
+                var recursiveCalls = snapshot.RecursiveCalls == null ? 0 : snapshot.RecursiveCalls[i];
+                MethodStats stats;
+                if(!statsDict.TryGetValue(methodId, out stats))
+                    statsDict.Add(methodId, new MethodStats {Calls = snapshot.Calls[i], RecursiveCalls = recursiveCalls, Method = MethodBaseTracingInstaller.GetMethod(methodId), MethodName = MethodSymbols.GetName(methodId), Ticks = selfTicks[i]});
+                else
+                {
+                    stats.Calls += snapshot.Calls[i];
+                    stats.RecursiveCalls += recursiveCalls;
+                    stats.Ticks += selfTicks[i];
+                }
+            }
+            return GetStatsAsList(statsDict, snapshot.ElapsedTicks);
+        }
+
+        // Rows of methods unloaded since they were called are merged into one, the row without a method is the self time of the root
+        internal static List<MethodStats> GetStatsAsList(Dictionary<int, MethodStats> statsDict, long elapsedTicks)
+        {
+            var rows = new List<MethodStats>(statsDict.Count + 2);
+            MethodStats unloaded = null;
+            long ticks = 0;
+            foreach(var stats in statsDict.Values)
+            {
+                ticks += stats.Ticks;
+                if(stats.Method != MethodBaseTracingInstaller.UnloadedMethod)
+                    rows.Add(stats);
+                else if(unloaded == null)
+                    rows.Add(unloaded = new MethodStats {Method = stats.Method, Calls = stats.Calls, RecursiveCalls = stats.RecursiveCalls, Ticks = stats.Ticks, Histogram = stats.Histogram});
+                else
+                {
+                    unloaded.Calls += stats.Calls;
+                    unloaded.RecursiveCalls += stats.RecursiveCalls;
+                    unloaded.Ticks += stats.Ticks;
+                    if(stats.Histogram != null)
+                    {
+                        if(unloaded.Histogram == null)
+                            unloaded.Histogram = new LatencyHistogram();
+                        unloaded.Histogram.Add(stats.Histogram);
+                    }
+                }
+            }
+            rows.Add(new MethodStats {Calls = 1, Ticks = elapsedTicks - ticks});
+            var result = rows.OrderByDescending(stats => stats.Ticks).ToList();
+            foreach(var stats in result)
+                stats.Percent = elapsedTicks == 0 ? 0.0 : stats.Ticks * 100.0 / elapsedTicks;
+            return result;
+        }
+    }
+}
\ No newline at end of file
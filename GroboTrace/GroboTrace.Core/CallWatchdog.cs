@@ -0,0 +1,230 @@
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.Linq;
+using System.Reflection;
+using System.Text;
+using System.Text.RegularExpressions;
+using System.Threading;
+
+namespace GroboTrace.Core
+{
+    // Periodically walks the active call path of every thread, from MethodCallTree.Current up to the root, and reports paths
+    // with a call or a watched Profiler.Profile section running longer than its threshold. Threads are not suspended:
+    // a path is read while its thread keeps running and is dropped if the thread has moved meanwhile.
+    // A stuck call is reported once, until a call or section inside it gets stuck too; reports are kept in a bounded buffer and written to the log
+    internal static class CallWatchdog
+    {
+        public static void Init()
+        {
+            defaultThreshold = TracingSettings.WatchdogThresholdMilliseconds;
+            methodThresholds = ParseMethodThresholds(TracingSettings.WatchdogMethods);
+            if(defaultThreshold > 0 || methodThresholds.Count > 0)
+                EnsureStarted();
+        }
+
+        public static void EnsureStarted()
+        {
+            if(started)
+                return;
+            lock(reportsLock)
+            {
+                if(started)
+                    return;
+                started = true;
+                new Thread(Run) {IsBackground = true, Name = "GroboTrace call watchdog"}.Start();
+            }
+        }
+
+        public static List<StuckCall> GetReports()
+        {
+            lock(reportsLock)
+                return reports.ToList();
+        }
+
+        private static void Run()
+        {
+            while(true)
+            {
+                Thread.Sleep(TracingSettings.WatchdogIntervalMilliseconds);
+                try
+                {
+                    Check();
+                }
+                catch(Exception e)
+                {
+                    DiagnosticLog.Write(LogLevel.Error, ".NET: call watchdog failed: " + e);
+                }
+            }
+        }
+
+        private static void Check()
+        {
+            var ticksPerMillisecond = TicksCalibration.TicksPerMillisecond;
+            if(ticksPerMillisecond <= 0)
+                return;
+            var callTrees = TracingAnalyzer.CallTrees;
+            for(var threadId = 0; threadId < callTrees.Length; ++threadId)
+            {
+                var callTree = callTrees[threadId];
+                var current = callTree.Current;
+                var sectionsCount = callTree.WatchedSectionsCount;
+                if(current == callTree.Root && sectionsCount == 0)
+                    continue;
+
+                var now = MethodBaseTracingInstaller.TicksReader();
+                var depth = 0;
+                for(var node = current; node != null && node != callTree.Root; node = node.Parent)
+                {
+                    Ensure(ref path, depth + 1);
+                    Ensure(ref enteredTicks, depth + 1);
+                    path[depth] = node;
+                    enteredTicks[depth] = node.EnteredTicks;
+                    ++depth;
+                }
+                if(callTree.Current != current || callTree.WatchedSectionsCount != sectionsCount)
+                    continue;
+
+                // Innermost call or section over its threshold, the whole path is reported anyway. A report is made
+                // once per such frame: the node with the start of its call, or no node with the start of a section
+                MethodCallNode stuckNode = null;
+                long stuckTicks = 0;
+                for(var i = 0; i < depth; ++i)
+                {
+                    var threshold = MethodBaseTracingInstaller.GetWatchdogThreshold(path[i].MethodId);
+                    if(threshold > 0 && now - enteredTicks[i] > threshold * ticksPerMillisecond)
+                    {
+                        stuckNode = path[i];
+                        stuckTicks = enteredTicks[i];
+                        break;
+                    }
+                }
+                string groboTraceKey = null;
+                long sectionStartTicks = 0;
+                var sections = callTree.WatchedSections;
+                for(var i = 0; sections != null && i < sectionsCount && i < sections.Length; ++i)
+                {
+                    var section = sections[i];
+                    if(stuckNode == null && section.ThresholdMilliseconds > 0 && now - section.StartTicks > section.ThresholdMilliseconds * ticksPerMillisecond)
+                        stuckTicks = section.StartTicks;
+                    groboTraceKey = section.GroboTraceKey;
+                    sectionStartTicks = section.StartTicks;
+                }
+
+                if(stuckTicks != 0 && (stuckTicks != callTree.reportedTicks || stuckNode != callTree.reportedNode))
+                {
+                    callTree.reportedNode = stuckNode;
+                    callTree.reportedTicks = stuckTicks;
+                    AddReport(CreateReport(threadId, groboTraceKey, groboTraceKey == null ? 0 : (now - sectionStartTicks) / ticksPerMillisecond, depth, now, ticksPerMillisecond));
+                }
+                if(depth > 0)
+                    Array.Clear(path, 0, depth);
+            }
+        }
+
+        private static StuckCall CreateReport(int threadId, string groboTraceKey, double sectionElapsedMilliseconds, int depth, long now, double ticksPerMillisecond)
+        {
+            var frames = new StuckCallFrame[depth];
+            for(var i = 0; i < depth; ++i)
+            {
+                var methodId = path[depth - 1 - i].MethodId;
+                frames[i] = new StuckCallFrame
+                    {
+                        Method = MethodBaseTracingInstaller.GetMethod(methodId),
+                        MethodName = MethodSymbols.GetName(methodId),
+                        ElapsedMilliseconds = (now - enteredTicks[depth - 1 - i]) / ticksPerMillisecond
+                    };
+            }
+            return new StuckCall
+                {
+                    ManagedThreadId = threadId,
+                    Timestamp = DateTime.UtcNow,
+                    GroboTraceKey = groboTraceKey,
+                    SectionElapsedMilliseconds = sectionElapsedMilliseconds,
+                    Frames = frames
+                };
+        }
+
+        private static void AddReport(StuckCall report)
+        {
+            lock(reportsLock)
+            {
+                if(reports.Count == TracingSettings.WatchdogReportsCount)
+                    reports.Dequeue();
+                reports.Enqueue(report);
+            }
+            if(DiagnosticLog.IsEnabled(LogLevel.Info))
+                DiagnosticLog.Write(LogLevel.Info, Format(report));
+        }
+
+        private static string Format(StuckCall report)
+        {
+            var result = new StringBuilder();
+            result.AppendFormat(CultureInfo.InvariantCulture, ".NET: stuck call on thread {0}", report.ManagedThreadId);
+            if(report.GroboTraceKey != null)
+                result.AppendFormat(CultureInfo.InvariantCulture, " in section {0} running for {1:F3}ms", report.GroboTraceKey, report.SectionElapsedMilliseconds);
+            for(var i = 0; i < report.Frames.Length; ++i)
+            {
+                var frame = report.Frames[i];
+                var name = frame.MethodName ?? (frame.Method == null ? "?" : frame.Method.DeclaringType?.FullName + "." + frame.Method.Name);
+                result.AppendLine();
+                result.AppendFormat(CultureInfo.InvariantCulture, "{0}{1:F3}ms {2}", new string(' ', (i + 1) * 4), frame.ElapsedMilliseconds, name);
+            }
+            return result.ToString();
+        }
+
+        // Resolved once when the method is registered and kept in its registry entry
+        public static int GetThreshold(MethodBase method)
+        {
+            if(methodThresholds.Count == 0)
+                return defaultThreshold;
+            var name = method.DeclaringType?.FullName + "." + method.Name;
+            foreach(var rule in methodThresholds)
+            {
+                if(rule.Item1.IsMatch(name))
+                    return rule.Item2;
+            }
+            return defaultThreshold;
+        }
+
+        // Semicolon-separated list of pattern=milliseconds, patterns are the same as in TracingSettings.ParseMethodsFilter
+        private static List<Tuple<Regex, int>> ParseMethodThresholds(string value)
+        {
+            var result = new List<Tuple<Regex, int>>();
+            if(string.IsNullOrWhiteSpace(value))
+                return result;
+            foreach(var rule in value.Split(new[] {';'}, StringSplitOptions.RemoveEmptyEntries))
+            {
+                var separator = rule.LastIndexOf('=');
+                int threshold;
+                var filter = separator < 0 ? null : TracingSettings.ParseMethodsFilter(rule.Substring(0, separator));
+                if(filter == null || !int.TryParse(rule.Substring(separator + 1).Trim(), NumberStyles.Integer, CultureInfo.InvariantCulture, out threshold) || threshold <= 0)
+                {
+                    DiagnosticLog.Write(LogLevel.Error, ".NET: bad watchdog rule, pattern=milliseconds is expected: " + rule);
+                    continue;
+                }
+                result.Add(Tuple.Create(filter, threshold));
+            }
+            return result;
+        }
+
+        private static void Ensure<T>(ref T[] array, int size)
+        {
+            if(array == null)
+                array = new T[Math.Max(size, 16)];
+            else if(array.Length < size)
+                Array.Resize(ref array, Math.Max(size, array.Length * 2));
+        }
+
+        private static readonly object reportsLock = new object();
+        private static readonly Queue<StuckCall> reports = new Queue<StuckCall>();
+        private static volatile bool started;
+
+        private static int defaultThreshold;
+        private static List<Tuple<Regex, int>> methodThresholds = new List<Tuple<Regex, int>>();
+
+        // State of the watchdog thread
+        private static MethodCallNode[] path;
+        private static long[] enteredTicks;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,15 @@
+namespace GroboTrace.Core
+{
+    // Mirrors ControlProtocol::Command of ClrProfiler
+    internal enum ControlCommand
+    {
+        EnableProbes = 1,
+        DisableProbes = 2,
+        ClearStats = 3,
+        DumpSnapshot = 4,
+        SetSamplingRate = 5,
+        SetCallTreeNodesLimit = 6,
+        GetStatus = 7,
+        Detach = 8
+    }
+}
\ No newline at end of file
@@ -0,0 +1,169 @@
+using System;
+using System.Globalization;
+using System.IO;
+using System.Linq;
+using System.Text;
+
+namespace GroboTrace.Core
+{
+    // Requests of the control socket, executed on the profiler's socket thread.
+    // Stats of other threads are read and cleared while they keep running, so the numbers are approximate
+    internal static class ControlCommands
+    {
+        public static ControlStatus Execute(ControlCommand command, long value, string argument, out string message)
+        {
+            switch(command)
+            {
+            case ControlCommand.EnableProbes:
+                return SetProbesEnabled(argument, true, out message);
+            case ControlCommand.DisableProbes:
+                return SetProbesEnabled(argument, false, out message);
+            case ControlCommand.ClearStats:
+                ClearStats();
+                message = "Stats are cleared";
+                return ControlStatus.Ok;
+            case ControlCommand.DumpSnapshot:
+                if(string.IsNullOrWhiteSpace(argument))
+                {
+                    message = "File name is required";
+                    return ControlStatus.BadRequest;
+                }
+                File.WriteAllText(argument, FormatSnapshot());
+                message = "Snapshot is written to " + argument;
+                return ControlStatus.Ok;
+            case ControlCommand.SetSamplingRate:
+                if(value < 0 || value > int.MaxValue)
+                {
+                    message = "Sampling rate must be non-negative";
+                    return ControlStatus.BadRequest;
+                }
+                TracingAnalyzer.SetSamplingRateOverride((int)value);
+                message = value == 0 ? "Sampling rates of Profiler.Profile sections are restored" : $"1 of {value} Profiler.Profile sections is traced";
+                return ControlStatus.Ok;
+            case ControlCommand.SetCallTreeNodesLimit:
+                if(value < 0 || value > int.MaxValue)
+                {
+                    message = "Limit must be non-negative";
+                    return ControlStatus.BadRequest;
+                }
+                MethodCallNode.NodesLimit = (int)value;
+                message = value == 0 ? "Call tree nodes are unlimited" : $"Call tree nodes are limited to {value}, {MethodCallNode.NodesCount} are used";
+                return ControlStatus.Ok;
+            case ControlCommand.GetStatus:
+                message = FormatStatus();
+                return ControlStatus.Ok;
+            case ControlCommand.Detach:
+                Detach();
+                message = "Probes are disabled, callbacks of the profiler are released";
+                return ControlStatus.Ok;
+            default:
+                message = $"Unknown command {(int)command}";
+                return ControlStatus.UnknownCommand;
+            }
+        }
+
+        private static ControlStatus SetProbesEnabled(string patterns, bool enabled, out string message)
+        {
+            var filter = TracingSettings.ParseMethodsFilter(patterns);
+            if(filter == null)
+            {
+                if(enabled)
+                    MethodBaseTracingInstaller.EnableAllMethods();
+                TracingAnalyzer.SetProbesEnabled(enabled);
+                message = enabled ? "Probes are enabled" : "Probes are disabled";
+                return ControlStatus.Ok;
+            }
+            var count = MethodBaseTracingInstaller.SetMethodsEnabled(filter, enabled);
+            message = $"Probes of {count} methods are {(enabled ? "enabled" : "disabled")}";
+            return ControlStatus.Ok;
+        }
+
+        // The profiler is about to be unloaded, so nothing may call into it afterwards.
+        // Reverted methods no longer reach the probes, the rest (dynamic methods) find them disabled
+        private static void Detach()
+        {
+            TracingAnalyzer.SetProbesEnabled(false);
+            SharedStatsPublisher.Stop();
+            StackSamples.Init(null, null);
+            WaitEvents.Init(null);
+            CpuTime.Init(null);
+            MethodSymbols.Init(null);
+            DiagnosticLog.Init(null, -1);
+        }
+
+        private static void ClearStats()
+        {
+            foreach(var callTree in TracingAnalyzer.CallTrees)
+            {
+                if(callTree.Root.ChildrenCount > 0)
+                    callTree.ClearAllStats();
+            }
+            MethodBaseTracingInstaller.ClearMethodStats();
+        }
+
+        private static string FormatStatus()
+        {
+            var result = new StringBuilder();
+            result.AppendLine($"Probes: {(TracingAnalyzer.ProbesEnabled ? "enabled" : "disabled")}, disabled methods: {MethodBaseTracingInstaller.DisabledMethodsCount}");
+            var samplingRate = TracingAnalyzer.GetSamplingRateOverride();
+            result.AppendLine($"Sampling: {(TracingAnalyzer.IsSamplingEnabled() ? "enabled" : "disabled")}, rate: {(samplingRate == 0 ? "per section" : samplingRate.ToString(CultureInfo.InvariantCulture))}");
+            var nodesLimit = MethodCallNode.NodesLimit;
+            result.AppendLine($"Call tree nodes: {MethodCallNode.NodesCount}, limit: {(nodesLimit == 0 ? "none" : nodesLimit.ToString(CultureInfo.InvariantCulture))}");
+            result.AppendLine($"Methods: {MethodBaseTracingInstaller.NumberOfMethods}");
+            var governor = OverheadGovernor.GetStats();
+            if(governor.Enabled)
+                result.AppendLine(string.Format(CultureInfo.InvariantCulture, "Overhead governor: {0}, overhead {1:F2}% of budget {2}%, steps down {3}, up {4}",
+                                                governor.Level, governor.OverheadPercent, governor.BudgetPercent, governor.StepsDown, governor.StepsUp));
+            else
+                result.AppendLine("Overhead governor: off");
+            return result.ToString();
+        }
+
+        // Per method totals followed by call trees of all threads, times are in milliseconds
+        private static string FormatSnapshot()
+        {
+            var ticksPerMillisecond = TicksCalibration.TicksPerMillisecond;
+            Func<long, string> format = ticks => (ticksPerMillisecond <= 0 ? 0 : ticks / ticksPerMillisecond).ToString("F3", CultureInfo.InvariantCulture);
+            var result = new StringBuilder();
+            result.AppendLine($"GroboTrace snapshot at {DateTime.UtcNow:O}");
+            result.AppendLine();
+            result.AppendLine("Methods:");
+            var methods = TracingSettings.Mode == TracingMode.Counting ? TracingAnalyzer.GetMethodCallCounts() : TracingAnalyzer.GetMethodHistograms();
+            foreach(var stats in methods)
+            {
+                result.Append($"{stats.Calls} calls {format(stats.Ticks)}ms ");
+                if(stats.Histogram != null)
+                    result.Append($"[p50 {format(stats.Histogram.Percentile50)}ms, p99 {format(stats.Histogram.Percentile99)}ms, p99.9 {format(stats.Histogram.Percentile999)}ms, max {format(stats.Histogram.Max)}ms] ");
+                result.AppendLine(stats.MethodName ?? stats.Method.DeclaringType?.FullName + "." + stats.Method.Name);
+            }
+            var callTrees = TracingAnalyzer.CallTrees;
+            for(var threadId = 0; threadId < callTrees.Length; ++threadId)
+            {
+                var root = callTrees[threadId].Root;
+                if(root.ChildrenCount == 0)
+                    continue;
+                result.AppendLine();
+                result.AppendLine($"Thread {threadId}:");
+                AppendNode(root, 0, format, result);
+            }
+            return result.ToString();
+        }
+
+        private static void AppendNode(MethodCallNode node, int depth, Func<long, string> format, StringBuilder result)
+        {
+            if(node.MethodId != 0)
+            {
+                var method = MethodBaseTracingInstaller.GetMethod(node.MethodId);
+                var name = MethodSymbols.GetName(node.MethodId) ?? (method == null ? "?" : method.DeclaringType?.FullName + "." + method.Name);
+                result.AppendLine($"{new string(' ', depth * 4)}{node.Calls} calls {format(node.Ticks)}ms {name}");
+            }
+            int childrenCount;
+            var children = node.GetChildren(out childrenCount)
+                               .Take(childrenCount)
+                               .Where(child => child.Calls > 0)
+                                     .OrderByDescending(child => child.Ticks);
+            foreach(var child in children)
+                AppendNode(child, node.MethodId == 0 ? depth : depth + 1, format, result);
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,12 @@
+namespace GroboTrace.Core
+{
+    // Mirrors ControlProtocol::Status of ClrProfiler
+    internal enum ControlStatus
+    {
+        Ok = 0,
+        UnknownCommand = 1,
+        BadRequest = 2,
+        NotReady = 3,
+        Failed = 4
+    }
+}
\ No newline at end of file
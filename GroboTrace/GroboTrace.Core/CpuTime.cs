@@ -0,0 +1,101 @@
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Threading;
+
+namespace GroboTrace.Core
+{
+    // CPU time of threads read through the profiler (GROBOTRACE_CPU_TIME), reports show it next to wall-clock ticks, so that
+    // a slow path that burns CPU can be told apart from one that sleeps, does I/O or waits on locks. It is read at boundaries
+    // of profiled sections, and on entry and exit of calls of the GROBOTRACE_CPU_TIME_TOP_METHODS heaviest methods,
+    // which a background thread picks by their total ticks every second. Every read is a system call, so other calls are not timed
+    internal static class CpuTime
+    {
+        public static void Init(MethodBaseTracingInstaller.ThreadCpuTimeReader reader)
+        {
+            Init(reader, TracingSettings.CpuTimeEnabled, TracingSettings.CpuTimeTopMethods);
+        }
+
+        // Settings are passed explicitly by tests, which cannot change TracingSettings
+        internal static void Init(MethodBaseTracingInstaller.ThreadCpuTimeReader reader, bool enabled, int topMethods)
+        {
+            if(reader == null || !enabled)
+            {
+                threadCpuTimeReader = null;
+                methodsEnabled = false;
+                return;
+            }
+            threadCpuTimeReader = reader;
+            topMethodsCount = topMethods;
+            if(topMethods <= 0 || StackSamples.Enabled || TracingSettings.Mode == TracingMode.Counting)
+                return;
+            methodsEnabled = true;
+            new Thread(Run) {IsBackground = true, Name = "GroboTrace CPU time methods"}.Start();
+        }
+
+        public static bool Enabled { get { return threadCpuTimeReader != null; } }
+
+        // Checked by probes before they look up the method
+        public static bool MethodsEnabled { get { return methodsEnabled; } }
+
+        // Nanoseconds of the current thread, 0 when CPU time is off
+        public static long Read()
+        {
+            var reader = threadCpuTimeReader;
+            return reader == null ? 0 : reader();
+        }
+
+        public static double TicksPerNanosecond { get { return TicksCalibration.TicksPerMillisecond / 1000000.0; } }
+
+        // Off-CPU time is the rest of the wall-clock ticks of the same calls, never negative as the clocks differ in resolution
+        public static void SetTicks(MethodStats stats, long cpuTicks, long measuredTicks)
+        {
+            stats.CpuTicks = Math.Min(cpuTicks, measuredTicks);
+            stats.OffCpuTicks = measuredTicks - stats.CpuTicks;
+        }
+
+        private static void Run()
+        {
+            while(methodsEnabled)
+            {
+                Thread.Sleep(selectionIntervalMilliseconds);
+                try
+                {
+                    SelectMethods();
+                }
+                catch(Exception e)
+                {
+                    DiagnosticLog.Write(LogLevel.Error, ".NET: failed to select methods for CPU time: " + e);
+                }
+            }
+        }
+
+        private static void SelectMethods()
+        {
+            var heaviest = new List<KeyValuePair<long, int>>();
+            MethodHistograms.Merge(ref histograms, unloadedHistogram);
+            for(var slot = 1; slot <= histograms.Length; ++slot)
+            {
+                var histogram = histograms[slot - 1];
+                if(histogram == null || histogram.Sum == 0)
+                    continue;
+                var methodId = MethodBaseTracingInstaller.GetMethodId(slot);
+                if(methodId == 0)
+                    continue;
+                heaviest.Add(new KeyValuePair<long, int>(histogram.Sum, methodId));
+            }
+            var ids = new HashSet<int>(heaviest.OrderByDescending(pair => pair.Key).Take(topMethodsCount).Select(pair => pair.Value));
+            MethodBaseTracingInstaller.SetCpuTimedMethods(ids);
+        }
+
+        private const int selectionIntervalMilliseconds = 1000;
+
+        // Reused by the selecting thread
+        private static LatencyHistogram[] histograms;
+        private static readonly LatencyHistogram unloadedHistogram = new LatencyHistogram();
+
+        private static volatile MethodBaseTracingInstaller.ThreadCpuTimeReader threadCpuTimeReader;
+        private static volatile bool methodsEnabled;
+        private static volatile int topMethodsCount;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,96 @@
+﻿using System;
+using System.Collections.Concurrent;
+using System.Globalization;
+using System.Runtime.InteropServices;
+using System.Threading;
+
+namespace GroboTrace.Core
+{
+    // Messages go to the log ring of the profiler, which formats and writes them on its own thread.
+    // Callers check IsEnabled before building anything expensive, on the JIT path a disabled message must cost nothing.
+    // A message with arguments is queued as a format and its arguments, which a thread of the log formats later,
+    // so the arguments must not change after the call
+    public static class DiagnosticLog
+    {
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        public delegate void LogWriter(int level, [MarshalAs(UnmanagedType.LPWStr)] string message);
+
+        public static void Init(LogWriter logWriter, int logLevel)
+        {
+            writer = logWriter;
+            level = logWriter == null ? -1 : logLevel;
+            if(logWriter != null && Interlocked.Exchange(ref formatterStarted, 1) == 0)
+                new Thread(FormatRecords) {IsBackground = true, Name = "GroboTrace log"}.Start();
+        }
+
+        public static bool IsEnabled(LogLevel messageLevel)
+        {
+            return (int)messageLevel <= level;
+        }
+
+        public static void Write(LogLevel messageLevel, string message)
+        {
+            // The writer is dropped when the profiler detaches
+            var currentWriter = writer;
+            if(IsEnabled(messageLevel) && currentWriter != null)
+                currentWriter((int)messageLevel, message);
+        }
+
+        public static void Write(LogLevel messageLevel, string format, object arg0, object arg1 = null, object arg2 = null)
+        {
+            if(!IsEnabled(messageLevel) || writer == null)
+                return;
+            // Like the profiler's ring, the queue never blocks a producer and drops what does not fit
+            if(Interlocked.Increment(ref queuedCount) > maxQueuedCount)
+            {
+                Interlocked.Decrement(ref queuedCount);
+                Interlocked.Increment(ref droppedCount);
+                return;
+            }
+            records.Enqueue(new Record {Level = messageLevel, Format = format, Arg0 = arg0, Arg1 = arg1, Arg2 = arg2});
+        }
+
+        private static void FormatRecords()
+        {
+            while(true)
+            {
+                Thread.Sleep(formatIntervalMilliseconds);
+                Record record;
+                while(records.TryDequeue(out record))
+                {
+                    Interlocked.Decrement(ref queuedCount);
+                    try
+                    {
+                        Write(record.Level, string.Format(CultureInfo.InvariantCulture, record.Format, record.Arg0, record.Arg1, record.Arg2));
+                    }
+                    catch(Exception e)
+                    {
+                        Write(LogLevel.Error, ".NET: failed to format log message '" + record.Format + "': " + e.Message);
+                    }
+                }
+                var dropped = Interlocked.Exchange(ref droppedCount, 0);
+                if(dropped > 0)
+                    Write(LogLevel.Error, ".NET: " + dropped + " messages are dropped, the log queue is full");
+            }
+        }
+
+        private struct Record
+        {
+            public LogLevel Level;
+            public string Format;
+            public object Arg0;
+            public object Arg1;
+            public object Arg2;
+        }
+
+        private const int maxQueuedCount = 4096;
+        private const int formatIntervalMilliseconds = 20;
+
+        private static LogWriter writer;
+        private static int level = -1;
+        private static readonly ConcurrentQueue<Record> records = new ConcurrentQueue<Record>();
+        private static int queuedCount;
+        private static long droppedCount;
+        private static int formatterStarted;
+    }
+}
\ No newline at end of file
@@ -1,5 +1,4 @@
 ﻿using System;
-using System.Diagnostics;
 using System.Reflection;
 using System.Reflection.Emit;
 
@@ -21,6 +20,8 @@ namespace GroboTrace.Core
             ticksReaderAddress = MethodBaseTracingInstaller.ticksReaderAddress;
             methodStartedAddress = MethodBaseTracingInstaller.methodStartedAddress;
             methodFinishedAddress = MethodBaseTracingInstaller.methodFinishedAddress;
+            methodCalledAddress = MethodBaseTracingInstaller.methodCalledAddress;
+            probesActiveAddress = MethodBaseTracingInstaller.probesActiveAddress;
         }
 
         public static void InstallTracing(DynamicMethod dynamicMethod)
@@ -30,14 +31,15 @@ namespace GroboTrace.Core
 
         private void Install()
         {
-            if(MethodBaseTracingInstaller.tracedMethods.ContainsKey(dynamicMethod))
+            object dummy;
+            if(MethodBaseTracingInstaller.tracedDynamicMethods.TryGetValue(dynamicMethod, out dummy))
                 return;
             lock(dynamicMethod)
             {
-                if(MethodBaseTracingInstaller.tracedMethods.ContainsKey(dynamicMethod))
+                if(MethodBaseTracingInstaller.tracedDynamicMethods.TryGetValue(dynamicMethod, out dummy))
                     return;
                 ExtendInternal();
-                MethodBaseTracingInstaller.tracedMethods.TryAdd(dynamicMethod, 0);
+                MethodBaseTracingInstaller.tracedDynamicMethods.Add(dynamicMethod, null);
             }
         }
 
@@ -45,33 +47,33 @@ namespace GroboTrace.Core
         {
             var methodBody = MethodBody.Read(dynamicMethod, false);
 
-            bool output = true;
+            var verbose = DiagnosticLog.IsEnabled(LogLevel.Verbose);
 
-            if(output) Debug.WriteLine("");
-            if(output) Debug.WriteLine("Initial methodBody of DynamicMethod");
-            if(output) Debug.WriteLine(methodBody);
+            if(verbose) DiagnosticLog.Write(LogLevel.Verbose, "Initial methodBody of DynamicMethod" + Environment.NewLine + methodBody);
 
             var methodContainsCycles = CycleFinderWithoutRecursion.HasCycle(methodBody.Instructions.ToArray());
-            if(output) Debug.WriteLine("Contains cycles: " + methodContainsCycles + "\n");
+            if(verbose) DiagnosticLog.Write(LogLevel.Verbose, "Contains cycles: {0}", methodContainsCycles);
 
-            if(!methodContainsCycles && methodBody.Instructions.Count < 50)
+            if(methodBody.Instructions.Count < MethodBaseTracingInstaller.filterMinInstructions && !(methodContainsCycles && MethodBaseTracingInstaller.filterTracesSmallMethodsWithLoops))
             {
-                Debug.WriteLine(dynamicMethod + " too simple to be traced");
+                DiagnosticLog.Write(LogLevel.Debug, "{0} too simple to be traced", dynamicMethod);
                 return;
             }
 
-            AddLocalVariables(methodBody);
-
             int functionId;
-            MethodBaseTracingInstaller.AddMethod(dynamicMethod, out functionId);
+            MethodBaseTracingInstaller.AddMethod(dynamicMethod, UIntPtr.Zero, out functionId);
 
-            ModifyMethodBody(methodBody, functionId);
+            if(TracingSettings.Mode == TracingMode.Counting)
+                InjectCallCounter(methodBody, functionId);
+            else
+            {
+                AddLocalVariables(methodBody);
+                ModifyMethodBody(methodBody, functionId);
+            }
 
             methodBody.WriteToDynamicMethod(dynamicMethod, Math.Max(methodBody.MaxStack, 3));
 
-            if(output) Debug.WriteLine("");
-            if(output) Debug.WriteLine("Changed methodBody of DynamicMethod");
-            if(output) Debug.WriteLine(methodBody);
+            if(verbose) DiagnosticLog.Write(LogLevel.Verbose, "Changed methodBody of DynamicMethod" + Environment.NewLine + methodBody);
         }
 
         private void AddLocalVariables(MethodBody methodBody)
@@ -86,6 +88,17 @@ namespace GroboTrace.Core
             ticksLocalIndex = methodBody.AddLocalVariable(typeof(long)).LocalIndex;
         }
 
+        private void InjectCallCounter(MethodBody methodBody, int functionId)
+        {
+            var methodCalledSignature = typeof(TracingAnalyzer).Module.ResolveSignature(typeof(TracingAnalyzer).GetMethod("MethodCalled", BindingFlags.Public | BindingFlags.Static).MetadataToken);
+
+            int startIndex = 0;
+
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldc_I4, (int)functionId)); // [ functionId ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)methodCalledAddress : (long)methodCalledAddress)); // [ functionId, funcAddr ]
+            methodBody.Instructions.Insert(startIndex, Instruction.Create(OpCodes.Calli, methodCalledSignature)); // []
+        }
+
         private void ModifyMethodBody(MethodBody methodBody, int functionId)
         {
             MethodBaseTracingInstaller.ReplaceRetInstructions(methodBody.Instructions, hasReturnType, resultLocalIndex);
@@ -98,20 +111,37 @@ namespace GroboTrace.Core
 
             int startIndex = 0;
 
-            methodBody.Instructions.Insert(startIndex++, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)ticksReaderAddress : (long)ticksReaderAddress));
+            var tryStartInstruction = methodBody.Instructions[startIndex];
+
+            // While probes are inactive (see TracingAnalyzer.UpdateProbesActive) the call is not timed at all, start ticks are left 0 to skip the finally part as well
+            var probeStartInstruction = Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)ticksReaderAddress : (long)ticksReaderAddress);
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)probesActiveAddress : (long)probesActiveAddress)); // [ flagAddr ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldind_I4)); // [ probesActive ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Brtrue, probeStartInstruction)); // []
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldc_I8, 0L)); // [ 0 ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Stloc, ticksLocalIndex)); // []
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Br, tryStartInstruction));
+
+            methodBody.Instructions.Insert(startIndex++, probeStartInstruction);
             methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Calli, ticksReaderSignature));
             methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Stloc, ticksLocalIndex));
 
             methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldc_I4, (int)functionId)); // [ ourMethod, functionId ]
-            methodBody.Instructions.Insert(startIndex++, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)methodStartedAddress : (long)methodStartedAddress)); // [ ourMethod, functionId, funcAddr ]
-            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Calli, methodStartedSignature)); // []
-
-            var tryStartInstruction = methodBody.Instructions[startIndex];
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldloc, ticksLocalIndex)); // [ ourMethod, functionId, startTicks ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)methodStartedAddress : (long)methodStartedAddress)); // [ ourMethod, functionId, startTicks, funcAddr ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Calli, methodStartedSignature)); // [ recorded ]
+            // A call MethodStarted did not record gets no MethodFinished either, start ticks are zeroed to skip the finally part
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Brtrue, tryStartInstruction)); // []
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldc_I8, 0L)); // [ 0 ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Stloc, ticksLocalIndex)); // []
 
             Instruction tryEndInstruction;
             Instruction finallyStartInstruction;
+            Instruction endFinallyInstruction = Instruction.Create(OpCodes.Endfinally);
 
-            methodBody.Instructions.Insert(methodBody.Instructions.Count, finallyStartInstruction = tryEndInstruction = Instruction.Create(OpCodes.Ldc_I4, (int)functionId)); // [ functionId ]
+            methodBody.Instructions.Insert(methodBody.Instructions.Count, finallyStartInstruction = tryEndInstruction = Instruction.Create(OpCodes.Ldloc, ticksLocalIndex)); // [ startTicks ]
+            methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(OpCodes.Brfalse, endFinallyInstruction)); // []
+            methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(OpCodes.Ldc_I4, (int)functionId)); // [ functionId ]
             methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)ticksReaderAddress : (long)ticksReaderAddress)); // [ functionId, funcAddr ]
             methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(OpCodes.Calli, ticksReaderSignature)); // [ functionId, ticks ]
             methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(OpCodes.Ldloc, ticksLocalIndex)); // [ functionId, ticks, startTicks ]
@@ -119,8 +149,7 @@ namespace GroboTrace.Core
             methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)methodFinishedAddress : (long)methodFinishedAddress)); // [ functionId, elapsed, profilerOverhead , funcAddr ]
             methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(OpCodes.Calli, methodFinishedSignature)); // []
 
-            Instruction endFinallyInstruction;
-            methodBody.Instructions.Insert(methodBody.Instructions.Count, endFinallyInstruction = Instruction.Create(OpCodes.Endfinally));
+            methodBody.Instructions.Insert(methodBody.Instructions.Count, endFinallyInstruction);
 
             Instruction finallyEndInstruction;
 
@@ -149,6 +178,8 @@ namespace GroboTrace.Core
         private static IntPtr ticksReaderAddress;
         private static IntPtr methodStartedAddress;
         private static IntPtr methodFinishedAddress;
+        private static IntPtr methodCalledAddress;
+        private static IntPtr probesActiveAddress;
 
         int resultLocalIndex = -1;
         int ticksLocalIndex;
@@ -1,5 +1,4 @@
 ﻿using System;
-using System.Diagnostics;
 using System.IO;
 using System.Reflection;
 using System.Runtime.InteropServices;
@@ -8,17 +7,17 @@ using RGiesecke.DllExport;
 
 namespace GroboTrace.Core
 {
-    public static class Loader
+    public static unsafe class Loader
     {
         private static Assembly CurrentDomain_AssemblyResolve(object sender, ResolveEventArgs args)
         {
-            Debug.WriteLine(args.Name);
+            DiagnosticLog.Write(LogLevel.Debug, ".NET: resolving assembly {0}", args.Name);
             foreach(var dll in dlls)
             {
                 if(args.Name.StartsWith(dll.FullName))
                 {
                     var dllFileName = dll.FileName;
-                    Debug.WriteLine("Asked to load {0}: {1}", dll, args.Name);
+                    DiagnosticLog.Write(LogLevel.Debug, ".NET: asked to load {0}: {1}", dllFileName, args.Name);
                     return Assembly.LoadFrom(Path.Combine(profilerDirectory, dllFileName));
                 }
             }
@@ -28,13 +27,84 @@ namespace GroboTrace.Core
         [DllExport(CallingConvention = CallingConvention.Cdecl)]
         public static void SetProfilerPath([MarshalAs(UnmanagedType.LPWStr)] string profilerDirectory)
         {
-            Debug.WriteLine("Profiler directory: " + profilerDirectory);
+            DiagnosticLog.Write(LogLevel.Debug, ".NET: profiler directory is {0}", profilerDirectory);
 
             Loader.profilerDirectory = profilerDirectory;
 
             AppDomain.CurrentDomain.AssemblyResolve += CurrentDomain_AssemblyResolve;
         }
 
+        // Entry of the profiler's bootstrap on .NET Core: load_assembly_and_get_function_pointer with the default
+        // ComponentEntryPoint signature. UnmanagedCallersOnly is not there in .NET Framework 4.5, so the exports are handed out as delegates
+        public static int GetEntryPoints(IntPtr entryPoints, int size)
+        {
+            var defaultContextLoader = GetDefaultContextLoader();
+            if(defaultContextLoader != null)
+                return (int)defaultContextLoader.GetMethod("GetEntryPoints").Invoke(null, new object[] {entryPoints, size});
+            if(size != entryPointDelegates.Length * IntPtr.Size)
+                return -1;
+            for(var i = 0; i < entryPointDelegates.Length; ++i)
+                Marshal.WriteIntPtr(entryPoints, i * IntPtr.Size, Marshal.GetFunctionPointerForDelegate(entryPointDelegates[i]));
+            return 0;
+        }
+
+        // The host loads a component into a load context of its own, where GroboTrace.dll referenced by the application would be loaded
+        // once more with separate statics. The copy there only hands the call over to GroboTrace.Core loaded into the default context.
+        // AssemblyLoadContext is not in .NET Framework 4.5, so it is reached through reflection; null when this is the default context
+        private static Type GetDefaultContextLoader()
+        {
+            var loadContextType = Type.GetType("System.Runtime.Loader.AssemblyLoadContext, System.Runtime.Loader", false);
+            if(loadContextType == null)
+                return null;
+            var defaultContext = loadContextType.GetProperty("Default").GetValue(null, null);
+            var currentContext = loadContextType.GetMethod("GetLoadContext", new[] {typeof(Assembly)}).Invoke(null, new object[] {typeof(Loader).Assembly});
+            if(currentContext == null || ReferenceEquals(currentContext, defaultContext))
+                return null;
+            var assembly = (Assembly)loadContextType.GetMethod("LoadFromAssemblyPath", new[] {typeof(string)}).Invoke(defaultContext, new object[] {typeof(Loader).Assembly.Location});
+            return assembly.GetType(typeof(Loader).FullName, true);
+        }
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        private delegate void SetProfilerPathDelegate([MarshalAs(UnmanagedType.LPWStr)] string profilerDirectory);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        private delegate void InitDelegate([MarshalAs(UnmanagedType.FunctionPtr)] MethodBaseTracingInstaller.SignatureTokenBuilderDelegate signatureTokenBuilderDelegate,
+                                           [MarshalAs(UnmanagedType.FunctionPtr)] MethodBaseTracingInstaller.MapEntriesAllocator mapEntriesAllocator,
+                                           [MarshalAs(UnmanagedType.FunctionPtr)] MethodBaseTracingInstaller.SampledTreeCopier sampledTreeCopier,
+                                           [MarshalAs(UnmanagedType.FunctionPtr)] MethodBaseTracingInstaller.SampledTreeCleaner sampledTreeCleaner,
+                                           [MarshalAs(UnmanagedType.FunctionPtr)] MethodBaseTracingInstaller.MethodSymbolReader methodSymbolReader,
+                                           [MarshalAs(UnmanagedType.FunctionPtr)] MethodBaseTracingInstaller.SharedStatsAreaGetter sharedStatsAreaGetter,
+                                           [MarshalAs(UnmanagedType.FunctionPtr)] DiagnosticLog.LogWriter logWriter,
+                                           int logLevel,
+                                           [MarshalAs(UnmanagedType.FunctionPtr)] MethodBaseTracingInstaller.WaitSlotSetter waitSlotSetter,
+                                           [MarshalAs(UnmanagedType.FunctionPtr)] MethodBaseTracingInstaller.ThreadCpuTimeReader threadCpuTimeReader);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        private delegate SharpResponse InstallTracingDelegate([MarshalAs(UnmanagedType.LPWStr)] string assemblyName,
+                                                              [MarshalAs(UnmanagedType.LPWStr)] string moduleName,
+                                                              UIntPtr moduleId,
+                                                              uint methodToken,
+                                                              byte* rawMethodBody,
+                                                              [MarshalAs(UnmanagedType.FunctionPtr)] MethodBaseTracingInstaller.MethodBodyAllocator allocateForMethodBody,
+                                                              int minInstructions,
+                                                              int traceSmallMethodsWithLoops);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        private delegate void ModuleUnloadedDelegate(UIntPtr moduleId);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        private delegate int ControlDelegate(int command, long value, byte* argument, int argumentSize, byte* message, int* messageSize);
+
+        // In the order of CoreEntryPoints in ManagedBootstrap.h, the fields keep the delegates alive for the lifetime of the process
+        private static readonly Delegate[] entryPointDelegates =
+            {
+                new SetProfilerPathDelegate(SetProfilerPath),
+                new InitDelegate(MethodBaseTracingInstaller.Init),
+                new InstallTracingDelegate(MethodBaseTracingInstaller.InstallTracing),
+                new ModuleUnloadedDelegate(MethodBaseTracingInstaller.ModuleUnloaded),
+                new ControlDelegate(MethodBaseTracingInstaller.Control),
+            };
+
         private static readonly DllName[] dlls =
             {
                 new DllName("GroboTrace,", "GroboTrace.dll"),
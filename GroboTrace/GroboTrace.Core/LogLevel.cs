@@ -0,0 +1,13 @@
+﻿namespace GroboTrace.Core
+{
+    // Same values as DiagnosticLog::Level of the profiler
+    public enum LogLevel
+    {
+        Error,
+        Info,
+        Debug,
+
+        // Method bodies before and after rewriting
+        Verbose
+    }
+}
\ No newline at end of file
@@ -1,12 +1,13 @@
 ﻿using System;
 using System.Collections.Concurrent;
 using System.Collections.Generic;
-using System.Diagnostics;
 using System.Linq;
 using System.Reflection;
 using System.Reflection.Emit;
 using System.Runtime.CompilerServices;
 using System.Runtime.InteropServices;
+using System.Text;
+using System.Text.RegularExpressions;
 using System.Threading;
 
 using GrEmit.Injection;
@@ -30,12 +31,25 @@ namespace GroboTrace.Core
         public int fAccurate; // real type is bool (false = 0, true != 0)
     }
 
+    // Node of a call tree aggregated by the native stack sampler, nodes go in preorder
+    [StructLayout(LayoutKind.Sequential)]
+    public struct SampledNode
+    {
+        public int parentIndex;
+        public int samples;
+        public UIntPtr moduleId;
+        public uint methodToken;
+        public IntPtr assemblyName;
+        public IntPtr modulePath;
+    }
+
     [StructLayout(LayoutKind.Sequential)]
     public struct SharpResponse
     {
         public IntPtr newMethodBody;
         public IntPtr pMapEntries;
         public uint mapEntriesCount;
+        public int methodId;
     }
 
     public static unsafe class MethodBaseTracingInstaller
@@ -63,6 +77,13 @@ namespace GroboTrace.Core
 
             methodStartedAddress = typeof(TracingAnalyzer).GetMethod("MethodStarted", BindingFlags.Public | BindingFlags.Static).MethodHandle.GetFunctionPointer();
             methodFinishedAddress = typeof(TracingAnalyzer).GetMethod("MethodFinished", BindingFlags.Public | BindingFlags.Static).MethodHandle.GetFunctionPointer();
+            methodCalledAddress = typeof(TracingAnalyzer).GetMethod("MethodCalled", BindingFlags.Public | BindingFlags.Static).MethodHandle.GetFunctionPointer();
+            blockEnteredAddress = typeof(TracingAnalyzer).GetMethod("BlockEntered", BindingFlags.Public | BindingFlags.Static).MethodHandle.GetFunctionPointer();
+            probesActiveAddress = TracingAnalyzer.probesActiveAddress;
+
+            callCounterShardsCount = 1;
+            while(callCounterShardsCount < Environment.ProcessorCount && callCounterShardsCount < maxCallCounterShardsCount)
+                callCounterShardsCount *= 2;
         }
 
         public static long TemplateForTicksSignature()
@@ -70,6 +91,8 @@ namespace GroboTrace.Core
             return 0L;
         }
 
+        // The only way to instrument dynamic methods: the profiling API reports their compilation (see CorProfiler::DynamicMethodJITCompilationStarted),
+        // but cannot replace their IL, as they have no module and no methodDef token
         public static void HookCreateDelegate(MethodInfo createDelegateMethod)
         {
             RuntimeHelpers.PrepareMethod(createDelegateMethod.MethodHandle);
@@ -157,10 +180,43 @@ namespace GroboTrace.Core
         [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
         public delegate IntPtr MapEntriesAllocator(UIntPtr size);
 
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        public delegate int SampledTreeCopier(int currentThreadOnly, SampledNode* buffer, int capacity);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        public delegate void SampledTreeCleaner(int currentThreadOnly);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        public delegate int MethodSymbolReader(int methodId, sbyte** assemblyName, sbyte** typeName, sbyte** methodName);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        public delegate byte* SharedStatsAreaGetter(long* capacity);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        public delegate void WaitSlotSetter(IntPtr slot);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        public delegate long ThreadCpuTimeReader();
+
         [DllExport(CallingConvention = CallingConvention.Cdecl)]
         public static void Init([MarshalAs(UnmanagedType.FunctionPtr)] SignatureTokenBuilderDelegate signatureTokenBuilderDelegate,
-                                [MarshalAs(UnmanagedType.FunctionPtr)] MapEntriesAllocator mapEntriesAllocator)
+                                [MarshalAs(UnmanagedType.FunctionPtr)] MapEntriesAllocator mapEntriesAllocator,
+                                [MarshalAs(UnmanagedType.FunctionPtr)] SampledTreeCopier sampledTreeCopier,
+                                [MarshalAs(UnmanagedType.FunctionPtr)] SampledTreeCleaner sampledTreeCleaner,
+                                [MarshalAs(UnmanagedType.FunctionPtr)] MethodSymbolReader methodSymbolReader,
+                                [MarshalAs(UnmanagedType.FunctionPtr)] SharedStatsAreaGetter sharedStatsAreaGetter,
+                                [MarshalAs(UnmanagedType.FunctionPtr)] DiagnosticLog.LogWriter logWriter,
+                                int logLevel,
+                                [MarshalAs(UnmanagedType.FunctionPtr)] WaitSlotSetter waitSlotSetter,
+                                [MarshalAs(UnmanagedType.FunctionPtr)] ThreadCpuTimeReader threadCpuTimeReader)
         {
+            DiagnosticLog.Init(logWriter, logLevel);
+            TicksCalibration.Init();
+            StackSamples.Init(sampledTreeCopier, sampledTreeCleaner);
+            MethodSymbols.Init(methodSymbolReader);
+            // Thresholds are resolved when methods are registered, so they must be known before the first one is
+            CallWatchdog.Init();
+
             signatureTokenBuilder = (moduleId, signature) =>
                 {
                     fixed(byte* b = &signature[0])
@@ -174,12 +230,18 @@ namespace GroboTrace.Core
 
             MethodBody.Init();
             MethodCallNodeEdgesFactory.Init();
+            SharedStatsPublisher.Init(sharedStatsAreaGetter);
+            OverheadGovernor.Init();
+            WaitEvents.Init(waitSlotSetter);
+            CpuTime.Init(threadCpuTimeReader);
 
             HookCreateDelegate(typeof(DynamicMethod).GetMethod("CreateDelegate", BindingFlags.Instance | BindingFlags.Public, null, new[] {typeof(Type), typeof(object)}, null));
             HookCreateDelegate(typeof(DynamicMethod).GetMethod("CreateDelegate", BindingFlags.Instance | BindingFlags.Public, null, new[] {typeof(Type)}, null));
 
             RuntimeHelpers.PrepareMethod(typeof(TracingAnalyzer).GetMethod("MethodStarted", BindingFlags.Public | BindingFlags.Static).MethodHandle);
             RuntimeHelpers.PrepareMethod(typeof(TracingAnalyzer).GetMethod("MethodFinished", BindingFlags.Public | BindingFlags.Static).MethodHandle);
+            RuntimeHelpers.PrepareMethod(typeof(TracingAnalyzer).GetMethod("MethodCalled", BindingFlags.Public | BindingFlags.Static).MethodHandle);
+            RuntimeHelpers.PrepareMethod(typeof(TracingAnalyzer).GetMethod("BlockEntered", BindingFlags.Public | BindingFlags.Static).MethodHandle);
         }
 
         [DllExport(CallingConvention = CallingConvention.Cdecl)]
@@ -189,24 +251,22 @@ namespace GroboTrace.Core
             UIntPtr moduleId,
             uint methodToken,
             byte* rawMethodBody,
-            [MarshalAs(UnmanagedType.FunctionPtr)] MethodBodyAllocator allocateForMethodBody)
+            [MarshalAs(UnmanagedType.FunctionPtr)] MethodBodyAllocator allocateForMethodBody,
+            int minInstructions,
+            int traceSmallMethodsWithLoops)
         {
             SharpResponse response = new SharpResponse();
+            filterMinInstructions = minInstructions;
+            filterTracesSmallMethodsWithLoops = traceSmallMethodsWithLoops != 0;
 
-            Debug.WriteLine(".NET: assembly = {0}; module = {1}", assemblyName, moduleName);
-            var assembly = AppDomain.CurrentDomain.GetAssemblies().FirstOrDefault(a => a.GetName().Name == assemblyName);
-            if(assembly == null)
-            {
-                Debug.WriteLine(".NET: Unable to obtain assembly with name {0}", assemblyName);
-                return response;
-            }
+            // Checked once per method, nothing is formatted below unless the level is on
+            var debug = DiagnosticLog.IsEnabled(LogLevel.Debug);
+            var verbose = DiagnosticLog.IsEnabled(LogLevel.Verbose);
 
-            var module = assembly.GetModules().FirstOrDefault(m => !m.Assembly.IsDynamic && m.FullyQualifiedName == moduleName);
+            if(debug) DiagnosticLog.Write(LogLevel.Debug, ".NET: assembly = {0}; module = {1}", assemblyName, moduleName);
+            var module = ResolveModule(assemblyName, moduleName);
             if(module == null)
-            {
-                Debug.WriteLine(".NET: Unable to obtain module. Assembly = {0}, module path = {1}", assemblyName, moduleName);
                 return response;
-            }
 
             MethodBase method;
             try
@@ -215,55 +275,109 @@ namespace GroboTrace.Core
             }
             catch(Exception)
             {
-                Debug.WriteLine(".NET: Unable to obtain method with token {2}. Assembly = {0}, module path = {1}", assemblyName, moduleName, methodToken);
+                DiagnosticLog.Write(LogLevel.Error, ".NET: Unable to obtain method with token {2}. Assembly = {0}, module path = {1}", assemblyName, moduleName, methodToken);
                 return response;
             }
 
-            Debug.WriteLine(".NET: type = {0}, method = {1}", method.DeclaringType, method);
+            // [DontTrace] and filter rules are checked by the profiler before calling here
+            if(debug) DiagnosticLog.Write(LogLevel.Debug, ".NET: method {0}.{1} is asked to be traced", method.DeclaringType, method);
+
+            var methodBody = MethodBody.Read(rawMethodBody, module, new MetadataToken(methodToken), false);
+
+            var rawSignature = methodBody.MethodSignature;
+            var methodSignature = new SignatureReader(rawSignature).ReadAndParseMethodSignature();
 
-            if(HasDontTraceAttribute(method))
+            if(verbose)
             {
-                Debug.WriteLine(method + " is marked with DontTraceAttribute and will not be traced");
-                return response;
+                DiagnosticLog.Write(LogLevel.Verbose, ".NET: method's signature is: " + Convert.ToBase64String(rawSignature));
+                DiagnosticLog.Write(LogLevel.Verbose, ".NET: method has {0} parameters", methodSignature.ParamCount);
+                WriteMethodBody("Plain", method, methodBody);
             }
 
-            if(HasDontTraceAttribute(method.DeclaringType))
+            var methodContainsCycles = CycleFinderWithoutRecursion.HasCycle(methodBody.Instructions.ToArray());
+
+            if(verbose) DiagnosticLog.Write(LogLevel.Verbose, "Contains cycles: {0}", methodContainsCycles);
+
+            if(methodBody.Instructions.Count < minInstructions && !(methodContainsCycles && traceSmallMethodsWithLoops != 0))
             {
-                Debug.WriteLine(method + " declaring type is marked with DontTraceAttribute and will not be traced");
+                if(debug) DiagnosticLog.Write(LogLevel.Debug, "{0} too simple to be traced", method);
                 return response;
             }
 
-            var output = true;
+            int functionId;
+            AddMethod(method, moduleId, out functionId);
 
-            if(output) Debug.WriteLine(".NET: method {0} is asked to be traced", method);
+            List<Tuple<Instruction, int>> oldOffsets = new List<Tuple<Instruction, int>>();
 
-            var methodBody = MethodBody.Read(rawMethodBody, module, new MetadataToken(methodToken), false);
+            foreach(var instruction in methodBody.Instructions)
+                oldOffsets.Add(Tuple.Create(instruction, instruction.Offset));
 
-            var rawSignature = methodBody.MethodSignature;
-            var methodSignature = new SignatureReader(rawSignature).ReadAndParseMethodSignature();
+            if(BasicBlockCounters.NeedCount(method))
+            {
+                var blockEnteredSignature = typeof(TracingAnalyzer).Module.ResolveSignature(typeof(TracingAnalyzer).GetMethod("BlockEntered", BindingFlags.Public | BindingFlags.Static).MetadataToken);
+                BasicBlockCounters.InjectCounters(method, methodBody, signatureTokenBuilder(moduleId, blockEnteredSignature), blockEnteredAddress);
+            }
 
-            if(output) Debug.WriteLine(".NET: method's signature is: " + Convert.ToBase64String(rawSignature));
-            if(output) Debug.WriteLine(".NET: method has {0} parameters", methodSignature.ParamCount);
+            if(TracingSettings.Mode == TracingMode.Counting)
+                InjectCallCounter(module, method, methodBody, moduleId, functionId);
+            else
+                InjectTracing(module, method, methodBody, moduleId, functionId);
 
-            if(output) sendToDebug("Plain", method, methodBody);
+            if(verbose) DiagnosticLog.Write(LogLevel.Verbose, "Initial maxStackSize = " + methodBody.MaxStack);
 
-            var methodContainsCycles = CycleFinderWithoutRecursion.HasCycle(methodBody.Instructions.ToArray());
+            methodBody.Seal();
 
-            if(output) Debug.WriteLine("Contains cycles: " + methodContainsCycles + "\n");
+            var methodBytes = methodBody.GetFullMethodBody(sig => signatureTokenBuilder(moduleId, sig), Math.Max(methodBody.MaxStack, 4));
 
-            if(!methodContainsCycles && methodBody.Instructions.Count < 50)
+            if(verbose)
             {
-                Debug.WriteLine(method + " too simple to be traced");
-                return response;
+                WriteMethodBody("Changed", method, methodBody);
+                DiagnosticLog.Write(LogLevel.Verbose, "Calculated maxStackSize = " + methodBody.MaxStack);
             }
 
-            int functionId;
-            AddMethod(method, out functionId);
+            var newMethodBody = (IntPtr)allocateForMethodBody(moduleId, (uint)methodBytes.Length);
+            Marshal.Copy(methodBytes, 0, newMethodBody, methodBytes.Length);
 
-            List<Tuple<Instruction, int>> oldOffsets = new List<Tuple<Instruction, int>>();
+            response.newMethodBody = newMethodBody;
+            response.methodId = functionId;
 
-            foreach(var instruction in methodBody.Instructions)
-                oldOffsets.Add(Tuple.Create(instruction, instruction.Offset));
+            var startMapEntries = allocateForMapEntries((UIntPtr)(oldOffsets.Count * Marshal.SizeOf(typeof(COR_IL_MAP))));
+
+            var pointer = startMapEntries;
+            foreach(var tuple in oldOffsets)
+            {
+                var mapEntry = new COR_IL_MAP
+                    {
+                        fAccurate = 1,
+                        oldOffset = (uint)tuple.Item2,
+                        newOffset = (uint)tuple.Item1.Offset
+                    };
+
+                Marshal.StructureToPtr(mapEntry, pointer, true);
+                pointer += Marshal.SizeOf(typeof(COR_IL_MAP));
+            }
+
+            response.pMapEntries = startMapEntries;
+            response.mapEntriesCount = (uint)oldOffsets.Count;
+
+            return response;
+        }
+
+        private static void InjectCallCounter(Module module, MethodBase method, MethodBody methodBody, UIntPtr moduleId, int functionId)
+        {
+            var methodCalledSignature = typeof(TracingAnalyzer).Module.ResolveSignature(typeof(TracingAnalyzer).GetMethod("MethodCalled", BindingFlags.Public | BindingFlags.Static).MetadataToken);
+            var methodCalledToken = signatureTokenBuilder(moduleId, methodCalledSignature);
+
+            var startIndex = GetStartIndex(module, method, methodBody);
+
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldc_I4, (int)functionId)); // [ functionId ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)methodCalledAddress : (long)methodCalledAddress)); // [ functionId, funcAddr ]
+            methodBody.Instructions.Insert(startIndex, Instruction.Create(OpCodes.Calli, methodCalledToken)); // []
+        }
+
+        private static void InjectTracing(Module module, MethodBase method, MethodBody methodBody, UIntPtr moduleId, int functionId)
+        {
+            var methodSignature = new SignatureReader(methodBody.MethodSignature).ReadAndParseMethodSignature();
 
             int resultLocalIndex = -1;
             int ticksLocalIndex;
@@ -284,49 +398,39 @@ namespace GroboTrace.Core
             var methodFinishedSignature = typeof(TracingAnalyzer).Module.ResolveSignature(typeof(TracingAnalyzer).GetMethod("MethodFinished", BindingFlags.Public | BindingFlags.Static).MetadataToken);
             var methodFinishedToken = signatureTokenBuilder(moduleId, methodFinishedSignature);
 
-            int startIndex = 0;
+            int startIndex = GetStartIndex(module, method, methodBody);
 
-            if(method.IsConstructor)
-            {
-                // Skip code before the call to ::base() or ::this()
-                var declaringType = method.DeclaringType;
-                if(declaringType != null)
-                {
-                    var baseType = declaringType.BaseType ?? typeof(object);
-                    var bindingFlags = BindingFlags.Instance | BindingFlags.Public | BindingFlags.NonPublic;
-                    var constructors = new HashSet<int>(
-                        declaringType.GetConstructors(bindingFlags)
-                                     .Concat(baseType.GetConstructors(bindingFlags))
-                                     .Select(c => c.MetadataToken));
-                    for(int i = 0; i < methodBody.Instructions.Count; ++i)
-                    {
-                        var instruction = methodBody.Instructions[i];
-                        if(instruction.OpCode != OpCodes.Call) continue;
-                        var token = (MetadataToken)instruction.Operand;
-                        var m = MetadataExtensions.ResolveMethod(module, token);
-                        if(constructors.Contains(m.MetadataToken))
-                        {
-                            startIndex = i + 1;
-                            break;
-                        }
-                    }
-                }
-            }
+            var tryStartInstruction = methodBody.Instructions[startIndex];
+
+            // While probes are inactive (see TracingAnalyzer.UpdateProbesActive) the call is not timed at all, start ticks are left 0 to skip the finally part as well
+            var probeStartInstruction = Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)ticksReaderAddress : (long)ticksReaderAddress);
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)probesActiveAddress : (long)probesActiveAddress)); // [ flagAddr ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldind_I4)); // [ probesActive ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Brtrue, probeStartInstruction)); // []
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldc_I8, 0L)); // [ 0 ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Stloc, ticksLocalIndex)); // []
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Br, tryStartInstruction));
 
-            methodBody.Instructions.Insert(startIndex++, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)ticksReaderAddress : (long)ticksReaderAddress));
+            methodBody.Instructions.Insert(startIndex++, probeStartInstruction);
             methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Calli, ticksReaderToken));
             methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Stloc, ticksLocalIndex));
 
             methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldc_I4, (int)functionId)); // [ ourMethod, functionId ]
-            methodBody.Instructions.Insert(startIndex++, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)methodStartedAddress : (long)methodStartedAddress)); // [ ourMethod, functionId, funcAddr ]
-            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Calli, methodStartedToken)); // []
-
-            var tryStartInstruction = methodBody.Instructions[startIndex];
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldloc, ticksLocalIndex)); // [ ourMethod, functionId, startTicks ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)methodStartedAddress : (long)methodStartedAddress)); // [ ourMethod, functionId, startTicks, funcAddr ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Calli, methodStartedToken)); // [ recorded ]
+            // A call MethodStarted did not record gets no MethodFinished either, start ticks are zeroed to skip the finally part
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Brtrue, tryStartInstruction)); // []
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Ldc_I8, 0L)); // [ 0 ]
+            methodBody.Instructions.Insert(startIndex++, Instruction.Create(OpCodes.Stloc, ticksLocalIndex)); // []
 
             Instruction tryEndInstruction;
             Instruction finallyStartInstruction;
+            Instruction endFinallyInstruction = Instruction.Create(OpCodes.Endfinally);
 
-            methodBody.Instructions.Insert(methodBody.Instructions.Count, finallyStartInstruction = tryEndInstruction = Instruction.Create(OpCodes.Ldc_I4, (int)functionId)); // [ functionId ]
+            methodBody.Instructions.Insert(methodBody.Instructions.Count, finallyStartInstruction = tryEndInstruction = Instruction.Create(OpCodes.Ldloc, ticksLocalIndex)); // [ startTicks ]
+            methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(OpCodes.Brfalse, endFinallyInstruction)); // []
+            methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(OpCodes.Ldc_I4, (int)functionId)); // [ functionId ]
             methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)ticksReaderAddress : (long)ticksReaderAddress)); // [ functionId, funcAddr ]
             methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(OpCodes.Calli, ticksReaderToken)); // [ functionId, ticks ]
             methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(OpCodes.Ldloc, ticksLocalIndex)); // [ functionId, ticks, startTicks ]
@@ -334,8 +438,7 @@ namespace GroboTrace.Core
             methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(IntPtr.Size == 4 ? OpCodes.Ldc_I4 : OpCodes.Ldc_I8, IntPtr.Size == 4 ? (int)methodFinishedAddress : (long)methodFinishedAddress)); // [ functionId, elapsed, profilerOverhead , funcAddr ]
             methodBody.Instructions.Insert(methodBody.Instructions.Count, Instruction.Create(OpCodes.Calli, methodFinishedToken)); // []
 
-            Instruction endFinallyInstruction;
-            methodBody.Instructions.Insert(methodBody.Instructions.Count, endFinallyInstruction = Instruction.Create(OpCodes.Endfinally));
+            methodBody.Instructions.Insert(methodBody.Instructions.Count, endFinallyInstruction);
 
             Instruction finallyEndInstruction;
 
@@ -362,68 +465,361 @@ namespace GroboTrace.Core
             }
 
             methodBody.ExceptionHandlers.Add(newException);
+        }
 
-            if(output) Debug.WriteLine("Initial maxStackSize = " + methodBody.MaxStack);
-            if(output) Debug.WriteLine("");
+        private static int GetStartIndex(Module module, MethodBase method, MethodBody methodBody)
+        {
+            if(!method.IsConstructor)
+                return 0;
+            // Skip code before the call to ::base() or ::this()
+            var declaringType = method.DeclaringType;
+            if(declaringType == null)
+                return 0;
+            var baseType = declaringType.BaseType ?? typeof(object);
+            var bindingFlags = BindingFlags.Instance | BindingFlags.Public | BindingFlags.NonPublic;
+            var constructors = new HashSet<int>(
+                declaringType.GetConstructors(bindingFlags)
+                             .Concat(baseType.GetConstructors(bindingFlags))
+                             .Select(c => c.MetadataToken));
+            for(int i = 0; i < methodBody.Instructions.Count; ++i)
+            {
+                var instruction = methodBody.Instructions[i];
+                if(instruction.OpCode != OpCodes.Call) continue;
+                var token = (MetadataToken)instruction.Operand;
+                var m = MetadataExtensions.ResolveMethod(module, token);
+                if(constructors.Contains(m.MetadataToken))
+                    return i + 1;
+            }
+            return 0;
+        }
 
-            methodBody.Seal();
+        internal static Module ResolveModule(string assemblyName, string moduleName)
+        {
+            var assembly = AppDomain.CurrentDomain.GetAssemblies().FirstOrDefault(a => a.GetName().Name == assemblyName);
+            if(assembly == null)
+            {
+                DiagnosticLog.Write(LogLevel.Error, ".NET: Unable to obtain assembly with name {0}", assemblyName);
+                return null;
+            }
 
-            var methodBytes = methodBody.GetFullMethodBody(sig => signatureTokenBuilder(moduleId, sig), Math.Max(methodBody.MaxStack, 4));
+            var module = assembly.GetModules().FirstOrDefault(m => !m.Assembly.IsDynamic && m.FullyQualifiedName == moduleName);
+            if(module == null)
+                DiagnosticLog.Write(LogLevel.Error, ".NET: Unable to obtain module. Assembly = {0}, module path = {1}", assemblyName, moduleName);
+            return module;
+        }
 
-            if(output) sendToDebug("Changed", method, methodBody);
+        // Method id is a slot in the registry plus the generation of the slot in the upper bits, slots of unloaded methods
+        // are reused until their generations run out, so stale ids from old call trees never resolve to a new method
+        public static void AddMethod(MethodBase method, UIntPtr moduleId, out int functionId)
+        {
+            // Instantiations share the body of their definition, so calls of all of them are counted as of the definition
+            var methodInfo = method as MethodInfo;
+            if(methodInfo != null && methodInfo.IsGenericMethod && !methodInfo.IsGenericMethodDefinition)
+                method = methodInfo.GetGenericMethodDefinition();
+            lock(registryLock)
+            {
+                int index;
+                var generation = 0;
+                if(freeSlots.Count > 0)
+                {
+                    index = freeSlots.Pop();
+                    generation = (GetEntry(index).Id >> slotBits) + 1;
+                }
+                else
+                {
+                    index = numberOfMethods;
+                    if(index == slotMask)
+                        throw new InvalidOperationException("Too many traced methods");
+                    Volatile.Write(ref numberOfMethods, index + 1);
+                }
+                functionId = generation << slotBits | (index + 1);
+
+                int adjustedIndex = index;
+                int arrayIndex = GetArrayIndex(index + 1);
+                if(arrayIndex > 0)
+                    adjustedIndex -= counts[arrayIndex - 1];
+
+                if(methods[arrayIndex] == null)
+                    methods[arrayIndex] = new MethodEntry[sizes[arrayIndex]];
+                // The overhead governor may step tracing down to counting calls
+                if((TracingSettings.Mode == TracingMode.Counting || TracingSettings.CpuBudgetPercent > 0) && callCounters[arrayIndex] == null)
+                    callCounters[arrayIndex] = CreateCallCounters(sizes[arrayIndex]);
+
+                // Dynamic methods are referenced weakly, their slots are reclaimed after they are collected
+                var dynamicMethod = method as DynamicMethod;
+                var entry = new MethodEntry {Id = functionId, ModuleId = moduleId, Disabled = IsDisabledByRules(method), WatchdogThreshold = CallWatchdog.GetThreshold(method)};
+                if(dynamicMethod == null)
+                    entry.Method = method;
+                else
+                    entry.DynamicMethod = new WeakReference<DynamicMethod>(dynamicMethod);
+
+                Volatile.Write(ref methods[arrayIndex][adjustedIndex], entry);
+
+                if(dynamicMethod != null)
+                {
+                    dynamicMethodSlots.Add(index);
+                    if(dynamicMethodSlots.Count >= nextDynamicMethodsSweep)
+                    {
+                        ReclaimCollectedDynamicMethods();
+                        nextDynamicMethodsSweep = Math.Max(dynamicMethodSlots.Count * 2, minDynamicMethodsSweep);
+                    }
+                }
+                else if(moduleId != UIntPtr.Zero)
+                {
+                    List<int> slots;
+                    if(!moduleSlots.TryGetValue(moduleId, out slots))
+                        moduleSlots.Add(moduleId, slots = new List<int>());
+                    slots.Add(index);
+                }
+            }
+        }
 
-            if(output) Debug.WriteLine("Calculated maxStackSize = " + methodBody.MaxStack);
-            if(output) Debug.WriteLine("");
+        // Called by the profiler when a module is about to be unloaded (collectible assemblies, unloaded app domains)
+        [DllExport(CallingConvention = CallingConvention.Cdecl)]
+        public static void ModuleUnloaded(UIntPtr moduleId)
+        {
+            StackSamples.ModuleUnloaded(moduleId);
+            lock(registryLock)
+            {
+                List<int> slots;
+                if(!moduleSlots.TryGetValue(moduleId, out slots))
+                    return;
+                moduleSlots.Remove(moduleId);
+                foreach(var index in slots)
+                    ReleaseSlot(index, true);
+                DiagnosticLog.Write(LogLevel.Debug, ".NET: module {0} is unloaded, {1} methods are released", moduleId, slots.Count);
+            }
+        }
 
-            var newMethodBody = (IntPtr)allocateForMethodBody(moduleId, (uint)methodBytes.Length);
-            Marshal.Copy(methodBytes, 0, newMethodBody, methodBytes.Length);
+        private static void ReclaimCollectedDynamicMethods()
+        {
+            var alive = 0;
+            for(var i = 0; i < dynamicMethodSlots.Count; ++i)
+            {
+                var index = dynamicMethodSlots[i];
+                DynamicMethod dynamicMethod;
+                if(GetEntry(index).DynamicMethod.TryGetTarget(out dynamicMethod))
+                    dynamicMethodSlots[alive++] = index;
+                else
+                    ReleaseSlot(index, true);
+            }
+            dynamicMethodSlots.RemoveRange(alive, dynamicMethodSlots.Count - alive);
+        }
 
-            response.newMethodBody = newMethodBody;
+        // Removes a method registered by GroboTrace itself, its call counts are dropped instead of being counted as unloaded
+        internal static void RemoveMethod(int id)
+        {
+            lock(registryLock)
+            {
+                var index = GetIndex(id);
+                if(GetMethodId(index + 1) == id)
+                    ReleaseSlot(index, false);
+            }
+        }
 
-            var startMapEntries = allocateForMapEntries((UIntPtr)(oldOffsets.Count * Marshal.SizeOf(typeof(COR_IL_MAP))));
+        // Must be called under registryLock. Call counts of the method are folded into the tombstone unless dropped, the entry stays
+        // in the slot with its old id until the slot is reused, so that the old id resolves to UnloadedMethod. The entry's flags are reset,
+        // so that a disabled method does not keep probes filtered after it is gone.
+        // Histograms are kept by threads under the old id, readers count them as unloaded (see MethodHistograms)
+        private static void ReleaseSlot(int index, bool keepCalls)
+        {
+            int adjustedIndex = index;
+            int arrayIndex = GetArrayIndex(index + 1);
+            if(arrayIndex > 0)
+                adjustedIndex -= counts[arrayIndex - 1];
 
-            var pointer = startMapEntries;
-            foreach(var tuple in oldOffsets)
+            var entry = methods[arrayIndex][adjustedIndex];
+            entry.Method = null;
+            entry.DynamicMethod = null;
+            entry.CpuTimed = false;
+            if(entry.Disabled)
             {
-                var mapEntry = new COR_IL_MAP
-                    {
-                        fAccurate = 1,
-                        oldOffset = (uint)tuple.Item2,
-                        newOffset = (uint)tuple.Item1.Offset
-                    };
+                entry.Disabled = false;
+                Volatile.Write(ref disabledMethodsCount, disabledMethodsCount - 1);
+                TracingAnalyzer.UpdateProbesFilter();
+            }
 
-                Marshal.StructureToPtr(mapEntry, pointer, true);
-                pointer += Marshal.SizeOf(typeof(COR_IL_MAP));
+            var shards = callCounters[arrayIndex];
+            if(shards != null)
+            {
+                long calls = 0;
+                foreach(var shard in shards)
+                    calls += Interlocked.Exchange(ref shard[adjustedIndex + callCounterPadding], 0);
+                if(keepCalls)
+                    Interlocked.Add(ref unloadedMethodCalls, calls);
             }
 
-            response.pMapEntries = startMapEntries;
-            response.mapEntriesCount = (uint)oldOffsets.Count;
+            // A slot of the last generation is retired, its tombstone stays for good
+            if(entry.Id >> slotBits < maxGeneration)
+                freeSlots.Push(index);
+        }
 
-            return response;
+        // Turns probes of the matching methods on or off, the rule applies to methods instrumented later as well
+        public static int SetMethodsEnabled(Regex filter, bool enabled)
+        {
+            lock(registryLock)
+            {
+                methodRules.Add(Tuple.Create(filter, enabled));
+                var changed = 0;
+                for(var index = 0; index < numberOfMethods; ++index)
+                {
+                    var method = GetMethod(GetMethodId(index + 1));
+                    if(method == null || !filter.IsMatch(GetFullName(method)))
+                        continue;
+                    GetEntry(index).Disabled = !enabled;
+                    ++changed;
+                }
+                UpdateDisabledMethodsCount();
+                return changed;
+            }
         }
 
-        private static bool HasDontTraceAttribute(MemberInfo member)
+        // Drops all rules, probes of every method are on
+        public static void EnableAllMethods()
         {
-            return member != null && member.GetCustomAttribute(typeof(DontTraceAttribute), false) != null;
+            lock(registryLock)
+            {
+                methodRules.Clear();
+                for(var index = 0; index < numberOfMethods; ++index)
+                    GetEntry(index).Disabled = false;
+                UpdateDisabledMethodsCount();
+            }
         }
 
-        public static void AddMethod(MethodBase method, out int functionId)
+        internal static void SetMethodDisabled(int id, bool disabled)
         {
-            var index = Interlocked.Increment(ref numberOfMethods) - 1;
-            functionId = index + 1;
-            int adjustedIndex = index;
+            lock(registryLock)
+            {
+                var entry = GetEntry(GetIndex(id));
+                if(entry == null || entry.Id != id)
+                    return;
+                entry.Disabled = disabled;
+                UpdateDisabledMethodsCount();
+            }
+        }
 
-            int arrayIndex = GetArrayIndex(index + 1);
-            if(arrayIndex > 0)
-                adjustedIndex -= counts[arrayIndex - 1];
+        // Ids of released methods are never disabled, their calls are counted as unloaded
+        public static bool IsMethodDisabled(int id)
+        {
+            var entry = GetEntry((id & slotMask) - 1);
+            return entry != null && entry.Id == id && entry.Disabled;
+        }
+
+        public static int DisabledMethodsCount { get { return Volatile.Read(ref disabledMethodsCount); } }
+
+        // Calls of these methods read CPU time of the thread on entry and exit, see CpuTime
+        public static void SetCpuTimedMethods(HashSet<int> ids)
+        {
+            lock(registryLock)
+            {
+                for(var index = 0; index < numberOfMethods; ++index)
+                {
+                    var entry = GetEntry(index);
+                    entry.CpuTimed = ids.Contains(entry.Id);
+                }
+            }
+        }
+
+        public static bool IsMethodCpuTimed(int id)
+        {
+            var entry = GetEntry((id & slotMask) - 1);
+            return entry != null && entry.Id == id && entry.CpuTimed;
+        }
+
+        // 0 for ids of unloaded methods
+        public static int GetWatchdogThreshold(int id)
+        {
+            var entry = GetEntry((id & slotMask) - 1);
+            return entry != null && entry.Id == id ? entry.WatchdogThreshold : 0;
+        }
+
+        // Must be called under registryLock
+        private static bool IsDisabledByRules(MethodBase method)
+        {
+            if(methodRules.Count == 0)
+                return false;
+            var name = GetFullName(method);
+            for(var i = methodRules.Count - 1; i >= 0; --i)
+            {
+                if(methodRules[i].Item1.IsMatch(name))
+                    return !methodRules[i].Item2;
+            }
+            return false;
+        }
 
-            if(methods[arrayIndex] == null)
+        // Must be called under registryLock
+        private static void UpdateDisabledMethodsCount()
+        {
+            var count = 0;
+            for(var index = 0; index < numberOfMethods; ++index)
             {
-                int arrayLength = sizes[arrayIndex];
-                Interlocked.CompareExchange(ref methods[arrayIndex], new MethodBase[arrayLength], null);
+                if(GetEntry(index).Disabled)
+                    ++count;
             }
+            Volatile.Write(ref disabledMethodsCount, count);
+            TracingAnalyzer.UpdateProbesFilter();
+        }
 
-            methods[arrayIndex][adjustedIndex] = method;
+        private static string GetFullName(MethodBase method)
+        {
+            return method.DeclaringType?.FullName + "." + method.Name;
+        }
+
+        // Resets per method totals, call trees are cleared separately
+        public static void ClearMethodStats()
+        {
+            MethodHistograms.Clear();
+            var numberOfMethods = NumberOfMethods;
+            for(var slot = 1; slot <= numberOfMethods; ++slot)
+            {
+                var methodId = GetMethodId(slot);
+                if(methodId == 0)
+                    continue;
+                int adjustedIndex = slot - 1;
+                int arrayIndex = GetArrayIndex(slot);
+                if(arrayIndex > 0)
+                    adjustedIndex -= counts[arrayIndex - 1];
+                var shards = callCounters[arrayIndex];
+                if(shards == null)
+                    continue;
+                foreach(var shard in shards)
+                    Interlocked.Exchange(ref shard[adjustedIndex + callCounterPadding], 0);
+            }
+            Interlocked.Exchange(ref unloadedMethodCalls, 0);
+        }
+
+        // Called by the profiler's control socket thread, see ControlProtocol.h
+        [DllExport(CallingConvention = CallingConvention.Cdecl)]
+        public static int Control(int command, long value, byte* argument, int argumentSize, byte* message, int* messageSize)
+        {
+            string reply;
+            int status;
+            try
+            {
+                var argumentString = argumentSize > 0 ? new string((sbyte*)argument, 0, argumentSize, Encoding.UTF8) : "";
+                status = (int)ControlCommands.Execute((ControlCommand)command, value, argumentString, out reply);
+            }
+            catch(Exception e)
+            {
+                status = (int)ControlStatus.Failed;
+                reply = e.ToString();
+            }
+            var bytes = Encoding.UTF8.GetBytes(reply ?? "");
+            var size = Math.Min(bytes.Length, *messageSize);
+            Marshal.Copy(bytes, 0, (IntPtr)message, size);
+            *messageSize = size;
+            return status;
+        }
+
+        private static MethodEntry GetEntry(int index)
+        {
+            int adjustedIndex = index;
+            int arrayIndex = GetArrayIndex(index + 1);
+            if(arrayIndex > 0)
+                adjustedIndex -= counts[arrayIndex - 1];
+
+            var array = methods[arrayIndex];
+            return array == null ? null : Volatile.Read(ref array[adjustedIndex]);
         }
 
         private static int GetArrayIndex(int count)
@@ -492,29 +888,108 @@ namespace GroboTrace.Core
             return dummyInstr;
         }
 
-        public static void sendToDebug(String label, MethodBase method, MethodBody methodBody)
+        // Only with LogLevel.Verbose, printing a method body costs more than rewriting it
+        public static void WriteMethodBody(string label, MethodBase method, MethodBody methodBody)
         {
-            Debug.WriteLine("");
-            Debug.WriteLine(label + " " + method.DeclaringType + "." + method.Name);
-            Debug.WriteLine(methodBody);
-            Debug.WriteLine("");
+            DiagnosticLog.Write(LogLevel.Verbose, label + " " + method.DeclaringType + "." + method.Name + Environment.NewLine + methodBody);
         }
 
         public static MethodBase GetMethod(int id)
         {
             if(id == 0) return null;
 
-            int index = id - 1;
+            var entry = GetEntry((id & slotMask) - 1);
+            if(entry == null)
+                return null;
+            if(entry.Id != id)
+                return UnloadedMethod;
+            if(entry.Method != null)
+                return entry.Method;
+            DynamicMethod dynamicMethod;
+            var weakReference = entry.DynamicMethod;
+            if(weakReference != null && weakReference.TryGetTarget(out dynamicMethod))
+                return dynamicMethod;
+            return UnloadedMethod;
+        }
+
+        // Current id of the method in the slot, 0 if the slot is free
+        public static int GetMethodId(int slot)
+        {
+            var entry = GetEntry(slot - 1);
+            if(entry == null || (entry.Method == null && entry.DynamicMethod == null))
+                return 0;
+            return entry.Id;
+        }
+
+        // Index of the slot of the method, the same for all generations of the slot
+        internal static int GetIndex(int id)
+        {
+            return (id & slotMask) - 1;
+        }
+
+        // Every shard is a separate array padded by a cache line on both sides,
+        // so that threads on different shards never write to the same cache line
+        private static long[][] CreateCallCounters(int size)
+        {
+            var result = new long[callCounterShardsCount][];
+            for(var shard = 0; shard < result.Length; ++shard)
+                result[shard] = new long[size + 2 * callCounterPadding];
+            return result;
+        }
+
+        public static void IncrementCallCount(int id)
+        {
+            int index = (id & slotMask) - 1;
+            int adjustedIndex = index;
+
+            int arrayIndex = GetArrayIndex(index + 1);
+            if(arrayIndex > 0)
+                adjustedIndex -= counts[arrayIndex - 1];
+
+            // A stale id must not count calls of the method that reuses the slot
+            if(Volatile.Read(ref methods[arrayIndex][adjustedIndex]).Id != id)
+            {
+                Interlocked.Increment(ref unloadedMethodCalls);
+                return;
+            }
+
+            // There is no cheap way to get current processor number on .NET 4.5, so threads are spread over the shards instead
+            var shard = Thread.CurrentThread.ManagedThreadId & (callCounterShardsCount - 1);
+            Interlocked.Increment(ref callCounters[arrayIndex][shard][adjustedIndex + callCounterPadding]);
+        }
+
+        public static long GetCallCount(int id)
+        {
+            if(id == 0) return 0;
+
+            int index = (id & slotMask) - 1;
             int adjustedIndex = index;
 
             int arrayIndex = GetArrayIndex(index + 1);
             if(arrayIndex > 0)
                 adjustedIndex -= counts[arrayIndex - 1];
 
-            return methods[arrayIndex][adjustedIndex];
+            var shards = callCounters[arrayIndex];
+            if(shards == null || GetEntry(index).Id != id)
+                return 0;
+            long result = 0;
+            foreach(var shard in shards)
+                result += Volatile.Read(ref shard[adjustedIndex + callCounterPadding]);
+            return result;
         }
 
-        internal static readonly ConcurrentDictionary<MethodBase, int> tracedMethods = new ConcurrentDictionary<MethodBase, int>();
+        public static int NumberOfMethods { get { return Volatile.Read(ref numberOfMethods); } }
+
+        // Stats of unloaded methods are folded into this one
+        public static readonly MethodBase UnloadedMethod = typeof(UnloadedMethods).GetMethod("Unloaded", BindingFlags.Public | BindingFlags.Static);
+        public static long UnloadedMethodCalls { get { return Interlocked.Read(ref unloadedMethodCalls); } }
+
+        internal static readonly ConditionalWeakTable<DynamicMethod, object> tracedDynamicMethods = new ConditionalWeakTable<DynamicMethod, object>();
+
+        // Thresholds of the profiler's method filter passed with the last method, dynamic methods are not seen by the filter
+        // and are checked against them too. Until the first method these are the defaults of the filter
+        internal static volatile int filterMinInstructions = 50;
+        internal static volatile bool filterTracesSmallMethodsWithLoops = true;
 
         private static readonly List<Delegate> createDelegateMethods = new List<Delegate>();
 
@@ -522,14 +997,55 @@ namespace GroboTrace.Core
         public static Func<long> TicksReader;
         public static IntPtr methodStartedAddress;
         public static IntPtr methodFinishedAddress;
+        public static IntPtr methodCalledAddress;
+        public static IntPtr blockEnteredAddress;
+        public static IntPtr probesActiveAddress;
 
         private static Func<UIntPtr, byte[], MetadataToken> signatureTokenBuilder;
         private static MapEntriesAllocator allocateForMapEntries;
 
-        private static readonly MethodBase[][] methods = new MethodBase[32][];
+        private static readonly MethodEntry[][] methods = new MethodEntry[32][];
+        private static readonly long[][][] callCounters = new long[32][][];
         private static int numberOfMethods;
+        private static long unloadedMethodCalls;
+
+        private static readonly object registryLock = new object();
+        private static readonly Stack<int> freeSlots = new Stack<int>();
+        private static readonly Dictionary<UIntPtr, List<int>> moduleSlots = new Dictionary<UIntPtr, List<int>>();
+        private static readonly List<int> dynamicMethodSlots = new List<int>();
+        private static int nextDynamicMethodsSweep = minDynamicMethodsSweep;
+        private static readonly List<Tuple<Regex, bool>> methodRules = new List<Tuple<Regex, bool>>();
+        private static int disabledMethodsCount;
+
+        private const int slotBits = 24;
+        private const int slotMask = (1 << slotBits) - 1;
+        private const int maxGeneration = 0x7F;
+        private const int minDynamicMethodsSweep = 1024;
 
         private static readonly int[] sizes;
         private static readonly int[] counts;
+
+        private const int maxCallCounterShardsCount = 64;
+        private const int callCounterPadding = 8;
+        private static readonly int callCounterShardsCount;
+
+        private class MethodEntry
+        {
+            public int Id;
+            public UIntPtr ModuleId;
+            public MethodBase Method;
+            public WeakReference<DynamicMethod> DynamicMethod;
+            public volatile bool Disabled;
+            public volatile bool CpuTimed;
+            // Milliseconds, 0 when calls of the method are not watched
+            public int WatchdogThreshold;
+        }
+    }
+
+    public static class UnloadedMethods
+    {
+        public static void Unloaded()
+        {
+        }
     }
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+using System;
 using System.Collections.Generic;
 using System.Linq;
 using System.Reflection;
@@ -12,45 +13,78 @@ namespace GroboTrace.Core
             this.parent = parent;
             MethodId = methodId;
             edges = new MCNE_Empty();
+            if(methodId != 0 && TracingSettings.CollectCallTreeNodeHistograms)
+                Histogram = new LatencyHistogram();
         }
 
         public MethodCallNode StartMethod(int methodId)
         {
             var child = edges.Jump(methodId);
             if(child != null) return child;
+            // Calls beyond the limit are attributed to the caller, MethodCallTree does not record them and gets no finishes for them
+            if(!TryReserveNode())
+                return this;
             child = new MethodCallNode(this, methodId);
             edges = MethodCallNodeEdgesFactory.Create(edges.MethodIds.Concat(new[] {methodId}), edges.Children.Concat(new[] {child}));
+            AddChild(child);
             return child;
         }
 
         public MethodCallNode FinishMethod(int methodId, long elapsed)
         {
             ++Calls;
-            Ticks += elapsed;
+            Ticks += elapsed - FoldedTicks;
+            FoldedTicks = 0;
+            Histogram?.RecordNonAtomic(elapsed);
+            if(EnteredCpuNanoseconds != 0)
+            {
+                var cpuNanoseconds = CpuTime.Read();
+                if(cpuNanoseconds != 0)
+                {
+                    CpuNanoseconds += cpuNanoseconds - EnteredCpuNanoseconds;
+                    CpuMeasuredTicks += elapsed;
+                }
+                EnteredCpuNanoseconds = 0;
+            }
             return parent;
         }
 
-        public MethodStatsNode GetStats(long totalTicks)
+        // The profiler reports only the sum of waits, which has no per-wait durations for a histogram to be built of
+        public void AddWaits(int count, long ticks)
         {
+            Calls += count;
+            Ticks += ticks;
+            Histogram = null;
+        }
+
+        public MethodStatsNode GetStats(long totalTicks, double ticksPerNanosecond)
+        {
+            var methodStats = new MethodStats
+                {
+                    Method = MethodBaseTracingInstaller.GetMethod(MethodId),
+                    MethodName = MethodSymbols.GetName(MethodId),
+                    Calls = Calls,
+                    RecursiveCalls = RecursiveCalls,
+                    Ticks = Ticks,
+                    Percent = totalTicks == 0 ? 0.0 : Ticks * 100.0 / totalTicks,
+                    Histogram = Histogram
+                };
+            if(CpuMeasuredTicks > 0)
+                CpuTime.SetTicks(methodStats, (long)(CpuNanoseconds * ticksPerNanosecond), CpuMeasuredTicks);
             return new MethodStatsNode
                 {
-                    MethodStats = new MethodStats
-                        {
-                            Method = MethodBaseTracingInstaller.GetMethod(MethodId),
-                            Calls = Calls,
-                            Ticks = Ticks,
-                            Percent = totalTicks == 0 ? 0.0 : Ticks * 100.0 / totalTicks
-                        },
+                    MethodStats = methodStats,
                     Children = Children.Select(child =>
                         {
-                            var childStats = child.GetStats(totalTicks);
+                            var childStats = child.GetStats(totalTicks, ticksPerNanosecond);
                             return childStats;
                         }).OrderByDescending(stats => stats.MethodStats.Ticks).
                                         ToArray()
                 };
         }
 
-        public void GetStats(Dictionary<MethodBase, MethodStats> statsDict)
+        // Rows are keyed by method id, the method is resolved once per row
+        public void GetStats(Dictionary<int, MethodStats> statsDict)
         {
             var selfTicks = Ticks;
             foreach(var child in Children)
@@ -58,16 +92,21 @@ namespace GroboTrace.Core
                 child.GetStats(statsDict);
                 selfTicks -= child.Ticks;
             }
-            var method = MethodBaseTracingInstaller.GetMethod(MethodId);
-            method = method.IsGenericMethod ? ((MethodInfo)method).GetGenericMethodDefinition() : method;
             MethodStats stats;
-            if(!statsDict.TryGetValue(method, out stats))
-                statsDict.Add(method, new MethodStats {Calls = Calls, Method = method, Ticks = selfTicks});
+            if(!statsDict.TryGetValue(MethodId, out stats))
+                statsDict.Add(MethodId, stats = new MethodStats {Calls = Calls, RecursiveCalls = RecursiveCalls, Method = MethodBaseTracingInstaller.GetMethod(MethodId), MethodName = MethodSymbols.GetName(MethodId), Ticks = selfTicks});
             else
             {
                 stats.Calls += Calls;
+                stats.RecursiveCalls += RecursiveCalls;
                 stats.Ticks += selfTicks;
             }
+            if(Histogram != null)
+            {
+                if(stats.Histogram == null)
+                    stats.Histogram = new LatencyHistogram();
+                stats.Histogram.Add(Histogram);
+            }
         }
 
         public void ClearStats()
@@ -78,7 +117,11 @@ namespace GroboTrace.Core
             {
                 var node = queue.Dequeue();
                 node.Calls = 0;
+                node.RecursiveCalls = 0;
                 node.Ticks = 0;
+                node.CpuNanoseconds = 0;
+                node.CpuMeasuredTicks = 0;
+                node.Histogram?.Clear();
                 foreach(var child in node.edges.Children)
                 {
                     if(child != null)
@@ -87,13 +130,78 @@ namespace GroboTrace.Core
             }
         }
 
+        private static bool TryReserveNode()
+        {
+            var limit = NodesLimit;
+            if(Interlocked.Increment(ref nodesCount) <= limit || limit <= 0)
+                return true;
+            Interlocked.Decrement(ref nodesCount);
+            return false;
+        }
+
+        // Nodes are never removed, ClearStats only resets their counters
+        public static int NodesCount { get { return Volatile.Read(ref nodesCount); } }
+
+        // Limit of the number of nodes in call trees of all threads, 0 means unlimited
+        public static int NodesLimit { get { return Volatile.Read(ref nodesLimit); } set { Volatile.Write(ref nodesLimit, Math.Max(0, value)); } }
+
+        // Plain copy of the edges' children for walking the tree without enumerators.
+        // Other threads read it while the owner thread adds children: the array is published before the count
+        private void AddChild(MethodCallNode child)
+        {
+            var array = children;
+            if(array == null)
+                array = new MethodCallNode[2];
+            else if(childrenCount == array.Length)
+            {
+                array = new MethodCallNode[childrenCount * 2];
+                Array.Copy(children, array, childrenCount);
+            }
+            array[childrenCount] = child;
+            Volatile.Write(ref children, array);
+            Volatile.Write(ref childrenCount, childrenCount + 1);
+        }
+
+        // The count is read first, so the array read after it holds at least that many children
+        public MethodCallNode[] GetChildren(out int count)
+        {
+            count = Volatile.Read(ref childrenCount);
+            return Volatile.Read(ref children) ?? noChildren;
+        }
+
+        public int ChildrenCount { get { return Volatile.Read(ref childrenCount); } }
+
         public int MethodId { get; set; }
         public int Calls { get; set; }
+        // Inner calls folded into this node by GROBOTRACE_RECURSION_FOLDING, Calls counts only the outermost ones
+        public int RecursiveCalls { get; set; }
         public long Ticks { get; set; }
+        public LatencyHistogram Histogram { get; private set; }
+        public MethodCallNode Parent { get { return parent; } }
+
+        // Start of the call running in this node, a node is active at most once at a time on its thread (recursive calls get deeper nodes).
+        // Meaningless once the node is left, read only for nodes on the active path
+        public long EnteredTicks;
+
+        // Self time of folded calls made within the call running in this node, which belongs to the folded nodes higher up the path,
+        // taken off Ticks when the call finishes (see MethodCallTree.StartMethodFolding)
+        public long FoldedTicks;
+
+        // CPU time of the calls that were timed and their wall-clock ticks, only calls of the methods picked by CpuTime are timed.
+        // Entry CPU time is 0 while no timed call runs in the node
+        public long CpuNanoseconds;
+        public long CpuMeasuredTicks;
+        public long EnteredCpuNanoseconds;
 
         public IEnumerable<MethodCallNode> Children { get { return edges.Children.Where(node => node.Calls > 0); } }
 
         private readonly MethodCallNode parent;
         private MethodCallNodeEdges edges;
+        private MethodCallNode[] children;
+        private int childrenCount;
+        private static readonly MethodCallNode[] noChildren = new MethodCallNode[0];
+
+        private static int nodesCount;
+        private static int nodesLimit = TracingSettings.MaxCallTreeNodes;
     }
 }
\ No newline at end of file
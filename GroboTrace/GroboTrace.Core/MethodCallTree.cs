@@ -1,56 +1,432 @@
+using System;
 using System.Collections.Generic;
 using System.Linq;
 using System.Reflection;
+using System.Threading;
 
 namespace GroboTrace.Core
 {
     internal class MethodCallTree
     {
         public MethodCallTree()
+            : this(TracingSettings.RecursionFolding)
         {
+        }
+
+        // Folding is passed explicitly by tests, which cannot change TracingSettings
+        internal MethodCallTree(int recursionFolding)
+        {
+            this.recursionFolding = recursionFolding;
             root = new MethodCallNode(null, 0);
             current = root;
             startTicks = MethodBaseTracingInstaller.TicksReader();
         }
 
-        public void StartMethod(int methodId)
+        // Returns false for a call which is not recorded, its finish must not be passed to FinishMethod
+        public bool StartMethod(int methodId, long startTicks)
         {
-            current = current.StartMethod(methodId);
+            if(recursionFolding > 0)
+                return StartMethodFolding(methodId, startTicks);
+            var next = current.StartMethod(methodId);
+            // Over the nodes limit the call stays in its caller's node, whose entry time must be kept
+            if(next == current)
+                return false;
+            Enter(next, methodId, startTicks);
+            return true;
         }
 
         public void FinishMethod(int methodId, long elsapsed)
         {
-            current = current.FinishMethod(methodId, elsapsed);
+            if(foldedCallsCount > 0 && foldedCallers[foldedCallsCount - 1] == current && foldedNodes[foldedCallsCount - 1].MethodId == methodId)
+            {
+                FinishFoldedCall(methodId, elsapsed);
+                return;
+            }
+            // Finishes come only for recorded starts, a stray one must not take the path out of the node of another method
+            if(current.MethodId != methodId)
+                return;
+            (methodHistograms ?? CreateMethodHistograms()).Record(methodId, elsapsed);
+            // A call made by a folded call is a child of the folded call's frame
+            if(foldedCallsCount > 0 && foldedCallers[foldedCallsCount - 1] == current.Parent)
+                foldedChildrenTicks[foldedCallsCount - 1] += elsapsed;
+            Volatile.Write(ref current, current.FinishMethod(methodId, elsapsed));
+        }
+
+        // GROBOTRACE_RECURSION_FOLDING: a call of a method that is already active within the last few levels of the path is folded
+        // into the node of the active call, where it is counted as a recursive call, and opens no new level. The path stays at the node
+        // of the caller, so calls made by a folded call go to the node of the frame that physically contains them, whose time includes
+        // theirs: A->B->A->C puts C under B. Self time of the folded call itself goes to the folded node: it is taken off the nodes
+        // between the caller and the folded node, so in A->B->A the self time of the inner A is A's, not B's.
+        // Folded calls are kept on a stack together with the node they were made from and the time of their own calls,
+        // to be matched by their finishes
+        private bool StartMethodFolding(int methodId, long startTicks)
+        {
+            var node = current;
+            for(var level = 0; level < recursionFolding && node != root; ++level)
+            {
+                if(node.MethodId == methodId)
+                {
+                    // Most threads never fold a call, the stack is allocated on the first one
+                    if(foldedNodes == null || foldedCallsCount == foldedNodes.Length)
+                    {
+                        var size = Math.Max(4, foldedCallsCount * 2);
+                        Array.Resize(ref foldedNodes, size);
+                        Array.Resize(ref foldedCallers, size);
+                        Array.Resize(ref foldedChildrenTicks, size);
+                    }
+                    foldedNodes[foldedCallsCount] = node;
+                    foldedCallers[foldedCallsCount] = current;
+                    foldedChildrenTicks[foldedCallsCount] = 0;
+                    ++foldedCallsCount;
+                    return true;
+                }
+                node = node.Parent;
+            }
+            var next = current.StartMethod(methodId);
+            if(next == current)
+                return false;
+            Enter(next, methodId, startTicks);
+            return true;
+        }
+
+        private void FinishFoldedCall(int methodId, long elapsed)
+        {
+            (methodHistograms ?? CreateMethodHistograms()).Record(methodId, elapsed);
+            var index = --foldedCallsCount;
+            var node = foldedNodes[index];
+            ++node.RecursiveCalls;
+            var selfTicks = elapsed - foldedChildrenTicks[index];
+            for(var caller = current; caller != node; caller = caller.Parent)
+                caller.FoldedTicks += selfTicks;
+            // Folded calls made one from another directly share the caller
+            if(index > 0 && foldedCallers[index - 1] == current)
+                foldedChildrenTicks[index - 1] += elapsed;
+            foldedNodes[index] = null;
+            foldedCallers[index] = null;
+        }
+
+        private void Enter(MethodCallNode next, int methodId, long startTicks)
+        {
+            next.EnteredTicks = startTicks;
+            if(CpuTime.MethodsEnabled && MethodBaseTracingInstaller.IsMethodCpuTimed(methodId))
+                next.EnteredCpuNanoseconds = CpuTime.Read();
+            Volatile.Write(ref current, next);
+        }
+
+        // Waits are children of the current node, they do not change it. They are kept out of method histograms,
+        // only their count and total time are known
+        public void AddWaits(int methodId, int count, long ticks)
+        {
+            var node = current.StartMethod(methodId);
+            if(node == current)
+                return;
+            node.AddWaits(count, ticks);
+        }
+
+        // Most threads never run a traced method, their trees get no histograms
+        private MethodHistograms CreateMethodHistograms()
+        {
+            Volatile.Write(ref methodHistograms, new MethodHistograms());
+            return methodHistograms;
+        }
+
+        // Returns the previous number of watched sections to be passed to EndWatchedSection
+        public int BeginWatchedSection(string groboTraceKey, long startTicks, int thresholdMilliseconds)
+        {
+            var count = watchedSectionsCount;
+            if(watchedSections == null || count == watchedSections.Length)
+                Array.Resize(ref watchedSections, Math.Max(4, count * 2));
+            watchedSections[count] = new WatchedSection {GroboTraceKey = groboTraceKey, StartTicks = startTicks, ThresholdMilliseconds = thresholdMilliseconds};
+            Volatile.Write(ref watchedSectionsCount, count + 1);
+            return count;
+        }
+
+        public void EndWatchedSection(int previousCount)
+        {
+            Volatile.Write(ref watchedSectionsCount, previousCount);
         }
 
         public MethodStatsNode GetStatsAsTree(long endTicks)
         {
             var elapsedTicks = endTicks - startTicks;
-            var result = current.GetStats(elapsedTicks);
+            var ticksPerNanosecond = CpuTime.Enabled ? CpuTime.TicksPerNanosecond : 0.0;
+            var result = current.GetStats(elapsedTicks, ticksPerNanosecond);
             result.MethodStats.Percent = 100.0;
+            var elapsedCpuNanoseconds = GetElapsedCpuNanoseconds();
+            if(elapsedCpuNanoseconds >= 0)
+                CpuTime.SetTicks(result.MethodStats, (long)(elapsedCpuNanoseconds * ticksPerNanosecond), elapsedTicks);
             return result;
         }
 
         public List<MethodStats> GetStatsAsList(long endTicks)
         {
             var elapsedTicks = endTicks - startTicks;
-            var statsDict = new Dictionary<MethodBase, MethodStats>();
+            var statsDict = new Dictionary<int, MethodStats>();
             foreach(var child in current.Children)
                 child.GetStats(statsDict);
-            var result = statsDict.Values.Concat(new[] {new MethodStats {Calls = 1, Ticks = elapsedTicks - statsDict.Values.Sum(node => node.Ticks)}}).OrderByDescending(stats => stats.Ticks).ToList();
-            foreach(var stats in result)
-                stats.Percent = stats.Ticks * 100.0 / elapsedTicks;
+            return CallTreeSnapshotAnalyzer.GetStatsAsList(statsDict, elapsedTicks);
+        }
+
+        // Copies only the nodes touched since the last ClearStats, no MethodBase resolution is done here.
+        // With maxNodes set only the heaviest nodes by total ticks are copied, together with their ancestors, so the copy
+        // stays small however large the tree is; ticks of the dropped nodes remain in the totals of their ancestors
+        public CallTreeSnapshot TakeSnapshot(long endTicks, int maxNodes)
+        {
+            if(snapshotNodes == null)
+            {
+                snapshotNodes = new MethodCallNode[16];
+                snapshotParentIndexes = new int[16];
+                snapshotStack = new MethodCallNode[16];
+                snapshotStackParentIndexes = new int[16];
+            }
+            var count = 0;
+            var stackSize = 0;
+            Push(ref stackSize, current, -1);
+            while(stackSize > 0)
+            {
+                --stackSize;
+                var node = snapshotStack[stackSize];
+                var parentIndex = snapshotStackParentIndexes[stackSize];
+                if(count == snapshotNodes.Length)
+                {
+                    Array.Resize(ref snapshotNodes, count * 2);
+                    Array.Resize(ref snapshotParentIndexes, count * 2);
+                }
+                snapshotNodes[count] = node;
+                snapshotParentIndexes[count] = parentIndex;
+                int childrenCount;
+                var children = node.GetChildren(out childrenCount);
+                for(var i = 0; i < childrenCount; ++i)
+                {
+                    var child = children[i];
+                    if(child.Calls > 0)
+                        Push(ref stackSize, child, count);
+                }
+                // The root of the snapshot is always kept
+                if(maxNodes > 0 && count > 0)
+                    AddToTopNodes(count, maxNodes - 1);
+                ++count;
+            }
+            if(maxNodes > 0 && count > maxNodes)
+                count = KeepTopNodes(count);
+            topNodesCount = 0;
+
+            var result = new CallTreeSnapshot
+                {
+                    ElapsedTicks = endTicks - startTicks,
+                    Count = count,
+                    MethodIds = new int[count],
+                    ParentIndexes = new int[count],
+                    Calls = new int[count],
+                    Ticks = new long[count],
+                    RecursiveCalls = recursionFolding > 0 ? new int[count] : null,
+                };
+            var ticksPerNanosecond = 0.0;
+            if(CpuTime.Enabled)
+            {
+                ticksPerNanosecond = CpuTime.TicksPerNanosecond;
+                var elapsedCpuNanoseconds = GetElapsedCpuNanoseconds();
+                result.ElapsedCpuTicks = elapsedCpuNanoseconds < 0 ? -1 : (long)(elapsedCpuNanoseconds * ticksPerNanosecond);
+                result.CpuTicks = new long[count];
+                result.CpuMeasuredTicks = new long[count];
+            }
+            for(var i = 0; i < count; ++i)
+            {
+                var node = snapshotNodes[i];
+                result.MethodIds[i] = node.MethodId;
+                result.ParentIndexes[i] = snapshotParentIndexes[i];
+                result.Calls[i] = node.Calls;
+                result.Ticks[i] = node.Ticks;
+                if(result.RecursiveCalls != null)
+                    result.RecursiveCalls[i] = node.RecursiveCalls;
+                if(result.CpuTicks != null)
+                {
+                    result.CpuTicks[i] = (long)(node.CpuNanoseconds * ticksPerNanosecond);
+                    result.CpuMeasuredTicks[i] = node.CpuMeasuredTicks;
+                }
+                snapshotNodes[i] = null;
+            }
             return result;
         }
 
+        // Bounded min-heap of snapshot indexes by ticks, the lightest of the kept nodes is on top
+        private void AddToTopNodes(int index, int capacity)
+        {
+            if(capacity <= 0)
+                return;
+            var ticks = snapshotNodes[index].Ticks;
+            if(topNodesCount == capacity)
+            {
+                if(ticks <= snapshotNodes[topNodes[0]].Ticks)
+                    return;
+                topNodes[0] = index;
+                SiftDown(0);
+                return;
+            }
+            if(topNodes == null || topNodesCount == topNodes.Length)
+                Array.Resize(ref topNodes, Math.Max(16, Math.Min(capacity, topNodesCount * 2)));
+            var position = topNodesCount++;
+            while(position > 0)
+            {
+                var parent = (position - 1) / 2;
+                if(snapshotNodes[topNodes[parent]].Ticks <= ticks)
+                    break;
+                topNodes[position] = topNodes[parent];
+                position = parent;
+            }
+            topNodes[position] = index;
+        }
+
+        private void SiftDown(int position)
+        {
+            var index = topNodes[position];
+            var ticks = snapshotNodes[index].Ticks;
+            while(true)
+            {
+                var child = 2 * position + 1;
+                if(child >= topNodesCount)
+                    break;
+                if(child + 1 < topNodesCount && snapshotNodes[topNodes[child + 1]].Ticks < snapshotNodes[topNodes[child]].Ticks)
+                    ++child;
+                if(snapshotNodes[topNodes[child]].Ticks >= ticks)
+                    break;
+                topNodes[position] = topNodes[child];
+                position = child;
+            }
+            topNodes[position] = index;
+        }
+
+        // Compacts the snapshot buffers to the root, the nodes of the heap and their ancestors, keeping the preorder
+        private int KeepTopNodes(int count)
+        {
+            if(keptNodes == null || keptNodes.Length < count)
+                keptNodes = new int[Math.Max(count, keptNodes == null ? 16 : keptNodes.Length * 2)];
+            Array.Clear(keptNodes, 0, count);
+            keptNodes[0] = 1;
+            for(var i = 0; i < topNodesCount; ++i)
+            {
+                for(var index = topNodes[i]; index >= 0 && keptNodes[index] == 0; index = snapshotParentIndexes[index])
+                    keptNodes[index] = 1;
+            }
+            // Parents precede their children, so their new indexes are known by then; keptNodes is reused to hold them
+            var keptCount = 0;
+            for(var i = 0; i < count; ++i)
+            {
+                if(keptNodes[i] == 0)
+                {
+                    snapshotNodes[i] = null;
+                    continue;
+                }
+                var parentIndex = snapshotParentIndexes[i];
+                snapshotNodes[keptCount] = snapshotNodes[i];
+                snapshotParentIndexes[keptCount] = parentIndex < 0 ? -1 : keptNodes[parentIndex] - 1;
+                keptNodes[i] = ++keptCount;
+            }
+            for(var i = keptCount; i < count; ++i)
+                snapshotNodes[i] = null;
+            return keptCount;
+        }
+
+        private void Push(ref int stackSize, MethodCallNode node, int parentIndex)
+        {
+            if(stackSize == snapshotStack.Length)
+            {
+                Array.Resize(ref snapshotStack, stackSize * 2);
+                Array.Resize(ref snapshotStackParentIndexes, stackSize * 2);
+            }
+            snapshotStack[stackSize] = node;
+            snapshotStackParentIndexes[stackSize] = parentIndex;
+            ++stackSize;
+        }
+
         public void ClearStats()
         {
             current.ClearStats();
             startTicks = MethodBaseTracingInstaller.TicksReader();
+            startCpuNanoseconds = 0;
         }
 
+        // Clears the whole tree of another thread, whose current node may be anywhere in it. Nodes on the active path keep
+        // their entry ticks, so the calls running there are recorded when they finish
+        public void ClearAllStats()
+        {
+            root.ClearStats();
+            startTicks = MethodBaseTracingInstaller.TicksReader();
+            startCpuNanoseconds = 0;
+        }
+
+        // Must be called by the thread of the tree, ClearStats may come from any thread
+        public void StartCpuTime()
+        {
+            startCpuNanoseconds = CpuTime.Read();
+        }
+
+        // Since StartCpuTime, -1 when it was not called after the last ClearStats
+        private long GetElapsedCpuNanoseconds()
+        {
+            if(startCpuNanoseconds == 0)
+                return -1;
+            var cpuNanoseconds = CpuTime.Read();
+            return cpuNanoseconds == 0 ? -1 : cpuNanoseconds - startCpuNanoseconds;
+        }
+
+        public MethodCallNode Root { get { return root; } }
+
+        // Latencies of methods called on this thread, merged across threads by readers
+        public MethodHistograms MethodHistograms { get { return Volatile.Read(ref methodHistograms); } }
+
+        // Read by CallWatchdog from its own thread
+        public MethodCallNode Current { get { return Volatile.Read(ref current); } }
+        public int WatchedSectionsCount { get { return Volatile.Read(ref watchedSectionsCount); } }
+        public WatchedSection[] WatchedSections { get { return watchedSections; } }
+
+        // Whether probes record anything on this thread when sampling is enabled
+        public bool Sampled { get; set; }
+
+        // Probe calls of this thread and how many of them were recorded or counted, written by the thread only and read by OverheadGovernor
+        public long ProbeCalls;
+        public long RecordedCalls;
+        public long CountedCalls;
+
+        // Slot the profiler adds waits of this thread to, see WaitEvents
+        public unsafe WaitEvents.Slot* Waits;
+
+        private readonly int recursionFolding;
+        // Folded calls running on the thread, the nodes they were made from and the time of the calls they made
+        private MethodCallNode[] foldedNodes;
+        private MethodCallNode[] foldedCallers;
+        private long[] foldedChildrenTicks;
+        private int foldedCallsCount;
+
         private readonly MethodCallNode root;
         private MethodCallNode current;
+        private MethodHistograms methodHistograms;
         internal long startTicks;
+        private long startCpuNanoseconds;
+
+        // Profiler.Profile sections with a watchdog threshold, innermost last
+        private WatchedSection[] watchedSections;
+        private int watchedSectionsCount;
+
+        // Stuck call or section reported last, written by CallWatchdog only: the node and the start of its call,
+        // or no node and the start of the section
+        internal MethodCallNode reportedNode;
+        internal long reportedTicks;
+
+        // Scratch buffers are allocated on the first snapshot, most threads never take one
+        private MethodCallNode[] snapshotNodes;
+        private int[] snapshotParentIndexes;
+        private MethodCallNode[] snapshotStack;
+        private int[] snapshotStackParentIndexes;
+        private int[] topNodes;
+        private int topNodesCount;
+        private int[] keptNodes;
+
+        public struct WatchedSection
+        {
+            public string GroboTraceKey;
+            public long StartTicks;
+            public int ThresholdMilliseconds;
+        }
     }
 }
\ No newline at end of file
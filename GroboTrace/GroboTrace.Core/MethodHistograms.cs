@@ -0,0 +1,128 @@
+using System;
+using System.Threading;
+
+namespace GroboTrace.Core
+{
+    // Latencies of methods recorded by probes of one thread, without interlocked operations on the hot path.
+    // Readers merge histograms of all threads. Histograms are kept by the full method id, so calls of a released method
+    // that are still running, or stale ids, are counted as unloaded instead of going to the method that reuses the slot
+    internal class MethodHistograms
+    {
+        // Called by the owner thread only
+        public void Record(int methodId, long ticks)
+        {
+            var index = MethodBaseTracingInstaller.GetIndex(methodId);
+            var chunkIndex = index >> chunkBits;
+            Entry entry = null;
+            if(chunkIndex < chunks.Length)
+            {
+                var chunk = chunks[chunkIndex];
+                if(chunk != null)
+                    entry = chunk[index & chunkMask];
+            }
+            if(entry == null || entry.MethodId != methodId)
+                entry = GetEntry(methodId, index);
+            entry.Histogram.RecordNonAtomic(ticks);
+        }
+
+        private Entry GetEntry(int methodId, int index)
+        {
+            // A stale id must not take the slot from the method that is registered there now
+            if(MethodBaseTracingInstaller.GetMethodId(index + 1) != methodId)
+                return unloaded;
+            var chunkIndex = index >> chunkBits;
+            if(chunkIndex >= chunks.Length)
+            {
+                var newChunks = new Entry[Math.Max(chunkIndex + 1, chunks.Length * 2)][];
+                Array.Copy(chunks, newChunks, chunks.Length);
+                Volatile.Write(ref chunks, newChunks);
+            }
+            var chunk = chunks[chunkIndex];
+            if(chunk == null)
+                Volatile.Write(ref chunks[chunkIndex], chunk = new Entry[chunkSize]);
+            // Records of the method that had the slot before are kept among unloaded ones
+            var previous = chunk[index & chunkMask];
+            if(previous != null)
+                unloaded.Histogram.Add(previous.Histogram);
+            var entry = new Entry(methodId);
+            Volatile.Write(ref chunk[index & chunkMask], entry);
+            return entry;
+        }
+
+        // Histograms of all threads are summed up into result, indexed by slot - 1, records of released methods go to unloaded.
+        // Threads keep recording meanwhile, so the numbers may be slightly behind, but nothing is lost
+        public static void Merge(ref LatencyHistogram[] result, LatencyHistogram unloadedResult)
+        {
+            var numberOfMethods = MethodBaseTracingInstaller.NumberOfMethods;
+            if(result == null || result.Length < numberOfMethods)
+                Array.Resize(ref result, numberOfMethods);
+            foreach(var histogram in result)
+                histogram?.Clear();
+            unloadedResult.Clear();
+            foreach(var callTree in TracingAnalyzer.CallTrees)
+                callTree.MethodHistograms?.AddTo(result, unloadedResult);
+        }
+
+        private void AddTo(LatencyHistogram[] result, LatencyHistogram unloadedResult)
+        {
+            var currentChunks = Volatile.Read(ref chunks);
+            for(var chunkIndex = 0; chunkIndex < currentChunks.Length; ++chunkIndex)
+            {
+                var chunk = Volatile.Read(ref currentChunks[chunkIndex]);
+                if(chunk == null)
+                    continue;
+                for(var i = 0; i < chunk.Length; ++i)
+                {
+                    var entry = Volatile.Read(ref chunk[i]);
+                    if(entry == null)
+                        continue;
+                    var index = (chunkIndex << chunkBits) + i;
+                    if(index < result.Length && MethodBaseTracingInstaller.GetMethodId(index + 1) == entry.MethodId)
+                        (result[index] ?? (result[index] = new LatencyHistogram())).Add(entry.Histogram);
+                    else
+                        unloadedResult.Add(entry.Histogram);
+                }
+            }
+            unloadedResult.Add(unloaded.Histogram);
+        }
+
+        // May be called from any thread, a record made by the owner at the same moment may survive
+        public static void Clear()
+        {
+            foreach(var callTree in TracingAnalyzer.CallTrees)
+                callTree.MethodHistograms?.ClearAll();
+        }
+
+        public void ClearAll()
+        {
+            var currentChunks = Volatile.Read(ref chunks);
+            foreach(var chunk in currentChunks)
+            {
+                if(chunk == null)
+                    continue;
+                for(var i = 0; i < chunk.Length; ++i)
+                    Volatile.Read(ref chunk[i])?.Histogram.Clear();
+            }
+            unloaded.Histogram.Clear();
+        }
+
+        private const int chunkBits = 8;
+        private const int chunkSize = 1 << chunkBits;
+        private const int chunkMask = chunkSize - 1;
+
+        // Slots are spread over chunks, so a thread that calls a few methods holds only a few small arrays
+        private Entry[][] chunks = new Entry[0][];
+        private readonly Entry unloaded = new Entry(0);
+
+        private class Entry
+        {
+            public Entry(int methodId)
+            {
+                MethodId = methodId;
+            }
+
+            public readonly int MethodId;
+            public readonly LatencyHistogram Histogram = new LatencyHistogram();
+        }
+    }
+}
\ No newline at end of file
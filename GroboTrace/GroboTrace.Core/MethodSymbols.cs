@@ -0,0 +1,47 @@
+using System.Collections.Concurrent;
+using System.Text;
+
+namespace GroboTrace.Core
+{
+    // Names of instrumented methods from the profiler's symbol table, reports use them instead of formatting MethodBase
+    internal static unsafe class MethodSymbols
+    {
+        public static void Init(MethodBaseTracingInstaller.MethodSymbolReader reader)
+        {
+            methodSymbolReader = reader;
+        }
+
+        public static string GetName(int methodId)
+        {
+            string name;
+            if(names.TryGetValue(methodId, out name))
+                return name;
+            var reader = methodSymbolReader;
+            if(reader == null || methodId == 0)
+                return null;
+            sbyte* assemblyName, typeName, methodName;
+            if(reader(methodId, &assemblyName, &typeName, &methodName) == 0)
+                return null;
+            name = Decode(typeName) + "." + Decode(methodName);
+            names.TryAdd(methodId, name);
+            return name;
+        }
+
+        // Names of methods GroboTrace.Core registers itself, the profiler knows nothing about them
+        public static void SetName(int methodId, string name)
+        {
+            names[methodId] = name;
+        }
+
+        private static string Decode(sbyte* str)
+        {
+            var length = 0;
+            while(str[length] != 0)
+                ++length;
+            return new string(str, 0, length, Encoding.UTF8);
+        }
+
+        private static readonly ConcurrentDictionary<int, string> names = new ConcurrentDictionary<int, string>();
+        private static MethodBaseTracingInstaller.MethodSymbolReader methodSymbolReader;
+    }
+}
\ No newline at end of file
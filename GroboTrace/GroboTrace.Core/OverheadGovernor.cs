@@ -0,0 +1,269 @@
+using System;
+using System.Globalization;
+using System.Reflection;
+using System.Threading;
+
+namespace GroboTrace.Core
+{
+    // Keeps probes within GROBOTRACE_CPU_BUDGET_PERCENT of CPU time of all processors. Every interval the probe calls of all threads
+    // are multiplied by per call costs calibrated at start, and while the estimate is over the budget probes are stepped down one level:
+    // full tracing, sampled sections, call counting, off. A level is stepped back up once the cost projected for it
+    // has stayed well below the budget for a few intervals, so that a bursty load does not make it flap
+    internal static class OverheadGovernor
+    {
+        public static void Init()
+        {
+            budgetPercent = TracingSettings.CpuBudgetPercent;
+            if(budgetPercent <= 0 || StackSamples.Enabled)
+                return;
+            // Methods rewritten in counting mode have no timings to drop
+            topLevel = TracingSettings.Mode == TracingMode.Counting ? OverheadLevel.Counting : OverheadLevel.Full;
+            level = topLevel;
+            enabled = true;
+            new Thread(Run) {IsBackground = true, Name = "GroboTrace overhead governor"}.Start();
+        }
+
+        public static OverheadGovernorStats GetStats()
+        {
+            var result = new OverheadGovernorStats
+                {
+                    Enabled = enabled,
+                    Level = level,
+                    BudgetPercent = budgetPercent,
+                    OverheadPercent = Volatile.Read(ref overheadPercent),
+                    StepsDown = Interlocked.Read(ref stepsDown),
+                    StepsUp = Interlocked.Read(ref stepsUp),
+                    Transitions = new long[transitions.Length]
+                };
+            for(var i = 0; i < transitions.Length; ++i)
+                result.Transitions[i] = Interlocked.Read(ref transitions[i]);
+            return result;
+        }
+
+        private static void Run()
+        {
+            try
+            {
+                Calibrate();
+            }
+            catch(Exception e)
+            {
+                DiagnosticLog.Write(LogLevel.Error, ".NET: failed to calibrate probe costs, overhead governor is off: " + e);
+                enabled = false;
+                return;
+            }
+            DiagnosticLog.Write(LogLevel.Info, string.Format(CultureInfo.InvariantCulture, ".NET: probe costs in ticks: recorded {0:F1}, counted {1:F1}, skipped {2:F1}",
+                                                             recordedCost, countedCost, skippedCost));
+
+            lastTicks = MethodBaseTracingInstaller.TicksReader();
+            CollectCalls(out lastProbes, out lastRecorded, out lastCounted);
+            while(true)
+            {
+                Thread.Sleep(TracingSettings.GovernorIntervalMilliseconds);
+                try
+                {
+                    Update();
+                }
+                catch(Exception e)
+                {
+                    DiagnosticLog.Write(LogLevel.Error, ".NET: overhead governor failed: " + e);
+                }
+            }
+        }
+
+        private static void Update()
+        {
+            var ticks = MethodBaseTracingInstaller.TicksReader();
+            long probes, recorded, counted;
+            CollectCalls(out probes, out recorded, out counted);
+            var elapsedTicks = ticks - lastTicks;
+            var probesDelta = probes - lastProbes;
+            var recordedDelta = recorded - lastRecorded;
+            var countedDelta = counted - lastCounted;
+            lastTicks = ticks;
+            lastProbes = probes;
+            lastRecorded = recorded;
+            lastCounted = counted;
+            if(elapsedTicks <= 0 || probesDelta < 0)
+                return;
+
+            var capacity = (double)elapsedTicks * Environment.ProcessorCount;
+            var skippedDelta = Math.Max(0, probesDelta - recordedDelta - countedDelta);
+            var overhead = (recordedDelta * recordedCost + countedDelta * countedCost + skippedDelta * skippedCost) * 100 / capacity;
+            Volatile.Write(ref overheadPercent, overhead);
+
+            var current = level;
+            if(current == OverheadLevel.Sampled && probesDelta > 0)
+                sampledShare = (double)recordedDelta / probesDelta;
+
+            if(overhead > budgetPercent)
+            {
+                quietIntervals = 0;
+                if(current != OverheadLevel.Off)
+                    Switch(current + 1, overhead);
+                return;
+            }
+            if(current == topLevel)
+                return;
+            var projected = Project(current - 1, probesDelta) * 100 / capacity;
+            if(projected >= budgetPercent * stepUpFraction)
+            {
+                quietIntervals = 0;
+                return;
+            }
+            if(++quietIntervals < stepUpIntervals)
+                return;
+            quietIntervals = 0;
+            Switch(current - 1, overhead);
+        }
+
+        // Probes count their calls at every level, so the cost of a higher level can be told from the calls made at a lower one
+        private static double Project(OverheadLevel target, long probes)
+        {
+            switch(target)
+            {
+            case OverheadLevel.Full:
+                return probes * (topLevel == OverheadLevel.Counting ? countedCost : recordedCost);
+            case OverheadLevel.Sampled:
+                return probes * (skippedCost + sampledShare * (recordedCost - skippedCost));
+            case OverheadLevel.Counting:
+                return probes * countedCost;
+            default:
+                return probes * skippedCost;
+            }
+        }
+
+        private static void Switch(OverheadLevel target, double overhead)
+        {
+            var previous = level;
+            level = target;
+            TracingAnalyzer.SetOverheadLevel(target);
+            Interlocked.Increment(ref transitions[(int)target]);
+            if(target > previous)
+                Interlocked.Increment(ref stepsDown);
+            else
+                Interlocked.Increment(ref stepsUp);
+            DiagnosticLog.Write(LogLevel.Info, string.Format(CultureInfo.InvariantCulture, ".NET: probe overhead is {0:F2}% of CPU with budget {1}%, switched from {2} to {3}",
+                                                             overhead, budgetPercent, previous, target));
+        }
+
+        // Counters of a thread are written by the thread itself, so the sums are slightly behind, which is fine for an estimate
+        private static void CollectCalls(out long probes, out long recorded, out long counted)
+        {
+            probes = 0;
+            recorded = 0;
+            counted = 0;
+            foreach(var callTree in TracingAnalyzer.CallTrees)
+            {
+                probes += callTree.ProbeCalls;
+                recorded += callTree.RecordedCalls;
+                counted += callTree.CountedCalls;
+            }
+        }
+
+        // Probe pairs are timed on the real MethodStarted and MethodFinished called on this thread for a method registered only for that,
+        // plus the two ticks reads made by the injected code. A recorded pair goes through the call tree, a counted one is the counting probe
+        // alone, a skipped one starts a method whose probes are off, as all methods are at the Off level. Like the injected code, finishes
+        // are called only for the starts which were recorded.
+        // The section keeps calls recorded if sampling is asked for. The method is removed afterwards along with the records it left
+        private static void Calibrate()
+        {
+            MethodBaseTracingInstaller.AddMethod(typeof(OverheadGovernor).GetMethod("CalibrationProbe", BindingFlags.NonPublic | BindingFlags.Static), UIntPtr.Zero, out calibrationMethodId);
+            var previousSampled = TracingAnalyzer.BeginSection(true);
+            try
+            {
+                var ticksRead = Measure(ReadTicks);
+                MethodBaseTracingInstaller.SetMethodDisabled(calibrationMethodId, false);
+                recordedCost = 2 * ticksRead + Measure(CallRecordedProbes);
+                countedCost = 2 * ticksRead + Measure(CallCountedProbes);
+                MethodBaseTracingInstaller.SetMethodDisabled(calibrationMethodId, true);
+                skippedCost = 2 * ticksRead + Measure(CallRecordedProbes);
+            }
+            finally
+            {
+                TracingAnalyzer.EndSection(previousSampled);
+                MethodBaseTracingInstaller.RemoveMethod(calibrationMethodId);
+                TracingAnalyzer.ClearStats();
+                TracingAnalyzer.ClearMethodHistogramsForCurrentThread();
+            }
+        }
+
+        private static void CalibrationProbe()
+        {
+        }
+
+        // Minimum over a few rounds, so that a preempted round does not spoil the estimate
+        private static double Measure(Func<int, long> body)
+        {
+            var best = double.MaxValue;
+            for(var round = 0; round < calibrationRounds; ++round)
+            {
+                var start = MethodBaseTracingInstaller.TicksReader();
+                sink += body(calibrationIterations);
+                var elapsed = MethodBaseTracingInstaller.TicksReader() - start;
+                best = Math.Min(best, (double)elapsed / calibrationIterations);
+            }
+            return best;
+        }
+
+        private static long ReadTicks(int iterations)
+        {
+            var ticksReader = MethodBaseTracingInstaller.TicksReader;
+            long result = 0;
+            for(var i = 0; i < iterations; ++i)
+                result += ticksReader();
+            return result;
+        }
+
+        private static long CallRecordedProbes(int iterations)
+        {
+            var methodId = calibrationMethodId;
+            for(var i = 0; i < iterations; ++i)
+            {
+                if(TracingAnalyzer.MethodStarted(methodId, i))
+                    TracingAnalyzer.MethodFinished(methodId, 1);
+            }
+            return iterations;
+        }
+
+        private static long CallCountedProbes(int iterations)
+        {
+            var methodId = calibrationMethodId;
+            for(var i = 0; i < iterations; ++i)
+            {
+                TracingAnalyzer.MethodCalled(methodId);
+            }
+            return iterations;
+        }
+
+        private const int calibrationIterations = 1 << 16;
+        private const int calibrationRounds = 5;
+
+        // A level is stepped up when its projected cost is below this part of the budget for stepUpIntervals intervals in a row
+        private const double stepUpFraction = 0.5;
+        private const int stepUpIntervals = 5;
+
+        private static bool enabled;
+        private static double budgetPercent;
+        private static OverheadLevel topLevel;
+        private static volatile OverheadLevel level;
+        private static double overheadPercent;
+        private static long stepsDown;
+        private static long stepsUp;
+        private static readonly long[] transitions = new long[4];
+
+        // State of the governor thread
+        private static double recordedCost;
+        private static double countedCost;
+        private static double skippedCost;
+        // Part of probe calls recorded the last time the level was Sampled, all of them are assumed until then
+        private static double sampledShare = 1;
+        private static int quietIntervals;
+        private static long lastTicks;
+        private static long lastProbes;
+        private static long lastRecorded;
+        private static long lastCounted;
+        private static long sink;
+        private static int calibrationMethodId;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,235 @@
+using System;
+using System.Runtime.InteropServices;
+using System.Threading;
+
+namespace GroboTrace.Core
+{
+    // Periodically copies per method totals and call trees of all threads to the shared memory segment created by ClrProfiler.
+    // Trees are read while their threads keep running, so the numbers of a single node may be slightly off, but never torn for readers:
+    // the whole area is rewritten under a seqlock (see SharedStatsFormat.h)
+    internal static unsafe class SharedStatsPublisher
+    {
+        public static void Init(MethodBaseTracingInstaller.SharedStatsAreaGetter getter)
+        {
+            if(getter == null)
+                return;
+            long capacity;
+            var area = getter(&capacity);
+            if(area == null || capacity < sizeof(StatsHeader))
+                return;
+            statsArea = area;
+            statsCapacity = capacity;
+            new Thread(Run) {IsBackground = true, Name = "GroboTrace shared stats"}.Start();
+        }
+
+        // The area is unmapped when the profiler detaches, nothing is written there after this returns
+        public static void Stop()
+        {
+            lock(publishLock)
+                statsArea = null;
+        }
+
+        private static void Run()
+        {
+            while(true)
+            {
+                Thread.Sleep(TracingSettings.SharedStatsIntervalMilliseconds);
+                try
+                {
+                    lock(publishLock)
+                    {
+                        if(statsArea == null)
+                            return;
+                        Publish();
+                    }
+                }
+                catch(Exception e)
+                {
+                    DiagnosticLog.Write(LogLevel.Error, ".NET: failed to publish shared stats: " + e);
+                }
+            }
+        }
+
+        private static void Publish()
+        {
+            var methodsCount = CollectMethods();
+            var threadsCount = 0;
+            var nodesCount = 0;
+            var callTrees = TracingAnalyzer.CallTrees;
+            for(var threadId = 0; threadId < callTrees.Length; ++threadId)
+            {
+                var root = callTrees[threadId].Root;
+                if(root.ChildrenCount == 0)
+                    continue;
+                Ensure(ref threads, threadsCount + 1);
+                threads[threadsCount++] = new ThreadRecord {managedThreadId = threadId, firstNode = nodesCount, nodesCount = 0};
+                var count = CollectNodes(root, nodesCount);
+                threads[threadsCount - 1].nodesCount = count;
+                nodesCount += count;
+            }
+
+            // Whatever does not fit is cut off: methods first, then whole threads
+            var available = statsCapacity - sizeof(StatsHeader);
+            var truncated = 0;
+            if((long)methodsCount * sizeof(MethodRecord) > available)
+            {
+                methodsCount = (int)(available / sizeof(MethodRecord));
+                truncated = 1;
+            }
+            available -= (long)methodsCount * sizeof(MethodRecord);
+            while(threadsCount > 0 && (long)threadsCount * sizeof(ThreadRecord) + (long)nodesCount * sizeof(NodeRecord) > available)
+            {
+                --threadsCount;
+                nodesCount = threads[threadsCount].firstNode;
+                truncated = 1;
+            }
+
+            var header = (StatsHeader*)statsArea;
+            Interlocked.Increment(ref header->sequence);
+            header->timestampMilliseconds = (long)(DateTime.UtcNow - unixEpoch).TotalMilliseconds;
+            header->ticksPerMillisecond = TicksCalibration.TicksPerMillisecond;
+            header->methodsCount = methodsCount;
+            header->threadsCount = threadsCount;
+            header->nodesCount = nodesCount;
+            header->truncated = truncated;
+            var methodRecords = (MethodRecord*)(statsArea + sizeof(StatsHeader));
+            for(var i = 0; i < methodsCount; ++i)
+                methodRecords[i] = methods[i];
+            var threadRecords = (ThreadRecord*)(methodRecords + methodsCount);
+            for(var i = 0; i < threadsCount; ++i)
+                threadRecords[i] = threads[i];
+            var nodeRecords = (NodeRecord*)(threadRecords + threadsCount);
+            for(var i = 0; i < nodesCount; ++i)
+                nodeRecords[i] = nodes[i];
+            Interlocked.Increment(ref header->sequence);
+        }
+
+        private static int CollectMethods()
+        {
+            var count = 0;
+            MethodHistograms.Merge(ref histograms, unloadedHistogram);
+            var numberOfMethods = MethodBaseTracingInstaller.NumberOfMethods;
+            for(var slot = 1; slot <= numberOfMethods; ++slot)
+            {
+                var methodId = MethodBaseTracingInstaller.GetMethodId(slot);
+                if(methodId == 0)
+                    continue;
+                var histogram = slot <= histograms.Length ? histograms[slot - 1] ?? emptyHistogram : emptyHistogram;
+                var calls = Math.Max(histogram.TotalCount, MethodBaseTracingInstaller.GetCallCount(methodId));
+                if(calls == 0)
+                    continue;
+                Ensure(ref methods, count + 1);
+                methods[count++] = new MethodRecord
+                    {
+                        methodId = methodId,
+                        calls = calls,
+                        ticks = histogram.Sum,
+                        p50 = histogram.Percentile50,
+                        p99 = histogram.Percentile99,
+                        p999 = histogram.Percentile999,
+                        max = histogram.Max
+                    };
+            }
+            return count;
+        }
+
+        private static int CollectNodes(MethodCallNode root, int firstNode)
+        {
+            var count = 0;
+            var stackSize = 0;
+            Ensure(ref stack, 1);
+            Ensure(ref stackParentIndexes, 1);
+            stack[stackSize] = root;
+            stackParentIndexes[stackSize++] = -1;
+            while(stackSize > 0)
+            {
+                --stackSize;
+                var node = stack[stackSize];
+                Ensure(ref nodes, firstNode + count + 1);
+                nodes[firstNode + count] = new NodeRecord {methodId = node.MethodId, parentIndex = stackParentIndexes[stackSize], calls = node.Calls, ticks = node.Ticks};
+                int childrenCount;
+                var children = node.GetChildren(out childrenCount);
+                for(var i = 0; i < childrenCount; ++i)
+                {
+                    var child = children[i];
+                    if(child.Calls == 0)
+                        continue;
+                    Ensure(ref stack, stackSize + 1);
+                    Ensure(ref stackParentIndexes, stackSize + 1);
+                    stack[stackSize] = child;
+                    stackParentIndexes[stackSize++] = count;
+                }
+                ++count;
+            }
+            Array.Clear(stack, 0, stack.Length);
+            return count;
+        }
+
+        private static void Ensure<T>(ref T[] array, int size)
+        {
+            if(array == null)
+                array = new T[Math.Max(size, 16)];
+            else if(array.Length < size)
+                Array.Resize(ref array, Math.Max(size, array.Length * 2));
+        }
+
+        [StructLayout(LayoutKind.Sequential)]
+        private struct StatsHeader
+        {
+            public long sequence;
+            public long timestampMilliseconds;
+            public double ticksPerMillisecond;
+            public int methodsCount;
+            public int threadsCount;
+            public int nodesCount;
+            public int truncated;
+        }
+
+        [StructLayout(LayoutKind.Sequential)]
+        private struct MethodRecord
+        {
+            public int methodId;
+            public int reserved;
+            public long calls;
+            public long ticks;
+            public long p50;
+            public long p99;
+            public long p999;
+            public long max;
+        }
+
+        [StructLayout(LayoutKind.Sequential)]
+        private struct ThreadRecord
+        {
+            public int managedThreadId;
+            public int firstNode;
+            public int nodesCount;
+            public int reserved;
+        }
+
+        [StructLayout(LayoutKind.Sequential)]
+        private struct NodeRecord
+        {
+            public int methodId;
+            public int parentIndex;
+            public long calls;
+            public long ticks;
+        }
+
+        private static readonly DateTime unixEpoch = new DateTime(1970, 1, 1, 0, 0, 0, DateTimeKind.Utc);
+
+        private static readonly object publishLock = new object();
+        private static byte* statsArea;
+        private static long statsCapacity;
+
+        // Publishing is done on a single thread, buffers are reused between rounds
+        private static MethodRecord[] methods;
+        private static LatencyHistogram[] histograms;
+        private static readonly LatencyHistogram unloadedHistogram = new LatencyHistogram();
+        private static readonly LatencyHistogram emptyHistogram = new LatencyHistogram();
+        private static ThreadRecord[] threads;
+        private static NodeRecord[] nodes;
+        private static MethodCallNode[] stack;
+        private static int[] stackParentIndexes;
+    }
+}
\ No newline at end of file
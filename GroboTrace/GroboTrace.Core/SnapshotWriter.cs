@@ -0,0 +1,456 @@
+using System;
+using System.IO;
+using System.Reflection;
+using System.Text;
+
+using GrEmit.Utils;
+
+namespace GroboTrace.Core
+{
+    // Writes call tree snapshots straight into buffers the calling thread reuses, without MethodStatsNode graphs or sorted copies
+    // of every level: reports of slow sections are made exactly when the process is already under pressure.
+    // Text is what TracingAnalyzerStatsFormatter makes of GetStats of the snapshot: the tree with children by total ticks,
+    // then methods by self ticks with unloaded ones in one row, nodes under 1% of the section are left out. Binary layout, little-endian:
+    //     int count, long elapsedTicks,
+    //     count nodes of int parentIndex, int methodId, int calls, int recursiveCalls, long ticks, long cpuTicks, long offCpuTicks,
+    //     count names of int byteCount followed by UTF-8 bytes.
+    // Node 0 is the root, CPU ticks are -1 where they were not measured, names of unknown methods are empty
+    internal static unsafe class SnapshotWriter
+    {
+        public static void WriteText(CallTreeSnapshot snapshot, long elapsedMilliseconds, TextWriter writer)
+        {
+            if(snapshot == null || snapshot.Count == 0)
+                return;
+            var buffers = GetBuffers();
+            buffers.writer = writer;
+            try
+            {
+                WriteTree(buffers, snapshot, elapsedMilliseconds);
+                WriteList(buffers, snapshot, elapsedMilliseconds);
+                buffers.Flush();
+            }
+            finally
+            {
+                buffers.writer = null;
+                buffers.length = 0;
+                Release(snapshot.Count);
+            }
+        }
+
+        public static void WriteBinary(CallTreeSnapshot snapshot, Stream stream)
+        {
+            var count = snapshot == null ? 0 : snapshot.Count;
+            var buffers = GetBuffers();
+            var size = binaryHeaderSize + count * binaryNodeSize;
+            for(var i = 0; i < count; ++i)
+                size += sizeof(int) + Encoding.UTF8.GetByteCount(GetName(snapshot.MethodIds[i]));
+            Ensure(ref buffers.bytes, size);
+            fixed(byte* start = &buffers.bytes[0])
+            {
+                var pointer = start;
+                *(int*)pointer = count;
+                *(long*)(pointer + 4) = count == 0 ? 0 : snapshot.ElapsedTicks;
+                pointer += binaryHeaderSize;
+                for(var i = 0; i < count; ++i)
+                {
+                    long cpuTicks, offCpuTicks;
+                    GetCpuTicks(snapshot, i, out cpuTicks, out offCpuTicks);
+                    *(int*)pointer = snapshot.ParentIndexes[i];
+                    *(int*)(pointer + 4) = snapshot.MethodIds[i];
+                    *(int*)(pointer + 8) = snapshot.Calls[i];
+                    *(int*)(pointer + 12) = snapshot.RecursiveCalls == null ? 0 : snapshot.RecursiveCalls[i];
+                    *(long*)(pointer + 16) = snapshot.Ticks[i];
+                    *(long*)(pointer + 24) = cpuTicks;
+                    *(long*)(pointer + 32) = offCpuTicks;
+                    pointer += binaryNodeSize;
+                }
+                for(var i = 0; i < count; ++i)
+                {
+                    var name = GetName(snapshot.MethodIds[i]);
+                    var byteCount = Encoding.UTF8.GetBytes(name, 0, name.Length, buffers.bytes, (int)(pointer - start) + sizeof(int));
+                    *(int*)pointer = byteCount;
+                    pointer += sizeof(int) + byteCount;
+                }
+            }
+            stream.Write(buffers.bytes, 0, size);
+            Release(count);
+        }
+
+        private static void WriteTree(Buffers buffers, CallTreeSnapshot snapshot, long elapsedMilliseconds)
+        {
+            var count = snapshot.Count;
+            var elapsedTicks = snapshot.ElapsedTicks;
+            var millisecondsPerTick = elapsedTicks == 0 ? 0.0 : (double)elapsedMilliseconds / elapsedTicks;
+            Ensure(ref buffers.firstChild, count);
+            Ensure(ref buffers.lastChild, count);
+            Ensure(ref buffers.nextSibling, count);
+            Ensure(ref buffers.keys, count);
+            Ensure(ref buffers.order, count);
+            Ensure(ref buffers.stack, count);
+            Ensure(ref buffers.depths, count);
+
+            // All nodes are sorted once and appended to the lists of their parents, which leaves every list in descending order of ticks
+            for(var i = 0; i < count; ++i)
+                buffers.firstChild[i] = -1;
+            for(var i = 1; i < count; ++i)
+            {
+                buffers.keys[i - 1] = -snapshot.Ticks[i];
+                buffers.order[i - 1] = i;
+            }
+            Sort(buffers, count - 1, null);
+            for(var k = 0; k < count - 1; ++k)
+            {
+                var i = buffers.order[k];
+                var parentIndex = snapshot.ParentIndexes[i];
+                buffers.nextSibling[i] = -1;
+                if(buffers.firstChild[parentIndex] < 0)
+                    buffers.firstChild[parentIndex] = i;
+                else
+                    buffers.nextSibling[buffers.lastChild[parentIndex]] = i;
+                buffers.lastChild[parentIndex] = i;
+            }
+
+            var stackSize = 0;
+            buffers.stack[stackSize] = 0;
+            buffers.depths[stackSize++] = 0;
+            while(stackSize > 0)
+            {
+                --stackSize;
+                var i = buffers.stack[stackSize];
+                var depth = buffers.depths[stackSize];
+                var percent = i == 0 ? 100.0 : elapsedTicks == 0 ? 0.0 : snapshot.Ticks[i] * 100.0 / elapsedTicks;
+                // Children never take more than their parent, the whole subtree is under the limit
+                if(percent < minPercent)
+                    continue;
+                long cpuTicks, offCpuTicks;
+                GetCpuTicks(snapshot, i, out cpuTicks, out offCpuTicks);
+                var methodId = snapshot.MethodIds[i];
+                WriteLine(buffers, depth, percent, elapsedMilliseconds, MethodBaseTracingInstaller.GetMethod(methodId) == null ? null : GetName(methodId), snapshot.Calls[i],
+                          snapshot.RecursiveCalls == null ? 0 : snapshot.RecursiveCalls[i], cpuTicks, offCpuTicks, millisecondsPerTick);
+                var first = stackSize;
+                for(var child = buffers.firstChild[i]; child >= 0; child = buffers.nextSibling[child])
+                {
+                    buffers.stack[stackSize] = child;
+                    buffers.depths[stackSize++] = depth + 1;
+                }
+                // The heaviest child is popped first
+                Array.Reverse(buffers.stack, first, stackSize - first);
+            }
+        }
+
+        // Rows are the ones CallTreeSnapshotAnalyzer.GetStatsAsList makes, summed up in the same buffers as the tree
+        private static void WriteList(Buffers buffers, CallTreeSnapshot snapshot, long elapsedMilliseconds)
+        {
+            var count = snapshot.Count;
+            var elapsedTicks = snapshot.ElapsedTicks;
+            Ensure(ref buffers.selfTicks, count);
+            Ensure(ref buffers.methodIds, count);
+            for(var i = 0; i < count; ++i)
+                buffers.selfTicks[i] = snapshot.Ticks[i];
+            for(var i = 1; i < count; ++i)
+                buffers.selfTicks[snapshot.ParentIndexes[i]] -= snapshot.Ticks[i];
+
+            // Nodes of the same method are made adjacent by sorting on method ids and summed up run by run. Rows keep the first node
+            // of their method for ties to be ordered as the rows of GetStats, which are made in the order of nodes
+            var nodesCount = 0;
+            for(var i = 1; i < count; ++i)
+            {
+                if(snapshot.MethodIds[i] == 0)
+                    continue;
+                buffers.methodIds[nodesCount] = snapshot.MethodIds[i];
+                buffers.order[nodesCount++] = i;
+            }
+            Array.Sort(buffers.methodIds, buffers.order, 0, nodesCount);
+            Ensure(ref buffers.entryMethodIds, nodesCount + 1);
+            Ensure(ref buffers.entryFirstNodes, nodesCount + 1);
+            Ensure(ref buffers.entryCalls, nodesCount + 1);
+            Ensure(ref buffers.entryRecursiveCalls, nodesCount + 1);
+            Ensure(ref buffers.entryTicks, nodesCount + 1);
+            var entriesCount = 0;
+            var entry = -1;
+            // Methods unloaded since they were called share one row
+            var unloadedEntry = -1;
+            long methodsTicks = 0;
+            for(var k = 0; k < nodesCount; ++k)
+            {
+                var i = buffers.order[k];
+                if(k == 0 || buffers.methodIds[k] != buffers.methodIds[k - 1])
+                {
+                    var unloaded = MethodBaseTracingInstaller.GetMethod(buffers.methodIds[k]) == MethodBaseTracingInstaller.UnloadedMethod;
+                    if(unloaded && unloadedEntry >= 0)
+                        entry = unloadedEntry;
+                    else
+                    {
+                        entry = entriesCount++;
+                        buffers.entryMethodIds[entry] = buffers.methodIds[k];
+                        buffers.entryFirstNodes[entry] = i;
+                        buffers.entryCalls[entry] = 0;
+                        buffers.entryRecursiveCalls[entry] = 0;
+                        buffers.entryTicks[entry] = 0;
+                        if(unloaded)
+                            unloadedEntry = entry;
+                    }
+                }
+                buffers.entryFirstNodes[entry] = Math.Min(buffers.entryFirstNodes[entry], i);
+                buffers.entryCalls[entry] += snapshot.Calls[i];
+                buffers.entryRecursiveCalls[entry] += snapshot.RecursiveCalls == null ? 0 : snapshot.RecursiveCalls[i];
+                buffers.entryTicks[entry] += buffers.selfTicks[i];
+                methodsTicks += buffers.selfTicks[i];
+            }
+            // Time of the section outside of all the methods, the last row of GetStats
+            buffers.entryMethodIds[entriesCount] = 0;
+            buffers.entryFirstNodes[entriesCount] = count;
+            buffers.entryCalls[entriesCount] = 1;
+            buffers.entryRecursiveCalls[entriesCount] = 0;
+            buffers.entryTicks[entriesCount] = elapsedTicks - methodsTicks;
+            ++entriesCount;
+
+            Ensure(ref buffers.keys, entriesCount);
+            for(var j = 0; j < entriesCount; ++j)
+            {
+                buffers.keys[j] = -buffers.entryTicks[j];
+                buffers.order[j] = j;
+            }
+            Sort(buffers, entriesCount, buffers.entryFirstNodes);
+            for(var k = 0; k < entriesCount; ++k)
+            {
+                var j = buffers.order[k];
+                var percent = elapsedTicks == 0 ? 0.0 : buffers.entryTicks[j] * 100.0 / elapsedTicks;
+                if(percent < minPercent)
+                    continue;
+                var methodId = buffers.entryMethodIds[j];
+                var name = MethodBaseTracingInstaller.GetMethod(methodId) == null ? null : j == unloadedEntry ? GetUnloadedMethodName() : GetName(methodId);
+                WriteLine(buffers, 0, percent, elapsedMilliseconds, name, buffers.entryCalls[j], buffers.entryRecursiveCalls[j], -1, -1, 0.0);
+            }
+        }
+
+        // Array.Sort is unstable, runs of equal keys are put in the order of their tie-breakers, or of their items if there are none,
+        // which is the order the stable OrderByDescending of GetStats gives
+        private static void Sort(Buffers buffers, int count, int[] tieBreakers)
+        {
+            Array.Sort(buffers.keys, buffers.order, 0, count);
+            Ensure(ref buffers.ties, count);
+            for(var start = 0; start < count;)
+            {
+                var end = start + 1;
+                while(end < count && buffers.keys[end] == buffers.keys[start])
+                    ++end;
+                if(end - start > 1)
+                {
+                    for(var k = start; k < end; ++k)
+                        buffers.ties[k] = tieBreakers == null ? buffers.order[k] : tieBreakers[buffers.order[k]];
+                    Array.Sort(buffers.ties, buffers.order, start, end - start);
+                }
+                start = end;
+            }
+        }
+
+        // Name is null for the root
+        private static void WriteLine(Buffers buffers, int depth, double percent, long elapsedMilliseconds, string name, int calls, int recursiveCalls,
+                                      long cpuTicks, long offCpuTicks, double millisecondsPerTick)
+        {
+            buffers.Append(' ', depth * 4);
+            buffers.AppendFixed(percent, 2);
+            buffers.Append("% ");
+            buffers.AppendFixed(elapsedMilliseconds * percent / 100.0, 3);
+            buffers.Append("ms ");
+            if(name == null)
+                buffers.Append("ROOT");
+            else
+            {
+                buffers.AppendInteger(calls);
+                buffers.Append(" calls ");
+                buffers.Append(name);
+            }
+            if(recursiveCalls > 0)
+            {
+                buffers.Append(" (+");
+                buffers.AppendInteger(recursiveCalls);
+                buffers.Append(" recursive)");
+            }
+            if(cpuTicks >= 0 && millisecondsPerTick > 0)
+            {
+                buffers.Append(" [on-CPU ");
+                buffers.AppendFixed(cpuTicks * millisecondsPerTick, 3);
+                buffers.Append("ms, off-CPU ");
+                buffers.AppendFixed(offCpuTicks * millisecondsPerTick, 3);
+                buffers.Append("ms]");
+            }
+            buffers.Append(Environment.NewLine);
+        }
+
+        // Same split as CpuTime.SetTicks gives to MethodStats, the section time for the root
+        private static void GetCpuTicks(CallTreeSnapshot snapshot, int index, out long cpuTicks, out long offCpuTicks)
+        {
+            cpuTicks = offCpuTicks = -1;
+            if(snapshot.CpuTicks == null)
+                return;
+            long measuredTicks;
+            if(index == 0)
+            {
+                if(snapshot.ElapsedCpuTicks < 0)
+                    return;
+                cpuTicks = snapshot.ElapsedCpuTicks;
+                measuredTicks = snapshot.ElapsedTicks;
+            }
+            else
+            {
+                measuredTicks = snapshot.CpuMeasuredTicks[index];
+                if(measuredTicks <= 0)
+                    return;
+                cpuTicks = snapshot.CpuTicks[index];
+            }
+            cpuTicks = Math.Min(cpuTicks, measuredTicks);
+            offCpuTicks = measuredTicks - cpuTicks;
+        }
+
+        // Names formatted here are kept with the ones from the profiler, a method is formatted once
+        private static string GetName(int methodId)
+        {
+            var name = MethodSymbols.GetName(methodId);
+            if(name != null)
+                return name;
+            var method = MethodBaseTracingInstaller.GetMethod(methodId);
+            if(method == null)
+                return "";
+            name = Format(method);
+            MethodSymbols.SetName(methodId, name);
+            return name;
+        }
+
+        // Row of all the unloaded methods, which GetStats leaves without a name
+        private static string GetUnloadedMethodName()
+        {
+            return unloadedMethodName ?? (unloadedMethodName = Format(MethodBaseTracingInstaller.UnloadedMethod));
+        }
+
+        private static string Format(MethodBase method)
+        {
+            var methodInfo = method as MethodInfo;
+            return methodInfo != null ? Formatter.Format(methodInfo) : Formatter.Format((ConstructorInfo)method);
+        }
+
+        private static Buffers GetBuffers()
+        {
+            return buffers ?? (buffers = new Buffers());
+        }
+
+        // Buffers grown for a huge snapshot are dropped instead of being kept for the life of the thread
+        private static void Release(int count)
+        {
+            if(count > maxRetainedNodes || (buffers.bytes != null && buffers.bytes.Length > maxRetainedNodes * binaryNodeSize))
+                buffers = null;
+        }
+
+        private static void Ensure<T>(ref T[] array, int size)
+        {
+            if(array == null)
+                array = new T[Math.Max(size, 16)];
+            else if(array.Length < size)
+                Array.Resize(ref array, Math.Max(size, array.Length * 2));
+        }
+
+        private const double minPercent = 1.0;
+        private const int binaryHeaderSize = 12;
+        private const int binaryNodeSize = 40;
+        private const int maxRetainedNodes = 1 << 16;
+
+        [ThreadStatic]
+        private static Buffers buffers;
+
+        private static string unloadedMethodName;
+
+        private class Buffers
+        {
+            public void Append(string value)
+            {
+                for(var i = 0; i < value.Length;)
+                {
+                    if(length == chars.Length)
+                        Flush();
+                    var chunk = Math.Min(value.Length - i, chars.Length - length);
+                    value.CopyTo(i, chars, length, chunk);
+                    length += chunk;
+                    i += chunk;
+                }
+            }
+
+            public void Append(char value, int repeatCount)
+            {
+                for(var i = 0; i < repeatCount; ++i)
+                {
+                    if(length == chars.Length)
+                        Flush();
+                    chars[length++] = value;
+                }
+            }
+
+            public void AppendInteger(long value)
+            {
+                if(value < 0)
+                {
+                    Append('-', 1);
+                    value = -value;
+                }
+                var digitsCount = 0;
+                do
+                {
+                    digits[digitsCount++] = (char)('0' + value % 10);
+                    value /= 10;
+                } while(value > 0);
+                while(digitsCount > 0)
+                    Append(digits[--digitsCount], 1);
+            }
+
+            // Like ToString("F<decimals>", CultureInfo.InvariantCulture) for the values of reports
+            public void AppendFixed(double value, int decimals)
+            {
+                long scale = 1;
+                for(var i = 0; i < decimals; ++i)
+                    scale *= 10;
+                if(value < 0)
+                {
+                    Append('-', 1);
+                    value = -value;
+                }
+                var scaled = (long)Math.Round(value * scale, MidpointRounding.AwayFromZero);
+                AppendInteger(scaled / scale);
+                Append('.', 1);
+                var fraction = scaled % scale;
+                for(var divisor = scale / 10; divisor > 0; divisor /= 10)
+                {
+                    Append((char)('0' + fraction / divisor), 1);
+                    fraction %= divisor;
+                }
+            }
+
+            public void Flush()
+            {
+                writer.Write(chars, 0, length);
+                length = 0;
+            }
+
+            public TextWriter writer;
+            public int length;
+            public byte[] bytes;
+            public long[] keys;
+            public int[] order;
+            public int[] ties;
+            public long[] selfTicks;
+            public int[] methodIds;
+            public int[] entryMethodIds;
+            public int[] entryFirstNodes;
+            public int[] entryCalls;
+            public int[] entryRecursiveCalls;
+            public long[] entryTicks;
+            public int[] firstChild;
+            public int[] lastChild;
+            public int[] nextSibling;
+            public int[] stack;
+            public int[] depths;
+
+            private readonly char[] chars = new char[4096];
+            private readonly char[] digits = new char[20];
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,154 @@
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Reflection;
+using System.Runtime.InteropServices;
+
+namespace GroboTrace.Core
+{
+    // Converts call trees aggregated by the native stack sampler into snapshots of the same shape as instrumented call trees have.
+    // Sampled methods are registered in MethodBaseTracingInstaller, so the same analyzers and formatter work with them
+    internal static unsafe class StackSamples
+    {
+        public static void Init(MethodBaseTracingInstaller.SampledTreeCopier copier, MethodBaseTracingInstaller.SampledTreeCleaner cleaner)
+        {
+            sampledTreeCopier = copier;
+            sampledTreeCleaner = cleaner;
+        }
+
+        // The profiler passes the copier only when the sampler has actually started, without ICorProfilerInfo10 it falls back to IL rewriting
+        // even if GROBOTRACE_ENGINE asks for stack sampling
+        public static bool Enabled { get { return sampledTreeCopier != null; } }
+
+        public static void Clear(bool currentThreadOnly)
+        {
+            sampledTreeCleaner?.Invoke(currentThreadOnly ? 1 : 0);
+        }
+
+        public static CallTreeSnapshot TakeSnapshot(bool currentThreadOnly)
+        {
+            var copier = sampledTreeCopier;
+            if(copier == null)
+                return null;
+            var nodes = new SampledNode[64];
+            int count;
+            while(true)
+            {
+                fixed(SampledNode* buffer = &nodes[0])
+                    count = copier(currentThreadOnly ? 1 : 0, buffer, nodes.Length);
+                if(count <= nodes.Length)
+                    break;
+                nodes = new SampledNode[count * 2];
+            }
+            if(count == 0)
+                return null;
+
+            // Samples are converted to microseconds, nodes of unknown methods are merged into their parents
+            long ticksPerSample = TracingSettings.StackSamplingIntervalMilliseconds * 1000L;
+            var snapshotIndexes = new int[count];
+            var result = new CallTreeSnapshot
+                {
+                    ElapsedTicks = nodes[0].samples * ticksPerSample,
+                    MethodIds = new int[count],
+                    ParentIndexes = new int[count],
+                    Calls = new int[count],
+                    Ticks = new long[count]
+                };
+            var resultCount = 0;
+            lock(methodIds)
+            {
+                for(var i = 0; i < count; ++i)
+                {
+                    var node = nodes[i];
+                    var methodId = i == 0 ? 0 : GetMethodId(node);
+                    if(i > 0 && methodId == 0)
+                    {
+                        snapshotIndexes[i] = snapshotIndexes[node.parentIndex];
+                        continue;
+                    }
+                    snapshotIndexes[i] = resultCount;
+                    result.MethodIds[resultCount] = methodId;
+                    result.ParentIndexes[resultCount] = i == 0 ? -1 : snapshotIndexes[node.parentIndex];
+                    result.Calls[resultCount] = node.samples;
+                    result.Ticks[resultCount] = node.samples * ticksPerSample;
+                    ++resultCount;
+                }
+            }
+            result.Count = resultCount;
+            return result;
+        }
+
+        public static void ModuleUnloaded(UIntPtr moduleId)
+        {
+            lock(methodIds)
+            {
+                foreach(var key in methodIds.Keys.Where(key => key.ModuleId == moduleId).ToList())
+                    methodIds.Remove(key);
+            }
+        }
+
+        private static int GetMethodId(SampledNode node)
+        {
+            if(node.assemblyName == IntPtr.Zero)
+                return 0;
+            var key = new MethodKey(node.moduleId, node.methodToken);
+            int methodId;
+            if(methodIds.TryGetValue(key, out methodId))
+                return methodId;
+            var method = ResolveMethod(Marshal.PtrToStringUni(node.assemblyName), Marshal.PtrToStringUni(node.modulePath), node.methodToken);
+            if(method != null)
+                MethodBaseTracingInstaller.AddMethod(method, node.moduleId, out methodId);
+            methodIds.Add(key, methodId);
+            return methodId;
+        }
+
+        private static MethodBase ResolveMethod(string assemblyName, string moduleName, uint methodToken)
+        {
+            var module = MethodBaseTracingInstaller.ResolveModule(assemblyName, moduleName);
+            if(module == null)
+                return null;
+            try
+            {
+                return module.ResolveMethod((int)methodToken);
+            }
+            catch(Exception)
+            {
+                DiagnosticLog.Write(LogLevel.Error, ".NET: Unable to obtain method with token {2}. Assembly = {0}, module path = {1}", assemblyName, moduleName, methodToken);
+                return null;
+            }
+        }
+
+        private struct MethodKey : IEquatable<MethodKey>
+        {
+            public MethodKey(UIntPtr moduleId, uint methodToken)
+            {
+                this.moduleId = moduleId;
+                this.methodToken = methodToken;
+            }
+
+            public bool Equals(MethodKey other)
+            {
+                return moduleId == other.moduleId && methodToken == other.methodToken;
+            }
+
+            public override bool Equals(object obj)
+            {
+                return obj is MethodKey && Equals((MethodKey)obj);
+            }
+
+            public UIntPtr ModuleId { get { return moduleId; } }
+
+            public override int GetHashCode()
+            {
+                return moduleId.GetHashCode() * 397 ^ (int)methodToken;
+            }
+
+            private readonly UIntPtr moduleId;
+            private readonly uint methodToken;
+        }
+
+        private static readonly Dictionary<MethodKey, int> methodIds = new Dictionary<MethodKey, int>();
+        private static MethodBaseTracingInstaller.SampledTreeCopier sampledTreeCopier;
+        private static MethodBaseTracingInstaller.SampledTreeCleaner sampledTreeCleaner;
+    }
+}
\ No newline at end of file
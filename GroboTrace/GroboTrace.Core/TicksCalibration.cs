@@ -0,0 +1,26 @@
+using System.Diagnostics;
+
+namespace GroboTrace.Core
+{
+    // Probes measure time with rdtsc, its frequency is estimated against Stopwatch since GroboTrace.Core was loaded
+    internal static class TicksCalibration
+    {
+        public static void Init()
+        {
+            startTicks = MethodBaseTracingInstaller.TicksReader();
+            startTimestamp = Stopwatch.GetTimestamp();
+        }
+
+        public static double TicksPerMillisecond
+        {
+            get
+            {
+                var elapsedMilliseconds = (Stopwatch.GetTimestamp() - startTimestamp) * 1000.0 / Stopwatch.Frequency;
+                return elapsedMilliseconds <= 0 ? 0 : (MethodBaseTracingInstaller.TicksReader() - startTicks) / elapsedMilliseconds;
+            }
+        }
+
+        private static long startTicks;
+        private static long startTimestamp;
+    }
+}
\ No newline at end of file
@@ -1,4 +1,8 @@
 ﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Linq;
+using System.Runtime.InteropServices;
 using System.Threading;
 
 namespace GroboTrace.Core
@@ -13,23 +17,210 @@ namespace GroboTrace.Core
             return result;
         }
 
-        public static void MethodStarted(int methodId)
+        // Returns whether the call was recorded, the injected code calls MethodFinished only for recorded calls
+        public static bool MethodStarted(int methodId, long startTicks)
         {
-            GetMethodCallTreeForCurrentThread().StartMethod(methodId);
+            var methodCallTree = GetMethodCallTreeForCurrentThread();
+            ++methodCallTree.ProbeCalls;
+            if(WaitEvents.Enabled)
+                WaitEvents.Poll(methodCallTree);
+            // Only starts are filtered: FinishMethod of a method started before probes were turned off still has to pop its node
+            if(probesFiltered)
+            {
+                if(!AreProbesEnabled(methodId))
+                    return false;
+                var level = overheadLevel;
+                if(level == OverheadLevel.Counting)
+                {
+                    ++methodCallTree.CountedCalls;
+                    MethodBaseTracingInstaller.IncrementCallCount(methodId);
+                    return false;
+                }
+                if(level == OverheadLevel.Off)
+                    return false;
+            }
+            if(samplingEnabled && !methodCallTree.Sampled)
+                return false;
+            ++methodCallTree.RecordedCalls;
+            return methodCallTree.StartMethod(methodId, startTicks);
         }
 
         public static void MethodFinished(int methodId, long elapsed)
         {
-            GetMethodCallTreeForCurrentThread().FinishMethod(methodId, elapsed);
+            var methodCallTree = GetMethodCallTreeForCurrentThread();
+            if(WaitEvents.Enabled)
+                WaitEvents.Poll(methodCallTree);
+            // Not gated by sampling: a call started before its section stopped being sampled must still leave its node
+            methodCallTree.FinishMethod(methodId, elapsed);
+        }
+
+        // The only probe injected in TracingMode.Counting
+        public static void MethodCalled(int methodId)
+        {
+            var methodCallTree = GetMethodCallTreeForCurrentThread();
+            ++methodCallTree.ProbeCalls;
+            if(probesFiltered && (!AreProbesEnabled(methodId) || overheadLevel == OverheadLevel.Off))
+                return;
+            ++methodCallTree.CountedCalls;
+            MethodBaseTracingInstaller.IncrementCallCount(methodId);
+        }
+
+        // Injected at basic block leaders of the methods selected by GROBOTRACE_BLOCKS
+        public static void BlockEntered(int blockId)
+        {
+            BasicBlockCounters.Increment(blockId);
+        }
+
+        // When sampling is enabled probes record only threads which are inside a sampled section
+        public static void EnableSampling(bool enabled)
+        {
+            samplingRequested = enabled;
+            UpdateSampling();
+        }
+
+        public static bool IsSamplingEnabled()
+        {
+            return samplingEnabled;
+        }
+
+        // Set through the control socket, replaces sampling rates of all Profiler.Profile sections, 0 restores them
+        public static void SetSamplingRateOverride(int rate)
+        {
+            samplingRateOverride = rate;
+            samplingRequested = rate > 0 || TracingSettings.SamplingEnabled;
+            UpdateSampling();
+        }
+
+        public static int GetSamplingRateOverride()
+        {
+            return samplingRateOverride;
+        }
+
+        public static void SetProbesEnabled(bool enabled)
+        {
+            probesEnabled = enabled;
+            UpdateProbesFilter();
+        }
+
+        public static bool ProbesEnabled { get { return probesEnabled; } }
+
+        public static OverheadGovernorStats GetOverheadGovernorStats()
+        {
+            return OverheadGovernor.GetStats();
+        }
+
+        // Set by OverheadGovernor, stays Full unless GROBOTRACE_CPU_BUDGET_PERCENT is exceeded
+        internal static void SetOverheadLevel(OverheadLevel level)
+        {
+            overheadLevel = level;
+            UpdateSampling();
+            UpdateProbesFilter();
+        }
+
+        internal static void UpdateProbesFilter()
+        {
+            probesFiltered = !probesEnabled || MethodBaseTracingInstaller.DisabledMethodsCount > 0 || overheadLevel >= OverheadLevel.Counting;
+        }
+
+        // Sampled level of the governor turns sampling on regardless of what was asked for
+        private static void UpdateSampling()
+        {
+            samplingEnabled = samplingRequested || overheadLevel == OverheadLevel.Sampled;
+            UpdateProbesActive();
+        }
+
+        // Probes injected into methods read this flag first and skip reading ticks and calling MethodStarted/MethodFinished while it is 0,
+        // which is the case when sampling is asked for and no thread is inside a sampled section. The Sampled level of the governor
+        // does not turn probes off, as the governor needs their calls counted to know when to step back up
+        private static void UpdateProbesActive()
+        {
+            lock(probesActiveLock)
+                Marshal.WriteInt32(probesActiveAddress, !samplingRequested || Volatile.Read(ref sampledThreads) > 0 ? 1 : 0);
+        }
+
+        private static IntPtr CreateProbesActive()
+        {
+            var result = Marshal.AllocHGlobal(sizeof(int));
+            Marshal.WriteInt32(result, TracingSettings.SamplingEnabled ? 0 : 1);
+            return result;
+        }
+
+        // Only the first thread entering a sampled section and the last one leaving it update the flag
+        private static void SetThreadSampled(MethodCallTree methodCallTree, bool sampled)
+        {
+            if(methodCallTree.Sampled == sampled)
+                return;
+            methodCallTree.Sampled = sampled;
+            var count = sampled ? Interlocked.Increment(ref sampledThreads) : Interlocked.Decrement(ref sampledThreads);
+            if(count == (sampled ? 1 : 0))
+                UpdateProbesActive();
+        }
+
+        private static bool AreProbesEnabled(int methodId)
+        {
+            return probesEnabled && !MethodBaseTracingInstaller.IsMethodDisabled(methodId);
+        }
+
+        // Returns previous value to be passed to EndSection, so that nested sections work
+        public static bool BeginSection(bool sampled)
+        {
+            var methodCallTree = GetMethodCallTreeForCurrentThread();
+            var previous = methodCallTree.Sampled;
+            SetThreadSampled(methodCallTree, sampled);
+            return previous;
+        }
+
+        public static void EndSection(bool previousSampled)
+        {
+            SetThreadSampled(GetMethodCallTreeForCurrentThread(), previousSampled);
+        }
+
+        // Watched sections are checked by CallWatchdog, which is started by the first of them unless GROBOTRACE_WATCHDOG_* settings started it
+        public static int BeginWatchedSection(string groboTraceKey, int thresholdMilliseconds)
+        {
+            CallWatchdog.EnsureStarted();
+            return GetMethodCallTreeForCurrentThread().BeginWatchedSection(groboTraceKey, MethodBaseTracingInstaller.TicksReader(), thresholdMilliseconds);
+        }
+
+        public static void EndWatchedSection(int previousCount)
+        {
+            GetMethodCallTreeForCurrentThread().EndWatchedSection(previousCount);
+        }
+
+        public static List<StuckCall> GetStuckCalls()
+        {
+            return CallWatchdog.GetReports();
         }
 
         public static void ClearStats()
         {
-            GetMethodCallTreeForCurrentThread().ClearStats();
+            if(StackSamples.Enabled)
+            {
+                StackSamples.Clear(true);
+                return;
+            }
+            var methodCallTree = GetMethodCallTreeForCurrentThread();
+            methodCallTree.ClearStats();
+            if(CpuTime.Enabled)
+                methodCallTree.StartCpuTime();
+        }
+
+        // Histograms are merged across threads, so ClearStats leaves them, MethodBaseTracingInstaller.ClearMethodStats clears those of all threads
+        internal static void ClearMethodHistogramsForCurrentThread()
+        {
+            GetMethodCallTreeForCurrentThread().MethodHistograms?.ClearAll();
+        }
+
+        // Nanoseconds, 0 when GROBOTRACE_CPU_TIME is off
+        public static long GetThreadCpuTime()
+        {
+            return CpuTime.Read();
         }
 
         public static Stats GetStats()
         {
+            if(StackSamples.Enabled)
+                return CallTreeSnapshotAnalyzer.GetStats(StackSamples.TakeSnapshot(true));
             var ticks = MethodBaseTracingInstaller.TicksReader();
             var methodCallTree = GetMethodCallTreeForCurrentThread();
             return new Stats
@@ -40,6 +231,118 @@ namespace GroboTrace.Core
                 };
         }
 
+        public static CallTreeSnapshot TakeSnapshot()
+        {
+            if(StackSamples.Enabled)
+                return StackSamples.TakeSnapshot(true);
+            var ticks = MethodBaseTracingInstaller.TicksReader();
+            return GetMethodCallTreeForCurrentThread().TakeSnapshot(ticks, TracingSettings.SnapshotNodes);
+        }
+
+        // Copies only the maxNodes heaviest nodes and their ancestors, 0 copies all of them. Sampled trees are aggregated by the profiler
+        // and always copied whole
+        public static CallTreeSnapshot TakeTopSnapshot(int maxNodes)
+        {
+            if(StackSamples.Enabled)
+                return StackSamples.TakeSnapshot(true);
+            var ticks = MethodBaseTracingInstaller.TicksReader();
+            return GetMethodCallTreeForCurrentThread().TakeSnapshot(ticks, maxNodes);
+        }
+
+        public static Stats GetSnapshotStats(CallTreeSnapshot snapshot)
+        {
+            return CallTreeSnapshotAnalyzer.GetStats(snapshot);
+        }
+
+        public static void WriteSnapshot(CallTreeSnapshot snapshot, long elapsedMilliseconds, TextWriter writer)
+        {
+            SnapshotWriter.WriteText(snapshot, elapsedMilliseconds, writer);
+        }
+
+        public static void WriteSnapshotBinary(CallTreeSnapshot snapshot, Stream stream)
+        {
+            SnapshotWriter.WriteBinary(snapshot, stream);
+        }
+
+        // Stacks of all threads sampled since the start, ticks are microseconds
+        public static Stats GetSampledStats()
+        {
+            return CallTreeSnapshotAnalyzer.GetStats(StackSamples.TakeSnapshot(false));
+        }
+
+        public static List<MethodStats> GetMethodHistograms()
+        {
+            var result = new List<MethodStats>();
+            LatencyHistogram[] histograms = null;
+            var unloadedHistogram = new LatencyHistogram();
+            MethodHistograms.Merge(ref histograms, unloadedHistogram);
+            for(var slot = 1; slot <= histograms.Length; ++slot)
+            {
+                var histogram = histograms[slot - 1];
+                if(histogram == null)
+                    continue;
+                var methodId = MethodBaseTracingInstaller.GetMethodId(slot);
+                if(methodId == 0)
+                    continue;
+                var method = MethodBaseTracingInstaller.GetMethod(methodId);
+                if(method == null)
+                    continue;
+                var calls = histogram.TotalCount;
+                if(calls == 0)
+                    continue;
+                result.Add(new MethodStats
+                    {
+                        Method = method,
+                        Calls = (int)Math.Min(calls, int.MaxValue),
+                        Ticks = histogram.Sum,
+                        Histogram = histogram
+                    });
+            }
+            if(unloadedHistogram.TotalCount > 0)
+            {
+                result.Add(new MethodStats
+                    {
+                        Method = MethodBaseTracingInstaller.UnloadedMethod,
+                        Calls = (int)Math.Min(unloadedHistogram.TotalCount, int.MaxValue),
+                        Ticks = unloadedHistogram.Sum,
+                        Histogram = unloadedHistogram
+                    });
+            }
+            return result.OrderByDescending(stats => stats.Ticks).ToList();
+        }
+
+        public static List<MethodStats> GetMethodCallCounts()
+        {
+            var result = new List<MethodStats>();
+            var numberOfMethods = MethodBaseTracingInstaller.NumberOfMethods;
+            for(var slot = 1; slot <= numberOfMethods; ++slot)
+            {
+                var methodId = MethodBaseTracingInstaller.GetMethodId(slot);
+                if(methodId == 0)
+                    continue;
+                var calls = MethodBaseTracingInstaller.GetCallCount(methodId);
+                if(calls == 0)
+                    continue;
+                var method = MethodBaseTracingInstaller.GetMethod(methodId);
+                if(method == null)
+                    continue;
+                result.Add(new MethodStats
+                    {
+                        Method = method,
+                        Calls = (int)Math.Min(calls, int.MaxValue)
+                    });
+            }
+            var unloadedCalls = MethodBaseTracingInstaller.UnloadedMethodCalls;
+            if(unloadedCalls > 0)
+                result.Add(new MethodStats {Method = MethodBaseTracingInstaller.UnloadedMethod, Calls = (int)Math.Min(unloadedCalls, int.MaxValue)});
+            return result.OrderByDescending(stats => stats.Calls).ToList();
+        }
+
+        public static List<BasicBlockStats> GetBasicBlockStats()
+        {
+            return BasicBlockCounters.GetStats();
+        }
+
         private static MethodCallTree GetMethodCallTreeForCurrentThread()
         {
             var id = Thread.CurrentThread.ManagedThreadId;
@@ -48,6 +351,22 @@ namespace GroboTrace.Core
             return callTreesMap[id];
         }
 
+        // Indexed by ManagedThreadId
+        internal static MethodCallTree[] CallTrees { get { return callTreesMap; } }
+
         private static readonly MethodCallTree[] callTreesMap = CreateMethodCallTreesMap();
+        private static volatile bool samplingEnabled = TracingSettings.SamplingEnabled;
+        private static volatile bool samplingRequested = TracingSettings.SamplingEnabled;
+        private static volatile int samplingRateOverride;
+
+        // Address of an int read by the injected probes, see UpdateProbesActive
+        internal static readonly IntPtr probesActiveAddress = CreateProbesActive();
+        private static readonly object probesActiveLock = new object();
+        private static int sampledThreads;
+
+        // The only check on the fast path of probes, set when probes are off globally or for some methods
+        private static volatile bool probesFiltered;
+        private static volatile bool probesEnabled = true;
+        private static volatile OverheadLevel overheadLevel;
     }
 }
\ No newline at end of file
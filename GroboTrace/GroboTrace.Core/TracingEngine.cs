@@ -0,0 +1,11 @@
+namespace GroboTrace.Core
+{
+    internal enum TracingEngine
+    {
+        // Probes are injected into method bodies at JIT time
+        Instrumentation,
+
+        // Nothing is rewritten, ClrProfiler periodically walks stacks of all managed threads
+        StackSampling
+    }
+}
\ No newline at end of file
@@ -0,0 +1,11 @@
+namespace GroboTrace.Core
+{
+    internal enum TracingMode
+    {
+        // Call trees with timings: rdtsc at entry and in a finally block at exit
+        Full,
+
+        // Only a call counter increment at entry, no timings and no try/finally
+        Counting
+    }
+}
\ No newline at end of file
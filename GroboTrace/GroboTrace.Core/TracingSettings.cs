@@ -0,0 +1,82 @@
+using System;
+using System.Globalization;
+using System.Linq;
+using System.Text.RegularExpressions;
+
+namespace GroboTrace.Core
+{
+    // Settings are passed to the profiled process through GROBOTRACE_* environment variables,
+    // the same way COR_* variables configure ClrProfiler itself
+    internal static class TracingSettings
+    {
+        private static bool GetBoolean(string name)
+        {
+            var value = Environment.GetEnvironmentVariable(name);
+            return value == "1" || string.Equals(value, "true", StringComparison.OrdinalIgnoreCase);
+        }
+
+        private static TEnum GetEnum<TEnum>(string name, TEnum defaultValue) where TEnum : struct
+        {
+            var value = Environment.GetEnvironmentVariable(name);
+            TEnum result;
+            return Enum.TryParse(value, true, out result) && Enum.IsDefined(typeof(TEnum), result) ? result : defaultValue;
+        }
+
+        private static int GetInt32(string name, int defaultValue)
+        {
+            int result;
+            return int.TryParse(Environment.GetEnvironmentVariable(name), out result) && result > 0 ? result : defaultValue;
+        }
+
+        private static double GetDouble(string name, double defaultValue)
+        {
+            double result;
+            return double.TryParse(Environment.GetEnvironmentVariable(name), NumberStyles.Float, CultureInfo.InvariantCulture, out result) && result > 0 ? result : defaultValue;
+        }
+
+        private static Regex GetMethodsFilter(string name)
+        {
+            return ParseMethodsFilter(Environment.GetEnvironmentVariable(name));
+        }
+
+        // Semicolon-separated list of Namespace.Type.Method patterns, '*' matches any substring
+        public static Regex ParseMethodsFilter(string value)
+        {
+            if(string.IsNullOrWhiteSpace(value))
+                return null;
+            var patterns = value.Split(new[] {';'}, StringSplitOptions.RemoveEmptyEntries)
+                                .Select(pattern => "^" + Regex.Escape(pattern.Trim()).Replace(@"\*", ".*") + "$");
+            return new Regex(string.Join("|", patterns), RegexOptions.Compiled);
+        }
+
+        public static readonly bool CollectCallTreeNodeHistograms = GetBoolean("GROBOTRACE_NODE_HISTOGRAMS");
+        public static readonly bool SamplingEnabled = GetBoolean("GROBOTRACE_SAMPLING");
+        public static readonly TracingMode Mode = GetEnum("GROBOTRACE_MODE", TracingMode.Full);
+        public static readonly Regex BasicBlocksFilter = GetMethodsFilter("GROBOTRACE_BLOCKS");
+        public static readonly int MaxCallTreeNodes = GetInt32("GROBOTRACE_MAX_CALL_TREE_NODES", 0);
+        // Snapshots of slow sections keep only this number of the heaviest nodes and their ancestors, 0 keeps all of them
+        public static readonly int SnapshotNodes = GetInt32("GROBOTRACE_SNAPSHOT_NODES", 0);
+        // Number of levels searched for an active call of the same method, 1 folds direct recursion only, 0 turns folding off
+        public static readonly int RecursionFolding = GetInt32("GROBOTRACE_RECURSION_FOLDING", 0);
+
+        // Read by ClrProfiler as well
+        public static readonly TracingEngine Engine = GetEnum("GROBOTRACE_ENGINE", TracingEngine.Instrumentation);
+        public static readonly int StackSamplingIntervalMilliseconds = GetInt32("GROBOTRACE_STACK_SAMPLING_INTERVAL_MS", 10);
+
+        public static readonly int SharedStatsIntervalMilliseconds = GetInt32("GROBOTRACE_SHARED_STATS_INTERVAL_MS", 1000);
+
+        // 0 turns the overhead governor off
+        public static readonly double CpuBudgetPercent = GetDouble("GROBOTRACE_CPU_BUDGET_PERCENT", 0);
+        public static readonly int GovernorIntervalMilliseconds = GetInt32("GROBOTRACE_GOVERNOR_INTERVAL_MS", 1000);
+
+        // CPU time of the thread at boundaries of profiled sections, and on entry and exit of calls of the heaviest methods when the number is set
+        public static readonly bool CpuTimeEnabled = GetBoolean("GROBOTRACE_CPU_TIME");
+        public static readonly int CpuTimeTopMethods = GetInt32("GROBOTRACE_CPU_TIME_TOP_METHODS", 0);
+
+        // Threshold of all traced calls and thresholds of the matching methods (Foo.Bar.*=500;Foo.Baz=2000), 0 and empty turn the watchdog off
+        public static readonly int WatchdogThresholdMilliseconds = GetInt32("GROBOTRACE_WATCHDOG_MS", 0);
+        public static readonly string WatchdogMethods = Environment.GetEnvironmentVariable("GROBOTRACE_WATCHDOG_METHODS");
+        public static readonly int WatchdogIntervalMilliseconds = GetInt32("GROBOTRACE_WATCHDOG_INTERVAL_MS", 1000);
+        public static readonly int WatchdogReportsCount = GetInt32("GROBOTRACE_WATCHDOG_REPORTS", 64);
+    }
+}
\ No newline at end of file
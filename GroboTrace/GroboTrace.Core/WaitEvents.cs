@@ -0,0 +1,127 @@
+using System;
+using System.Reflection;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
+
+namespace GroboTrace.Core
+{
+    // Waits recorded by the profiler from runtime events (GROBOTRACE_WAITS) are added to call trees as children of the node
+    // that was current when they happened. The profiler sums them up in a slot of the thread, probes of the thread take them from there
+    internal static unsafe class WaitEvents
+    {
+        // Same layout as WaitTracker::Slot of the profiler
+        [StructLayout(LayoutKind.Sequential)]
+        public struct Slot
+        {
+            public long pending;
+            public long lockWaits;
+            public long lockWaitNanoseconds;
+            public long handleWaits;
+            public long handleWaitNanoseconds;
+            public long queueWaits;
+            public long queueWaitNanoseconds;
+        }
+
+        public static void Init(MethodBaseTracingInstaller.WaitSlotSetter setter)
+        {
+            if(setter == null)
+            {
+                enabled = false;
+                slotSetter = null;
+                return;
+            }
+            int id;
+            MethodBaseTracingInstaller.AddMethod(LockWaitMethod, UIntPtr.Zero, out id);
+            MethodSymbols.SetName(id, "[lock wait]");
+            lockWaitMethodId = id;
+            MethodBaseTracingInstaller.AddMethod(HandleWaitMethod, UIntPtr.Zero, out id);
+            MethodSymbols.SetName(id, "[handle wait]");
+            handleWaitMethodId = id;
+            MethodBaseTracingInstaller.AddMethod(ThreadPoolQueueMethod, UIntPtr.Zero, out id);
+            MethodSymbols.SetName(id, "[thread pool queue]");
+            threadPoolQueueMethodId = id;
+            slotSetter = setter;
+            enabled = true;
+        }
+
+        public static bool Enabled { get { return enabled; } }
+
+        // Called by probes before they change the current node
+        [MethodImpl(MethodImplOptions.AggressiveInlining)]
+        public static void Poll(MethodCallTree tree)
+        {
+            if(!registered)
+                Register(tree);
+            var slot = tree.Waits;
+            if(slot != null && slot->pending != 0)
+                Collect(tree, slot);
+        }
+
+        // Trees are indexed by ManagedThreadId, which is reused, so a new thread sets the slot of its tree again
+        private static void Register(MethodCallTree tree)
+        {
+            registered = true;
+            var setter = slotSetter;
+            if(setter == null)
+                return;
+            if(tree.Waits == null)
+            {
+                // Never freed, the tree lives as long as the process
+                var slot = (Slot*)Marshal.AllocHGlobal(sizeof(Slot));
+                *slot = new Slot();
+                tree.Waits = slot;
+            }
+            setter((IntPtr)tree.Waits);
+        }
+
+        private static void Collect(MethodCallTree tree, Slot* slot)
+        {
+            slot->pending = 0;
+            var lockWaits = slot->lockWaits;
+            var lockWaitNanoseconds = slot->lockWaitNanoseconds;
+            var handleWaits = slot->handleWaits;
+            var handleWaitNanoseconds = slot->handleWaitNanoseconds;
+            var queueWaits = slot->queueWaits;
+            var queueWaitNanoseconds = slot->queueWaitNanoseconds;
+            slot->lockWaits = slot->lockWaitNanoseconds = slot->handleWaits = slot->handleWaitNanoseconds = slot->queueWaits = slot->queueWaitNanoseconds = 0;
+            if(TracingAnalyzer.IsSamplingEnabled() && !tree.Sampled)
+                return;
+            var ticksPerNanosecond = TicksCalibration.TicksPerMillisecond / 1000000.0;
+            if(lockWaits > 0)
+                tree.AddWaits(lockWaitMethodId, (int)lockWaits, (long)(lockWaitNanoseconds * ticksPerNanosecond));
+            if(handleWaits > 0)
+                tree.AddWaits(handleWaitMethodId, (int)handleWaits, (long)(handleWaitNanoseconds * ticksPerNanosecond));
+            if(queueWaits > 0)
+                tree.AddWaits(threadPoolQueueMethodId, (int)queueWaits, (long)(queueWaitNanoseconds * ticksPerNanosecond));
+        }
+
+        public static readonly MethodBase LockWaitMethod = typeof(WaitMethods).GetMethod("LockWait", BindingFlags.Public | BindingFlags.Static);
+        public static readonly MethodBase HandleWaitMethod = typeof(WaitMethods).GetMethod("HandleWait", BindingFlags.Public | BindingFlags.Static);
+        public static readonly MethodBase ThreadPoolQueueMethod = typeof(WaitMethods).GetMethod("ThreadPoolQueue", BindingFlags.Public | BindingFlags.Static);
+
+        [ThreadStatic]
+        private static bool registered;
+
+        private static volatile bool enabled;
+        private static MethodBaseTracingInstaller.WaitSlotSetter slotSetter;
+        private static int lockWaitMethodId;
+        private static int handleWaitMethodId;
+        private static int threadPoolQueueMethodId;
+    }
+
+    // Stand-ins for waits in call trees. Lock waits are contention on monitors, handle waits are Monitor.Wait and waits on wait handles
+    public static class WaitMethods
+    {
+        public static void LockWait()
+        {
+        }
+
+        public static void HandleWait()
+        {
+        }
+
+        public static void ThreadPoolQueue()
+        {
+        }
+    }
+}
\ No newline at end of file
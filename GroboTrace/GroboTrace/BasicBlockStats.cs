@@ -0,0 +1,15 @@
+using System.Reflection;
+
+namespace GroboTrace
+{
+    public class BasicBlockStats
+    {
+        public MethodBase Method { get; set; }
+
+        // Offset of the first instruction of the block in the original IL of the method
+        public int ILOffset { get; set; }
+
+        public bool IsLoopHeader { get; set; }
+        public long Count { get; set; }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,22 @@
+namespace GroboTrace
+{
+    // Raw copy of the nodes of a thread's call tree touched during a profiled section.
+    // Node 0 is the section root, other nodes refer to their parents by index.
+    public class CallTreeSnapshot
+    {
+        public long ElapsedTicks { get; set; }
+        public int Count { get; set; }
+        public int[] MethodIds { get; set; }
+        public int[] ParentIndexes { get; set; }
+        public int[] Calls { get; set; }
+        public long[] Ticks { get; set; }
+        // Null unless GROBOTRACE_RECURSION_FOLDING is on
+        public int[] RecursiveCalls { get; set; }
+
+        // Null unless GROBOTRACE_CPU_TIME is on. On-CPU ticks of the section (-1 when its start was not measured)
+        // and of the timed calls of every node, together with the wall-clock ticks of those calls
+        public long ElapsedCpuTicks { get; set; }
+        public long[] CpuTicks { get; set; }
+        public long[] CpuMeasuredTicks { get; set; }
+    }
+}
\ No newline at end of file
@@ -2,6 +2,7 @@ using System;
 
 namespace GroboTrace
 {
+    // Called on a thread pool thread after the slow section has finished
     public interface IProfilerSink
     {
         void WhenCurrentDurationIsLongerThanPercentile99(TimeSpan currentDuration, TimeStatistics timeStatistics, string trace);
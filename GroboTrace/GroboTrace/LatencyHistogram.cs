@@ -0,0 +1,214 @@
+using System;
+using System.Threading;
+
+namespace GroboTrace
+{
+    // Log-linear (HDR-style) histogram: a value falls into the power-of-two range of its highest bit,
+    // each range is split into 2^subBucketBits linear sub-buckets, so relative error is at most 2^-subBucketBits.
+    // Ranges are allocated on first use, recording is O(1) and does not take locks.
+    public class LatencyHistogram
+    {
+        public LatencyHistogram()
+            : this(defaultSubBucketBits)
+        {
+        }
+
+        public LatencyHistogram(int subBucketBits)
+        {
+            if(subBucketBits < 1 || subBucketBits > maxSubBucketBits)
+                throw new ArgumentOutOfRangeException(nameof(subBucketBits), $"Must be in range [1, {maxSubBucketBits}]");
+            this.subBucketBits = subBucketBits;
+            subBucketCount = 1 << subBucketBits;
+            ranges = new long[64 - subBucketBits][];
+        }
+
+        public void Record(long value)
+        {
+            if(value < 0)
+                value = 0;
+            int rangeIndex, subBucketIndex;
+            GetBucket(value, out rangeIndex, out subBucketIndex);
+            var counts = ranges[rangeIndex] ?? AllocateRange(rangeIndex);
+            Interlocked.Increment(ref counts[subBucketIndex]);
+            Interlocked.Add(ref sum, value);
+            var currentMax = Volatile.Read(ref max);
+            while(value > currentMax)
+            {
+                var previousMax = Interlocked.CompareExchange(ref max, value, currentMax);
+                if(previousMax == currentMax)
+                    break;
+                currentMax = previousMax;
+            }
+        }
+
+        // Same as Record, but for histograms owned by a single thread (e.g. call tree nodes)
+        public void RecordNonAtomic(long value)
+        {
+            if(value < 0)
+                value = 0;
+            int rangeIndex, subBucketIndex;
+            GetBucket(value, out rangeIndex, out subBucketIndex);
+            var counts = ranges[rangeIndex] ?? AllocateRange(rangeIndex);
+            ++counts[subBucketIndex];
+            sum += value;
+            if(value > max)
+                max = value;
+        }
+
+        public void Add(LatencyHistogram other)
+        {
+            if(other.subBucketBits != subBucketBits)
+                throw new ArgumentException("Histograms must have the same precision", nameof(other));
+            for(var rangeIndex = 0; rangeIndex < other.ranges.Length; ++rangeIndex)
+            {
+                var otherCounts = other.ranges[rangeIndex];
+                if(otherCounts == null)
+                    continue;
+                var counts = ranges[rangeIndex] ?? AllocateRange(rangeIndex);
+                for(var i = 0; i < otherCounts.Length; ++i)
+                {
+                    var count = Volatile.Read(ref otherCounts[i]);
+                    if(count != 0)
+                        Interlocked.Add(ref counts[i], count);
+                }
+            }
+            Interlocked.Add(ref sum, other.Sum);
+            var otherMax = other.Max;
+            var currentMax = Volatile.Read(ref max);
+            while(otherMax > currentMax)
+            {
+                var previousMax = Interlocked.CompareExchange(ref max, otherMax, currentMax);
+                if(previousMax == currentMax)
+                    break;
+                currentMax = previousMax;
+            }
+        }
+
+        public void Clear()
+        {
+            foreach(var counts in ranges)
+            {
+                if(counts != null)
+                    Array.Clear(counts, 0, counts.Length);
+            }
+            Volatile.Write(ref sum, 0);
+            Volatile.Write(ref max, 0);
+        }
+
+        // Returns the highest value equivalent to the bucket containing the given percentile (0..100]
+        public long GetValueAtPercentile(double percentile)
+        {
+            var totalCount = TotalCount;
+            if(totalCount == 0)
+                return 0;
+            var targetCount = Math.Max(1L, (long)Math.Ceiling(totalCount * Math.Min(percentile, 100.0) / 100.0));
+            long count = 0;
+            for(var rangeIndex = 0; rangeIndex < ranges.Length; ++rangeIndex)
+            {
+                var counts = ranges[rangeIndex];
+                if(counts == null)
+                    continue;
+                for(var i = 0; i < counts.Length; ++i)
+                {
+                    count += Volatile.Read(ref counts[i]);
+                    if(count >= targetCount)
+                        return Math.Min(GetHighestEquivalentValue(rangeIndex, i), Max);
+                }
+            }
+            return Max;
+        }
+
+        public long TotalCount
+        {
+            get
+            {
+                long result = 0;
+                foreach(var counts in ranges)
+                {
+                    if(counts == null)
+                        continue;
+                    for(var i = 0; i < counts.Length; ++i)
+                        result += Volatile.Read(ref counts[i]);
+                }
+                return result;
+            }
+        }
+
+        public long Sum { get { return Volatile.Read(ref sum); } }
+        public long Max { get { return Volatile.Read(ref max); } }
+        public long Percentile50 { get { return GetValueAtPercentile(50.0); } }
+        public long Percentile99 { get { return GetValueAtPercentile(99.0); } }
+        public long Percentile999 { get { return GetValueAtPercentile(99.9); } }
+
+        private void GetBucket(long value, out int rangeIndex, out int subBucketIndex)
+        {
+            if(value < subBucketCount)
+            {
+                rangeIndex = 0;
+                subBucketIndex = (int)value;
+                return;
+            }
+            var highestBit = GetHighestBit((ulong)value);
+            var shift = highestBit - subBucketBits;
+            rangeIndex = shift + 1;
+            subBucketIndex = (int)(value >> shift) - subBucketCount;
+        }
+
+        private long GetHighestEquivalentValue(int rangeIndex, int subBucketIndex)
+        {
+            if(rangeIndex == 0)
+                return subBucketIndex;
+            var shift = rangeIndex - 1;
+            var lowestValue = (long)(subBucketCount + subBucketIndex) << shift;
+            return lowestValue + (1L << shift) - 1;
+        }
+
+        private long[] AllocateRange(int rangeIndex)
+        {
+            Interlocked.CompareExchange(ref ranges[rangeIndex], new long[subBucketCount], null);
+            return ranges[rangeIndex];
+        }
+
+        private static int GetHighestBit(ulong value)
+        {
+            var result = 0;
+            if((value & 0xFFFFFFFF00000000) != 0)
+            {
+                value >>= 32;
+                result |= 32;
+            }
+            if((value & 0xFFFF0000) != 0)
+            {
+                value >>= 16;
+                result |= 16;
+            }
+            if((value & 0xFF00) != 0)
+            {
+                value >>= 8;
+                result |= 8;
+            }
+            if((value & 0xF0) != 0)
+            {
+                value >>= 4;
+                result |= 4;
+            }
+            if((value & 0xC) != 0)
+            {
+                value >>= 2;
+                result |= 2;
+            }
+            if((value & 0x2) != 0)
+                result |= 1;
+            return result;
+        }
+
+        private const int defaultSubBucketBits = 4;
+        private const int maxSubBucketBits = 16;
+
+        private readonly int subBucketBits;
+        private readonly int subBucketCount;
+        private readonly long[][] ranges;
+        private long sum;
+        private long max;
+    }
+}
\ No newline at end of file
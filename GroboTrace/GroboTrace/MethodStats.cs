@@ -5,8 +5,16 @@ namespace GroboTrace
     public class MethodStats
     {
         public MethodBase Method { get; set; }
+        // Name captured by the profiler at instrumentation time, formatting it needs no reflection
+        public string MethodName { get; set; }
         public double Percent { get; set; }
         public long Ticks { get; set; }
+        // Split of the ticks of the calls whose CPU time was measured (GROBOTRACE_CPU_TIME), null for others
+        public long? CpuTicks { get; set; }
+        public long? OffCpuTicks { get; set; }
         public int Calls { get; set; }
+        // Inner calls of a recursion folded into the node of the outermost one (GROBOTRACE_RECURSION_FOLDING), not included in Calls
+        public int RecursiveCalls { get; set; }
+        public LatencyHistogram Histogram { get; set; }
     }
 }
\ No newline at end of file
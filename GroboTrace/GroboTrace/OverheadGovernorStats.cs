@@ -0,0 +1,20 @@
+namespace GroboTrace
+{
+    public class OverheadGovernorStats
+    {
+        // False unless GROBOTRACE_CPU_BUDGET_PERCENT is set
+        public bool Enabled { get; set; }
+
+        public OverheadLevel Level { get; set; }
+        public double BudgetPercent { get; set; }
+
+        // Estimated share of CPU time of all processors spent in probes during the last interval
+        public double OverheadPercent { get; set; }
+
+        public long StepsDown { get; set; }
+        public long StepsUp { get; set; }
+
+        // Number of switches to every level, indexed by OverheadLevel
+        public long[] Transitions { get; set; }
+    }
+}
\ No newline at end of file
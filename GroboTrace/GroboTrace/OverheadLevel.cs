@@ -0,0 +1,13 @@
+namespace GroboTrace
+{
+    // What probes do, from the most to the least expensive. Lowered by the overhead governor when GROBOTRACE_CPU_BUDGET_PERCENT is exceeded
+    public enum OverheadLevel
+    {
+        Full,
+        // Call trees are recorded only inside sampled Profiler.Profile sections
+        Sampled,
+        // Calls are counted into TracingAnalyzer.GetMethodCallCounts, nothing is timed
+        Counting,
+        Off
+    }
+}
\ No newline at end of file
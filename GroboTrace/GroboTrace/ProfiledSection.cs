@@ -1,5 +1,6 @@
 using System;
 using System.Diagnostics;
+using System.Threading;
 
 namespace GroboTrace
 {
@@ -9,23 +10,60 @@ namespace GroboTrace
         {
             this.profilerSink = profilerSink;
             this.timeStatistics = timeStatistics;
-            TracingAnalyzer.ClearStatsForCurrentThread();
+            sampled = !TracingAnalyzer.SamplingEnabled || timeStatistics.ShouldSample();
+            previousSampled = TracingAnalyzer.BeginSectionForCurrentThread(sampled);
+            var watchdogThreshold = timeStatistics.WatchdogThresholdMilliseconds;
+            previousWatchedSections = watchdogThreshold > 0 ? TracingAnalyzer.BeginWatchedSectionForCurrentThread(timeStatistics.GroboTraceKey, watchdogThreshold) : -1;
+            if(sampled)
+                TracingAnalyzer.ClearStatsForCurrentThread();
+            startCpuTime = TracingAnalyzer.GetCpuTimeForCurrentThread();
             stopwatch = Stopwatch.StartNew();
         }
 
         public void Dispose()
         {
             stopwatch.Stop();
+            var cpuTime = startCpuTime == 0 ? (TimeSpan?)null : TimeSpan.FromTicks((TracingAnalyzer.GetCpuTimeForCurrentThread() - startCpuTime) / 100);
+            TracingAnalyzer.EndSectionForCurrentThread(previousSampled);
+            if(previousWatchedSections >= 0)
+                TracingAnalyzer.EndWatchedSectionForCurrentThread(previousWatchedSections);
             if(timeStatistics.RegisterDuration(stopwatch.ElapsedMilliseconds))
             {
-                var stats = TracingAnalyzer.GetStatsForCurrentThread();
-                var trace = TracingAnalyzerStatsFormatter.Format(stats, stopwatch.ElapsedMilliseconds);
-                profilerSink.WhenCurrentDurationIsLongerThanPercentile99(stopwatch.Elapsed, timeStatistics, trace);
+                if(!sampled)
+                {
+                    // There is no tree for this one, trace the next few sections of this key instead
+                    timeStatistics.ForceSampling();
+                    if(profilerSink != null)
+                        ThreadPool.QueueUserWorkItem(NotifyProfilerSink, new SlowSection(timeStatistics.GroboTraceKey, stopwatch.Elapsed, cpuTime, null));
+                    return;
+                }
+                // Only a raw copy of the tree is taken on the request thread, the trace is built in background
+                var slowSection = new SlowSection(timeStatistics.GroboTraceKey, stopwatch.Elapsed, cpuTime, TracingAnalyzer.TakeSnapshotForCurrentThread());
+                timeStatistics.SlowSections.Add(slowSection);
+                if(profilerSink != null)
+                    ThreadPool.QueueUserWorkItem(NotifyProfilerSink, slowSection);
+            }
+        }
+
+        private void NotifyProfilerSink(object state)
+        {
+            var slowSection = (SlowSection)state;
+            try
+            {
+                profilerSink.WhenCurrentDurationIsLongerThanPercentile99(slowSection.Duration, timeStatistics, slowSection.Trace);
+            }
+            catch(Exception e)
+            {
+                Debug.WriteLine("Profiler sink failed: " + e);
             }
         }
 
         private readonly IProfilerSink profilerSink;
         private readonly TimeStatistics timeStatistics;
         private readonly Stopwatch stopwatch;
+        private readonly long startCpuTime;
+        private readonly bool sampled;
+        private readonly bool previousSampled;
+        private readonly int previousWatchedSections;
     }
 }
\ No newline at end of file
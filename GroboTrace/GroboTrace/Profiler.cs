@@ -1,4 +1,5 @@
-﻿using System.Collections.Concurrent;
+﻿using System;
+using System.Collections.Concurrent;
 
 namespace GroboTrace
 {
@@ -10,6 +11,20 @@ namespace GroboTrace
             return new ProfiledSection(profilerSink, timeStatistics);
         }
 
+        // With sampling enabled instrumented methods are recorded only inside sampled sections,
+        // on other threads probes return right away
+        public static bool SamplingEnabled { get { return TracingAnalyzer.SamplingEnabled; } set { TracingAnalyzer.SamplingEnabled = value; } }
+
+        public static void SetSamplingRate(string groboTraceKey, int samplingRate)
+        {
+            GetTimeStatistics(groboTraceKey).SamplingRate = samplingRate;
+        }
+
+        public static void SetWatchdogThreshold(string groboTraceKey, TimeSpan threshold)
+        {
+            GetTimeStatistics(groboTraceKey).WatchdogThresholdMilliseconds = (int)Math.Min(threshold.TotalMilliseconds, int.MaxValue);
+        }
+
         public static TimeStatistics GetTimeStatistics(string groboTraceKey)
         {
             return timeStatisticsMap.GetOrAdd(groboTraceKey, x => new TimeStatistics(groboTraceKey));
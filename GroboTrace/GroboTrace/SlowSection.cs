@@ -0,0 +1,56 @@
+using System;
+using System.IO;
+
+namespace GroboTrace
+{
+    public class SlowSection
+    {
+        public SlowSection(string groboTraceKey, TimeSpan duration, CallTreeSnapshot snapshot)
+            : this(groboTraceKey, duration, null, snapshot)
+        {
+        }
+
+        public SlowSection(string groboTraceKey, TimeSpan duration, TimeSpan? cpuTime, CallTreeSnapshot snapshot)
+        {
+            GroboTraceKey = groboTraceKey;
+            Duration = duration;
+            CpuTime = cpuTime;
+            Snapshot = snapshot;
+            Timestamp = DateTime.UtcNow;
+            stats = new Lazy<Stats>(() => TracingAnalyzer.GetStats(Snapshot));
+            trace = new Lazy<string>(FormatTrace);
+        }
+
+        public string GroboTraceKey { get; }
+        public TimeSpan Duration { get; }
+        // CPU time the thread spent in the section, null unless GROBOTRACE_CPU_TIME is on
+        public TimeSpan? CpuTime { get; }
+        public DateTime Timestamp { get; }
+        public CallTreeSnapshot Snapshot { get; }
+
+        // Methods are resolved and the trace is formatted only when somebody asks for it
+        public Stats Stats { get { return stats.Value; } }
+        public string Trace { get { return trace.Value; } }
+
+        // Writes the same text as Trace without building Stats
+        public void WriteTrace(TextWriter writer)
+        {
+            if(Snapshot == null)
+                writer.Write(Trace);
+            else
+                TracingAnalyzer.WriteSnapshot(Snapshot, (long)Duration.TotalMilliseconds, writer);
+        }
+
+        private string FormatTrace()
+        {
+            if(Snapshot == null)
+                return TracingAnalyzerStatsFormatter.Format(Stats, (long)Duration.TotalMilliseconds);
+            var writer = new StringWriter();
+            TracingAnalyzer.WriteSnapshot(Snapshot, (long)Duration.TotalMilliseconds, writer);
+            return writer.ToString();
+        }
+
+        private readonly Lazy<Stats> stats;
+        private readonly Lazy<string> trace;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,81 @@
+using System;
+using System.Linq;
+
+namespace GroboTrace
+{
+    // Keeps N slowest sections of the current time window and of the previous one
+    public class SlowSectionsRing
+    {
+        public SlowSectionsRing(int capacity, TimeSpan window)
+        {
+            if(capacity <= 0)
+                throw new ArgumentOutOfRangeException(nameof(capacity));
+            this.window = window;
+            sections = new SlowSection[capacity];
+            previousSections = new SlowSection[0];
+        }
+
+        public bool Add(SlowSection section)
+        {
+            lock(locker)
+            {
+                if(section.Timestamp - windowStart >= window)
+                {
+                    previousSections = section.Timestamp - windowStart < window + window ? sections.Take(count).ToArray() : new SlowSection[0];
+                    sections = new SlowSection[sections.Length];
+                    count = 0;
+                    windowStart = section.Timestamp;
+                }
+                if(count < sections.Length)
+                {
+                    sections[count++] = section;
+                    return true;
+                }
+                var fastestIndex = 0;
+                for(var i = 1; i < count; ++i)
+                {
+                    if(sections[i].Duration < sections[fastestIndex].Duration)
+                        fastestIndex = i;
+                }
+                if(section.Duration <= sections[fastestIndex].Duration)
+                    return false;
+                sections[fastestIndex] = section;
+                return true;
+            }
+        }
+
+        public SlowSection[] GetSlowSections()
+        {
+            lock(locker)
+                return sections.Take(count).Concat(previousSections).OrderByDescending(section => section.Duration).ToArray();
+        }
+
+        public int Capacity
+        {
+            get
+            {
+                lock(locker)
+                    return sections.Length;
+            }
+            set
+            {
+                if(value <= 0)
+                    throw new ArgumentOutOfRangeException(nameof(value));
+                lock(locker)
+                {
+                    var retained = sections.Take(count).OrderByDescending(section => section.Duration).Take(value).ToArray();
+                    sections = new SlowSection[value];
+                    Array.Copy(retained, sections, retained.Length);
+                    count = retained.Length;
+                }
+            }
+        }
+
+        private readonly TimeSpan window;
+        private readonly object locker = new object();
+        private SlowSection[] sections;
+        private SlowSection[] previousSections;
+        private int count;
+        private DateTime windowStart;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,18 @@
+using System;
+
+namespace GroboTrace
+{
+    // A call path found by the watchdog to run longer than its threshold, captured while the thread kept running
+    public class StuckCall
+    {
+        public int ManagedThreadId { get; set; }
+        public DateTime Timestamp { get; set; }
+
+        // Innermost watched Profiler.Profile section of the thread, null if there is none
+        public string GroboTraceKey { get; set; }
+        public double SectionElapsedMilliseconds { get; set; }
+
+        // Active calls from the outermost one, empty when the thread records no call tree
+        public StuckCallFrame[] Frames { get; set; }
+    }
+}
\ No newline at end of file
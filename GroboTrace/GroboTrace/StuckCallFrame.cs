@@ -0,0 +1,13 @@
+using System.Reflection;
+
+namespace GroboTrace
+{
+    public class StuckCallFrame
+    {
+        public MethodBase Method { get; set; }
+        public string MethodName { get; set; }
+
+        // Time since the call was entered
+        public double ElapsedMilliseconds { get; set; }
+    }
+}
\ No newline at end of file
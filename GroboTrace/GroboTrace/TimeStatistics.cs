@@ -1,4 +1,5 @@
 ﻿using System;
+using System.Threading;
 
 namespace GroboTrace
 {
@@ -11,42 +12,92 @@ namespace GroboTrace
 
         public bool RegisterDuration(double durationMilliseconds)
         {
-            lock(locker)
-            {
-                var d = Math.Max(durationMilliseconds * 10, 1);
-                var bin = Math.Min((int)Math.Round(Math.Log10(d) * 30), counts.Length - 1);
-                counts[bin]++;
-                TotalCount++;
-                MaxTime = Math.Max(MaxTime, durationMilliseconds);
-                Percentile99Time = GetPercentile99Time();
-                return durationMilliseconds > Percentile99Time || Math.Abs(durationMilliseconds - MaxTime) < 1e-3;
-            }
+            histogram.Record((long)(durationMilliseconds * 1000));
+            Interlocked.Increment(ref registeredCount);
+            var isMaxTime = UpdateMaxTime(durationMilliseconds);
+            return durationMilliseconds > Percentile99Time || isMaxTime;
+        }
+
+        // Head-based decision made once per section: 1 of SamplingRate sections is traced,
+        // plus several sections right after an untraced one turned out to be slow
+        public bool ShouldSample()
+        {
+            if(Volatile.Read(ref forcedSamples) > 0 && Interlocked.Decrement(ref forcedSamples) >= 0)
+                return true;
+            var rateOverride = TracingAnalyzer.SamplingRateOverride;
+            var rate = rateOverride > 0 ? rateOverride : SamplingRate;
+            return rate <= 1 || Interlocked.Increment(ref samplingCounter) % rate == 0;
+        }
+
+        public void ForceSampling()
+        {
+            Volatile.Write(ref forcedSamples, forcedSamplesCount);
         }
 
         public override string ToString()
         {
-            return $"GroboTraceKey: {GroboTraceKey}, TotalCount: {TotalCount}, Percentile99Time: {TimeSpan.FromMilliseconds(Percentile99Time)}, MaxTime: {TimeSpan.FromMilliseconds(MaxTime)}";
+            return $"GroboTraceKey: {GroboTraceKey}, TotalCount: {TotalCount}, Percentile50Time: {TimeSpan.FromMilliseconds(Percentile50Time)}, Percentile99Time: {TimeSpan.FromMilliseconds(Percentile99Time)}, Percentile999Time: {TimeSpan.FromMilliseconds(Percentile999Time)}, MaxTime: {TimeSpan.FromMilliseconds(MaxTime)}";
         }
 
-        private double GetPercentile99Time()
+        private bool UpdateMaxTime(double durationMilliseconds)
         {
-            var index = (int)Math.Round(TotalCount * 0.99);
-            var count = 0;
-            for(var i = 0; i < counts.Length; i++)
+            var currentMaxTime = Volatile.Read(ref maxTime);
+            while(durationMilliseconds > currentMaxTime)
             {
-                count += counts[i];
-                if(count >= index)
-                    return (int)Math.Round(Math.Pow(10, (double)i / 30) / 10);
+                var previousMaxTime = Interlocked.CompareExchange(ref maxTime, durationMilliseconds, currentMaxTime);
+                if(previousMaxTime == currentMaxTime)
+                    return true;
+                currentMaxTime = previousMaxTime;
             }
-            return MaxTime;
+            return Math.Abs(durationMilliseconds - currentMaxTime) < 1e-3;
         }
 
         public string GroboTraceKey { get; }
-        public int TotalCount { get; private set; }
-        public double MaxTime { get; private set; }
-        public double Percentile99Time { get; private set; }
+        public int TotalCount { get { return Volatile.Read(ref registeredCount); } }
+        public double MaxTime { get { return Volatile.Read(ref maxTime); } }
+        // The histogram is scanned again only after a part of the durations registered since the last scan: every one of the first few,
+        // then one in computedCount / 8, but at least one in percentileRefreshPeriod
+        public double Percentile99Time
+        {
+            get
+            {
+                var count = TotalCount;
+                var computedCount = Volatile.Read(ref percentile99Count);
+                if(count - computedCount >= Math.Min(Math.Max(1, computedCount / 8), percentileRefreshPeriod))
+                {
+                    Volatile.Write(ref percentile99Count, count);
+                    Volatile.Write(ref percentile99Time, histogram.GetValueAtPercentile(99.0) / 1000.0);
+                }
+                return Volatile.Read(ref percentile99Time);
+            }
+        }
+
+        public double Percentile50Time { get { return histogram.GetValueAtPercentile(50.0) / 1000.0; } }
+        public double Percentile999Time { get { return histogram.GetValueAtPercentile(99.9) / 1000.0; } }
+
+        // Durations in microseconds
+        public LatencyHistogram Histogram { get { return histogram; } }
+
+        // Used only when TracingAnalyzer.SamplingEnabled is on, 1 means every section is traced
+        public int SamplingRate { get { return Volatile.Read(ref samplingRate); } set { Volatile.Write(ref samplingRate, Math.Max(1, value)); } }
+
+        // Sections running longer are reported by the watchdog while they are still running, see TracingAnalyzer.GetStuckCalls. 0 turns it off
+        public int WatchdogThresholdMilliseconds { get { return Volatile.Read(ref watchdogThresholdMilliseconds); } set { Volatile.Write(ref watchdogThresholdMilliseconds, Math.Max(0, value)); } }
+
+        public SlowSectionsRing SlowSections { get; } = new SlowSectionsRing(defaultSlowSectionsCount, TimeSpan.FromMinutes(1));
+
+        private const int percentileRefreshPeriod = 64;
+        private const int defaultSlowSectionsCount = 10;
+        private const int forcedSamplesCount = 8;
 
-        private readonly int[] counts = new int[250];
-        private readonly object locker = new object();
+        private readonly LatencyHistogram histogram = new LatencyHistogram();
+        private int registeredCount;
+        private double maxTime;
+        private double percentile99Time;
+        private int percentile99Count;
+        private int samplingRate = 1;
+        private int samplingCounter;
+        private int forcedSamples;
+        private int watchdogThresholdMilliseconds;
     }
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 ﻿using System;
 using System.Collections.Generic;
 using System.Diagnostics;
+using System.IO;
 using System.Linq;
 using System.Reflection;
 
@@ -22,6 +23,25 @@ namespace GroboTrace
                                            ElapsedTicks = 0
                                        };
                 clearStatsDelegate = () => { };
+                getMethodHistogramsDelegate = () => new List<MethodStats>();
+                getMethodCallCountsDelegate = () => new List<MethodStats>();
+                getBasicBlockStatsDelegate = () => new List<BasicBlockStats>();
+                getOverheadGovernorStatsDelegate = () => new OverheadGovernorStats {Transitions = new long[4]};
+                getStuckCallsDelegate = () => new List<StuckCall>();
+                getSampledStatsDelegate = getStatsDelegate;
+                takeSnapshotDelegate = () => null;
+                takeTopSnapshotDelegate = maxNodes => null;
+                getSnapshotStatsDelegate = snapshot => getStatsDelegate();
+                writeSnapshotDelegate = (snapshot, elapsedMilliseconds, writer) => { };
+                writeSnapshotBinaryDelegate = (snapshot, stream) => { };
+                enableSamplingDelegate = enabled => { };
+                isSamplingEnabledDelegate = () => false;
+                beginSectionDelegate = sampled => false;
+                endSectionDelegate = previousSampled => { };
+                getSamplingRateOverrideDelegate = () => 0;
+                beginWatchedSectionDelegate = (groboTraceKey, thresholdMilliseconds) => -1;
+                endWatchedSectionDelegate = previousCount => { };
+                getThreadCpuTimeDelegate = () => 0;
             }
             else
             {
@@ -29,17 +49,52 @@ namespace GroboTrace
                 var tracingAnalyzerType = groboTraceAssembly.GetType("GroboTrace.Core.TracingAnalyzer");
                 if(tracingAnalyzerType == null)
                     throw new InvalidOperationException("Unable to load type GroboTrace.Core.TracingAnalyzer");
-                var getStatsMethod = tracingAnalyzerType.GetMethod("GetStats", BindingFlags.Static | BindingFlags.Public);
-                if(getStatsMethod == null)
-                    throw new InvalidOperationException("Missing method GroboTrace.Core.TracingAnalyzer.GetStats");
-                var clearStatsMethod = tracingAnalyzerType.GetMethod("ClearStats", BindingFlags.Static | BindingFlags.Public);
-                if(clearStatsMethod == null)
-                    throw new InvalidOperationException("Missing method GroboTrace.Core.TracingAnalyzer.ClearStats");
+                var getStatsMethod = GetMethod(tracingAnalyzerType, "GetStats");
+                var clearStatsMethod = GetMethod(tracingAnalyzerType, "ClearStats");
+                var getMethodHistogramsMethod = GetMethod(tracingAnalyzerType, "GetMethodHistograms");
+                var getMethodCallCountsMethod = GetMethod(tracingAnalyzerType, "GetMethodCallCounts");
+                var getBasicBlockStatsMethod = GetMethod(tracingAnalyzerType, "GetBasicBlockStats");
+                var getSampledStatsMethod = GetMethod(tracingAnalyzerType, "GetSampledStats");
+                var getOverheadGovernorStatsMethod = GetMethod(tracingAnalyzerType, "GetOverheadGovernorStats");
+                var getStuckCallsMethod = GetMethod(tracingAnalyzerType, "GetStuckCalls");
                 getStatsDelegate = () => (Stats)getStatsMethod.Invoke(null, new object[0]);
                 clearStatsDelegate = () => clearStatsMethod.Invoke(null, new object[0]);
+                getMethodHistogramsDelegate = () => (List<MethodStats>)getMethodHistogramsMethod.Invoke(null, new object[0]);
+                getMethodCallCountsDelegate = () => (List<MethodStats>)getMethodCallCountsMethod.Invoke(null, new object[0]);
+                getBasicBlockStatsDelegate = () => (List<BasicBlockStats>)getBasicBlockStatsMethod.Invoke(null, new object[0]);
+                getSampledStatsDelegate = () => (Stats)getSampledStatsMethod.Invoke(null, new object[0]);
+                getOverheadGovernorStatsDelegate = () => (OverheadGovernorStats)getOverheadGovernorStatsMethod.Invoke(null, new object[0]);
+                getStuckCallsDelegate = () => (List<StuckCall>)getStuckCallsMethod.Invoke(null, new object[0]);
+                // These are called on the request thread, so avoid reflection invocation overhead there
+                takeSnapshotDelegate = CreateDelegate<Func<CallTreeSnapshot>>(tracingAnalyzerType, "TakeSnapshot");
+                takeTopSnapshotDelegate = CreateDelegate<Func<int, CallTreeSnapshot>>(tracingAnalyzerType, "TakeTopSnapshot");
+                getSnapshotStatsDelegate = CreateDelegate<Func<CallTreeSnapshot, Stats>>(tracingAnalyzerType, "GetSnapshotStats");
+                writeSnapshotDelegate = CreateDelegate<Action<CallTreeSnapshot, long, TextWriter>>(tracingAnalyzerType, "WriteSnapshot");
+                writeSnapshotBinaryDelegate = CreateDelegate<Action<CallTreeSnapshot, Stream>>(tracingAnalyzerType, "WriteSnapshotBinary");
+                enableSamplingDelegate = CreateDelegate<Action<bool>>(tracingAnalyzerType, "EnableSampling");
+                isSamplingEnabledDelegate = CreateDelegate<Func<bool>>(tracingAnalyzerType, "IsSamplingEnabled");
+                beginSectionDelegate = CreateDelegate<Func<bool, bool>>(tracingAnalyzerType, "BeginSection");
+                endSectionDelegate = CreateDelegate<Action<bool>>(tracingAnalyzerType, "EndSection");
+                getSamplingRateOverrideDelegate = CreateDelegate<Func<int>>(tracingAnalyzerType, "GetSamplingRateOverride");
+                beginWatchedSectionDelegate = CreateDelegate<Func<string, int, int>>(tracingAnalyzerType, "BeginWatchedSection");
+                endWatchedSectionDelegate = CreateDelegate<Action<int>>(tracingAnalyzerType, "EndWatchedSection");
+                getThreadCpuTimeDelegate = CreateDelegate<Func<long>>(tracingAnalyzerType, "GetThreadCpuTime");
             }
         }
 
+        private static MethodInfo GetMethod(Type tracingAnalyzerType, string name)
+        {
+            var method = tracingAnalyzerType.GetMethod(name, BindingFlags.Static | BindingFlags.Public);
+            if(method == null)
+                throw new InvalidOperationException($"Missing method GroboTrace.Core.TracingAnalyzer.{name}");
+            return method;
+        }
+
+        private static TDelegate CreateDelegate<TDelegate>(Type tracingAnalyzerType, string name)
+        {
+            return (TDelegate)(object)Delegate.CreateDelegate(typeof(TDelegate), GetMethod(tracingAnalyzerType, name));
+        }
+
         public static void ClearStatsForCurrentThread()
         {
             clearStatsDelegate();
@@ -50,7 +105,125 @@ namespace GroboTrace
             return getStatsDelegate();
         }
 
+        public static CallTreeSnapshot TakeSnapshotForCurrentThread()
+        {
+            return takeSnapshotDelegate();
+        }
+
+        // Keeps only the maxNodes heaviest nodes and their ancestors, time of the rest stays in the totals of their ancestors.
+        // Trees of the stack sampling engine are copied whole, maxNodes is ignored there
+        public static CallTreeSnapshot TakeSnapshotForCurrentThread(int maxNodes)
+        {
+            return takeTopSnapshotDelegate(maxNodes);
+        }
+
+        public static Stats GetStats(CallTreeSnapshot snapshot)
+        {
+            return getSnapshotStatsDelegate(snapshot);
+        }
+
+        // Same text as TracingAnalyzerStatsFormatter.Format(GetStats(snapshot), elapsedMilliseconds), written through buffers
+        // the thread reuses instead of building the stats
+        public static void WriteSnapshot(CallTreeSnapshot snapshot, long elapsedMilliseconds, TextWriter writer)
+        {
+            writeSnapshotDelegate(snapshot, elapsedMilliseconds, writer);
+        }
+
+        // Compact binary form of the snapshot with method names, the layout is described in GroboTrace.Core.SnapshotWriter
+        public static void WriteSnapshot(CallTreeSnapshot snapshot, Stream stream)
+        {
+            writeSnapshotBinaryDelegate(snapshot, stream);
+        }
+
+        // Latencies of every traced method over the whole process lifetime, across all threads
+        public static List<MethodStats> GetMethodHistograms()
+        {
+            return getMethodHistogramsDelegate();
+        }
+
+        // Calls of every instrumented method when GROBOTRACE_MODE = Counting, ticks are not measured in this mode
+        public static List<MethodStats> GetMethodCallCounts()
+        {
+            return getMethodCallCountsDelegate();
+        }
+
+        // Entry counts of basic blocks of the methods selected by GROBOTRACE_BLOCKS, in original IL order of every method
+        public static List<BasicBlockStats> GetBasicBlockStats()
+        {
+            return getBasicBlockStatsDelegate();
+        }
+
+        // Whole process call tree aggregated by the stack sampler when GROBOTRACE_ENGINE = StackSampling.
+        // Ticks are microseconds of sampled time, Calls are numbers of samples
+        public static Stats GetSampledStats()
+        {
+            return getSampledStatsDelegate();
+        }
+
+        // Level the overhead governor keeps probes at and the counters of its switches
+        public static OverheadGovernorStats GetOverheadGovernorStats()
+        {
+            return getOverheadGovernorStatsDelegate();
+        }
+
+        // Calls and watched sections that ran longer than their watchdog thresholds, the oldest reports are dropped first
+        public static List<StuckCall> GetStuckCalls()
+        {
+            return getStuckCallsDelegate();
+        }
+
+        public static bool SamplingEnabled { get { return isSamplingEnabledDelegate(); } set { enableSamplingDelegate(value); } }
+
+        internal static bool BeginSectionForCurrentThread(bool sampled)
+        {
+            return beginSectionDelegate(sampled);
+        }
+
+        internal static void EndSectionForCurrentThread(bool previousSampled)
+        {
+            endSectionDelegate(previousSampled);
+        }
+
+        // Returns the number of watched sections of the thread before this one, -1 if GroboTrace.Core is not loaded
+        internal static int BeginWatchedSectionForCurrentThread(string groboTraceKey, int thresholdMilliseconds)
+        {
+            return beginWatchedSectionDelegate(groboTraceKey, thresholdMilliseconds);
+        }
+
+        internal static void EndWatchedSectionForCurrentThread(int previousCount)
+        {
+            endWatchedSectionDelegate(previousCount);
+        }
+
+        // Nanoseconds of CPU time of the current thread, 0 unless GROBOTRACE_CPU_TIME is on
+        internal static long GetCpuTimeForCurrentThread()
+        {
+            return getThreadCpuTimeDelegate();
+        }
+
+        // Sampling rate set for all sections through the control socket, 0 if there is none
+        internal static int SamplingRateOverride { get { return getSamplingRateOverrideDelegate(); } }
+
         private static readonly Action clearStatsDelegate;
         private static readonly Func<Stats> getStatsDelegate;
+        private static readonly Func<List<MethodStats>> getMethodHistogramsDelegate;
+        private static readonly Func<List<MethodStats>> getMethodCallCountsDelegate;
+        private static readonly Func<List<BasicBlockStats>> getBasicBlockStatsDelegate;
+        private static readonly Func<Stats> getSampledStatsDelegate;
+        private static readonly Func<OverheadGovernorStats> getOverheadGovernorStatsDelegate;
+        private static readonly Func<List<StuckCall>> getStuckCallsDelegate;
+        private static readonly Func<CallTreeSnapshot> takeSnapshotDelegate;
+        private static readonly Func<int, CallTreeSnapshot> takeTopSnapshotDelegate;
+        private static readonly Func<CallTreeSnapshot, Stats> getSnapshotStatsDelegate;
+        private static readonly Action<CallTreeSnapshot, long, TextWriter> writeSnapshotDelegate;
+        private static readonly Action<CallTreeSnapshot, Stream> writeSnapshotBinaryDelegate;
+        private static readonly Action<bool> enableSamplingDelegate;
+        private static readonly Func<bool> isSamplingEnabledDelegate;
+        private static readonly Func<bool, bool> beginSectionDelegate;
+        private static readonly Action<bool> endSectionDelegate;
+        private static readonly Func<int> getSamplingRateOverrideDelegate;
+        private static readonly Func<string, int, int> beginWatchedSectionDelegate;
+        private static readonly Action<int> endWatchedSectionDelegate;
+        private static readonly Func<long> getThreadCpuTimeDelegate;
     }
 }
\ No newline at end of file
@@ -13,13 +13,14 @@ namespace GroboTrace
         public static string Format(Stats stats, long elapsedMilliseconds)
         {
             var sb = new StringBuilder();
-            Format(stats.Tree, elapsedMilliseconds, 0, sb);
+            var millisecondsPerTick = stats.ElapsedTicks == 0 ? 0.0 : (double)elapsedMilliseconds / stats.ElapsedTicks;
+            Format(stats.Tree, elapsedMilliseconds, millisecondsPerTick, 0, sb);
             foreach(var item in stats.List)
-                Format(item, elapsedMilliseconds, 0, sb);
+                Format(item, elapsedMilliseconds, millisecondsPerTick, 0, sb);
             return sb.ToString();
         }
 
-        private static void Format(MethodStats stats, long elapsedMilliseconds, int depth, StringBuilder result)
+        private static void Format(MethodStats stats, long elapsedMilliseconds, double millisecondsPerTick, int depth, StringBuilder result)
         {
             if(stats == null || stats.Percent < 1.0)
                 return;
@@ -27,17 +28,28 @@ namespace GroboTrace
             result.Append($"{margin}");
             result.Append($"{stats.Percent.ToString("F2", CultureInfo.InvariantCulture)}% ");
             result.Append($"{(elapsedMilliseconds * stats.Percent / 100.0).ToString("F3", CultureInfo.InvariantCulture)}ms ");
-            result.Append(stats.Method != null ? $"{stats.Calls} calls {Format(stats.Method)}" : "ROOT");
+            result.Append(stats.Method != null ? $"{stats.Calls} calls {stats.MethodName ?? Format(stats.Method)}" : "ROOT");
+            if(stats.RecursiveCalls > 0)
+                result.Append($" (+{stats.RecursiveCalls} recursive)");
+            if(stats.Histogram != null && millisecondsPerTick > 0)
+                result.Append($" [p50 {FormatTicks(stats.Histogram.Percentile50, millisecondsPerTick)}ms, p99 {FormatTicks(stats.Histogram.Percentile99, millisecondsPerTick)}ms, p99.9 {FormatTicks(stats.Histogram.Percentile999, millisecondsPerTick)}ms]");
+            if(stats.CpuTicks.HasValue && stats.OffCpuTicks.HasValue && millisecondsPerTick > 0)
+                result.Append($" [on-CPU {FormatTicks(stats.CpuTicks.Value, millisecondsPerTick)}ms, off-CPU {FormatTicks(stats.OffCpuTicks.Value, millisecondsPerTick)}ms]");
             result.AppendLine();
         }
 
-        private static void Format(MethodStatsNode node, long elapsedMilliseconds, int depth, StringBuilder result)
+        private static void Format(MethodStatsNode node, long elapsedMilliseconds, double millisecondsPerTick, int depth, StringBuilder result)
         {
-            Format(node.MethodStats, elapsedMilliseconds, depth, result);
+            Format(node.MethodStats, elapsedMilliseconds, millisecondsPerTick, depth, result);
             if(node.Children == null)
                 return;
             foreach(var child in node.Children)
-                Format(child, elapsedMilliseconds, depth + 1, result);
+                Format(child, elapsedMilliseconds, millisecondsPerTick, depth + 1, result);
+        }
+
+        private static string FormatTicks(long ticks, double millisecondsPerTick)
+        {
+            return (ticks * millisecondsPerTick).ToString("F3", CultureInfo.InvariantCulture);
         }
 
         private static string Format(MethodBase methodBase)
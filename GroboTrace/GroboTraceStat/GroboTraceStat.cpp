@@ -0,0 +1,484 @@
+// Prints live stats of a process profiled with GROBOTRACE_SHARED_STATS=1.
+// Attaches to the shared memory segment read-only, so it never disturbs the profiled process
+//
+//   GroboTraceStat <pid> top [N]           - N methods with the largest total time (20 by default)
+//   GroboTraceStat <pid> tree [threadId]   - call trees of all threads or of the given managed thread
+//
+// Processes profiled with GROBOTRACE_CONTROL=1 are also controlled through their control socket:
+//
+//   GroboTraceStat <pid> enable [patterns] - turn probes on, for all methods or for Namespace.Type.Method patterns
+//   GroboTraceStat <pid> disable [patterns]
+//   GroboTraceStat <pid> clear             - clear stats of all threads
+//   GroboTraceStat <pid> dump <file>       - make the process write a snapshot of its stats to the file
+//   GroboTraceStat <pid> sampling <N>      - trace 1 of N Profiler.Profile sections, 0 restores rates set by the code
+//   GroboTraceStat <pid> nodes <N>         - limit the number of call tree nodes, 0 removes the limit
+//   GroboTraceStat <pid> status
+//
+// A .NET Core 3.0+ process started without the profiler gets it through the diagnostics port of the runtime.
+// The attached profiler reads GROBOTRACE_* settings from the environment of the process and always opens the control socket:
+//
+//   GroboTraceStat <pid> attach <profiler> - load libClrProfiler.so or ClrProfiler.dll into the process
+//   GroboTraceStat <pid> detach            - revert instrumented methods and unload the attached profiler
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../ClrProfiler/ControlProtocol.h"
+#include "../ClrProfiler/SharedStatsFormat.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace SharedStatsFormat;
+
+struct Snapshot
+{
+	StatsHeader header;
+	vector<MethodRecord> methods;
+	vector<ThreadRecord> threads;
+	vector<NodeRecord> nodes;
+};
+
+static const char* Attach(unsigned pid)
+{
+#ifdef _WIN32
+	char name[64];
+	sprintf_s(name, "Local\\GroboTrace-%u", pid);
+	auto mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+	if (mapping == nullptr)
+		return nullptr;
+	return static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+	auto name = "/grobotrace-" + to_string(pid);
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return nullptr;
+	struct stat info;
+	void* address = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(SegmentHeader))
+		address = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return address == MAP_FAILED ? nullptr : static_cast<const char*>(address);
+#endif
+}
+
+template<typename T>
+static void CopyRecords(const char*& from, const char* end, int32_t count, vector<T>& to)
+{
+	if (count < 0 || static_cast<size_t>(end - from) / sizeof(T) < static_cast<size_t>(count))
+		count = 0;
+	to.resize(count);
+	if (count > 0)
+		memcpy(to.data(), from, count * sizeof(T));
+	from += count * sizeof(T);
+}
+
+// Copies the stats area under the seqlock, retries while the writer is inside or has been there during the copy
+static bool TakeSnapshot(const char* stats, size_t capacity, Snapshot& snapshot)
+{
+	auto header = reinterpret_cast<const StatsHeader*>(stats);
+	for (int attempt = 0; attempt < 1000; ++attempt)
+	{
+		auto sequence = header->sequence;
+		if (sequence == 0)
+			return false;
+		if (sequence & 1)
+		{
+			this_thread::sleep_for(chrono::milliseconds(1));
+			continue;
+		}
+		atomic_thread_fence(memory_order_acquire);
+		memcpy(&snapshot.header, stats, sizeof(StatsHeader));
+		auto from = stats + sizeof(StatsHeader);
+		auto end = stats + capacity;
+		CopyRecords(from, end, snapshot.header.methodsCount, snapshot.methods);
+		CopyRecords(from, end, snapshot.header.threadsCount, snapshot.threads);
+		CopyRecords(from, end, snapshot.header.nodesCount, snapshot.nodes);
+		atomic_thread_fence(memory_order_acquire);
+		if (header->sequence == sequence)
+			return true;
+	}
+	return false;
+}
+
+static string GetMethodName(const char* symbols, int32_t methodId)
+{
+	if (methodId == 0)
+		return "<root>";
+	auto entry = symbols == nullptr ? nullptr : FindSymbol(symbols, methodId);
+	if (entry == nullptr)
+		return "<method " + to_string(methodId) + ">";
+	string result = entry->typeName != 0 ? GetSymbolString(symbols, entry->typeName) : "";
+	if (entry->methodName != 0)
+		result += (result.empty() ? "" : ".") + string(GetSymbolString(symbols, entry->methodName));
+	return result;
+}
+
+static double ToMilliseconds(const Snapshot& snapshot, int64_t ticks)
+{
+	return snapshot.header.ticksPerMillisecond > 0 ? ticks / snapshot.header.ticksPerMillisecond : 0;
+}
+
+static void PrintTop(const Snapshot& snapshot, const char* symbols, size_t count)
+{
+	auto methods = snapshot.methods;
+	sort(methods.begin(), methods.end(), [](const MethodRecord& left, const MethodRecord& right) { return left.ticks > right.ticks; });
+	if (methods.size() > count)
+		methods.resize(count);
+	printf("%12s %12s %10s %10s %10s %10s  %s\n", "calls", "total ms", "p50 ms", "p99 ms", "p99.9 ms", "max ms", "method");
+	for (auto& method : methods)
+	{
+		printf("%12lld %12.3f %10.3f %10.3f %10.3f %10.3f  %s\n",
+			static_cast<long long>(method.calls),
+			ToMilliseconds(snapshot, method.ticks),
+			ToMilliseconds(snapshot, method.p50),
+			ToMilliseconds(snapshot, method.p99),
+			ToMilliseconds(snapshot, method.p999),
+			ToMilliseconds(snapshot, method.max),
+			GetMethodName(symbols, method.methodId).c_str());
+	}
+}
+
+static void PrintTree(const Snapshot& snapshot, const char* symbols, const ThreadRecord& thread)
+{
+	printf("Thread %d\n", thread.managedThreadId);
+	if (thread.firstNode < 0 || thread.nodesCount <= 0 || static_cast<size_t>(thread.firstNode) + thread.nodesCount > snapshot.nodes.size())
+		return;
+	// Nodes go in preorder, so the depth of a node is known by the time it is printed
+	vector<int> depths(thread.nodesCount);
+	for (int i = 1; i < thread.nodesCount; ++i)
+	{
+		auto& node = snapshot.nodes[thread.firstNode + i];
+		depths[i] = node.parentIndex >= 0 && node.parentIndex < i ? depths[node.parentIndex] + 1 : 1;
+		printf("%*s%s: %lld calls, %.3f ms\n", depths[i] * 2, "",
+			GetMethodName(symbols, node.methodId).c_str(),
+			static_cast<long long>(node.calls),
+			ToMilliseconds(snapshot, node.ticks));
+	}
+}
+
+static string GetControlSocketPath(unsigned pid)
+{
+	auto setting = getenv("GROBOTRACE_CONTROL_SOCKET");
+	if (setting != nullptr && *setting != 0)
+		return setting;
+	char path[1024];
+#ifdef _WIN32
+	auto len = GetTempPathA(sizeof(path) - 32, path);
+	sprintf_s(path + len, sizeof(path) - len, "grobotrace-%u.sock", pid);
+#else
+	snprintf(path, sizeof(path), "/tmp/grobotrace-%u.sock", pid);
+#endif
+	return path;
+}
+
+static bool SendAll(intptr_t socket, const void* buffer, size_t size)
+{
+	auto data = static_cast<const char*>(buffer);
+	while (size > 0)
+	{
+		auto sent = send(socket, data, static_cast<int>(size), 0);
+		if (sent <= 0)
+			return false;
+		data += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+static bool ReceiveAll(intptr_t socket, void* buffer, size_t size)
+{
+	auto data = static_cast<char*>(buffer);
+	while (size > 0)
+	{
+		auto received = recv(socket, data, static_cast<int>(size), 0);
+		if (received <= 0)
+			return false;
+		data += received;
+		size -= received;
+	}
+	return true;
+}
+
+static int SendCommand(unsigned pid, ControlProtocol::Command command, int64_t value, const string& argument)
+{
+	auto path = GetControlSocketPath(pid);
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	if (path.size() >= sizeof(address.sun_path) || argument.size() > ControlProtocol::maxArgumentSize)
+	{
+		fprintf(stderr, "Control socket path or argument is too long\n");
+		return 2;
+	}
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, path.c_str(), path.size());
+
+#ifdef _WIN32
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+	auto socket = static_cast<intptr_t>(::socket(AF_UNIX, SOCK_STREAM, 0));
+	if (socket < 0 || connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+	{
+		fprintf(stderr, "Unable to connect to %s, is the process running with GROBOTRACE_CONTROL=1?\n", path.c_str());
+		return 1;
+	}
+
+	ControlProtocol::RequestHeader request;
+	request.magic = ControlProtocol::requestMagic;
+	request.version = ControlProtocol::version;
+	request.command = command;
+	request.value = value;
+	request.argumentSize = static_cast<uint32_t>(argument.size());
+	request.reserved = 0;
+	ControlProtocol::ResponseHeader response;
+	string message;
+	bool ok = SendAll(socket, &request, sizeof(request)) && SendAll(socket, argument.data(), argument.size())
+		&& ReceiveAll(socket, &response, sizeof(response)) && response.magic == ControlProtocol::responseMagic
+		&& response.messageSize <= ControlProtocol::maxMessageSize;
+	if (ok)
+	{
+		message.resize(response.messageSize);
+		ok = response.messageSize == 0 || ReceiveAll(socket, &message[0], response.messageSize);
+	}
+#ifdef _WIN32
+	closesocket(socket);
+#else
+	close(static_cast<int>(socket));
+#endif
+	if (!ok)
+	{
+		fprintf(stderr, "Control socket closed the connection\n");
+		return 1;
+	}
+	fprintf(response.status == ControlProtocol::Ok ? stdout : stderr, "%s\n", message.c_str());
+	return response.status == ControlProtocol::Ok ? 0 : 1;
+}
+
+// CLSID_CorProfiler of ClrProfiler in the byte order of GUID
+static const uint8_t profilerClsid[16] = { 0x24, 0x28, 0xde, 0x1b, 0x74, 0xad, 0xf0, 0x46, 0x95, 0xa4, 0xd7, 0xe7, 0xda, 0xb3, 0xb6, 0xb6 };
+
+static void AppendUInt16(vector<uint8_t>& buffer, uint16_t value)
+{
+	buffer.push_back(static_cast<uint8_t>(value));
+	buffer.push_back(static_cast<uint8_t>(value >> 8));
+}
+
+static void AppendUInt32(vector<uint8_t>& buffer, uint32_t value)
+{
+	AppendUInt16(buffer, static_cast<uint16_t>(value));
+	AppendUInt16(buffer, static_cast<uint16_t>(value >> 16));
+}
+
+// The diagnostics protocol has zero-terminated UTF-16 strings
+static void AppendUtf16(vector<uint8_t>& buffer, const string& str)
+{
+	vector<uint16_t> chars;
+	for (size_t i = 0; i < str.size();)
+	{
+		auto c = static_cast<uint8_t>(str[i]);
+		int length = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+		uint32_t code = length == 1 ? c : c & (0x3F >> (length - 1));
+		for (int j = 1; j < length && i + j < str.size(); ++j)
+			code = (code << 6) | (static_cast<uint8_t>(str[i + j]) & 0x3F);
+		i += length;
+		if (code < 0x10000)
+			chars.push_back(static_cast<uint16_t>(code));
+		else
+		{
+			chars.push_back(static_cast<uint16_t>(0xD800 + ((code - 0x10000) >> 10)));
+			chars.push_back(static_cast<uint16_t>(0xDC00 + ((code - 0x10000) & 0x3FF)));
+		}
+	}
+	chars.push_back(0);
+	AppendUInt32(buffer, static_cast<uint32_t>(chars.size()));
+	for (auto c : chars)
+		AppendUInt16(buffer, c);
+}
+
+// Sends a request to the diagnostics port of the runtime: a named pipe on Windows, a socket in TMPDIR elsewhere
+static bool ExchangeDiagnosticMessage(unsigned pid, const vector<uint8_t>& request, uint8_t* response, size_t responseSize)
+{
+#ifdef _WIN32
+	char name[64];
+	sprintf_s(name, "\\\\.\\pipe\\dotnet-diagnostic-%u", pid);
+	auto pipe = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (pipe == INVALID_HANDLE_VALUE)
+		return false;
+	DWORD transferred;
+	bool ok = WriteFile(pipe, request.data(), static_cast<DWORD>(request.size()), &transferred, nullptr) && transferred == request.size();
+	while (ok && responseSize > 0)
+	{
+		ok = ReadFile(pipe, response, static_cast<DWORD>(responseSize), &transferred, nullptr) && transferred > 0;
+		response += transferred;
+		responseSize -= transferred;
+	}
+	CloseHandle(pipe);
+	return ok;
+#else
+	auto folder = getenv("TMPDIR");
+	string path = folder != nullptr && *folder != 0 ? folder : "/tmp";
+	auto prefix = "dotnet-diagnostic-" + to_string(pid) + "-";
+	auto directory = opendir(path.c_str());
+	if (directory == nullptr)
+		return false;
+	string socketName;
+	while (auto entry = readdir(directory))
+	{
+		string name = entry->d_name;
+		if (name.compare(0, prefix.size(), prefix) == 0 && name.size() > 7 && name.compare(name.size() - 7, 7, "-socket") == 0)
+			socketName = name;
+	}
+	closedir(directory);
+	path += "/" + socketName;
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	if (socketName.empty() || path.size() >= sizeof(address.sun_path))
+		return false;
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, path.c_str(), path.size());
+	auto socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socket < 0)
+		return false;
+	bool ok = connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0
+		&& SendAll(socket, request.data(), request.size()) && ReceiveAll(socket, response, responseSize);
+	close(socket);
+	return ok;
+#endif
+}
+
+static int AttachProfiler(unsigned pid, const string& profilerPath)
+{
+	// AttachProfiler of the Profiler command set: timeout, CLSID, profiler path and client data, which is not used
+	vector<uint8_t> payload;
+	AppendUInt32(payload, 10000);
+	payload.insert(payload.end(), profilerClsid, profilerClsid + sizeof(profilerClsid));
+	AppendUtf16(payload, profilerPath);
+	AppendUInt32(payload, 0);
+
+	const char magic[14] = "DOTNET_IPC_V1";
+	vector<uint8_t> request(magic, magic + sizeof(magic));
+	AppendUInt16(request, static_cast<uint16_t>(sizeof(magic) + 6 + payload.size()));
+	request.push_back(0x03);
+	request.push_back(0x01);
+	AppendUInt16(request, 0);
+	request.insert(request.end(), payload.begin(), payload.end());
+
+	// Header with the Server command set, OK or Error, followed by an HRESULT
+	uint8_t response[24];
+	if (!ExchangeDiagnosticMessage(pid, request, response, sizeof(response)))
+	{
+		fprintf(stderr, "Unable to reach the diagnostics port of process %u, is it a .NET Core 3.0+ process?\n", pid);
+		return 1;
+	}
+	auto hr = static_cast<uint32_t>(response[20]) | static_cast<uint32_t>(response[21]) << 8 | static_cast<uint32_t>(response[22]) << 16 | static_cast<uint32_t>(response[23]) << 24;
+	if (response[17] != 0x00 || hr != 0)
+	{
+		fprintf(stderr, "Attach failed with 0x%08X\n", hr);
+		return 1;
+	}
+	printf("Profiler is attached, it is controlled through %s\n", GetControlSocketPath(pid).c_str());
+	return 0;
+}
+
+static int Usage()
+{
+	fprintf(stderr,
+		"Usage: GroboTraceStat <pid> top [N]\n"
+		"       GroboTraceStat <pid> tree [threadId]\n"
+		"       GroboTraceStat <pid> enable|disable [patterns]\n"
+		"       GroboTraceStat <pid> clear|status\n"
+		"       GroboTraceStat <pid> dump <file>\n"
+		"       GroboTraceStat <pid> sampling|nodes <N>\n"
+		"       GroboTraceStat <pid> attach <profiler>\n"
+		"       GroboTraceStat <pid> detach\n");
+	return 2;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+		return Usage();
+	auto pid = static_cast<unsigned>(strtoul(argv[1], nullptr, 10));
+	string command = argv[2];
+	string argument = argc > 3 ? argv[3] : "";
+	if (command == "enable")
+		return SendCommand(pid, ControlProtocol::EnableProbes, 0, argument);
+	if (command == "disable")
+		return SendCommand(pid, ControlProtocol::DisableProbes, 0, argument);
+	if (command == "clear")
+		return SendCommand(pid, ControlProtocol::ClearStats, 0, "");
+	if (command == "status")
+		return SendCommand(pid, ControlProtocol::GetStatus, 0, "");
+	if (command == "dump" && !argument.empty())
+		return SendCommand(pid, ControlProtocol::DumpSnapshot, 0, argument);
+	if (command == "sampling" && !argument.empty())
+		return SendCommand(pid, ControlProtocol::SetSamplingRate, strtoll(argument.c_str(), nullptr, 10), "");
+	if (command == "nodes" && !argument.empty())
+		return SendCommand(pid, ControlProtocol::SetCallTreeNodesLimit, strtoll(argument.c_str(), nullptr, 10), "");
+	if (command == "attach" && !argument.empty())
+		return AttachProfiler(pid, argument);
+	if (command == "detach")
+		return SendCommand(pid, ControlProtocol::Detach, 0, "");
+	if (command != "top" && command != "tree")
+		return Usage();
+
+	auto segment = Attach(pid);
+	if (segment == nullptr)
+	{
+		fprintf(stderr, "No shared stats for process %u, is it running with GROBOTRACE_SHARED_STATS=1?\n", pid);
+		return 1;
+	}
+	auto segmentHeader = reinterpret_cast<const SegmentHeader*>(segment);
+	if (segmentHeader->magic != segmentMagic || segmentHeader->version != segmentVersion)
+	{
+		fprintf(stderr, "Unsupported shared stats segment version %u\n", segmentHeader->version);
+		return 1;
+	}
+	auto symbols = segment + segmentHeader->symbolsOffset;
+	auto symbolsHeader = reinterpret_cast<const SymbolsHeader*>(symbols);
+	if (symbolsHeader->magic != symbolsMagic || symbolsHeader->version != symbolsVersion)
+		symbols = nullptr;
+
+	Snapshot snapshot;
+	if (!TakeSnapshot(segment + segmentHeader->statsOffset, segmentHeader->statsCapacity, snapshot))
+	{
+		fprintf(stderr, "Stats have not been published yet\n");
+		return 1;
+	}
+	if (snapshot.header.truncated)
+		fprintf(stderr, "Stats are truncated, increase GROBOTRACE_SHARED_STATS_MB\n");
+
+	if (command == "top")
+		PrintTop(snapshot, symbols, argc > 3 ? strtoul(argv[3], nullptr, 10) : 20);
+	else
+	{
+		auto threadId = argc > 3 ? atoi(argv[3]) : -1;
+		for (auto& thread : snapshot.threads)
+		{
+			if (threadId < 0 || thread.managedThreadId == threadId)
+				PrintTree(snapshot, symbols, thread);
+		}
+	}
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,77 @@
+using System.Collections.Generic;
+using System.Linq;
+using System.Reflection;
+using System.Reflection.Emit;
+
+using GrEmit.MethodBodyParsing;
+
+using GroboTrace.Core;
+
+using NUnit.Framework;
+
+using MethodBody = GrEmit.MethodBodyParsing.MethodBody;
+
+namespace Tests
+{
+    [TestFixture]
+    public class TestBasicBlockFinder
+    {
+        [Test]
+        public void StraightLineCodeIsOneBlock()
+        {
+            var blocks = FindBasicBlocks("Add");
+            Assert.AreEqual(1, blocks.Count);
+            Assert.AreEqual(0, blocks[0].Leader.Offset);
+            Assert.IsFalse(blocks[0].IsLoopHeader);
+        }
+
+        [Test]
+        public void BranchToNextInstructionDoesNotEndBlock()
+        {
+            var dynamicMethod = new DynamicMethod("BranchToNext", typeof(int), new[] {typeof(int)}, typeof(TestBasicBlockFinder), true);
+            var il = dynamicMethod.GetILGenerator();
+            var conditionalTarget = il.DefineLabel();
+            var target = il.DefineLabel();
+            il.Emit(System.Reflection.Emit.OpCodes.Ldarg_0);
+            il.Emit(System.Reflection.Emit.OpCodes.Brtrue_S, conditionalTarget);
+            il.MarkLabel(conditionalTarget);
+            il.Emit(System.Reflection.Emit.OpCodes.Ldarg_0);
+            il.Emit(System.Reflection.Emit.OpCodes.Br_S, target);
+            il.MarkLabel(target);
+            il.Emit(System.Reflection.Emit.OpCodes.Ret);
+            var methodBody = MethodBody.Read(dynamicMethod, false);
+            var blocks = BasicBlockFinder.FindBasicBlocks(methodBody.Instructions.ToArray(), methodBody.ExceptionHandlers);
+            Assert.AreEqual(1, blocks.Count);
+            Assert.AreEqual(0, blocks[0].Leader.Offset);
+        }
+
+        [Test]
+        public void LoopHeaderIsFound()
+        {
+            var blocks = FindBasicBlocks("Sum");
+            Assert.That(blocks.Count, Is.GreaterThan(2));
+            Assert.AreEqual(0, blocks[0].Leader.Offset);
+            Assert.AreEqual(1, blocks.Count(block => block.IsLoopHeader));
+        }
+
+        private static List<BasicBlock> FindBasicBlocks(string methodName)
+        {
+            var method = typeof(TestBasicBlockFinder).GetMethod(methodName, BindingFlags.Static | BindingFlags.NonPublic);
+            var methodBody = MethodBody.Read(method, false);
+            return BasicBlockFinder.FindBasicBlocks(methodBody.Instructions.ToArray(), methodBody.ExceptionHandlers);
+        }
+
+        private static int Add(int x, int y)
+        {
+            return x + y;
+        }
+
+        private static int Sum(int[] values)
+        {
+            var result = 0;
+            for(var i = 0; i < values.Length; ++i)
+                result += values[i];
+            return result;
+        }
+    }
+}
\ No newline at end of file
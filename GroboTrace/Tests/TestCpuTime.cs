@@ -0,0 +1,73 @@
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Reflection;
+using System.Threading;
+
+using GroboTrace.Core;
+
+using NUnit.Framework;
+
+namespace Tests
+{
+    [TestFixture]
+    public class TestCpuTime
+    {
+        [SetUp]
+        public void SetUp()
+        {
+            cpuNanoseconds = 1000000;
+            // Every registered method with calls stays among the top ones, so the selecting thread keeps the timed method picked
+            CpuTime.Init(() => Interlocked.Read(ref cpuNanoseconds), true, int.MaxValue);
+        }
+
+        [TearDown]
+        public void TearDown()
+        {
+            CpuTime.Init(null, false, 0);
+            MethodBaseTracingInstaller.SetCpuTimedMethods(new HashSet<int>());
+        }
+
+        [Test]
+        public void CpuTimeIsReportedForTimedNodeAndRoot()
+        {
+            var method = typeof(TestCpuTime).GetMethod("Timed", BindingFlags.Static | BindingFlags.Public);
+            int methodId;
+            MethodBaseTracingInstaller.AddMethod(method, new UIntPtr(0x4801), out methodId);
+            GroboTrace.Stats stats = null;
+            long elapsed = 0;
+            double ticksPerMillisecond = 0;
+            var thread = new Thread(() =>
+                {
+                    TestMethodHistograms.Call(methodId, 1, 10);
+                    MethodBaseTracingInstaller.SetCpuTimedMethods(new HashSet<int> {methodId});
+                    TracingAnalyzer.ClearStats();
+                    ticksPerMillisecond = TicksCalibration.TicksPerMillisecond;
+                    elapsed = (long)(10 * ticksPerMillisecond);
+                    // 4ms on CPU out of 10ms of the call, then the thread sleeps off CPU
+                    TracingAnalyzer.MethodStarted(methodId, 0);
+                    Interlocked.Add(ref cpuNanoseconds, 4000000);
+                    TracingAnalyzer.MethodFinished(methodId, elapsed);
+                    Thread.Sleep(50);
+                    stats = TracingAnalyzer.GetStats();
+                });
+            thread.Start();
+            thread.Join();
+
+            var node = stats.Tree.Children.Single(x => x.MethodStats.Method == method).MethodStats;
+            Assert.AreEqual(elapsed, node.CpuTicks.Value + node.OffCpuTicks.Value);
+            Assert.AreEqual(4 * ticksPerMillisecond, node.CpuTicks.Value, 0.05 * ticksPerMillisecond);
+
+            var root = stats.Tree.MethodStats;
+            Assert.AreEqual(stats.ElapsedTicks, root.CpuTicks.Value + root.OffCpuTicks.Value);
+            Assert.AreEqual(4 * ticksPerMillisecond, root.CpuTicks.Value, 0.05 * ticksPerMillisecond);
+            Assert.Greater(root.OffCpuTicks.Value, 40 * ticksPerMillisecond);
+        }
+
+        public static void Timed()
+        {
+        }
+
+        private static long cpuNanoseconds;
+    }
+}
\ No newline at end of file
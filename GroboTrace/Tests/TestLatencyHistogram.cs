@@ -0,0 +1,97 @@
+using System;
+using System.Linq;
+using System.Threading.Tasks;
+
+using GroboTrace;
+
+using NUnit.Framework;
+
+namespace Tests
+{
+    [TestFixture]
+    public class TestLatencyHistogram
+    {
+        [Test]
+        public void SmallValuesAreExact()
+        {
+            var histogram = new LatencyHistogram();
+            for(var i = 1; i <= 10; ++i)
+                histogram.Record(i);
+            Assert.AreEqual(10, histogram.TotalCount);
+            Assert.AreEqual(55, histogram.Sum);
+            Assert.AreEqual(10, histogram.Max);
+            Assert.AreEqual(5, histogram.Percentile50);
+            Assert.AreEqual(10, histogram.Percentile99);
+        }
+
+        [Test]
+        public void PercentilesAreWithinRelativeError()
+        {
+            var histogram = new LatencyHistogram();
+            for(var i = 1; i <= 100000; ++i)
+                histogram.Record(i);
+            AssertWithinRelativeError(50000, histogram.Percentile50);
+            AssertWithinRelativeError(99000, histogram.Percentile99);
+            AssertWithinRelativeError(99900, histogram.Percentile999);
+        }
+
+        [Test]
+        public void BimodalDistributionIsVisibleInTail()
+        {
+            var histogram = new LatencyHistogram();
+            for(var i = 0; i < 990; ++i)
+                histogram.Record(1000);
+            for(var i = 0; i < 10; ++i)
+                histogram.Record(1000000);
+            AssertWithinRelativeError(1000, histogram.Percentile50);
+            AssertWithinRelativeError(1000, histogram.Percentile99);
+            AssertWithinRelativeError(1000000, histogram.Percentile999);
+        }
+
+        [Test]
+        public void ConcurrentRecordingLosesNothing()
+        {
+            var histogram = new LatencyHistogram();
+            Parallel.For(0, 8, thread =>
+                {
+                    for(var i = 0; i < 100000; ++i)
+                        histogram.Record(i);
+                });
+            Assert.AreEqual(800000, histogram.TotalCount);
+            Assert.AreEqual(8L * Enumerable.Range(0, 100000).Sum(i => (long)i), histogram.Sum);
+            Assert.AreEqual(99999, histogram.Max);
+        }
+
+        [Test]
+        public void AddMergesHistograms()
+        {
+            var first = new LatencyHistogram();
+            var second = new LatencyHistogram();
+            first.Record(10);
+            second.Record(1000);
+            second.RecordNonAtomic(100000);
+            first.Add(second);
+            Assert.AreEqual(3, first.TotalCount);
+            Assert.AreEqual(101010, first.Sum);
+            Assert.AreEqual(100000, first.Max);
+        }
+
+        [Test]
+        public void TimeStatisticsReportsSlowDurations()
+        {
+            var timeStatistics = new TimeStatistics("test");
+            for(var i = 0; i < 1000; ++i)
+                timeStatistics.RegisterDuration(10);
+            Assert.IsFalse(timeStatistics.RegisterDuration(5));
+            Assert.IsTrue(timeStatistics.RegisterDuration(500));
+            Assert.AreEqual(1002, timeStatistics.TotalCount);
+            Assert.AreEqual(500, timeStatistics.MaxTime, 1e-9);
+            Assert.AreEqual(10, timeStatistics.Percentile50Time, 10 * 0.0625);
+        }
+
+        private static void AssertWithinRelativeError(long expected, long actual)
+        {
+            Assert.That(Math.Abs(actual - expected), Is.LessThanOrEqualTo(expected / 16), $"Expected {expected}, but was {actual}");
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,101 @@
+using System;
+using System.Linq;
+using System.Reflection;
+using System.Threading;
+
+using GroboTrace.Core;
+
+using NUnit.Framework;
+
+namespace Tests
+{
+    [TestFixture]
+    public class TestMethodHistograms
+    {
+        [Test]
+        public void CallsOfAllThreadsAreMerged()
+        {
+            var method = GetMethod("First");
+            int methodId;
+            MethodBaseTracingInstaller.AddMethod(method, new UIntPtr(0x2601), out methodId);
+            var threads = Enumerable.Range(0, 4).Select(i => new Thread(() => Call(methodId, 1000, 10))).ToArray();
+            foreach(var thread in threads)
+                thread.Start();
+            foreach(var thread in threads)
+                thread.Join();
+            var stats = TracingAnalyzer.GetMethodHistograms().Single(x => x.Method == method);
+            Assert.AreEqual(4000, stats.Calls);
+            Assert.AreEqual(40000, stats.Ticks);
+            Assert.AreEqual(10, stats.Histogram.Percentile99);
+        }
+
+        [Test]
+        public void ClearResetsHistogramsOfAllThreads()
+        {
+            var method = GetMethod("Second");
+            int methodId;
+            MethodBaseTracingInstaller.AddMethod(method, new UIntPtr(0x2602), out methodId);
+            var thread = new Thread(() => Call(methodId, 10, 10));
+            thread.Start();
+            thread.Join();
+            MethodBaseTracingInstaller.ClearMethodStats();
+            Assert.IsFalse(TracingAnalyzer.GetMethodHistograms().Any(x => x.Method == method));
+            Call(methodId, 3, 10);
+            Assert.AreEqual(3, TracingAnalyzer.GetMethodHistograms().Single(x => x.Method == method).Calls);
+        }
+
+        [Test]
+        public void UnrecordedRecursiveCallDoesNotFinishOuterCall()
+        {
+            var method = GetMethod("Third");
+            int methodId;
+            MethodBaseTracingInstaller.AddMethod(method, new UIntPtr(0x2801), out methodId);
+            bool outerRecorded = false, innerRecorded = true;
+            GroboTrace.Stats stats = null;
+            var thread = new Thread(() =>
+                {
+                    outerRecorded = TracingAnalyzer.MethodStarted(methodId, 0);
+                    MethodBaseTracingInstaller.SetMethodDisabled(methodId, true);
+                    innerRecorded = TracingAnalyzer.MethodStarted(methodId, 0);
+                    MethodBaseTracingInstaller.SetMethodDisabled(methodId, false);
+                    if(innerRecorded)
+                        TracingAnalyzer.MethodFinished(methodId, 10);
+                    stats = TracingAnalyzer.GetStats();
+                    TracingAnalyzer.MethodFinished(methodId, 30);
+                });
+            thread.Start();
+            thread.Join();
+            Assert.IsTrue(outerRecorded);
+            Assert.IsFalse(innerRecorded);
+            // The outer call is still running when stats are taken, the path has not left its node
+            Assert.AreSame(method, stats.Tree.MethodStats.Method);
+            Assert.AreEqual(30, TracingAnalyzer.GetMethodHistograms().Single(x => x.Method == method).Ticks);
+        }
+
+        internal static void Call(int methodId, int calls, long ticks)
+        {
+            for(var i = 0; i < calls; ++i)
+            {
+                TracingAnalyzer.MethodStarted(methodId, 0);
+                TracingAnalyzer.MethodFinished(methodId, ticks);
+            }
+        }
+
+        internal static MethodInfo GetMethod(string name)
+        {
+            return typeof(TestMethodHistograms).GetMethod(name, BindingFlags.Static | BindingFlags.Public);
+        }
+
+        public static void First()
+        {
+        }
+
+        public static void Second()
+        {
+        }
+
+        public static void Third()
+        {
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,134 @@
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Reflection;
+using System.Text.RegularExpressions;
+
+using GroboTrace.Core;
+
+using NUnit.Framework;
+
+namespace Tests
+{
+    [TestFixture]
+    public class TestMethodRegistry
+    {
+        [Test]
+        public void ReleasedSlotIsReusedWithNextGeneration()
+        {
+            var first = GetMethod("First");
+            var second = GetMethod("Second");
+            int firstId, secondId;
+            MethodBaseTracingInstaller.AddMethod(first, new UIntPtr(0x3601), out firstId);
+            MethodBaseTracingInstaller.ModuleUnloaded(new UIntPtr(0x3601));
+            MethodBaseTracingInstaller.AddMethod(second, new UIntPtr(0x3602), out secondId);
+            Assert.AreEqual(firstId & slotMask, secondId & slotMask);
+            Assert.AreNotEqual(firstId, secondId);
+            Assert.AreSame(MethodBaseTracingInstaller.UnloadedMethod, MethodBaseTracingInstaller.GetMethod(firstId));
+            Assert.AreSame(second, MethodBaseTracingInstaller.GetMethod(secondId));
+        }
+
+        [Test]
+        public void SlotIsRetiredWhenItsGenerationsRunOut()
+        {
+            var first = GetMethod("First");
+            var ids = new HashSet<int>();
+            for(var i = 0; i < 200; ++i)
+            {
+                int id;
+                MethodBaseTracingInstaller.AddMethod(first, new UIntPtr(0x3608), out id);
+                MethodBaseTracingInstaller.ModuleUnloaded(new UIntPtr(0x3608));
+                Assert.IsTrue(ids.Add(id));
+            }
+            Assert.IsTrue(ids.All(id => MethodBaseTracingInstaller.GetMethod(id) == MethodBaseTracingInstaller.UnloadedMethod));
+        }
+
+        [Test]
+        public void ReleasingDisabledMethodResetsItsState()
+        {
+            var third = GetMethod("Third");
+            var fourth = GetMethod("Fourth");
+            int thirdId, fourthId;
+            MethodBaseTracingInstaller.AddMethod(third, new UIntPtr(0x3603), out thirdId);
+            try
+            {
+                MethodBaseTracingInstaller.SetMethodsEnabled(new Regex(Regex.Escape(typeof(TestMethodRegistry).FullName + ".Third")), false);
+                Assert.AreEqual(1, MethodBaseTracingInstaller.DisabledMethodsCount);
+                Assert.IsTrue(MethodBaseTracingInstaller.IsMethodDisabled(thirdId));
+                MethodBaseTracingInstaller.ModuleUnloaded(new UIntPtr(0x3603));
+                Assert.AreEqual(0, MethodBaseTracingInstaller.DisabledMethodsCount);
+                MethodBaseTracingInstaller.AddMethod(fourth, new UIntPtr(0x3604), out fourthId);
+                Assert.AreEqual(thirdId & slotMask, fourthId & slotMask);
+                Assert.IsFalse(MethodBaseTracingInstaller.IsMethodDisabled(fourthId));
+                Assert.IsFalse(MethodBaseTracingInstaller.IsMethodDisabled(thirdId));
+            }
+            finally
+            {
+                MethodBaseTracingInstaller.EnableAllMethods();
+            }
+        }
+
+        [Test]
+        public void CallsWithStaleIdAreCountedAsUnloaded()
+        {
+            var fifth = GetMethod("Fifth");
+            var sixth = GetMethod("Sixth");
+            int fifthId, sixthId;
+            MethodBaseTracingInstaller.AddMethod(fifth, new UIntPtr(0x3605), out fifthId);
+            MethodBaseTracingInstaller.ClearMethodStats();
+            TestMethodHistograms.Call(fifthId, 2, 10);
+            MethodBaseTracingInstaller.ModuleUnloaded(new UIntPtr(0x3605));
+            MethodBaseTracingInstaller.AddMethod(sixth, new UIntPtr(0x3606), out sixthId);
+            TestMethodHistograms.Call(fifthId, 3, 10);
+            TestMethodHistograms.Call(sixthId, 5, 10);
+            var stats = TracingAnalyzer.GetMethodHistograms();
+            Assert.IsFalse(stats.Any(x => x.Method == fifth));
+            Assert.AreEqual(5, stats.Single(x => x.Method == sixth).Calls);
+            Assert.AreEqual(5, stats.Single(x => x.Method == MethodBaseTracingInstaller.UnloadedMethod).Calls);
+        }
+
+        [Test]
+        public void GenericMethodInstantiationIsRegisteredAsDefinition()
+        {
+            var definition = GetMethod("Generic");
+            int methodId;
+            MethodBaseTracingInstaller.AddMethod(definition.MakeGenericMethod(typeof(int)), new UIntPtr(0x3607), out methodId);
+            Assert.AreSame(definition, MethodBaseTracingInstaller.GetMethod(methodId));
+        }
+
+        private static MethodInfo GetMethod(string name)
+        {
+            return typeof(TestMethodRegistry).GetMethod(name, BindingFlags.Static | BindingFlags.Public);
+        }
+
+        public static void First()
+        {
+        }
+
+        public static void Second()
+        {
+        }
+
+        public static void Third()
+        {
+        }
+
+        public static void Fourth()
+        {
+        }
+
+        public static void Fifth()
+        {
+        }
+
+        public static void Sixth()
+        {
+        }
+
+        public static void Generic<T>()
+        {
+        }
+
+        private const int slotMask = (1 << 24) - 1;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,88 @@
+using System.Linq;
+
+using GroboTrace.Core;
+
+using NUnit.Framework;
+
+namespace Tests
+{
+    [TestFixture]
+    public class TestRecursionFolding
+    {
+        [Test]
+        public void DirectRecursionIsFoldedIntoOutermostCall()
+        {
+            var tree = new MethodCallTree(1);
+            tree.StartMethod(a, 0);
+            tree.StartMethod(a, 0);
+            tree.StartMethod(a, 0);
+            tree.StartMethod(c, 0);
+            tree.FinishMethod(c, 5);
+            tree.FinishMethod(a, 10);
+            tree.FinishMethod(a, 20);
+            tree.FinishMethod(a, 100);
+
+            Assert.AreSame(tree.Root, tree.Current);
+            var nodeA = GetChild(tree.Root, a);
+            Assert.AreEqual(1, nodeA.Calls);
+            Assert.AreEqual(2, nodeA.RecursiveCalls);
+            Assert.AreEqual(100, nodeA.Ticks);
+            Assert.AreEqual(1, nodeA.ChildrenCount);
+            Assert.AreEqual(5, GetChild(nodeA, c).Ticks);
+        }
+
+        [Test]
+        public void CallsOfFoldedCallGoToNodeOfPhysicalCaller()
+        {
+            // A->B->A->C, then the next turn A->B->A->B->C
+            var tree = new MethodCallTree(2);
+            tree.StartMethod(a, 0);
+            tree.StartMethod(b, 0);
+            tree.StartMethod(a, 0);
+            tree.StartMethod(c, 0);
+            tree.FinishMethod(c, 5);
+            tree.FinishMethod(a, 10);
+            tree.FinishMethod(b, 30);
+            tree.StartMethod(b, 0);
+            tree.StartMethod(a, 0);
+            tree.StartMethod(b, 0);
+            tree.StartMethod(c, 0);
+            tree.FinishMethod(c, 7);
+            tree.FinishMethod(b, 9);
+            tree.FinishMethod(a, 12);
+            tree.FinishMethod(b, 40);
+            tree.FinishMethod(a, 100);
+
+            Assert.AreSame(tree.Root, tree.Current);
+            var nodeA = GetChild(tree.Root, a);
+            Assert.AreEqual(1, nodeA.Calls);
+            Assert.AreEqual(2, nodeA.RecursiveCalls);
+            Assert.AreEqual(100, nodeA.Ticks);
+            Assert.AreEqual(1, nodeA.ChildrenCount);
+            var nodeB = GetChild(nodeA, b);
+            Assert.AreEqual(2, nodeB.Calls);
+            Assert.AreEqual(1, nodeB.RecursiveCalls);
+            // Self times of the inner calls of A, 10 - 5 and 12 - 9, are taken off B
+            Assert.AreEqual(70 - 5 - 3, nodeB.Ticks);
+            Assert.AreEqual(1, nodeB.ChildrenCount);
+            var nodeC = GetChild(nodeB, c);
+            Assert.AreEqual(2, nodeC.Calls);
+            Assert.AreEqual(12, nodeC.Ticks);
+            // Self time of A is that of the outer call, 100 - 30 - 40, and of the two inner ones, of B that of its two calls, 30 - 10
+            // and 40 - 12, and of the inner one, 9 - 7
+            Assert.AreEqual(30 + 5 + 3, nodeA.Ticks - nodeB.Ticks);
+            Assert.AreEqual(20 + 28 + 2, nodeB.Ticks - nodeC.Ticks);
+        }
+
+        private static MethodCallNode GetChild(MethodCallNode node, int methodId)
+        {
+            int count;
+            var children = node.GetChildren(out count);
+            return children.Take(count).Single(child => child.MethodId == methodId);
+        }
+
+        private const int a = 1;
+        private const int b = 2;
+        private const int c = 3;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,76 @@
+using System;
+using System.IO;
+using System.Reflection;
+
+using GroboTrace;
+using GroboTrace.Core;
+
+using NUnit.Framework;
+
+namespace Tests
+{
+    [TestFixture]
+    public class TestSnapshotWriter
+    {
+        [Test]
+        public void TextIsTheSameAsFormattedStats()
+        {
+            int first, second, third, fourth, unloaded1, unloaded2;
+            MethodBaseTracingInstaller.AddMethod(GetMethod("First"), new UIntPtr(0x5001), out first);
+            MethodBaseTracingInstaller.AddMethod(GetMethod("Second"), new UIntPtr(0x5001), out second);
+            MethodBaseTracingInstaller.AddMethod(GetMethod("Third"), new UIntPtr(0x5001), out third);
+            MethodBaseTracingInstaller.AddMethod(GetMethod("Fourth"), new UIntPtr(0x5001), out fourth);
+            MethodBaseTracingInstaller.AddMethod(GetMethod("Fifth"), new UIntPtr(0x5002), out unloaded1);
+            MethodBaseTracingInstaller.AddMethod(GetMethod("Sixth"), new UIntPtr(0x5003), out unloaded2);
+            MethodBaseTracingInstaller.ModuleUnloaded(new UIntPtr(0x5002));
+            MethodBaseTracingInstaller.ModuleUnloaded(new UIntPtr(0x5003));
+
+            // Ties in the tree and in the list, a method in two nodes and two unloaded methods
+            var snapshot = new CallTreeSnapshot
+                {
+                    ElapsedTicks = 1000,
+                    Count = 8,
+                    MethodIds = new[] {0, first, second, third, unloaded1, unloaded2, first, fourth},
+                    ParentIndexes = new[] {-1, 0, 0, 1, 1, 2, 2, 2},
+                    Calls = new[] {0, 1, 2, 3, 4, 5, 6, 7},
+                    Ticks = new long[] {1000, 300, 300, 100, 100, 50, 100, 100},
+                    ElapsedCpuTicks = 600,
+                    CpuTicks = new long[] {0, 100, 0, 0, 0, 0, 0, 0},
+                    CpuMeasuredTicks = new long[] {0, 300, 0, 0, 0, 0, 0, 0},
+                };
+            var writer = new StringWriter();
+            SnapshotWriter.WriteText(snapshot, 100, writer);
+            var expected = TracingAnalyzerStatsFormatter.Format(CallTreeSnapshotAnalyzer.GetStats(snapshot), 100);
+            Assert.AreEqual(expected, writer.ToString());
+        }
+
+        private static MethodInfo GetMethod(string name)
+        {
+            return typeof(TestSnapshotWriter).GetMethod(name, BindingFlags.Static | BindingFlags.Public);
+        }
+
+        public static void First()
+        {
+        }
+
+        public static void Second()
+        {
+        }
+
+        public static void Third()
+        {
+        }
+
+        public static void Fourth()
+        {
+        }
+
+        public static void Fifth()
+        {
+        }
+
+        public static void Sixth()
+        {
+        }
+    }
+}
\ No newline at end of file